@@ -0,0 +1,146 @@
+/*
+ * Copyright 2008 Stephen Liu
+ * For license terms, see the file COPYING along with this library.
+ */
+
+// the heap allocations of the text decoder per command. malloc, calloc
+// and realloc are interposed and counted while decode runs, every command
+// is first decoded as often as measured to warm up the reused messages of
+// a batch and the slabs.
+// Exits with 1 if a command allocates after the warm-up.
+// The interposition calls the glibc entry points, so it is Linux only
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "spserver/spbuffer.hpp"
+
+#include "spcachemsg.hpp"
+#include "spcacheslab.hpp"
+#include "spcacheproto.hpp"
+
+extern "C" {
+
+extern void * __libc_malloc( size_t size );
+extern void * __libc_calloc( size_t count, size_t size );
+extern void * __libc_realloc( void * ptr, size_t size );
+extern void __libc_free( void * ptr );
+
+}
+
+static int sCounting = 0;
+static size_t sAllocs = 0;
+
+extern "C" {
+
+void * malloc( size_t size )
+{
+	if( sCounting ) sAllocs++;
+	return __libc_malloc( size );
+}
+
+void * calloc( size_t count, size_t size )
+{
+	if( sCounting ) sAllocs++;
+	return __libc_calloc( count, size );
+}
+
+void * realloc( void * ptr, size_t size )
+{
+	if( sCounting ) sAllocs++;
+	return __libc_realloc( ptr, size );
+}
+
+void free( void * ptr )
+{
+	__libc_free( ptr );
+}
+
+}
+
+static const char * sCmds[] = {
+	"get user:1000\r\n",
+	"get user:1 user:2 user:3 user:4 user:5 user:6 user:7 user:8 user:9 user:10\r\n",
+	"gets user:1 user:2 user:3 user:4 user:5 user:6 user:7 user:8 user:9 user:10\r\n",
+	"set user:1000 0 0 32\r\n01234567890123456789012345678901\r\n",
+	"cas user:1000 0 0 32 12345\r\n01234567890123456789012345678901\r\n",
+	"delete user:1002\r\n",
+	"incr counter:1 1\r\n",
+	"decr counter:1 1\r\n",
+	"version\r\n",
+	NULL
+};
+
+// decode count copies of request, return the allocations of decode
+static size_t countAllocs( SP_CacheMsgDecoder * decoder, const char * request, int count )
+{
+	SP_Buffer inBuffer;
+	for( int i = 0; i < count; i++ ) inBuffer.append( request, strlen( request ) );
+
+	size_t allocs = 0;
+
+	for( ; inBuffer.getSize() > 0; ) {
+		sAllocs = 0;
+		sCounting = 1;
+		decoder->decode( &inBuffer );
+		sCounting = 0;
+		allocs += sAllocs;
+
+		for( int i = 0; i < decoder->getCount(); i++ ) {
+			SP_CacheItem * item = decoder->getMsg( i )->takeItem();
+			if( NULL != item ) item->release();
+		}
+
+		decoder->reset();
+	}
+
+	return allocs;
+}
+
+int main( int argc, char * argv[] )
+{
+	int count = 10000;
+
+	int c = 0;
+	while( ( c = getopt( argc, argv, "n:v" ) ) != EOF ) {
+		switch( c ) {
+			case 'n':
+				count = atoi( optarg );
+				break;
+			default:
+				printf( "Usage: %s [-n <count>]\n", argv[0] );
+				printf( "\t-n requests of every command, default is 10000\n" );
+				exit( 0 );
+		}
+	}
+
+	if( count <= 0 ) count = 10000;
+
+	SP_CacheSlabs slabs;
+	SP_CacheMsgDecoder decoder( &slabs, SP_CacheMsgDecoder::eText );
+
+	int failed = 0;
+
+	printf( "heap allocations of decode, %d requests of every command\n", count );
+	printf( "%-10s %12s %12s %10s\n", "command", "warm-up", "allocs", "per cmd" );
+
+	for( int i = 0; NULL != sCmds[i]; i++ ) {
+		size_t warmUp = countAllocs( &decoder, sCmds[i], count );
+		size_t allocs = countAllocs( &decoder, sCmds[i], count );
+
+		char cmd[ 16 ] = { 0 };
+		sscanf( sCmds[i], "%15s", cmd );
+
+		printf( "%-10s %12lu %12lu %10.3f\n", cmd, (unsigned long)warmUp,
+				(unsigned long)allocs, (double)allocs / count );
+
+		if( allocs > 0 ) failed = 1;
+	}
+
+	printf( "%s\n", failed ? "FAILED" : "OK" );
+
+	return failed;
+}
+
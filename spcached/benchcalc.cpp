@@ -0,0 +1,105 @@
+/*
+ * Copyright 2008 Stephen Liu
+ * For license terms, see the file COPYING along with this library.
+ */
+
+// the cost of incr and decr. The threads add to one hot counter and then
+// to counters picked at random, incr and decr in turn
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "spcacheimpl.hpp"
+#include "spcachemsg.hpp"
+#include "spcacheindex.hpp"
+#include "spcachebench.hpp"
+
+typedef struct tagCalcData {
+	SP_CacheEx * mCacheEx;
+
+	// counters used by the run
+	int mCounters;
+} CalcData_t;
+
+static void calcLoop( SP_CacheBench_t * bench )
+{
+	CalcData_t * data = (CalcData_t*)bench->mData;
+
+	unsigned int seed = bench->mIndex + 1;
+
+	for( ; ! *bench->mStop; bench->mOps++ ) {
+		char key[ 32 ] = { 0 };
+		snprintf( key, sizeof( key ), "counter%u", sp_bench_rand( &seed ) % data->mCounters );
+
+		uint64_t newValue = 0;
+		if( bench->mOps & 1 ) {
+			data->mCacheEx->incr( key, 1, &newValue );
+		} else {
+			data->mCacheEx->decr( key, 1, &newValue );
+		}
+	}
+}
+
+int main( int argc, char * argv[] )
+{
+	int maxThreads = 8, msec = 1000, counters = 1000;
+
+	int c = 0;
+	while( ( c = getopt( argc, argv, "t:d:k:v" ) ) != EOF ) {
+		switch( c ) {
+			case 't':
+				maxThreads = atoi( optarg );
+				break;
+			case 'd':
+				msec = atoi( optarg );
+				break;
+			case 'k':
+				counters = atoi( optarg );
+				break;
+			default:
+				printf( "Usage: %s [-t <max_threads>] [-d <msec>] [-k <counters>]\n", argv[0] );
+				printf( "\t-t runs 1, 2, 4 ... up to max_threads, default is 8\n" );
+				printf( "\t-d msec of every run, default is 1000\n" );
+				printf( "\t-k counters of the random run, default is 1000\n" );
+				exit( 0 );
+		}
+	}
+
+	if( counters <= 0 ) counters = 1000;
+
+	SP_CacheEx cacheEx( SP_CacheIndex::eHash, 100000, 16 );
+
+	for( int i = 0; i < counters; i++ ) {
+		char key[ 32 ] = { 0 };
+		snprintf( key, sizeof( key ), "counter%d", i );
+
+		// room for 20 digits, the counter is always updated in place
+		SP_CacheItem * item = SP_CacheItem::newInstance( NULL, key, 22 );
+		item->appendDataBlock( "1000000\r\n", 9 );
+		cacheEx.set( item, 0 );
+	}
+
+	CalcData_t data;
+	memset( &data, 0, sizeof( data ) );
+	data.mCacheEx = &cacheEx;
+
+	printf( "incr and decr in turn, %d msec per run\n", msec );
+	printf( "%8s %12s %10s %12s %10s\n", "threads", "1 key/s", "ns/op", "random/s", "ns/op" );
+
+	for( int threads = 1; threads <= maxThreads; threads *= 2 ) {
+		data.mCounters = 1;
+		double hotOps = sp_bench_run( threads, msec, calcLoop, &data );
+
+		data.mCounters = counters;
+		double ops = sp_bench_run( threads, msec, calcLoop, &data );
+
+		printf( "%8d %12.0f %10.1f %12.0f %10.1f\n", threads,
+				hotOps, hotOps > 0 ? 1e9 * threads / hotOps : 0,
+				ops, ops > 0 ? 1e9 * threads / ops : 0 );
+	}
+
+	return 0;
+}
+
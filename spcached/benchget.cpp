@@ -0,0 +1,159 @@
+/*
+ * Copyright 2008 Stephen Liu
+ * For license terms, see the file COPYING along with this library.
+ */
+
+// the cost of a get on a few hot keys, every key of the reply takes
+// a reference of its item, so all the threads meet on the same counters.
+// The reference count is also run alone against a mutex guarded count,
+// the way the items kept it before the atomic one
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "spserver/sputils.hpp"
+#include "spserver/spmsgblock.hpp"
+
+#include "spcacheimpl.hpp"
+#include "spcachemsg.hpp"
+#include "spcacheindex.hpp"
+#include "spcachebench.hpp"
+
+typedef struct tagGetData {
+	SP_CacheEx * mCacheEx;
+	int mHotKeys, mKeysPerGet;
+
+	SP_CacheItem * mItem;
+
+	sp_thread_mutex_t mMutex;
+	volatile int mCount;
+} GetData_t;
+
+static void getLoop( SP_CacheBench_t * bench )
+{
+	GetData_t * data = (GetData_t*)bench->mData;
+
+	char keys[ 64 ][ 32 ];
+	SP_ArrayList keyList;
+
+	for( int i = 0; i < data->mKeysPerGet; i++ ) {
+		snprintf( keys[i], sizeof( keys[i] ), "hot%d", i % data->mHotKeys );
+		keyList.append( keys[i] );
+	}
+
+	SP_MsgBlockList blockList;
+
+	for( ; ! *bench->mStop; bench->mOps++ ) {
+		data->mCacheEx->get( &keyList, &blockList );
+		blockList.clean();
+	}
+}
+
+static void atomicLoop( SP_CacheBench_t * bench )
+{
+	GetData_t * data = (GetData_t*)bench->mData;
+
+	for( ; ! *bench->mStop; bench->mOps++ ) {
+		data->mItem->addRef();
+		data->mItem->release();
+	}
+}
+
+static void mutexLoop( SP_CacheBench_t * bench )
+{
+	GetData_t * data = (GetData_t*)bench->mData;
+
+	for( ; ! *bench->mStop; bench->mOps++ ) {
+		sp_thread_mutex_lock( &data->mMutex );
+		data->mCount++;
+		sp_thread_mutex_unlock( &data->mMutex );
+
+		sp_thread_mutex_lock( &data->mMutex );
+		data->mCount--;
+		sp_thread_mutex_unlock( &data->mMutex );
+	}
+}
+
+int main( int argc, char * argv[] )
+{
+	int maxThreads = 8, msec = 1000;
+
+	GetData_t data;
+	memset( &data, 0, sizeof( data ) );
+	data.mHotKeys = 1;
+	data.mKeysPerGet = 10;
+
+	int c = 0;
+	while( ( c = getopt( argc, argv, "t:d:k:m:v" ) ) != EOF ) {
+		switch( c ) {
+			case 't':
+				maxThreads = atoi( optarg );
+				break;
+			case 'd':
+				msec = atoi( optarg );
+				break;
+			case 'k':
+				data.mHotKeys = atoi( optarg );
+				break;
+			case 'm':
+				data.mKeysPerGet = atoi( optarg );
+				break;
+			default:
+				printf( "Usage: %s [-t <max_threads>] [-d <msec>] [-k <hot_keys>] [-m <keys_per_get>]\n", argv[0] );
+				printf( "\t-t runs 1, 2, 4 ... up to max_threads, default is 8\n" );
+				printf( "\t-d msec of every run, default is 1000\n" );
+				printf( "\t-k hot keys, default is 1\n" );
+				printf( "\t-m keys of a get, taken from the hot keys in turn, default is 10\n" );
+				exit( 0 );
+		}
+	}
+
+	if( data.mHotKeys <= 0 ) data.mHotKeys = 1;
+	if( data.mKeysPerGet <= 0 || data.mKeysPerGet > 64 ) data.mKeysPerGet = 10;
+
+	SP_CacheEx cacheEx( SP_CacheIndex::eHash, 100000, 16 );
+	data.mCacheEx = &cacheEx;
+
+	for( int i = 0; i < data.mHotKeys; i++ ) {
+		char key[ 32 ] = { 0 };
+		snprintf( key, sizeof( key ), "hot%d", i );
+
+		SP_CacheItem * item = SP_CacheItem::newInstance( NULL, key, 34 );
+		item->appendDataBlock( "0123456789012345678901234567890\r\n", 33 );
+		cacheEx.set( item, 0 );
+	}
+
+	data.mItem = SP_CacheItem::newInstance( NULL, "refcount", 0 );
+	sp_thread_mutex_init( &data.mMutex, NULL );
+
+	printf( "get of %d keys on %d hot keys, %d msec per run\n",
+			data.mKeysPerGet, data.mHotKeys, msec );
+	printf( "%8s %12s %10s %10s\n", "threads", "gets/s", "ns/get", "ns/key" );
+
+	for( int threads = 1; threads <= maxThreads; threads *= 2 ) {
+		double ops = sp_bench_run( threads, msec, getLoop, &data );
+		printf( "%8d %12.0f %10.1f %10.1f\n", threads, ops,
+				ops > 0 ? 1e9 * threads / ops : 0,
+				ops > 0 ? 1e9 * threads / ops / data.mKeysPerGet : 0 );
+	}
+
+	printf( "\naddRef + release of one item, atomic count vs mutex guarded count\n" );
+	printf( "%8s %12s %12s\n", "threads", "atomic ns", "mutex ns" );
+
+	for( int threads = 1; threads <= maxThreads; threads *= 2 ) {
+		double atomicOps = sp_bench_run( threads, msec, atomicLoop, &data );
+		double mutexOps = sp_bench_run( threads, msec, mutexLoop, &data );
+
+		printf( "%8d %12.1f %12.1f\n", threads,
+				atomicOps > 0 ? 1e9 * threads / atomicOps : 0,
+				mutexOps > 0 ? 1e9 * threads / mutexOps : 0 );
+	}
+
+	data.mItem->release();
+	sp_thread_mutex_destroy( &data.mMutex );
+
+	return 0;
+}
+
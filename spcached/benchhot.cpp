@@ -0,0 +1,253 @@
+/*
+ * Copyright 2008 Stephen Liu
+ * For license terms, see the file COPYING along with this library.
+ */
+
+// the per-thread copies of the hot keys. The gets of a few hot keys are
+// run without and with SP_CacheHotKeys, then a stress check races the
+// copies against a writer: a set, a delete or an eviction that is done
+// must never be followed by a get of an older value.
+// Exits with 1 if the check fails
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "spserver/sputils.hpp"
+#include "spserver/spmsgblock.hpp"
+
+#include "spcacheimpl.hpp"
+#include "spcachemsg.hpp"
+#include "spcacheindex.hpp"
+#include "spcachehot.hpp"
+#include "spcacheatomic.hpp"
+#include "spcachebench.hpp"
+
+// the races of the stress check
+enum { eSet, eDelete, eEvict };
+
+typedef struct tagHotData {
+	SP_CacheEx * mCacheEx;
+	int mHotKeys, mKeysPerGet;
+
+	int mRace;
+
+	// the version the writer is done with, read by the readers
+	volatile int mDone;
+
+	volatile int mViolations;
+} HotData_t;
+
+static void setValue( SP_CacheEx * cacheEx, const char * key, int version )
+{
+	char value[ 32 ] = { 0 };
+	int len = snprintf( value, sizeof( value ), "%d\r\n", version );
+
+	SP_CacheItem * item = SP_CacheItem::newInstance( NULL, key, len );
+	item->appendDataBlock( value, len );
+	if( 0 != cacheEx->set( item, 0 ) ) item->release();
+}
+
+static void getLoop( SP_CacheBench_t * bench )
+{
+	HotData_t * data = (HotData_t*)bench->mData;
+
+	char keys[ 64 ][ 32 ];
+	SP_ArrayList keyList;
+
+	for( int i = 0; i < data->mKeysPerGet; i++ ) {
+		snprintf( keys[i], sizeof( keys[i] ), "hot%d", i % data->mHotKeys );
+		keyList.append( keys[i] );
+	}
+
+	SP_MsgBlockList blockList;
+
+	for( ; ! *bench->mStop; bench->mOps++ ) {
+		data->mCacheEx->get( &keyList, &blockList );
+		blockList.clean();
+	}
+}
+
+static double runGets( int threads, int msec, int useCopies, HotData_t * data )
+{
+	SP_CacheHotKeys hotKeys( 16 );
+
+	SP_CacheEx cacheEx( SP_CacheIndex::eHash, 100000, 16 );
+	if( useCopies ) cacheEx.setHotKeys( &hotKeys );
+
+	for( int i = 0; i < data->mHotKeys; i++ ) {
+		char key[ 32 ] = { 0 };
+		snprintf( key, sizeof( key ), "hot%d", i );
+
+		SP_CacheItem * item = SP_CacheItem::newInstance( NULL, key, 34 );
+		item->appendDataBlock( "0123456789012345678901234567890\r\n", 33 );
+		cacheEx.set( item, 0 );
+	}
+
+	data->mCacheEx = &cacheEx;
+
+	return sp_bench_run( threads, msec, getLoop, data );
+}
+
+// thread 0 writes, the others read the key "race" by getItem and get in turn
+static void raceLoop( SP_CacheBench_t * bench )
+{
+	HotData_t * data = (HotData_t*)bench->mData;
+	SP_CacheEx * cacheEx = data->mCacheEx;
+
+	if( 0 == bench->mIndex ) {
+		for( int version = 1; ! *bench->mStop; version++, bench->mOps++ ) {
+			setValue( cacheEx, "race", version );
+
+			// a while for the readers to copy the value
+			if( eSet == data->mRace ) sp_atomic_inc( &( data->mDone ) );
+			usleep( 100 );
+
+			if( eDelete == data->mRace ) {
+				cacheEx->erase( "race" );
+			} else if( eEvict == data->mRace ) {
+				// the cache holds 4 items in insertion order, the fillers push it out
+				for( int i = 0; i < 4; i++ ) {
+					char key[ 32 ] = { 0 };
+					snprintf( key, sizeof( key ), "filler%d", i );
+					setValue( cacheEx, key, version );
+				}
+			}
+
+			if( eSet != data->mRace ) sp_atomic_inc( &( data->mDone ) );
+		}
+
+		return;
+	}
+
+	char key[ 8 ] = "race";
+	SP_ArrayList keyList;
+	keyList.append( key );
+
+	SP_MsgBlockList blockList;
+
+	for( ; ! *bench->mStop; bench->mOps++ ) {
+		int done = sp_atomic_add( &( data->mDone ), 0 );
+
+		// a set done is seen, a value deleted or evicted is not
+		int least = eSet == data->mRace ? done : done + 1;
+		int version = -1;
+
+		if( bench->mOps & 1 ) {
+			SP_CacheItem * item = cacheEx->getItem( key );
+			if( NULL != item ) {
+				version = atoi( (char*)item->getDataBlock() );
+				item->release();
+			}
+		} else {
+			cacheEx->get( &keyList, &blockList );
+			if( blockList.getCount() > 2 ) {
+				char value[ 32 ] = { 0 };
+				const SP_MsgBlock * block = blockList.getItem( 1 );
+				memcpy( value, block->getData(), block->getSize() < 31 ? block->getSize() : 31 );
+				version = atoi( value );
+			}
+			blockList.clean();
+		}
+
+		if( version >= 0 ? version < least : ( eSet == data->mRace && done > 0 ) ) {
+			sp_atomic_inc( &( data->mViolations ) );
+		}
+	}
+}
+
+static int runRace( int race, int threads, int msec, HotData_t * data, size_t * hits )
+{
+	SP_CacheHotKeys hotKeys( 4 );
+
+	// one shard of 4 items, so the fillers evict in order
+	SP_CacheEx cacheEx( SP_CacheIndex::eHash, 4, 1 );
+	cacheEx.setHotKeys( &hotKeys );
+
+	data->mCacheEx = &cacheEx;
+	data->mRace = race;
+	data->mDone = 0;
+	data->mViolations = 0;
+
+	sp_bench_run( threads + 1, msec, raceLoop, data );
+
+	*hits = hotKeys.getHits();
+
+	return data->mViolations;
+}
+
+int main( int argc, char * argv[] )
+{
+	int maxThreads = 8, msec = 1000;
+
+	HotData_t data;
+	memset( &data, 0, sizeof( data ) );
+	data.mHotKeys = 1;
+	data.mKeysPerGet = 1;
+
+	int c = 0;
+	while( ( c = getopt( argc, argv, "t:d:k:m:v" ) ) != EOF ) {
+		switch( c ) {
+			case 't':
+				maxThreads = atoi( optarg );
+				break;
+			case 'd':
+				msec = atoi( optarg );
+				break;
+			case 'k':
+				data.mHotKeys = atoi( optarg );
+				break;
+			case 'm':
+				data.mKeysPerGet = atoi( optarg );
+				break;
+			default:
+				printf( "Usage: %s [-t <max_threads>] [-d <msec>] [-k <hot_keys>] [-m <keys_per_get>]\n", argv[0] );
+				printf( "\t-t runs 1, 2, 4 ... up to max_threads, the stress check runs\n"
+						"\t   max_threads readers, default is 8\n" );
+				printf( "\t-d msec of every run, default is 1000\n" );
+				printf( "\t-k hot keys, default is 1\n" );
+				printf( "\t-m keys of a get, taken from the hot keys in turn, default is 1\n" );
+				exit( 0 );
+		}
+	}
+
+	if( maxThreads <= 0 ) maxThreads = 8;
+	if( data.mHotKeys <= 0 ) data.mHotKeys = 1;
+	if( data.mKeysPerGet <= 0 || data.mKeysPerGet > 64 ) data.mKeysPerGet = 1;
+
+	printf( "get of %d keys on %d hot keys, without and with the copies, %d msec per run\n",
+			data.mKeysPerGet, data.mHotKeys, msec );
+	printf( "%8s %12s %10s %12s %10s\n", "threads", "shared/s", "ns/get", "copies/s", "ns/get" );
+
+	for( int threads = 1; threads <= maxThreads; threads *= 2 ) {
+		double sharedOps = runGets( threads, msec, 0, &data );
+		double copyOps = runGets( threads, msec, 1, &data );
+
+		printf( "%8d %12.0f %10.1f %12.0f %10.1f\n", threads,
+				sharedOps, sharedOps > 0 ? 1e9 * threads / sharedOps : 0,
+				copyOps, copyOps > 0 ? 1e9 * threads / copyOps : 0 );
+	}
+
+	printf( "\nstress check, 1 writer and %d readers of one hot key\n", maxThreads );
+	printf( "%8s %12s %12s\n", "race", "copy hits", "violations" );
+
+	static const char * names[] = { "set", "delete", "evict" };
+
+	int failed = 0;
+
+	for( int race = eSet; race <= eEvict; race++ ) {
+		size_t hits = 0;
+		int violations = runRace( race, maxThreads, msec, &data, &hits );
+
+		printf( "%8s %12lu %12d\n", names[ race ], (unsigned long)hits, violations );
+
+		// the copies must have served some of the gets, or nothing is checked
+		if( violations > 0 || 0 == hits ) failed = 1;
+	}
+
+	printf( "%s\n", failed ? "FAILED" : "OK" );
+
+	return failed;
+}
+
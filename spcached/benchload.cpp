@@ -0,0 +1,338 @@
+/*
+ * Copyright 2008 Stephen Liu
+ * For license terms, see the file COPYING along with this library.
+ */
+
+// a load client over the text protocol, to compare the server types.
+// Every connection has its own thread and one request in flight, a mix
+// of gets and sets on random keys. The throughput, the latency percentiles
+// and the failures are reported for 1, 4, 16 ... up to -c connections
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <signal.h>
+#include <netdb.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#include "spcachebench.hpp"
+
+// latency buckets of usec, 16 in every power of 2
+enum { eBuckets = 16 * 32 };
+
+typedef struct tagLoadStat {
+	size_t mBuckets[ eBuckets ];
+
+	// replied with an error, connections refused, closed by the server
+	size_t mErrors, mRefused, mClosed;
+} LoadStat_t;
+
+typedef struct tagLoadData {
+	struct sockaddr_in mAddr;
+
+	int mKeys, mReadPercent;
+
+	// "set key 0 0 size\r\n" is written before the value
+	char * mValue;
+	int mValueSize;
+
+	LoadStat_t * mStats;
+} LoadData_t;
+
+static int toBucket( double usec )
+{
+	unsigned int value = (unsigned int)usec + 1;
+
+	int octave = 0;
+	for( ; ( value >> ( octave + 1 ) ) > 0 && octave < 31; ) octave++;
+
+	int bucket = 16 * octave + (int)( ( (double)value - ( 1u << octave ) ) * 16 / ( 1u << octave ) );
+
+	return bucket < eBuckets ? bucket : eBuckets - 1;
+}
+
+// the upper bound of a bucket
+static double fromBucket( int bucket )
+{
+	double base = (double)( 1u << ( bucket / 16 ) );
+
+	return base + base * ( bucket % 16 + 1 ) / 16 - 1;
+}
+
+static int connectTo( const struct sockaddr_in * addr )
+{
+	int fd = socket( AF_INET, SOCK_STREAM, 0 );
+	if( fd < 0 ) return -1;
+
+	if( 0 != connect( fd, (struct sockaddr*)addr, sizeof( *addr ) ) ) {
+		close( fd );
+		return -1;
+	}
+
+	int on = 1;
+	setsockopt( fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof( on ) );
+
+	return fd;
+}
+
+static int sendAll( int fd, const char * buffer, size_t len )
+{
+	for( size_t pos = 0; pos < len; ) {
+		int ret = send( fd, buffer + pos, len - pos, 0 );
+		if( ret < 0 && EINTR == errno ) continue;
+		if( ret <= 0 ) return -1;
+		pos += ret;
+	}
+
+	return 0;
+}
+
+static int isEndOf( const char * buffer, size_t len, const char * tail )
+{
+	size_t tailLen = strlen( tail );
+
+	return len >= tailLen && 0 == memcmp( buffer + len - tailLen, tail, tailLen );
+}
+
+// read a complete reply, return -1 if the connection is closed,
+// 1 if the reply is an error, 0 if OK
+static int readReply( int fd, int isGet, char * buffer, size_t size )
+{
+	size_t len = 0;
+
+	for( ; ; ) {
+		int ret = recv( fd, buffer + len, size - len, 0 );
+		if( ret < 0 && EINTR == errno ) continue;
+		if( ret <= 0 ) return -1;
+		len += ret;
+
+		if( 0 == strncmp( buffer, "SERVER_ERROR", len < 12 ? len : 12 )
+				|| 0 == strncmp( buffer, "CLIENT_ERROR", len < 12 ? len : 12 )
+				|| 0 == strncmp( buffer, "ERROR", len < 5 ? len : 5 ) ) {
+			if( isEndOf( buffer, len, "\r\n" ) ) return 1;
+		} else if( isGet ? isEndOf( buffer, len, "END\r\n" ) : isEndOf( buffer, len, "\r\n" ) ) {
+			return 0;
+		}
+
+		// only the tail is checked, the value is dropped when the buffer is full
+		if( len == size ) {
+			memmove( buffer, buffer + len - 8, 8 );
+			len = 8;
+		}
+	}
+}
+
+static void loadLoop( SP_CacheBench_t * bench )
+{
+	LoadData_t * data = (LoadData_t*)bench->mData;
+	LoadStat_t * stat = &( data->mStats[ bench->mIndex ] );
+
+	unsigned int seed = bench->mIndex + 1;
+
+	size_t size = data->mValueSize + 256;
+	char * request = (char*)malloc( size ), * reply = (char*)malloc( size );
+
+	int fd = -1;
+
+	for( ; ! *bench->mStop; ) {
+		if( fd < 0 ) {
+			fd = connectTo( &( data->mAddr ) );
+			if( fd < 0 ) {
+				stat->mRefused++;
+				usleep( 10000 );
+				continue;
+			}
+		}
+
+		unsigned int key = sp_bench_rand( &seed ) % data->mKeys;
+		int isGet = (int)( sp_bench_rand( &seed ) % 100 ) < data->mReadPercent;
+
+		int len = 0;
+		if( isGet ) {
+			len = snprintf( request, size, "get key%u\r\n", key );
+		} else {
+			len = snprintf( request, size, "set key%u 0 0 %d\r\n", key, data->mValueSize );
+			memcpy( request + len, data->mValue, data->mValueSize + 2 );
+			len += data->mValueSize + 2;
+		}
+
+		double begin = sp_bench_now();
+
+		int ret = sendAll( fd, request, len );
+		if( 0 == ret ) ret = readReply( fd, isGet, reply, size );
+
+		if( ret < 0 ) {
+			stat->mClosed++;
+			close( fd );
+			fd = -1;
+			continue;
+		}
+
+		// only the served requests are in ops/s and the latency
+		if( ret > 0 ) {
+			stat->mErrors++;
+			continue;
+		}
+
+		stat->mBuckets[ toBucket( ( sp_bench_now() - begin ) * 1000000 ) ]++;
+		bench->mOps++;
+	}
+
+	if( fd >= 0 ) close( fd );
+
+	free( request );
+	free( reply );
+}
+
+static double percentile( const size_t * buckets, size_t total, double part )
+{
+	size_t count = 0;
+
+	for( int i = 0; i < eBuckets; i++ ) {
+		count += buckets[i];
+		if( count > 0 && count >= total * part ) return fromBucket( i );
+	}
+
+	return 0;
+}
+
+int main( int argc, char * argv[] )
+{
+	const char * host = "127.0.0.1";
+	int port = 11216, maxConns = 64, msec = 1000;
+
+	LoadData_t data;
+	memset( &data, 0, sizeof( data ) );
+	data.mKeys = 10000;
+	data.mReadPercent = 90;
+	data.mValueSize = 100;
+
+	int c = 0;
+	while( ( c = getopt( argc, argv, "h:p:c:d:k:r:l:v" ) ) != EOF ) {
+		switch( c ) {
+			case 'h':
+				host = optarg;
+				break;
+			case 'p':
+				port = atoi( optarg );
+				break;
+			case 'c':
+				maxConns = atoi( optarg );
+				break;
+			case 'd':
+				msec = atoi( optarg );
+				break;
+			case 'k':
+				data.mKeys = atoi( optarg );
+				break;
+			case 'r':
+				data.mReadPercent = atoi( optarg );
+				break;
+			case 'l':
+				data.mValueSize = atoi( optarg );
+				break;
+			default:
+				printf( "Usage: %s [-h <host>] [-p <port>] [-c <max_connections>] [-d <msec>]\n"
+						"\t[-k <keys>] [-r <read_percent>] [-l <value_size>]\n", argv[0] );
+				printf( "\t-h host of the server, default is 127.0.0.1\n" );
+				printf( "\t-p port of the server, default is 11216\n" );
+				printf( "\t-c runs 1, 4, 16 ... up to max_connections, default is 64\n" );
+				printf( "\t-d msec of every run, default is 1000\n" );
+				printf( "\t-k keys, default is 10000\n" );
+				printf( "\t-r percent of gets, the others are sets, default is 90\n" );
+				printf( "\t-l bytes of a value, default is 100\n" );
+				exit( 0 );
+		}
+	}
+
+	if( maxConns <= 0 ) maxConns = 64;
+	if( data.mKeys <= 0 ) data.mKeys = 10000;
+	if( data.mValueSize < 0 ) data.mValueSize = 100;
+
+	// a connection closed by the server is counted, not fatal
+	signal( SIGPIPE, SIG_IGN );
+
+	struct hostent * entry = gethostbyname( host );
+	if( NULL == entry ) {
+		printf( "Unknown host %s\n", host );
+		exit( 1 );
+	}
+
+	data.mAddr.sin_family = AF_INET;
+	data.mAddr.sin_port = htons( port );
+	memcpy( &( data.mAddr.sin_addr ), entry->h_addr, sizeof( data.mAddr.sin_addr ) );
+
+	data.mValue = (char*)malloc( data.mValueSize + 2 );
+	memset( data.mValue, 'v', data.mValueSize );
+	memcpy( data.mValue + data.mValueSize, "\r\n", 2 );
+
+	// fill the keys, so the gets hit
+	int fd = connectTo( &( data.mAddr ) );
+	if( fd < 0 ) {
+		printf( "Cannot connect to %s:%d\n", host, port );
+		exit( 1 );
+	}
+
+	char * request = (char*)malloc( data.mValueSize + 256 );
+	char reply[ 256 ] = { 0 };
+
+	for( int i = 0; i < data.mKeys; i++ ) {
+		int len = snprintf( request, 256, "set key%d 0 0 %d\r\n", i, data.mValueSize );
+		memcpy( request + len, data.mValue, data.mValueSize + 2 );
+
+		if( 0 != sendAll( fd, request, len + data.mValueSize + 2 )
+				|| 0 != readReply( fd, 0, reply, sizeof( reply ) ) ) {
+			printf( "Cannot fill the keys\n" );
+			exit( 1 );
+		}
+	}
+
+	close( fd );
+	free( request );
+
+	printf( "%d%% gets of %d keys, %d bytes values, %s:%d, %d msec per run\n",
+			data.mReadPercent, data.mKeys, data.mValueSize, host, port, msec );
+	printf( "%6s %10s %9s %9s %9s %8s %8s %8s\n", "conns", "ops/s",
+			"p50 us", "p99 us", "p99.9 us", "errors", "refused", "closed" );
+
+	for( int conns = 1; conns <= maxConns; conns *= 4 ) {
+		data.mStats = (LoadStat_t*)calloc( conns, sizeof( LoadStat_t ) );
+
+		double ops = sp_bench_run( conns, msec, loadLoop, &data );
+
+		LoadStat_t total;
+		memset( &total, 0, sizeof( total ) );
+
+		size_t count = 0;
+
+		for( int i = 0; i < conns; i++ ) {
+			for( int j = 0; j < eBuckets; j++ ) {
+				total.mBuckets[j] += data.mStats[i].mBuckets[j];
+				count += data.mStats[i].mBuckets[j];
+			}
+			total.mErrors += data.mStats[i].mErrors;
+			total.mRefused += data.mStats[i].mRefused;
+			total.mClosed += data.mStats[i].mClosed;
+		}
+
+		printf( "%6d %10.0f %9.0f %9.0f %9.0f %8lu %8lu %8lu\n", conns, ops,
+				percentile( total.mBuckets, count, 0.5 ),
+				percentile( total.mBuckets, count, 0.99 ),
+				percentile( total.mBuckets, count, 0.999 ),
+				(unsigned long)total.mErrors, (unsigned long)total.mRefused,
+				(unsigned long)total.mClosed );
+
+		free( data.mStats );
+	}
+
+	free( data.mValue );
+
+	return 0;
+}
+
@@ -0,0 +1,192 @@
+/*
+ * Copyright 2008 Stephen Liu
+ * For license terms, see the file COPYING along with this library.
+ */
+
+// the cost of parsing the text protocol. A mix of commands is replayed
+// through the decoder in pipelined batches, nothing reaches the cache.
+// The command lookup is also run alone, the switch of getCmd against
+// the scan of the command names it replaced
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+
+#include "spserver/spbuffer.hpp"
+
+#include "spcachemsg.hpp"
+#include "spcacheproto.hpp"
+#include "spcachebench.hpp"
+
+// the mix of 20 commands, a value of 32 bytes for the stores
+static const char * sMix[] = {
+	"get user:1000\r\n",
+	"get user:1001\r\n",
+	"get user:1002\r\n",
+	"get user:1003\r\n",
+	"get user:1004\r\n",
+	"get user:1005\r\n",
+	"get user:1006\r\n",
+	"get user:1007\r\n",
+	"get user:1008\r\n",
+	"get user:1009\r\n",
+	"get user:1010\r\n",
+	"get user:1011\r\n",
+	"get user:1 user:2 user:3 user:4 user:5 user:6 user:7 user:8 user:9 user:10\r\n",
+	"gets user:1 user:2 user:3 user:4 user:5 user:6 user:7 user:8 user:9 user:10\r\n",
+	"set user:1000 0 0 32\r\n01234567890123456789012345678901\r\n",
+	"set user:1001 0 3600 32\r\n01234567890123456789012345678901\r\n",
+	"delete user:1002\r\n",
+	"incr counter:1 1\r\n",
+	"decr counter:1 1\r\n",
+	"version\r\n",
+	NULL
+};
+
+static const char * sNames[] = {
+	"get", "gets", "set", "add", "replace", "cas", "append", "prepend",
+	"delete", "incr", "decr", "flush_all", "stats", "version", "quit", NULL
+};
+
+typedef struct tagParseData {
+	// the mix repeated to fill a pipelined batch
+	char * mBatch;
+	size_t mBatchLen;
+	int mBatchCmds;
+
+	// copies of the names
+	char mNames[ 16 ][ 16 ];
+	int mNameCount;
+} ParseData_t;
+
+static void decodeLoop( SP_CacheBench_t * bench )
+{
+	ParseData_t * data = (ParseData_t*)bench->mData;
+
+	SP_CacheMsgDecoder decoder( NULL, SP_CacheMsgDecoder::eText );
+	SP_Buffer inBuffer;
+
+	for( ; ! *bench->mStop; ) {
+		inBuffer.append( data->mBatch, data->mBatchLen );
+
+		for( ; inBuffer.getSize() > 0; ) {
+			decoder.decode( &inBuffer );
+
+			for( int i = 0; i < decoder.getCount(); i++ ) {
+				SP_CacheItem * item = decoder.getMsg( i )->takeItem();
+				if( NULL != item ) item->release();
+			}
+
+			bench->mOps += decoder.getCount();
+			decoder.reset();
+		}
+	}
+}
+
+static void switchLoop( SP_CacheBench_t * bench )
+{
+	ParseData_t * data = (ParseData_t*)bench->mData;
+
+	int sum = 0;
+
+	for( ; ! *bench->mStop; ) {
+		for( int i = 0; i < data->mNameCount; i++, bench->mOps++ ) {
+			// read through a volatile, the lookups are not hoisted out of the loop
+			const char * volatile name = data->mNames[i];
+			sum += SP_CacheProtoMessage::getCmd( name );
+		}
+	}
+
+	if( sum < 0 ) printf( "%d\n", sum );
+}
+
+static void scanLoop( SP_CacheBench_t * bench )
+{
+	ParseData_t * data = (ParseData_t*)bench->mData;
+
+	int sum = 0;
+
+	for( ; ! *bench->mStop; ) {
+		for( int i = 0; i < data->mNameCount; i++, bench->mOps++ ) {
+			const char * volatile name = data->mNames[i];
+
+			int cmd = SP_CacheProtoMessage::eUnknown;
+			for( int j = 0; NULL != sNames[j]; j++ ) {
+				if( 0 == strcasecmp( name, sNames[j] ) ) {
+					cmd = j;
+					break;
+				}
+			}
+			sum += cmd;
+		}
+	}
+
+	if( sum < 0 ) printf( "%d\n", sum );
+}
+
+int main( int argc, char * argv[] )
+{
+	int msec = 1000, maxBatch = 64;
+
+	int c = 0;
+	while( ( c = getopt( argc, argv, "d:b:v" ) ) != EOF ) {
+		switch( c ) {
+			case 'd':
+				msec = atoi( optarg );
+				break;
+			case 'b':
+				maxBatch = atoi( optarg );
+				break;
+			default:
+				printf( "Usage: %s [-d <msec>] [-b <max_batch>]\n", argv[0] );
+				printf( "\t-d msec of every run, default is 1000\n" );
+				printf( "\t-b pipelined commands of 1, 4, 16 ... up to max_batch, default is 64\n" );
+				exit( 0 );
+		}
+	}
+
+	if( maxBatch <= 0 ) maxBatch = 64;
+
+	ParseData_t data;
+	memset( &data, 0, sizeof( data ) );
+
+	printf( "decode of a mix of get, gets, set, delete, incr, decr, version, %d msec per run\n", msec );
+	printf( "%8s %12s %10s\n", "batch", "cmds/s", "ns/cmd" );
+
+	for( int batch = 1; batch <= maxBatch; batch *= 4 ) {
+		size_t len = 0;
+		for( int i = 0; i < batch; i++ ) len += strlen( sMix[ i % 20 ] );
+
+		data.mBatch = (char*)realloc( data.mBatch, len );
+		data.mBatchLen = 0;
+		data.mBatchCmds = batch;
+
+		for( int i = 0; i < batch; i++ ) {
+			size_t cmdLen = strlen( sMix[ i % 20 ] );
+			memcpy( data.mBatch + data.mBatchLen, sMix[ i % 20 ], cmdLen );
+			data.mBatchLen += cmdLen;
+		}
+
+		double ops = sp_bench_run( 1, msec, decodeLoop, &data );
+		printf( "%8d %12.0f %10.1f\n", batch, ops, ops > 0 ? 1e9 / ops : 0 );
+	}
+
+	free( data.mBatch );
+
+	for( ; NULL != sNames[ data.mNameCount ]; data.mNameCount++ ) {
+		strcpy( data.mNames[ data.mNameCount ], sNames[ data.mNameCount ] );
+	}
+
+	double switchOps = sp_bench_run( 1, msec, switchLoop, &data );
+	double scanOps = sp_bench_run( 1, msec, scanLoop, &data );
+
+	printf( "\nlookup of a command name, the switch of getCmd vs a scan of the names\n" );
+	printf( "%12s %12s\n", "switch ns", "scan ns" );
+	printf( "%12.1f %12.1f\n", switchOps > 0 ? 1e9 / switchOps : 0,
+			scanOps > 0 ? 1e9 / scanOps : 0 );
+
+	return 0;
+}
+
@@ -0,0 +1,275 @@
+/*
+ * Copyright 2008 Stephen Liu
+ * For license terms, see the file COPYING along with this library.
+ */
+
+// the queue between the event thread and the workers under load, the
+// fixed queue size of -q alone and with the admission control of -a. Sessions
+// arrive at a rate and send requests at intervals, the workers take one
+// usec of service per request. The waits go through SP_CacheQueueStat,
+// the same as in the server. The load is given as a part of the capacity
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/time.h>
+
+#include "spcachequeue.hpp"
+#include "spcachebench.hpp"
+
+enum { eMaxQueue = 1024 * 1024 };
+
+typedef struct tagQueueData {
+	SP_CacheQueueStat * mQueueStat;
+
+	pthread_mutex_t mMutex;
+	pthread_cond_t mCond;
+
+	// the enter times of the waiting requests, a ring
+	struct timeval * mQueue;
+	int mHead, mCount;
+
+	int mService, mStop;
+
+	// the waits of the served requests, usec
+	double * mWaits;
+	int mServed, mMaxWaits;
+} QueueData_t;
+
+typedef struct tagSession {
+	double mNextTime;
+	int mLeft;
+} Session_t;
+
+static void * workerLoop( void * arg )
+{
+	QueueData_t * data = (QueueData_t*)arg;
+
+	for( ; ; ) {
+		pthread_mutex_lock( &data->mMutex );
+		for( ; 0 == data->mCount && ! data->mStop; ) {
+			pthread_cond_wait( &data->mCond, &data->mMutex );
+		}
+
+		if( 0 == data->mCount ) {
+			pthread_mutex_unlock( &data->mMutex );
+			break;
+		}
+
+		struct timeval enterTime = data->mQueue[ data->mHead ];
+		data->mHead = ( data->mHead + 1 ) % eMaxQueue;
+		data->mCount--;
+		pthread_mutex_unlock( &data->mMutex );
+
+		data->mQueueStat->leave( &enterTime );
+
+		double wait = sp_bench_now() - ( enterTime.tv_sec + enterTime.tv_usec / 1000000.0 );
+
+		pthread_mutex_lock( &data->mMutex );
+		if( data->mServed < data->mMaxWaits ) data->mWaits[ data->mServed ] = wait * 1000000;
+		data->mServed++;
+		pthread_mutex_unlock( &data->mMutex );
+
+		usleep( data->mService );
+	}
+
+	return NULL;
+}
+
+static int push( QueueData_t * data )
+{
+	int ret = -1;
+
+	pthread_mutex_lock( &data->mMutex );
+	if( data->mCount < eMaxQueue ) {
+		data->mQueueStat->enter( &( data->mQueue[ ( data->mHead + data->mCount ) % eMaxQueue ] ) );
+		data->mCount++;
+		ret = 0;
+		pthread_cond_signal( &data->mCond );
+	}
+	pthread_mutex_unlock( &data->mMutex );
+
+	return ret;
+}
+
+static int compareWait( const void * item1, const void * item2 )
+{
+	double wait1 = *(const double*)item1, wait2 = *(const double*)item2;
+
+	return wait1 < wait2 ? -1 : ( wait1 > wait2 ? 1 : 0 );
+}
+
+// return the rejected requests, *refused is set to the refused sessions
+static int runLoad( double load, int admission, int workers, int service, int queueSize,
+		int requests, int interval, int targetWait, int msec, int * refused, QueueData_t * data )
+{
+	SP_CacheQueueStat queueStat;
+	if( admission ) queueStat.setTargetWait( targetWait );
+
+	data->mQueueStat = &queueStat;
+	data->mHead = data->mCount = data->mStop = data->mServed = 0;
+
+	pthread_t * threads = (pthread_t*)calloc( workers, sizeof( pthread_t ) );
+	for( int i = 0; i < workers; i++ ) pthread_create( &( threads[i] ), NULL, workerLoop, data );
+
+	// sessions per second to offer load times the capacity
+	double rate = load * workers * 1000000.0 / service / requests;
+
+	int maxSessions = (int)( rate * ( requests * interval / 1000000.0 + 1 ) ) + 1024;
+	Session_t * sessions = (Session_t*)calloc( maxSessions, sizeof( Session_t ) );
+	int active = 0, rejected = 0;
+
+	*refused = 0;
+
+	double begin = sp_bench_now(), arrived = 0;
+
+	for( double now = begin; now - begin < msec / 1000.0; now = sp_bench_now() ) {
+		for( ; arrived < ( now - begin ) * rate; arrived++ ) {
+			if( admission && queueStat.isOverloaded() ) {
+				queueStat.reject();
+				( *refused )++;
+			} else if( active < maxSessions ) {
+				sessions[ active ].mNextTime = now;
+				sessions[ active ].mLeft = requests;
+				active++;
+			}
+		}
+
+		for( int i = 0; i < active; ) {
+			Session_t * session = &( sessions[i] );
+
+			if( session->mNextTime <= now ) {
+				// a full queue refuses the request, whatever session it is of,
+				// -q is the hard cap with -a too, the same as in the server
+				if( data->mCount >= queueSize || 0 != push( data ) ) rejected++;
+
+				session->mNextTime += interval / 1000000.0;
+				session->mLeft--;
+			}
+
+			if( session->mLeft <= 0 ) {
+				sessions[i] = sessions[ --active ];
+			} else {
+				i++;
+			}
+		}
+
+		usleep( 100 );
+	}
+
+	pthread_mutex_lock( &data->mMutex );
+	data->mStop = 1;
+	pthread_cond_broadcast( &data->mCond );
+	pthread_mutex_unlock( &data->mMutex );
+
+	for( int i = 0; i < workers; i++ ) pthread_join( threads[i], NULL );
+
+	free( sessions );
+	free( threads );
+
+	return rejected;
+}
+
+int main( int argc, char * argv[] )
+{
+	int workers = 4, service = 1000, queueSize = 100, requests = 10;
+	int interval = 1000, targetWait = 2000, msec = 2000;
+
+	int c = 0;
+	while( ( c = getopt( argc, argv, "t:s:q:n:i:w:d:v" ) ) != EOF ) {
+		switch( c ) {
+			case 't':
+				workers = atoi( optarg );
+				break;
+			case 's':
+				service = atoi( optarg );
+				break;
+			case 'q':
+				queueSize = atoi( optarg );
+				break;
+			case 'n':
+				requests = atoi( optarg );
+				break;
+			case 'i':
+				interval = atoi( optarg );
+				break;
+			case 'w':
+				targetWait = atoi( optarg );
+				break;
+			case 'd':
+				msec = atoi( optarg );
+				break;
+			default:
+				printf( "Usage: %s [-t <workers>] [-s <usec>] [-q <queue_size>] [-n <requests>]\n"
+						"\t[-i <usec>] [-w <usec>] [-d <msec>]\n", argv[0] );
+				printf( "\t-t workers, default is 4\n" );
+				printf( "\t-s usec of service per request, default is 1000\n" );
+				printf( "\t-q queue size, with and without admission control, default is 100\n" );
+				printf( "\t-n requests of a session, default is 10\n" );
+				printf( "\t-i usec between the requests of a session, default is 1000\n" );
+				printf( "\t-w queue wait target of admission control, default is 2000\n" );
+				printf( "\t-d msec of every run, default is 2000\n" );
+				exit( 0 );
+		}
+	}
+
+	if( workers <= 0 ) workers = 4;
+	if( service <= 0 ) service = 1000;
+	if( requests <= 0 ) requests = 10;
+
+	QueueData_t data;
+	memset( &data, 0, sizeof( data ) );
+	pthread_mutex_init( &data.mMutex, NULL );
+	pthread_cond_init( &data.mCond, NULL );
+	data.mQueue = (struct timeval*)calloc( eMaxQueue, sizeof( struct timeval ) );
+	data.mService = service;
+	data.mMaxWaits = eMaxQueue;
+	data.mWaits = (double*)calloc( data.mMaxWaits, sizeof( double ) );
+
+	printf( "%d workers of %d usec, sessions of %d requests every %d usec, %d msec per run\n",
+			workers, service, requests, interval, msec );
+	printf( "%-10s %5s %9s %9s %9s %9s %9s %9s\n", "queue", "load", "served/s",
+			"rejected", "refused", "avg us", "p99 us", "max us" );
+
+	static const double loads[] = { 0.5, 0.9, 1.2, 2.0, 4.0, 0 };
+
+	for( int i = 0; loads[i] > 0; i++ ) {
+		for( int admission = 0; admission <= 1; admission++ ) {
+			int refused = 0;
+
+			double begin = sp_bench_now();
+			int rejected = runLoad( loads[i], admission, workers, service, queueSize,
+					requests, interval, targetWait, msec, &refused, &data );
+			double seconds = sp_bench_now() - begin;
+
+			int count = data.mServed < data.mMaxWaits ? data.mServed : data.mMaxWaits;
+			qsort( data.mWaits, count, sizeof( double ), compareWait );
+
+			double total = 0;
+			for( int j = 0; j < count; j++ ) total += data.mWaits[j];
+
+			char name[ 16 ] = { 0 };
+			if( admission ) {
+				snprintf( name, sizeof( name ), "-a -q %d", queueSize );
+			} else {
+				snprintf( name, sizeof( name ), "-q %d", queueSize );
+			}
+
+			printf( "%-10s %5.1f %9.0f %9d %9d %9.0f %9.0f %9.0f\n", name, loads[i],
+					data.mServed / seconds, rejected, refused,
+					count > 0 ? total / count : 0,
+					count > 0 ? data.mWaits[ count * 99 / 100 ] : 0,
+					count > 0 ? data.mWaits[ count - 1 ] : 0 );
+		}
+	}
+
+	free( data.mWaits );
+	free( data.mQueue );
+	pthread_cond_destroy( &data.mCond );
+	pthread_mutex_destroy( &data.mMutex );
+
+	return 0;
+}
+
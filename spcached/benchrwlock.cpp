@@ -0,0 +1,136 @@
+/*
+ * Copyright 2008 Stephen Liu
+ * For license terms, see the file COPYING along with this library.
+ */
+
+// scaling of a read mostly load over the shard locks. Every thread gets
+// random keys and sets one now and then, from 1 up to 32 threads.
+// The hash index takes the shared lock for gets, the dict index cannot,
+// a get of SP_DictCache changes it, so it is run as the exclusive case
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+
+#include "spserver/sputils.hpp"
+#include "spserver/spmsgblock.hpp"
+
+#include "spcacheimpl.hpp"
+#include "spcachemsg.hpp"
+#include "spcacheindex.hpp"
+#include "spcachebench.hpp"
+
+typedef struct tagRwData {
+	SP_CacheEx * mCacheEx;
+	int mKeys, mReadPercent;
+} RwData_t;
+
+static void rwLoop( SP_CacheBench_t * bench )
+{
+	RwData_t * data = (RwData_t*)bench->mData;
+
+	unsigned int seed = bench->mIndex + 1;
+
+	char key[ 32 ] = { 0 };
+	SP_ArrayList keyList;
+	keyList.append( key );
+
+	SP_MsgBlockList blockList;
+
+	for( ; ! *bench->mStop; bench->mOps++ ) {
+		snprintf( key, sizeof( key ), "key%u", sp_bench_rand( &seed ) % data->mKeys );
+
+		if( (int)( sp_bench_rand( &seed ) % 100 ) < data->mReadPercent ) {
+			data->mCacheEx->get( &keyList, &blockList );
+			blockList.clean();
+		} else {
+			SP_CacheItem * item = SP_CacheItem::newInstance( NULL, key, 34 );
+			item->appendDataBlock( "0123456789012345678901234567890\r\n", 33 );
+			if( 0 != data->mCacheEx->set( item, 0 ) ) item->release();
+		}
+	}
+}
+
+static double runIndex( int algo, int threads, int msec, int policy, RwData_t * data )
+{
+	SP_CacheEx cacheEx( algo, data->mKeys * 2, 16, 0, NULL, policy );
+
+	for( int i = 0; i < data->mKeys; i++ ) {
+		char key[ 32 ] = { 0 };
+		snprintf( key, sizeof( key ), "key%d", i );
+
+		SP_CacheItem * item = SP_CacheItem::newInstance( NULL, key, 34 );
+		item->appendDataBlock( "0123456789012345678901234567890\r\n", 33 );
+		cacheEx.set( item, 0 );
+	}
+
+	data->mCacheEx = &cacheEx;
+
+	return sp_bench_run( threads, msec, rwLoop, data );
+}
+
+int main( int argc, char * argv[] )
+{
+	int maxThreads = 32, msec = 1000;
+	const char * policyName = "fifo";
+
+	RwData_t data;
+	memset( &data, 0, sizeof( data ) );
+	data.mKeys = 10000;
+	data.mReadPercent = 95;
+
+	int c = 0;
+	while( ( c = getopt( argc, argv, "t:d:k:r:e:v" ) ) != EOF ) {
+		switch( c ) {
+			case 't':
+				maxThreads = atoi( optarg );
+				break;
+			case 'd':
+				msec = atoi( optarg );
+				break;
+			case 'k':
+				data.mKeys = atoi( optarg );
+				break;
+			case 'r':
+				data.mReadPercent = atoi( optarg );
+				break;
+			case 'e':
+				policyName = optarg;
+				break;
+			default:
+				printf( "Usage: %s [-t <max_threads>] [-d <msec>] [-k <keys>] [-r <read_percent>] [-e <policy>]\n", argv[0] );
+				printf( "\t-t runs 1, 2, 4 ... up to max_threads, default is 32\n" );
+				printf( "\t-d msec of every run, default is 1000\n" );
+				printf( "\t-k keys, default is 10000\n" );
+				printf( "\t-r percent of gets, the others are sets, default is 95\n" );
+				printf( "\t-e eviction policy, fifo, lru, slru or clock, default is fifo\n" );
+				exit( 0 );
+		}
+	}
+
+	if( data.mKeys <= 0 ) data.mKeys = 10000;
+
+	int policy = SP_CacheShard::getPolicy( policyName );
+	if( policy < 0 ) {
+		printf( "Unknown eviction policy: %s\n", policyName );
+		exit( 1 );
+	}
+
+	printf( "%d%% gets of %d keys, 16 shards, %s, %d msec per run\n",
+			data.mReadPercent, data.mKeys, SP_CacheShard::getPolicyName( policy ), msec );
+	printf( "%8s %12s %10s %12s %10s\n", "threads", "hash ops/s", "ns/op", "dict ops/s", "ns/op" );
+
+	for( int threads = 1; threads <= maxThreads; threads *= 2 ) {
+		double hashOps = runIndex( SP_CacheIndex::eHash, threads, msec, policy, &data );
+		double dictOps = runIndex( SP_DictCache::eFIFO, threads, msec, policy, &data );
+
+		printf( "%8d %12.0f %10.1f %12.0f %10.1f\n", threads,
+				hashOps, hashOps > 0 ? 1e9 * threads / hashOps : 0,
+				dictOps, dictOps > 0 ? 1e9 * threads / dictOps : 0 );
+	}
+
+	return 0;
+}
+
@@ -0,0 +1,189 @@
+/*
+ * Copyright 2008 Stephen Liu
+ * For license terms, see the file COPYING along with this library.
+ */
+
+// the cost of a set by the size of its value. The requests arrive in
+// reads of a few KB, like they come off a socket, and go through the
+// text decoder into the cache. The data block of the item is also filled
+// alone, by takeDataBlock against the copy and erase it replaced
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "spserver/spbuffer.hpp"
+
+#include "spcacheimpl.hpp"
+#include "spcachemsg.hpp"
+#include "spcacheindex.hpp"
+#include "spcacheproto.hpp"
+#include "spcachebench.hpp"
+
+typedef struct tagSetData {
+	SP_CacheEx * mCacheEx;
+	int mKeys, mReadSize;
+
+	// requests of every key, "set key 0 0 size\r\n" and the value
+	char ** mRequests;
+	size_t * mRequestLens;
+
+	size_t mValueSize;
+} SetData_t;
+
+static void decodeLoop( SP_CacheBench_t * bench )
+{
+	SetData_t * data = (SetData_t*)bench->mData;
+
+	SP_CacheMsgDecoder decoder( NULL, SP_CacheMsgDecoder::eText );
+	SP_Buffer inBuffer;
+
+	for( int index = 0; ! *bench->mStop; index = ( index + 1 ) % data->mKeys ) {
+		const char * request = data->mRequests[ index ];
+		size_t len = data->mRequestLens[ index ];
+
+		for( size_t pos = 0; pos < len; ) {
+			size_t bytes = len - pos;
+			if( bytes > (size_t)data->mReadSize ) bytes = data->mReadSize;
+
+			inBuffer.append( request + pos, bytes );
+			pos += bytes;
+
+			decoder.decode( &inBuffer );
+
+			for( int i = 0; i < decoder.getCount(); i++ ) {
+				SP_CacheItem * item = decoder.getMsg( i )->takeItem();
+				if( 0 != data->mCacheEx->set( item, 0 ) ) item->release();
+				bench->mOps++;
+			}
+
+			decoder.reset();
+		}
+	}
+}
+
+static void fillLoop( SP_CacheBench_t * bench, int take )
+{
+	SetData_t * data = (SetData_t*)bench->mData;
+
+	SP_Buffer inBuffer;
+
+	for( int index = 0; ! *bench->mStop; index = ( index + 1 ) % data->mKeys ) {
+		char key[ 32 ] = { 0 };
+		snprintf( key, sizeof( key ), "key%d", index );
+
+		const char * value = strchr( data->mRequests[ index ], '\n' ) + 1;
+		size_t len = data->mValueSize + 2;
+
+		SP_CacheItem * item = SP_CacheItem::newInstance( NULL, key, len );
+
+		for( size_t pos = 0; pos < len; ) {
+			size_t bytes = len - pos;
+			if( bytes > (size_t)data->mReadSize ) bytes = data->mReadSize;
+
+			inBuffer.append( value + pos, bytes );
+			pos += bytes;
+
+			if( take ) {
+				item->takeDataBlock( &inBuffer, inBuffer.getSize() );
+			} else {
+				item->appendDataBlock( inBuffer.getBuffer(), inBuffer.getSize() );
+				inBuffer.erase( inBuffer.getSize() );
+			}
+		}
+
+		if( 0 != data->mCacheEx->set( item, 0 ) ) item->release();
+		bench->mOps++;
+	}
+}
+
+static void takeLoop( SP_CacheBench_t * bench )
+{
+	fillLoop( bench, 1 );
+}
+
+static void copyLoop( SP_CacheBench_t * bench )
+{
+	fillLoop( bench, 0 );
+}
+
+int main( int argc, char * argv[] )
+{
+	int msec = 1000;
+	size_t maxSize = 1024 * 1024;
+
+	SetData_t data;
+	memset( &data, 0, sizeof( data ) );
+	data.mKeys = 16;
+	data.mReadSize = 16 * 1024;
+
+	int c = 0;
+	while( ( c = getopt( argc, argv, "s:d:k:r:v" ) ) != EOF ) {
+		switch( c ) {
+			case 's':
+				maxSize = strtoul( optarg, NULL, 10 );
+				break;
+			case 'd':
+				msec = atoi( optarg );
+				break;
+			case 'k':
+				data.mKeys = atoi( optarg );
+				break;
+			case 'r':
+				data.mReadSize = atoi( optarg );
+				break;
+			default:
+				printf( "Usage: %s [-s <max_size>] [-d <msec>] [-k <keys>] [-r <read_size>]\n", argv[0] );
+				printf( "\t-s values of 16, 64, 256 ... bytes up to max_size, default is 1048576\n" );
+				printf( "\t-d msec of every run, default is 1000\n" );
+				printf( "\t-k keys set in turn, default is 16\n" );
+				printf( "\t-r bytes of every read, default is 16384\n" );
+				exit( 0 );
+		}
+	}
+
+	if( data.mKeys <= 0 ) data.mKeys = 16;
+	if( data.mReadSize <= 0 ) data.mReadSize = 16 * 1024;
+
+	SP_CacheEx cacheEx( SP_CacheIndex::eHash, 100000, 16 );
+	data.mCacheEx = &cacheEx;
+
+	data.mRequests = (char**)calloc( data.mKeys, sizeof( char * ) );
+	data.mRequestLens = (size_t*)calloc( data.mKeys, sizeof( size_t ) );
+
+	printf( "set by value size, %d keys, reads of %d bytes, %d msec per run\n",
+			data.mKeys, data.mReadSize, msec );
+	printf( "%10s %12s %10s %12s %12s\n", "size", "sets/s", "MB/s", "take ns", "copy ns" );
+
+	for( size_t size = 16; size <= maxSize; size *= 4 ) {
+		data.mValueSize = size;
+
+		for( int i = 0; i < data.mKeys; i++ ) {
+			char line[ 64 ] = { 0 };
+			int len = snprintf( line, sizeof( line ), "set key%d 0 0 %lu\r\n", i, (unsigned long)size );
+
+			data.mRequests[i] = (char*)realloc( data.mRequests[i], len + size + 2 );
+			memcpy( data.mRequests[i], line, len );
+			memset( data.mRequests[i] + len, 'v', size );
+			memcpy( data.mRequests[i] + len + size, "\r\n", 2 );
+			data.mRequestLens[i] = len + size + 2;
+		}
+
+		double ops = sp_bench_run( 1, msec, decodeLoop, &data );
+		double takeOps = sp_bench_run( 1, msec, takeLoop, &data );
+		double copyOps = sp_bench_run( 1, msec, copyLoop, &data );
+
+		printf( "%10lu %12.0f %10.1f %12.1f %12.1f\n", (unsigned long)size, ops,
+				ops * size / ( 1024 * 1024 ),
+				takeOps > 0 ? 1e9 / takeOps : 0,
+				copyOps > 0 ? 1e9 / copyOps : 0 );
+	}
+
+	for( int i = 0; i < data.mKeys; i++ ) free( data.mRequests[i] );
+	free( data.mRequests );
+	free( data.mRequestLens );
+
+	return 0;
+}
+
@@ -0,0 +1,478 @@
+/*
+ * Copyright 2008 Stephen Liu
+ * For license terms, see the file COPYING along with this library.
+ */
+
+// replay of requests through the decoder and the handler, the same as a
+// session of the server does, against the replies expected. Every check
+// feeds its input at once and then one byte at a time.
+// Exits with 1 if a reply differs
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "spserver/spbuffer.hpp"
+#include "spserver/sprequest.hpp"
+#include "spserver/spresponse.hpp"
+#include "spserver/spmsgblock.hpp"
+#include "spserver/spmsgdecoder.hpp"
+
+#include "spcacheimpl.hpp"
+#include "spcachemsg.hpp"
+#include "spcacheindex.hpp"
+#include "spcacheproto.hpp"
+#include "spcachebinary.hpp"
+#include "spcachemr.hpp"
+
+static void takeReplies( SP_Response * response, SP_Buffer * output )
+{
+	for( SP_Message * msg = response->takeMessage(); NULL != msg;
+			msg = response->takeMessage() ) {
+		// append takes a length of 0 as a C string
+		SP_Buffer * buffer = msg->getMsg();
+		if( buffer->getSize() > 0 ) output->append( buffer->getBuffer(), buffer->getSize() );
+
+		SP_MsgBlockList * blockList = msg->getFollowBlockList();
+		for( int i = 0; i < blockList->getCount(); i++ ) {
+			const SP_MsgBlock * block = blockList->getItem( i );
+			if( block->getSize() > 0 ) output->append( block->getData(), block->getSize() );
+		}
+
+		delete msg;
+	}
+}
+
+// one session of input fed step bytes at a time, the replies go to output
+static void replay( SP_CacheEx * cacheEx, const SP_Buffer * input, size_t step, SP_Buffer * output )
+{
+	SP_Sid_t sid;
+	memset( &sid, 0, sizeof( sid ) );
+
+	SP_CacheProtoHandler handler( cacheEx );
+	SP_Request request;
+
+	SP_Response response( sid );
+	int isClosed = handler.start( &request, &response );
+	takeReplies( &response, output );
+
+	SP_Buffer inBuffer;
+
+	for( size_t pos = 0; ! isClosed && pos < input->getSize(); pos += step ) {
+		size_t len = input->getSize() - pos < step ? input->getSize() - pos : step;
+		inBuffer.append( (char*)input->getBuffer() + pos, len );
+
+		for( ; ! isClosed && inBuffer.getSize() > 0; ) {
+			if( SP_MsgDecoder::eOK != request.getMsgDecoder()->decode( &inBuffer ) ) break;
+
+			SP_Response response( sid );
+			isClosed = handler.handle( &request, &response );
+			takeReplies( &response, output );
+		}
+	}
+
+	handler.close();
+}
+
+// one line "<opcode> <status> <opaque> <value>" for every binary reply
+static void renderBinary( const SP_Buffer * replies, SP_Buffer * output )
+{
+	const unsigned char * pos = (unsigned char*)replies->getBuffer();
+	const unsigned char * end = pos + replies->getSize();
+
+	for( ; pos + SP_CacheBinaryProto::eHeaderSize <= end; ) {
+		int keyLen = ( pos[2] << 8 ) | pos[3], extLen = pos[4], status = ( pos[6] << 8 ) | pos[7];
+		size_t bodyLen = ( (size_t)pos[8] << 24 ) | ( pos[9] << 16 ) | ( pos[10] << 8 ) | pos[11];
+		uint32_t opaque = ( (uint32_t)pos[12] << 24 ) | ( pos[13] << 16 ) | ( pos[14] << 8 ) | pos[15];
+
+		char line[ 64 ] = { 0 };
+		snprintf( line, sizeof( line ), "%02x %d %u ", pos[1], status, opaque );
+		output->append( line );
+
+		pos += SP_CacheBinaryProto::eHeaderSize;
+		if( pos + bodyLen > end ) break;
+
+		if( bodyLen > (size_t)( extLen + keyLen ) ) {
+			output->append( pos + extLen + keyLen, bodyLen - extLen - keyLen );
+		}
+		output->append( "\n" );
+
+		pos += bodyLen;
+	}
+
+	if( pos != end ) output->append( "<broken frame>\n" );
+}
+
+static void binaryRequest( SP_Buffer * buffer, int opcode, uint32_t opaque,
+		const char * key, int keyLen, const void * extras, int extLen,
+		const char * value, size_t valueLen )
+{
+	unsigned char header[ SP_CacheBinaryProto::eHeaderSize ] = { 0 };
+
+	size_t bodyLen = keyLen + extLen + valueLen;
+
+	header[0] = SP_CacheBinaryProto::eRequestMagic;
+	header[1] = opcode;
+	header[2] = keyLen >> 8;
+	header[3] = keyLen;
+	header[4] = extLen;
+	header[8] = bodyLen >> 24;
+	header[9] = bodyLen >> 16;
+	header[10] = bodyLen >> 8;
+	header[11] = bodyLen;
+	header[12] = opaque >> 24;
+	header[13] = opaque >> 16;
+	header[14] = opaque >> 8;
+	header[15] = opaque;
+
+	buffer->append( header, sizeof( header ) );
+	if( extLen > 0 ) buffer->append( extras, extLen );
+	if( keyLen > 0 ) buffer->append( key, keyLen );
+	if( valueLen > 0 ) buffer->append( value, valueLen );
+}
+
+static void binarySet( SP_Buffer * buffer, uint32_t opaque, const char * key, int keyLen,
+		const char * value )
+{
+	// flags and exptime, both 0
+	char extras[ 8 ] = { 0 };
+
+	binaryRequest( buffer, SP_CacheBinaryProto::eSet, opaque, key, keyLen,
+			extras, sizeof( extras ), value, strlen( value ) );
+}
+
+// return 0 if the replies of both feeds are expected
+static int expect( const char * name, int isBinary, const SP_Buffer * input,
+		const char * expected, size_t maxItemSize = 1024 * 1024 )
+{
+	int failed = 0;
+
+	static const size_t steps[] = { 0, 1 };
+
+	for( int i = 0; i < (int)( sizeof( steps ) / sizeof( steps[0] ) ); i++ ) {
+		SP_CacheEx cacheEx( SP_CacheIndex::eHash, 0 );
+		cacheEx.setMaxItemSize( maxItemSize );
+
+		SP_Buffer replies, output;
+		replay( &cacheEx, input, steps[i] > 0 ? steps[i] : input->getSize(), &replies );
+
+		if( isBinary ) {
+			renderBinary( &replies, &output );
+		} else {
+			output.append( replies.getBuffer(), replies.getSize() );
+		}
+
+		if( output.getSize() != strlen( expected )
+				|| 0 != memcmp( output.getBuffer(), expected, output.getSize() ) ) {
+			printf( "%s, fed %s: FAILED\n", name, steps[i] > 0 ? "by byte" : "at once" );
+			printf( "expected:\n%s\ngot:\n%.*s\n", expected,
+					(int)output.getSize(), (char*)output.getBuffer() );
+			failed = 1;
+		}
+	}
+
+	if( ! failed ) printf( "%s: OK\n", name );
+
+	return failed;
+}
+
+// a bad binary request has its body skipped, not parsed as the next header
+static int checkBinaryBadRequest()
+{
+	SP_Buffer input;
+
+	char longKey[ 300 ];
+	memset( longKey, 'k', sizeof( longKey ) );
+
+	// the ignored value of a get, over eMaxIgnoredValue
+	char value[ 2000 ];
+	memset( value, 'v', sizeof( value ) );
+
+	binarySet( &input, 1, "foo", 3, "bar" );
+	binarySet( &input, 2, longKey, 251, "hello" );
+	binarySet( &input, 3, longKey, 300, "world" );
+	binaryRequest( &input, SP_CacheBinaryProto::eGet, 4, "foo", 3, NULL, 0, value, sizeof( value ) );
+	binaryRequest( &input, SP_CacheBinaryProto::eGet, 5, "foo", 3, NULL, 0, NULL, 0 );
+	binaryRequest( &input, SP_CacheBinaryProto::eGet, 6, longKey, 250, NULL, 0, NULL, 0 );
+
+	return expect( "binary bad requests", 1, &input,
+			"01 0 1 \n"
+			"01 4 2 Key too long\n"
+			"01 4 3 Key too long\n"
+			"00 4 4 Invalid arguments\n"
+			"00 0 5 bar\n"
+			"00 1 6 Not found\n" );
+}
+
+// a value read into its item by SP_CacheValueReader, as the mr reactor
+// does, then decoded without any input
+static int checkValueReader( int isBinary )
+{
+	// over a chunk, so the value space ends at the chunk boundary
+	enum { eValueSize = 1536 * 1024 };
+
+	SP_Sid_t sid;
+	memset( &sid, 0, sizeof( sid ) );
+
+	SP_CacheEx cacheEx( SP_CacheIndex::eHash, 0 );
+	cacheEx.setMaxItemSize( 2 * 1024 * 1024 );
+
+	SP_CacheProtoHandler handler( &cacheEx );
+	SP_Request request;
+
+	SP_Buffer inBuffer, replies;
+
+	SP_Response response( sid );
+	handler.start( &request, &response );
+
+	char * value = (char*)malloc( eValueSize + 2 );
+	for( int i = 0; i < eValueSize; i++ ) value[i] = 'a' + i % 26;
+	memcpy( value + eValueSize, "\r\n", 2 );
+
+	char extras[ 8 ] = { 0 };
+	if( isBinary ) {
+		binaryRequest( &inBuffer, SP_CacheBinaryProto::eSet, 1, "foo", 3,
+				extras, sizeof( extras ), NULL, 0 );
+		// the body length is of the value, which is not in the buffer
+		size_t bodyLen = 3 + sizeof( extras ) + eValueSize;
+		unsigned char * header = (unsigned char*)inBuffer.getBuffer();
+		header[8] = bodyLen >> 24;
+		header[9] = bodyLen >> 16;
+		header[10] = bodyLen >> 8;
+		header[11] = bodyLen;
+	} else {
+		char line[ 64 ] = { 0 };
+		snprintf( line, sizeof( line ), "set foo 0 0 %d\r\n", eValueSize );
+		inBuffer.append( line );
+	}
+
+	SP_MsgDecoder * decoder = request.getMsgDecoder();
+	SP_CacheValueReader * reader = dynamic_cast<SP_CacheValueReader*>( decoder );
+
+	int failed = ( NULL == reader || SP_MsgDecoder::eOK == decoder->decode( &inBuffer ) );
+
+	// 3 parts of odd sizes, the tail "\r\n" of text is in the last one
+	size_t pos = 0, total = isBinary ? eValueSize : eValueSize + 2;
+	for( int i = 0; ! failed && pos < total; i++ ) {
+		size_t bytes = 0;
+		void * space = reader->getValueSpace( &bytes );
+		if( NULL == space ) break;
+
+		if( bytes > 40000 ) bytes = 40000;
+		memcpy( space, value + pos, bytes );
+		reader->fillValue( bytes );
+		pos += bytes;
+	}
+
+	size_t bytes = 0;
+	if( pos != total || NULL != reader->getValueSpace( &bytes )
+			|| SP_MsgDecoder::eOK != decoder->decode( &inBuffer ) ) {
+		failed = 1;
+	} else {
+		SP_Response response( sid );
+		handler.handle( &request, &response );
+		takeReplies( &response, &replies );
+	}
+
+	SP_CacheItem * item = cacheEx.getItem( "foo" );
+	if( NULL == item || item->getDataBytes() != (size_t)eValueSize + 2 ) {
+		failed = 1;
+	} else {
+		char * data = (char*)malloc( eValueSize + 2 );
+		item->readDataBlock( 0, data, eValueSize + 2 );
+		if( 0 != memcmp( data, value, eValueSize + 2 ) ) failed = 1;
+		free( data );
+	}
+	if( NULL != item ) item->release();
+
+	handler.close();
+	free( value );
+
+	printf( "%s value reader: %s\n", isBinary ? "binary" : "text", failed ? "FAILED" : "OK" );
+
+	return failed;
+}
+
+// a get of a key over 250 bytes is refused, not answered with a cut key,
+// one of 250 bytes is a miss
+static int checkTextLongKey()
+{
+	SP_Buffer input;
+
+	char longKey[ 252 ] = { 0 };
+	memset( longKey, 'k', 251 );
+
+	input.append( "set foo 0 0 3\r\nbar\r\n" );
+	input.append( "get " );
+	input.append( longKey + 1 );
+	input.append( "\r\nget foo " );
+	input.append( longKey );
+	input.append( "\r\n" );
+
+	return expect( "text long key", 0, &input,
+			"STORED\r\n"
+			"END\r\n"
+			"CLIENT_ERROR bad command line format\r\n" );
+}
+
+// a bytes of -1, over 64 bits or not a number is refused, one over -I
+// is refused and its value skipped, even one that wrapped an unsigned int
+static int checkTextBytes()
+{
+	static const char * bads[] = { "-1", "18446744073709551615", "99999999999999999999", "3x", NULL };
+
+	int failed = 0;
+
+	for( int i = 0; NULL != bads[i]; i++ ) {
+		char line[ 64 ] = { 0 };
+		snprintf( line, sizeof( line ), "set foo 0 0 %s\r\nbar\r\n", bads[i] );
+
+		SP_Buffer input;
+		input.append( line );
+
+		snprintf( line, sizeof( line ), "bytes %s", bads[i] );
+		failed |= expect( line, 0, &input, "CLIENT_ERROR bad command line format\r\n" );
+	}
+
+	// the reply comes after the 4G are skipped, an unsigned int wrapped
+	// the size to 1 and took "bar" as a bad data chunk
+	SP_Buffer input;
+	input.append( "set foo 0 0 4294967295\r\nbar\r\nget foo\r\n" );
+
+	failed |= expect( "bytes 4294967295", 0, &input, "" );
+
+	input.reset();
+	input.append( "set foo 0 0 11\r\n12345678901\r\n" );
+	input.append( "set foo 0 0 3\r\nbar\r\nget foo\r\n" );
+
+	failed |= expect( "set over -I", 0, &input,
+			"SERVER_ERROR object too large for cache\r\n"
+			"STORED\r\nVALUE foo 0 3\r\nbar\r\nEND\r\n", 10 );
+
+	return failed;
+}
+
+// append and prepend cannot take a value over -I
+static int checkCatLimit()
+{
+	SP_Buffer input;
+
+	input.append( "set foo 0 0 6\r\n123456\r\n" );
+	input.append( "append foo 0 0 4\r\n7890\r\n" );
+	input.append( "append foo 0 0 1\r\nx\r\n" );
+	input.append( "prepend foo 0 0 1\r\nx\r\n" );
+	input.append( "get foo\r\n" );
+
+	return expect( "append over -I", 0, &input,
+			"STORED\r\nSTORED\r\nNOT_STORED\r\nNOT_STORED\r\n"
+			"VALUE foo 0 10\r\n1234567890\r\nEND\r\n", 10 );
+}
+
+// bytes of c and "\r\n"
+static void appendData( SP_Buffer * buffer, size_t bytes, char c )
+{
+	char * value = (char*)malloc( bytes + 2 );
+	memset( value, c, bytes );
+	memcpy( value + bytes, "\r\n", 2 );
+	buffer->append( value, bytes + 2 );
+	free( value );
+}
+
+static void appendValue( SP_Buffer * buffer, const char * cmd, const char * key, size_t bytes, char c )
+{
+	char line[ 128 ] = { 0 };
+	snprintf( line, sizeof( line ), "%s %s 0 0 %lu\r\n", cmd, key, (unsigned long)bytes );
+	buffer->append( line );
+
+	appendData( buffer, bytes, c );
+}
+
+// -e slru with a tiny -m, a chunked value is read, promoted to protected
+// by the evictions of the fillers, then appended to in place many times.
+// The append which takes it into a third chunk resizes it in protected,
+// the fillers are all evicted, the value must never be the victim
+static int checkSlruAppend()
+{
+	enum { eBigSize = 2000 * 1024, eFillers = 30, eFillerSize = 100 * 1024,
+			eAppends = 100, eAppendSize = 1000 };
+
+	SP_CacheEx cacheEx( SP_CacheIndex::eHash, 0, 1, 3 * 1024 * 1024, NULL, SP_CacheShard::eSLRU );
+	cacheEx.setMaxItemSize( 4 * 1024 * 1024 );
+
+	SP_Buffer input, replies, expected;
+
+	appendValue( &input, "set", "big", eBigSize, 'a' );
+	input.append( "get big\r\n" );
+	expected.append( "STORED\r\n" );
+	char line[ 64 ] = { 0 };
+	snprintf( line, sizeof( line ), "VALUE big 0 %d\r\n", eBigSize );
+	expected.append( line );
+	appendData( &expected, eBigSize, 'a' );
+	expected.append( "END\r\n" );
+
+	for( int i = 0; i < eFillers; i++ ) {
+		char key[ 32 ] = { 0 };
+		snprintf( key, sizeof( key ), "filler%d", i );
+		appendValue( &input, "set", key, eFillerSize, 'f' );
+		expected.append( "STORED\r\n" );
+	}
+
+	replay( &cacheEx, &input, input.getSize(), &replies );
+
+	SP_Buffer stat;
+	cacheEx.stat( &stat );
+	int failed = ( NULL == stat.find( "STAT slru_protected_items 1\r\n", 29 ) );
+
+	// a new session, the reply of the get no longer holds the item, so the
+	// appends are done in place
+	input.reset();
+
+	for( int i = 0; i < eAppends; i++ ) {
+		appendValue( &input, "append", "big", eAppendSize, 'b' );
+		expected.append( "STORED\r\n" );
+	}
+
+	replay( &cacheEx, &input, input.getSize(), &replies );
+
+	if( replies.getSize() != expected.getSize()
+			|| 0 != memcmp( replies.getBuffer(), expected.getBuffer(), expected.getSize() ) ) {
+		failed = 1;
+	}
+
+	SP_CacheItem * item = cacheEx.getItem( "big" );
+	size_t total = eBigSize + eAppends * eAppendSize;
+
+	if( NULL == item || item->getDataBytes() != total + 2 ) {
+		failed = 1;
+	} else {
+		char * data = (char*)malloc( total + 2 );
+		item->readDataBlock( 0, data, total + 2 );
+		for( size_t i = 0; i < total && ! failed; i++ ) {
+			if( data[i] != ( i < eBigSize ? 'a' : 'b' ) ) failed = 1;
+		}
+		free( data );
+	}
+	if( NULL != item ) item->release();
+
+	printf( "slru append: %s\n", failed ? "FAILED" : "OK" );
+
+	return failed;
+}
+
+int main( int argc, char * argv[] )
+{
+	int failed = 0;
+
+	failed |= checkBinaryBadRequest();
+	failed |= checkValueReader( 0 );
+	failed |= checkValueReader( 1 );
+	failed |= checkTextLongKey();
+	failed |= checkSlruAppend();
+	failed |= checkTextBytes();
+	failed |= checkCatLimit();
+
+	printf( "%s\n", failed ? "FAILED" : "OK" );
+
+	return failed;
+}
@@ -0,0 +1,210 @@
+/*
+ * Copyright 2008 Stephen Liu
+ * For license terms, see the file COPYING along with this library.
+ */
+
+// a primary and a replica over the loopback. The primary has items before
+// the replica connects, so it does a full sync, then writers race sets,
+// appends, incrs and deletes on the same keys while the log streams.
+// The replica must end with the same items as the primary.
+// Exits with 1 if they differ
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "spcacheimpl.hpp"
+#include "spcachemsg.hpp"
+#include "spcacheindex.hpp"
+#include "spcacherepl.hpp"
+
+enum { eKeys = 64, eWriters = 4, eBigSize = 1536 * 1024 };
+
+typedef struct tagReplData {
+	SP_CacheEx * mPrimary;
+	int mIndex, mRounds;
+} ReplData_t;
+
+static void setValue( SP_CacheEx * cacheEx, const char * key, const char * value, size_t len )
+{
+	SP_CacheItem * item = SP_CacheItem::newInstance( NULL, key, len + 2 );
+	item->appendDataBlock( value, len );
+	item->appendDataBlock( "\r\n", 2 );
+	if( 0 != cacheEx->set( item, 0 ) ) item->release();
+}
+
+static void appendValue( SP_CacheEx * cacheEx, const char * key, const char * value, size_t len )
+{
+	SP_CacheItem * item = SP_CacheItem::newInstance( NULL, key, len + 2 );
+	item->appendDataBlock( value, len );
+	item->appendDataBlock( "\r\n", 2 );
+	if( 0 != cacheEx->append( item, 0 ) ) item->release();
+}
+
+// the writers share the keys, so the records of a key come from several threads
+static void * writeLoop( void * arg )
+{
+	ReplData_t * data = (ReplData_t*)arg;
+	SP_CacheEx * cacheEx = data->mPrimary;
+
+	unsigned int seed = data->mIndex + 1;
+
+	for( int i = 0; i < data->mRounds; i++ ) {
+		char key[ 32 ] = { 0 }, value[ 64 ] = { 0 };
+		snprintf( key, sizeof( key ), "key%d", rand_r( &seed ) % eKeys );
+		int len = snprintf( value, sizeof( value ), "%d.%d", data->mIndex, i );
+
+		uint64_t newValue = 0;
+
+		switch( rand_r( &seed ) % 8 ) {
+			case 0:
+				cacheEx->erase( key );
+				break;
+			case 1:
+				appendValue( cacheEx, key, value, len );
+				break;
+			case 2:
+				setValue( cacheEx, key, "7", 1 );
+				cacheEx->incr( key, data->mIndex + 1, &newValue );
+				break;
+			default:
+				setValue( cacheEx, key, value, len );
+				break;
+		}
+	}
+
+	return NULL;
+}
+
+// return 0 if the item of key is the same in both
+static int compareItem( SP_CacheEx * primary, SP_CacheEx * replica, const char * key )
+{
+	SP_CacheItem * item1 = primary->getItem( key ), * item2 = replica->getItem( key );
+
+	int ret = 0;
+
+	if( NULL == item1 || NULL == item2 ) {
+		ret = ( item1 == item2 ) ? 0 : -1;
+	} else if( item1->getDataBytes() != item2->getDataBytes()
+			|| item1->getClientFlags() != item2->getClientFlags() ) {
+		ret = -1;
+	} else {
+		size_t bytes = item1->getDataBytes();
+		char * data1 = (char*)malloc( bytes ), * data2 = (char*)malloc( bytes );
+
+		item1->readDataBlock( 0, data1, bytes );
+		item2->readDataBlock( 0, data2, bytes );
+		ret = ( 0 == memcmp( data1, data2, bytes ) ) ? 0 : -1;
+
+		free( data1 );
+		free( data2 );
+	}
+
+	if( NULL != item1 ) item1->release();
+	if( NULL != item2 ) item2->release();
+
+	return ret;
+}
+
+// return the count of the keys which differ
+static int compareAll( SP_CacheEx * primary, SP_CacheEx * replica )
+{
+	int diffs = compareItem( primary, replica, "big" ) ? 1 : 0;
+
+	for( int i = 0; i < eKeys; i++ ) {
+		char key[ 32 ] = { 0 };
+		snprintf( key, sizeof( key ), "key%d", i );
+		if( 0 != compareItem( primary, replica, key ) ) diffs++;
+	}
+
+	return diffs;
+}
+
+int main( int argc, char * argv[] )
+{
+	int port = 11290, rounds = 20000, seconds = 10;
+
+	int c = 0;
+	while( ( c = getopt( argc, argv, "p:n:s:v" ) ) != EOF ) {
+		switch( c ) {
+			case 'p':
+				port = atoi( optarg );
+				break;
+			case 'n':
+				rounds = atoi( optarg );
+				break;
+			case 's':
+				seconds = atoi( optarg );
+				break;
+			default:
+				printf( "Usage: %s [-p <port>] [-n <rounds>] [-s <seconds>]\n", argv[0] );
+				printf( "\t-p loopback port of the primary, default is 11290\n" );
+				printf( "\t-n changes of every writer, default is 20000\n" );
+				printf( "\t-s seconds the replica has to catch up, default is 10\n" );
+				exit( 0 );
+		}
+	}
+
+	// the threads of the primary run until the exit, the same as in spcached,
+	// so the primary is never deleted
+	SP_CacheEx * primary = new SP_CacheEx( SP_CacheIndex::eHash, 0, 16 );
+	primary->setMaxItemSize( 0 );
+
+	// a backlog smaller than the big value, its record forces a full sync
+	SP_CacheReplLog * replLog = new SP_CacheReplLog( 1024 * 1024 );
+	primary->setReplLog( replLog );
+
+	SP_CacheReplPrimary * server = new SP_CacheReplPrimary( primary, replLog );
+	if( 0 != server->start( "127.0.0.1", port ) ) {
+		printf( "Cannot listen on port %d\n", port );
+		return 1;
+	}
+
+	// in the full sync, one of them over the backlog
+	for( int i = 0; i < eKeys; i++ ) {
+		char key[ 32 ] = { 0 };
+		snprintf( key, sizeof( key ), "key%d", i );
+		setValue( primary, key, key, strlen( key ) );
+	}
+
+	char * big = (char*)malloc( eBigSize );
+	for( int i = 0; i < eBigSize; i++ ) big[i] = 'a' + i % 26;
+	setValue( primary, "big", big, eBigSize );
+
+	SP_CacheEx replicaCache( SP_CacheIndex::eHash, 0, 16 );
+	replicaCache.setMaxItemSize( 0 );
+
+	SP_CacheReplica replica( &replicaCache, "127.0.0.1", port );
+	replicaCache.setReplica( &replica );
+	replica.start();
+
+	ReplData_t data[ eWriters ];
+	pthread_t threads[ eWriters ];
+
+	for( int i = 0; i < eWriters; i++ ) {
+		data[i].mPrimary = primary;
+		data[i].mIndex = i;
+		data[i].mRounds = rounds;
+		pthread_create( &( threads[i] ), NULL, writeLoop, &( data[i] ) );
+	}
+
+	for( int i = 0; i < eWriters; i++ ) pthread_join( threads[i], NULL );
+
+	// its record is larger than the backlog, the replica does a full sync again
+	appendValue( primary, "big", big, 1024 );
+
+	free( big );
+
+	int diffs = compareAll( primary, &replicaCache );
+	for( int i = 0; i < seconds * 10 && diffs > 0; i++ ) {
+		usleep( 100000 );
+		diffs = compareAll( primary, &replicaCache );
+	}
+
+	printf( "%d of %d keys differ\n", diffs, eKeys + 1 );
+	printf( "%s\n", diffs > 0 ? "FAILED" : "OK" );
+
+	return diffs > 0 ? 1 : 0;
+}
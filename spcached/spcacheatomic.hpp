@@ -0,0 +1,76 @@
+/*
+ * Copyright 2008 Stephen Liu
+ * For license terms, see the file COPYING along with this library.
+ */
+
+#ifndef __spcacheatomic_hpp__
+#define __spcacheatomic_hpp__
+
+// full-barrier atomic operations on an int, return the new value
+
+#ifdef WIN32
+
+#include <windows.h>
+
+inline int sp_atomic_inc( volatile int * value )
+{
+	return InterlockedIncrement( (volatile LONG *)value );
+}
+
+inline int sp_atomic_dec( volatile int * value )
+{
+	return InterlockedDecrement( (volatile LONG *)value );
+}
+
+inline int sp_atomic_add( volatile int * value, int delta )
+{
+	return InterlockedExchangeAdd( (volatile LONG *)value, delta ) + delta;
+}
+
+inline size_t sp_atomic_inc( volatile size_t * value )
+{
+#ifdef _WIN64
+	return InterlockedIncrement64( (volatile LONGLONG *)value );
+#else
+	return InterlockedIncrement( (volatile LONG *)value );
+#endif
+}
+
+// 1 : swapped, 0 : *value is not oldValue
+inline int sp_atomic_cas( volatile int * value, int oldValue, int newValue )
+{
+	return oldValue == InterlockedCompareExchange( (volatile LONG *)value, newValue, oldValue );
+}
+
+#else
+
+inline int sp_atomic_inc( volatile int * value )
+{
+	return __sync_add_and_fetch( value, 1 );
+}
+
+inline int sp_atomic_dec( volatile int * value )
+{
+	return __sync_sub_and_fetch( value, 1 );
+}
+
+inline int sp_atomic_add( volatile int * value, int delta )
+{
+	return __sync_add_and_fetch( value, delta );
+}
+
+inline size_t sp_atomic_inc( volatile size_t * value )
+{
+	return __sync_add_and_fetch( value, 1 );
+}
+
+// 1 : swapped, 0 : *value is not oldValue
+inline int sp_atomic_cas( volatile int * value, int oldValue, int newValue )
+{
+	return __sync_bool_compare_and_swap( value, oldValue, newValue ) ? 1 : 0;
+}
+
+#endif
+
+#endif
+
@@ -0,0 +1,110 @@
+/*
+ * Copyright 2008 Stephen Liu
+ * For license terms, see the file COPYING along with this library.
+ */
+
+#ifndef __spcachebench_hpp__
+#define __spcachebench_hpp__
+
+// helpers of the bench programs, they are not part of the server.
+// A bench runs a loop in several threads for a while and reports
+// the operations per second, the threads are plain pthreads
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/time.h>
+
+typedef struct tagSP_CacheBench {
+	// index of the thread, count of the threads
+	int mIndex, mThreads;
+
+	// shared by all the threads
+	void * mData;
+
+	volatile int * mStop;
+
+	// counted by the thread
+	size_t mOps;
+} SP_CacheBench_t;
+
+typedef void ( * SP_CacheBenchFunc_t )( SP_CacheBench_t * bench );
+
+// seconds since the epoch, to the usec
+inline double sp_bench_now()
+{
+	struct timeval now;
+	gettimeofday( &now, NULL );
+
+	return now.tv_sec + now.tv_usec / 1000000.0;
+}
+
+typedef struct tagSP_CacheBenchStart {
+	SP_CacheBenchFunc_t mFunc;
+	SP_CacheBench_t * mBench;
+} SP_CacheBenchStart_t;
+
+inline void * sp_bench_start( void * arg )
+{
+	SP_CacheBenchStart_t * start = (SP_CacheBenchStart_t*)arg;
+	start->mFunc( start->mBench );
+
+	return NULL;
+}
+
+// run func in count threads for msec, func loops until *mStop,
+// return the operations per second of all the threads
+inline double sp_bench_run( int count, int msec, SP_CacheBenchFunc_t func, void * data )
+{
+	volatile int stop = 0;
+
+	SP_CacheBench_t * benches = (SP_CacheBench_t*)calloc( count, sizeof( SP_CacheBench_t ) );
+	SP_CacheBenchStart_t * starts = (SP_CacheBenchStart_t*)calloc( count, sizeof( SP_CacheBenchStart_t ) );
+	pthread_t * threads = (pthread_t*)calloc( count, sizeof( pthread_t ) );
+
+	double begin = sp_bench_now();
+
+	for( int i = 0; i < count; i++ ) {
+		benches[i].mIndex = i;
+		benches[i].mThreads = count;
+		benches[i].mData = data;
+		benches[i].mStop = &stop;
+
+		starts[i].mFunc = func;
+		starts[i].mBench = &( benches[i] );
+
+		pthread_create( &( threads[i] ), NULL, sp_bench_start, &( starts[i] ) );
+	}
+
+	usleep( msec * 1000 );
+	stop = 1;
+
+	size_t ops = 0;
+	for( int i = 0; i < count; i++ ) {
+		pthread_join( threads[i], NULL );
+		ops += benches[i].mOps;
+	}
+
+	double seconds = sp_bench_now() - begin;
+
+	free( threads );
+	free( starts );
+	free( benches );
+
+	return seconds > 0 ? ops / seconds : 0;
+}
+
+// xorshift, cheap random numbers of a thread, seed is kept by the caller, not 0
+inline unsigned int sp_bench_rand( unsigned int * seed )
+{
+	*seed ^= *seed << 13;
+	*seed ^= *seed >> 17;
+	*seed ^= *seed << 5;
+
+	return *seed;
+}
+
+#endif
+
@@ -0,0 +1,464 @@
+/*
+ * Copyright 2008 Stephen Liu
+ * For license terms, see the file COPYING along with this library.
+ */
+
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "spserver/spbuffer.hpp"
+#include "spserver/spresponse.hpp"
+#include "spserver/spmsgdecoder.hpp"
+
+#include "spcachebinary.hpp"
+#include "spcachemsg.hpp"
+#include "spcacheimpl.hpp"
+
+// all the integers are in network byte order
+
+static uint16_t sp_get16( const unsigned char * p )
+{
+	return ( p[0] << 8 ) | p[1];
+}
+
+static uint32_t sp_get32( const unsigned char * p )
+{
+	return ( (uint32_t)p[0] << 24 ) | ( p[1] << 16 ) | ( p[2] << 8 ) | p[3];
+}
+
+static uint64_t sp_get64( const unsigned char * p )
+{
+	return ( (uint64_t)sp_get32( p ) << 32 ) | sp_get32( p + 4 );
+}
+
+static void sp_put16( unsigned char * p, uint16_t v )
+{
+	p[0] = v >> 8;
+	p[1] = v;
+}
+
+static void sp_put32( unsigned char * p, uint32_t v )
+{
+	p[0] = v >> 24;
+	p[1] = v >> 16;
+	p[2] = v >> 8;
+	p[3] = v;
+}
+
+static void sp_put64( unsigned char * p, uint64_t v )
+{
+	sp_put32( p, (uint32_t)( v >> 32 ) );
+	sp_put32( p + 4, (uint32_t)v );
+}
+
+//---------------------------------------------------------
+
+int SP_CacheBinaryProto :: isStorage( int opcode )
+{
+	switch( opcode ) {
+		case eSet: case eAdd: case eReplace: case eAppend: case ePrepend:
+		case eSetQ: case eAddQ: case eReplaceQ: case eAppendQ: case ePrependQ:
+			return 1;
+	}
+
+	return 0;
+}
+
+int SP_CacheBinaryProto :: isQuiet( int opcode )
+{
+	switch( opcode ) {
+		case eGetQ: case eGetKQ: case eSetQ: case eAddQ: case eReplaceQ:
+		case eDeleteQ: case eIncrementQ: case eDecrementQ: case eQuitQ:
+		case eFlushQ: case eAppendQ: case ePrependQ:
+			return 1;
+	}
+
+	return 0;
+}
+
+int SP_CacheBinaryProto :: decode( SP_Buffer * inBuffer, SP_CacheSlabs * slabs, size_t maxItemSize,
+		SP_CacheProtoMessage * message, int * hasHeader, size_t * bodyLeft )
+{
+	if( ! *hasHeader ) {
+		if( inBuffer->getSize() < eHeaderSize ) return SP_MsgDecoder::eMoreData;
+
+		const unsigned char * header = (unsigned char*)inBuffer->getBuffer();
+
+		int opcode = header[1], keyLen = sp_get16( header + 2 ), extLen = header[4];
+		size_t bodyLen = sp_get32( header + 8 );
+
+		if( eRequestMagic != header[0] || (size_t)( keyLen + extLen ) > bodyLen ) {
+			// the stream cannot be resynchronized, the opcode is left -1
+			*hasHeader = 1;
+			message->setError( "bad magic" );
+			inBuffer->reset();
+			return SP_MsgDecoder::eOK;
+		}
+
+		size_t valueLen = bodyLen - keyLen - extLen;
+
+		// bodyLen is up to 4G, only a body known to be short is buffered,
+		// a bad one is skipped as it arrives, so the session goes on
+		int isBad = ( keyLen > eMaxKeyLen || ( ! isStorage( opcode ) && valueLen > eMaxIgnoredValue ) );
+
+		// the value of storage commands is streamed into the item
+		size_t needed = eHeaderSize;
+		if( ! isBad ) needed += isStorage( opcode ) ? keyLen + extLen : bodyLen;
+
+		if( inBuffer->getSize() < needed ) return SP_MsgDecoder::eMoreData;
+
+		*hasHeader = 1;
+
+		message->setBinary( opcode, sp_get32( header + 12 ), sp_get64( header + 16 ) );
+
+		const unsigned char * extras = header + eHeaderSize;
+
+		char key[ eMaxKeyLen + 1 ] = { 0 };
+		if( ! isBad ) memcpy( key, extras + extLen, keyLen );
+
+		if( isBad ) {
+			message->setError( keyLen > eMaxKeyLen ? "Key too long" : "Invalid arguments" );
+			*bodyLeft = bodyLen;
+		} else if( isStorage( opcode ) ) {
+			int isSet = ( eSet == opcode || eSetQ == opcode || eAdd == opcode
+					|| eAddQ == opcode || eReplace == opcode || eReplaceQ == opcode );
+
+			if( '\0' == key[0] || extLen != ( isSet ? 8 : 0 ) ) {
+				message->setError( "Invalid arguments" );
+			} else if( maxItemSize > 0 && valueLen > maxItemSize ) {
+				message->setTooLarge();
+			} else {
+				uint32_t flags = isSet ? sp_get32( extras ) : 0;
+				if( isSet ) message->setExpTime( sp_get32( extras + 4 ) );
+
+				message->setItem( SP_CacheItem::newInstance( slabs, key, valueLen + 2 ) );
+				message->getItem()->setClientFlags( flags );
+				message->getItem()->setCasUnique( message->getCas() + 1 );
+			}
+
+			// a bad request still has its value to skip
+			*bodyLeft = valueLen;
+		} else {
+			switch( opcode ) {
+				case eGet: case eGetQ: case eGetK: case eGetKQ:
+				case eDelete: case eDeleteQ:
+					if( '\0' != key[0] ) {
+						message->reserveKeys( keyLen + 1 );
+						message->addKey( key, keyLen );
+					} else {
+						message->setError( "Invalid arguments" );
+					}
+					break;
+				case eIncrement: case eDecrement: case eIncrementQ: case eDecrementQ:
+					if( '\0' != key[0] && 20 == extLen ) {
+						message->setDelta( sp_get64( extras ) );
+						message->setInitial( sp_get64( extras + 8 ) );
+
+						// 0xffffffff means no auto-create, keep it as -1
+						uint32_t expTime = sp_get32( extras + 16 );
+						message->setExpTime( 0xffffffff == expTime ? (time_t)-1 : (time_t)expTime );
+
+						message->reserveKeys( keyLen + 1 );
+						message->addKey( key, keyLen );
+					} else {
+						message->setError( "Invalid arguments" );
+					}
+					break;
+				case eFlush: case eFlushQ:
+					if( 4 == extLen ) message->setExpTime( sp_get32( extras ) );
+					break;
+				case eStat:
+					if( '\0' != key[0] ) {
+						message->reserveKeys( keyLen + 1 );
+						message->addKey( key, keyLen );
+					}
+					break;
+			}
+		}
+
+		inBuffer->erase( needed );
+	}
+
+	if( *bodyLeft > 0 ) {
+		SP_CacheItem * item = message->getItem();
+
+		size_t bytes = 0;
+		if( NULL != item ) {
+			bytes = item->takeDataBlock( inBuffer, *bodyLeft );
+		} else {
+			bytes = *bodyLeft > inBuffer->getSize() ? inBuffer->getSize() : *bodyLeft;
+			inBuffer->erase( bytes );
+		}
+
+		*bodyLeft -= bytes;
+
+		if( *bodyLeft > 0 ) return SP_MsgDecoder::eMoreData;
+
+		if( NULL != item ) item->appendDataBlock( "\r\n", 2 );
+	}
+
+	return SP_MsgDecoder::eOK;
+}
+
+void SP_CacheBinaryProto :: reply( SP_Buffer * buffer, const SP_CacheProtoMessage * message,
+		int status, uint64_t cas, const void * extras, int extLen,
+		const char * key, int keyLen, const void * value, size_t valueLen )
+{
+	unsigned char header[ eHeaderSize ] = { 0 };
+
+	header[0] = eResponseMagic;
+	header[1] = message->getOpcode();
+	sp_put16( header + 2, keyLen );
+	header[4] = extLen;
+	sp_put16( header + 6, status );
+	sp_put32( header + 8, extLen + keyLen + valueLen );
+	sp_put32( header + 12, message->getOpaque() );
+	sp_put64( header + 16, cas );
+
+	buffer->append( header, sizeof( header ) );
+	if( extLen > 0 ) buffer->append( extras, extLen );
+	if( keyLen > 0 ) buffer->append( key, keyLen );
+	if( valueLen > 0 && NULL != value ) buffer->append( value, valueLen );
+}
+
+void SP_CacheBinaryProto :: replyStatus( SP_Buffer * buffer, const SP_CacheProtoMessage * message,
+		int status, const char * text )
+{
+	reply( buffer, message, status, 0, NULL, 0, NULL, 0, text, strlen( text ) );
+}
+
+void SP_CacheBinaryProto :: doGet( SP_CacheEx * cacheEx, SP_CacheProtoMessage * message,
+		SP_Buffer * buffer )
+{
+	int opcode = message->getOpcode();
+	int withKey = ( eGetK == opcode || eGetKQ == opcode );
+
+	const char * key = message->getKey();
+
+	SP_CacheItem * item = cacheEx->getItem( key );
+
+	if( NULL != item ) {
+		unsigned char extras[ 4 ] = { 0 };
+		sp_put32( extras, item->getClientFlags() );
+
+		reply( buffer, message, eNoError, item->getCasUnique(), extras, sizeof( extras ),
+				key, withKey ? strlen( key ) : 0, NULL, item->getValueBytes() );
+
+		// the value may be chunked
+		size_t left = item->getValueBytes();
+		for( int i = 0; i < item->getChunkCount() && left > 0; i++ ) {
+			size_t bytes = 0;
+			const void * chunk = item->getChunk( i, &bytes );
+			if( bytes > left ) bytes = left;
+
+			buffer->append( chunk, bytes );
+			left -= bytes;
+		}
+
+		item->release();
+	} else if( ! isQuiet( opcode ) ) {
+		reply( buffer, message, eKeyNotFound, 0, NULL, 0,
+				key, withKey ? strlen( key ) : 0, "Not found", 9 );
+	}
+}
+
+void SP_CacheBinaryProto :: doStore( SP_CacheEx * cacheEx, SP_CacheProtoMessage * message,
+		SP_Buffer * buffer )
+{
+	int opcode = message->getOpcode(), ret = 0, status = eNoError;
+
+	SP_CacheItem * item = message->takeItem();
+
+	// keep it alive to report the cas
+	item->addRef();
+
+	switch( opcode ) {
+		case eSet: case eSetQ:
+			if( 0 != message->getCas() ) {
+				ret = cacheEx->cas( item, message->getExpTime() );
+				if( 0 != ret ) status = ( 1 == ret ) ? eKeyExists : eKeyNotFound;
+			} else {
+				cacheEx->set( item, message->getExpTime() );
+			}
+			break;
+		case eAdd: case eAddQ:
+			if( 0 != cacheEx->add( item, message->getExpTime() ) ) status = eKeyExists;
+			break;
+		case eReplace: case eReplaceQ:
+			if( 0 != cacheEx->replace( item, message->getExpTime() ) ) status = eKeyNotFound;
+			break;
+		case eAppend: case eAppendQ:
+			if( 0 != cacheEx->append( item, message->getExpTime() ) ) status = eNotStored;
+			break;
+		case ePrepend: case ePrependQ:
+			if( 0 != cacheEx->prepend( item, message->getExpTime() ) ) status = eNotStored;
+			break;
+	}
+
+	if( eNoError == status ) {
+		// append/prepend store a new item, its cas is not known here
+		uint64_t cas = ( eAppend == opcode || ePrepend == opcode
+				|| eAppendQ == opcode || ePrependQ == opcode ) ? 0 : item->getCasUnique();
+
+		if( ! isQuiet( opcode ) ) reply( buffer, message, eNoError, cas, NULL, 0, NULL, 0, NULL, 0 );
+	} else {
+		// the cache does not take the item on failure
+		item->release();
+
+		if( eKeyExists == status ) {
+			replyStatus( buffer, message, status, "Data exists for key." );
+		} else if( eKeyNotFound == status ) {
+			replyStatus( buffer, message, status, "Not found" );
+		} else {
+			replyStatus( buffer, message, status, "Not stored." );
+		}
+	}
+
+	item->release();
+}
+
+void SP_CacheBinaryProto :: doCalc( SP_CacheEx * cacheEx, SP_CacheProtoMessage * message,
+		SP_Buffer * buffer )
+{
+	int opcode = message->getOpcode();
+	int isIncr = ( eIncrement == opcode || eIncrementQ == opcode );
+
+	const char * key = message->getKey();
+
+	int ret = -1;
+	uint64_t newValue = 0;
+
+	for( int retry = 0; retry < 2 && -1 == ret; retry++ ) {
+		if( isIncr ) {
+			ret = cacheEx->incr( key, message->getDelta(), &newValue );
+		} else {
+			ret = cacheEx->decr( key, message->getDelta(), &newValue );
+		}
+
+		if( -1 != ret || -1 == message->getExpTime() ) break;
+
+		// not found, create it with the initial value
+		char num[ 32 ] = { 0 };
+		int numLen = snprintf( num, sizeof( num ), "%llu", (unsigned long long)message->getInitial() );
+
+		SP_CacheItem * item = SP_CacheItem::newInstance( cacheEx->getSlabs(),
+				key, numLen + 2 );
+		item->appendDataBlock( num, numLen );
+		item->appendDataBlock( "\r\n", 2 );
+
+		if( 0 == cacheEx->add( item, message->getExpTime() ) ) {
+			ret = 0;
+			newValue = message->getInitial();
+		} else {
+			// someone else created it, try again
+			item->release();
+		}
+	}
+
+	if( 0 == ret ) {
+		if( ! isQuiet( opcode ) ) {
+			unsigned char value[ 8 ] = { 0 };
+			sp_put64( value, newValue );
+			reply( buffer, message, eNoError, 0, NULL, 0, NULL, 0, value, sizeof( value ) );
+		}
+	} else if( -2 == ret ) {
+		replyStatus( buffer, message, eNonNumeric,
+				"Non-numeric server-side value for incr or decr" );
+	} else {
+		replyStatus( buffer, message, eKeyNotFound, "Not found" );
+	}
+}
+
+void SP_CacheBinaryProto :: doStat( SP_CacheEx * cacheEx, SP_CacheProtoMessage * message,
+		SP_Buffer * buffer )
+{
+	SP_Buffer text;
+	if( 0 != cacheEx->stat( &text, message->getKey() ) ) {
+		replyStatus( buffer, message, eKeyNotFound, "Not found" );
+		return;
+	}
+
+	// one packet for every "STAT name value" line, an empty one at the end
+	for( char * line = text.getLine(); NULL != line; line = text.getLine() ) {
+		if( 0 == strncmp( line, "STAT ", 5 ) ) {
+			const char * name = line + 5;
+			const char * value = strchr( name, ' ' );
+
+			int nameLen = NULL != value ? value - name : strlen( name );
+			value = NULL != value ? value + 1 : "";
+
+			reply( buffer, message, eNoError, 0, NULL, 0, name, nameLen, value, strlen( value ) );
+		}
+
+		free( line );
+	}
+
+	reply( buffer, message, eNoError, 0, NULL, 0, NULL, 0, NULL, 0 );
+}
+
+int SP_CacheBinaryProto :: handle( SP_CacheEx * cacheEx, SP_CacheProtoMessage * message,
+		SP_Response * response )
+{
+	int ret = 0;
+
+	SP_Buffer * buffer = response->getReply()->getMsg();
+
+	int opcode = message->getOpcode();
+
+	// a broken frame, nothing can be replied
+	if( opcode < 0 ) return 1;
+
+	if( message->isTooLarge() ) {
+		replyStatus( buffer, message, eValueTooLarge, "Too large." );
+		return 0;
+	}
+
+	if( NULL != message->getError() ) {
+		replyStatus( buffer, message, eInvalidArgs, message->getError() );
+		return 0;
+	}
+
+	switch( opcode ) {
+		case eGet: case eGetQ: case eGetK: case eGetKQ:
+			doGet( cacheEx, message, buffer );
+			break;
+		case eSet: case eAdd: case eReplace: case eAppend: case ePrepend:
+		case eSetQ: case eAddQ: case eReplaceQ: case eAppendQ: case ePrependQ:
+			doStore( cacheEx, message, buffer );
+			break;
+		case eDelete: case eDeleteQ:
+			if( 0 == cacheEx->erase( message->getKey() ) ) {
+				if( ! isQuiet( opcode ) ) reply( buffer, message, eNoError, 0, NULL, 0, NULL, 0, NULL, 0 );
+			} else {
+				replyStatus( buffer, message, eKeyNotFound, "Not found" );
+			}
+			break;
+		case eIncrement: case eDecrement: case eIncrementQ: case eDecrementQ:
+			doCalc( cacheEx, message, buffer );
+			break;
+		case eFlush: case eFlushQ:
+			cacheEx->flushAll( message->getExpTime() );
+			if( ! isQuiet( opcode ) ) reply( buffer, message, eNoError, 0, NULL, 0, NULL, 0, NULL, 0 );
+			break;
+		case eNoop:
+			reply( buffer, message, eNoError, 0, NULL, 0, NULL, 0, NULL, 0 );
+			break;
+		case eVersion:
+			reply( buffer, message, eNoError, 0, NULL, 0, NULL, 0, "1.2.5", 5 );
+			break;
+		case eStat:
+			doStat( cacheEx, message, buffer );
+			break;
+		case eQuit: case eQuitQ:
+			if( ! isQuiet( opcode ) ) reply( buffer, message, eNoError, 0, NULL, 0, NULL, 0, NULL, 0 );
+			ret = 1;
+			break;
+		default:
+			replyStatus( buffer, message, eUnknownCommand, "Unknown command" );
+			break;
+	}
+
+	return ret;
+}
+
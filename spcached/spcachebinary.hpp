@@ -0,0 +1,78 @@
+/*
+ * Copyright 2008 Stephen Liu
+ * For license terms, see the file COPYING along with this library.
+ */
+
+#ifndef __spcachebinary_hpp__
+#define __spcachebinary_hpp__
+
+#include <sys/types.h>
+#include <stdint.h>
+
+class SP_Buffer;
+class SP_Response;
+class SP_CacheEx;
+class SP_CacheSlabs;
+class SP_CacheItem;
+class SP_CacheProtoMessage;
+
+// memcached binary protocol, shares SP_CacheEx with the text protocol
+class SP_CacheBinaryProto {
+public:
+	enum { eRequestMagic = 0x80, eResponseMagic = 0x81, eHeaderSize = 24 };
+
+	// the longest key, the same as the text protocol, and the most value
+	// bytes of a command without a value, they are read and ignored
+	enum { eMaxKeyLen = 250, eMaxIgnoredValue = 1024 };
+
+	enum {
+		eGet = 0x00, eSet = 0x01, eAdd = 0x02, eReplace = 0x03,
+		eDelete = 0x04, eIncrement = 0x05, eDecrement = 0x06, eQuit = 0x07,
+		eFlush = 0x08, eGetQ = 0x09, eNoop = 0x0a, eVersion = 0x0b,
+		eGetK = 0x0c, eGetKQ = 0x0d, eAppend = 0x0e, ePrepend = 0x0f,
+		eStat = 0x10, eSetQ = 0x11, eAddQ = 0x12, eReplaceQ = 0x13,
+		eDeleteQ = 0x14, eIncrementQ = 0x15, eDecrementQ = 0x16, eQuitQ = 0x17,
+		eFlushQ = 0x18, eAppendQ = 0x19, ePrependQ = 0x1a
+	};
+
+	enum {
+		eNoError = 0x00, eKeyNotFound = 0x01, eKeyExists = 0x02,
+		eValueTooLarge = 0x03, eInvalidArgs = 0x04, eNotStored = 0x05,
+		eNonNumeric = 0x06, eUnknownCommand = 0x81, eOutOfMemory = 0x82
+	};
+
+	// decode one request into message, *hasHeader is set when the header is done,
+	// *bodyLeft is the count of value bytes still to read, a value larger than
+	// maxItemSize is skipped. A key longer than eMaxKeyLen or a command without
+	// a value with more than eMaxIgnoredValue bytes of it is refused, its body
+	// is skipped and never buffered.
+	// return SP_MsgDecoder::eOK or SP_MsgDecoder::eMoreData
+	static int decode( SP_Buffer * inBuffer, SP_CacheSlabs * slabs, size_t maxItemSize,
+			SP_CacheProtoMessage * message, int * hasHeader, size_t * bodyLeft );
+
+	// return 1 : terminate session, 0 : continue
+	static int handle( SP_CacheEx * cacheEx, SP_CacheProtoMessage * message,
+			SP_Response * response );
+
+private:
+	static int isStorage( int opcode );
+
+	// the quiet commands reply nothing on success, getq/getkq on miss
+	static int isQuiet( int opcode );
+
+	// value can be NULL, then the caller appends valueLen bytes
+	static void reply( SP_Buffer * buffer, const SP_CacheProtoMessage * message,
+			int status, uint64_t cas, const void * extras, int extLen,
+			const char * key, int keyLen, const void * value, size_t valueLen );
+
+	static void replyStatus( SP_Buffer * buffer, const SP_CacheProtoMessage * message,
+			int status, const char * text );
+
+	static void doGet( SP_CacheEx * cacheEx, SP_CacheProtoMessage * message, SP_Buffer * buffer );
+	static void doStore( SP_CacheEx * cacheEx, SP_CacheProtoMessage * message, SP_Buffer * buffer );
+	static void doCalc( SP_CacheEx * cacheEx, SP_CacheProtoMessage * message, SP_Buffer * buffer );
+	static void doStat( SP_CacheEx * cacheEx, SP_CacheProtoMessage * message, SP_Buffer * buffer );
+};
+
+#endif
+
@@ -7,12 +7,18 @@
 #include <stdlib.h>
 #include <string.h>
 #include <assert.h>
+#include <signal.h>
 
 #ifndef WIN32
 
 #include "spserver/spserver.hpp"
 #include "spserver/splfserver.hpp"
 
+#include "spcachemr.hpp"
+#include "spcacherepl.hpp"
+#include "spcacheproxy.hpp"
+#include "spcacheudp.hpp"
+
 #else
 
 #include "spserver/spiocpserver.hpp"
@@ -23,39 +29,296 @@ typedef SP_IocpLFServer SP_LFServer;
 
 #endif
 
+#include "spserver/sputils.hpp"
 #include "spdict/spdictcache.hpp"
 
 #include "spcachemsg.hpp"
 #include "spcacheproto.hpp"
 #include "spcacheimpl.hpp"
+#include "spcacheslab.hpp"
+#include "spcacheindex.hpp"
+#include "spcachequeue.hpp"
+#include "spcachesnap.hpp"
+#include "spcachehot.hpp"
 #include "spgetopt.h"
 
+typedef struct tagSP_CacheOptions {
+	int mPort, mMaxThreads, mMaxCount, mShardCount, mMaxMegaBytes;
+	int mPreallocate, mCrawlItems, mCrawlInterval;
+	size_t mMaxItemSize;
+	double mFactor;
+	char mServerType[ 16 ], mIndexType[ 16 ], mPolicyName[ 16 ];
+
+	int mQueueSize, mTimeout, mMaxConnections, mBacklog;
+	int mAdmission, mTargetWait;
+
+	char mSnapshotPath[ 512 ];
+	int mSnapshotInterval;
+
+	int mReplPort, mReplBacklog;
+	char mReplicaOf[ 128 ];
+
+	char mUpstreams[ 1024 ];
+
+	int mUdpPort;
+
+	int mHotKeys;
+} SP_CacheOptions_t;
+
+// the names of the options in a config file
+static const struct {
+	const char * mName;
+	int mOption;
+} sConfigNames[] = {
+	{ "port", 'p' }, { "threads", 't' }, { "items", 'c' }, { "megabytes", 'm' },
+	{ "shards", 'n' }, { "factor", 'f' }, { "preallocate", 'L' }, { "item_size_max", 'I' },
+	{ "index", 'i' }, { "policy", 'e' }, { "crawl_items", 'x' }, { "crawl_interval", 'y' },
+	{ "server", 's' }, { "queue_size", 'q' }, { "timeout", 'o' },
+	{ "max_connections", 'C' }, { "backlog", 'b' }, { "admission_control", 'a' },
+	{ "queue_wait_target", 'w' }, { "snapshot_file", 'S' }, { "snapshot_interval", 'P' },
+	{ "repl_port", 'r' }, { "repl_backlog", 'B' }, { "replica_of", 'R' },
+	{ "upstreams", 'u' }, { "udp_port", 'U' }, { "hot_keys", 'H' },
+	{ NULL, 0 }
+};
+
+// value : NULL for a switch given on the command line
+// 0 : OK, -1 : unknown option
+static int setOption( SP_CacheOptions_t * opts, int c, const char * value )
+{
+	// a switch in a config file can be turned off
+	int isOn = NULL == value || ( 0 != strcasecmp( value, "no" )
+			&& 0 != strcasecmp( value, "off" ) && 0 != strcmp( value, "0" ) );
+
+	switch ( c ) {
+		case 'p' :
+			opts->mPort = atoi( value );
+			break;
+		case 't':
+			opts->mMaxThreads = atoi( value );
+			break;
+		case 'c':
+			opts->mMaxCount = atoi( value );
+			break;
+		case 'm':
+			opts->mMaxMegaBytes = atoi( value );
+			break;
+		case 'n':
+			opts->mShardCount = atoi( value );
+			break;
+		case 'f':
+			opts->mFactor = atof( value );
+			break;
+		case 'L':
+			opts->mPreallocate = isOn;
+			break;
+		case 'I':
+		{
+			// k or m suffix as memcached
+			char * unit = NULL;
+			opts->mMaxItemSize = strtoul( value, &unit, 10 );
+			if( 'k' == *unit || 'K' == *unit ) opts->mMaxItemSize *= 1024;
+			if( 'm' == *unit || 'M' == *unit ) opts->mMaxItemSize *= 1024 * 1024;
+			break;
+		}
+		case 'i':
+			sp_strlcpy( opts->mIndexType, value, sizeof( opts->mIndexType ) );
+			break;
+		case 'e':
+			sp_strlcpy( opts->mPolicyName, value, sizeof( opts->mPolicyName ) );
+			break;
+		case 'x':
+			opts->mCrawlItems = atoi( value );
+			break;
+		case 'y':
+			opts->mCrawlInterval = atoi( value );
+			break;
+		case 's':
+			sp_strlcpy( opts->mServerType, value, sizeof( opts->mServerType ) );
+			break;
+		case 'q':
+			opts->mQueueSize = atoi( value );
+			break;
+		case 'o':
+			opts->mTimeout = atoi( value );
+			break;
+		case 'C':
+			opts->mMaxConnections = atoi( value );
+			break;
+		case 'b':
+			opts->mBacklog = atoi( value );
+			break;
+		case 'a':
+			opts->mAdmission = isOn;
+			break;
+		case 'w':
+			opts->mTargetWait = atoi( value );
+			break;
+		case 'S':
+			sp_strlcpy( opts->mSnapshotPath, value, sizeof( opts->mSnapshotPath ) );
+			break;
+		case 'P':
+			opts->mSnapshotInterval = atoi( value );
+			break;
+		case 'r':
+			opts->mReplPort = atoi( value );
+			break;
+		case 'B':
+			opts->mReplBacklog = atoi( value );
+			break;
+		case 'R':
+			sp_strlcpy( opts->mReplicaOf, value, sizeof( opts->mReplicaOf ) );
+			break;
+		case 'u':
+			sp_strlcpy( opts->mUpstreams, value, sizeof( opts->mUpstreams ) );
+			break;
+		case 'U':
+			opts->mUdpPort = atoi( value );
+			break;
+		case 'H':
+			opts->mHotKeys = atoi( value );
+			break;
+		default:
+			return -1;
+	}
+
+	return 0;
+}
+
+// "name value" lines, # starts a comment
+// 0 : OK, -1 : cannot read the file or unknown name
+static int loadConfig( SP_CacheOptions_t * opts, const char * path )
+{
+	FILE * fp = fopen( path, "r" );
+	if( NULL == fp ) {
+		printf( "Cannot open config file %s\n", path );
+		return -1;
+	}
+
+	int ret = 0;
+
+	char line[ 512 ] = { 0 };
+	for( int lineNo = 1; 0 == ret && NULL != fgets( line, sizeof( line ), fp ); lineNo++ ) {
+		char * pos = strchr( line, '#' );
+		if( NULL != pos ) *pos = '\0';
+
+		char name[ 64 ] = { 0 }, value[ 256 ] = { 0 };
+		int count = sscanf( line, "%63s %255s", name, value );
+		if( count <= 0 ) continue;
+
+		int c = 0;
+		for( int i = 0; NULL != sConfigNames[i].mName && 0 == c; i++ ) {
+			if( 0 == strcasecmp( name, sConfigNames[i].mName ) ) c = sConfigNames[i].mOption;
+		}
+
+		// a switch may be given without a value
+		if( 0 == c || ( count < 2 && 'L' != c && 'a' != c )
+				|| 0 != setOption( opts, c, count < 2 ? NULL : value ) ) {
+			printf( "Invalid line %d in config file %s: %s\n", lineNo, path, name );
+			ret = -1;
+		}
+	}
+
+	fclose( fp );
+
+	return ret;
+}
+
+static int getCpuCount()
+{
+#ifdef WIN32
+	SYSTEM_INFO info;
+	GetSystemInfo( &info );
+	return info.dwNumberOfProcessors;
+#else
+	int count = (int)sysconf( _SC_NPROCESSORS_ONLN );
+	return count > 0 ? count : 1;
+#endif
+}
+
+static SP_CacheSnapshot * sSnapshot = NULL;
+
+#ifndef WIN32
+static void onSnapshotSignal( int sig )
+{
+	if( NULL != sSnapshot ) sSnapshot->request();
+}
+#endif
+
 int main( int argc, char * argv[] )
 {
-	int port = 11216, maxThreads = 1, maxCount = 100000;
-	const char * serverType = "hahs";
+	SP_CacheOptions_t opts;
+	memset( &opts, 0, sizeof( opts ) );
+
+	opts.mPort = 11216;
+	opts.mMaxCount = -1;
+	opts.mShardCount = 16;
+	opts.mCrawlItems = 32;
+	opts.mCrawlInterval = 1000;
+	opts.mFactor = 1.25;
+	sp_strlcpy( opts.mServerType, "hahs", sizeof( opts.mServerType ) );
+	sp_strlcpy( opts.mIndexType, "hash", sizeof( opts.mIndexType ) );
+	sp_strlcpy( opts.mPolicyName, "fifo", sizeof( opts.mPolicyName ) );
+	opts.mMaxItemSize = 1024 * 1024;
+	opts.mQueueSize = 100;
+	opts.mTimeout = 60;
+	opts.mTargetWait = 2000;
+	opts.mReplBacklog = 16;
 
 	extern char *optarg ;
 	int c ;
 
-	while( ( c = getopt ( argc, argv, "p:t:c:s:v" )) != EOF ) {
+	while( ( c = getopt ( argc, argv, "p:t:c:m:n:f:LI:i:e:x:y:s:q:o:C:b:aw:S:P:r:B:R:u:U:H:F:v" )) != EOF ) {
 		switch ( c ) {
-			case 'p' :
-				port = atoi( optarg );
-				break;
-			case 't':
-				maxThreads = atoi( optarg );
+			case 'L':
+			case 'a':
+				setOption( &opts, c, NULL );
 				break;
-			case 'c':
-				maxCount = atoi( optarg );
-				break;
-			case 's':
-				serverType = optarg;
+			case 'F':
+				// the options after -F override the file
+				if( 0 != loadConfig( &opts, optarg ) ) exit( 0 );
 				break;
 			case '?' :
 			case 'v' :
-				printf( "Usage: %s [-p <port>] [-t <threads>] [-c <cache_items>] [-s <hahs|lf>]\n", argv[0] );
+				printf( "Usage: %s [-p <port>] [-t <threads>] [-c <cache_items>] [-m <megabytes>]\n"
+						"\t[-n <shards>] [-f <factor>] [-L] [-I <size>] [-i <hash|dict>]\n"
+						"\t[-e <fifo|lru|slru|clock>] [-x <items>] [-y <usec>] [-s <hahs|lf|mr|proxy>]\n"
+						"\t[-q <queue_size>] [-o <timeout>] [-C <max_connections>] [-b <backlog>]\n"
+						"\t[-a] [-w <usec>] [-S <snapshot_file>] [-P <seconds>] [-r <repl_port>]\n"
+						"\t[-B <megabytes>] [-R <host:port>] [-u <host:port,...>] [-U <udp_port>]\n"
+						"\t[-H <hot_keys>] [-F <config_file>]\n",
+						argv[0] );
+				printf( "\t-f chunk size growth factor of slab classes, default is 1.25\n" );
+				printf( "\t-L preallocate the memory of -m at startup\n" );
+				printf( "\t-I largest value to store, k or m suffix, 0 means no limit, default is 1m\n" );
+				printf( "\t-i index of the cache, hash table or spdict, default is hash\n" );
+				printf( "\t-e eviction policy, default is fifo\n" );
+				printf( "\t-x items checked by the expiry crawler per slice, 0 disables it, default is 32\n" );
+				printf( "\t-y usec the expiry crawler sleeps between slices, default is 1000\n" );
+				printf( "\t-s mr runs -t event loops, one for every cpu by default,\n"
+						"\t   the requests are handled on the loop which reads them,\n"
+						"\t   -s proxy forwards the requests to the -u backends\n" );
+				printf( "\t-q requests waiting for the workers, default is 100\n" );
+				printf( "\t-o seconds an idle session is kept, default is 60\n" );
+				printf( "\t-C most sessions, default is the limit of the server\n" );
+				printf( "\t-b listen backlog of -s mr, default is 1024\n" );
+				printf( "\t-a admission control, new sessions are refused while the average\n"
+						"\t   queue wait is over -w, -q still bounds the queue\n" );
+				printf( "\t-w usec of queue wait -a refuses new sessions above, default is 2000\n" );
+				printf( "\t-S snapshot file, loaded at startup, written every -P seconds\n"
+						"\t   and on SIGUSR1\n" );
+				printf( "\t-P seconds between snapshots, default is 0, only on SIGUSR1\n" );
+				printf( "\t-r port the replicas connect to, default is 0, no replicas\n" );
+				printf( "\t-B megabytes of the replication backlog, default is 16\n" );
+				printf( "\t-R follow the primary at host:port, its -r port\n" );
+				printf( "\t-u backends of -s proxy, the keys are spread by consistent hashing\n" );
+				printf( "\t-U udp port for get and gets, default is 0, off\n" );
+				printf( "\t-H hot keys tracked, every thread serves them from its own copies,\n"
+						"\t   default is 0, off\n" );
+				printf( "\t-F config file of \"name value\" lines, the names are in the README\n" );
 				exit( 0 );
+			default:
+				setOption( &opts, c, optarg );
+				break;
 		}
 	}
 
@@ -67,22 +330,170 @@ int main( int argc, char * argv[] )
 
 	if( 0 != sp_initsock() ) assert( 0 );
 
-	SP_CacheEx cacheEx( SP_DictCache::eFIFO, maxCount > 0 ? maxCount : 100000 );
+	int policy = SP_CacheShard::getPolicy( opts.mPolicyName );
+	if( policy < 0 ) {
+		printf( "Unknown eviction policy: %s\n", opts.mPolicyName );
+		exit( 0 );
+	}
+
+	// with a memory limit, the item count is unbounded unless -c is given
+	if( opts.mMaxMegaBytes > 0 ) {
+		if( opts.mMaxCount < 0 ) opts.mMaxCount = 0;
+	} else {
+		if( opts.mMaxCount <= 0 ) opts.mMaxCount = 100000;
+	}
+
+	size_t maxBytes = opts.mMaxMegaBytes > 0 ? (size_t)opts.mMaxMegaBytes * 1024 * 1024 : 0;
+
+	SP_CacheSlabs * slabs = new SP_CacheSlabs( opts.mFactor, opts.mPreallocate ? maxBytes : 0 );
+
+	int algo = SP_CacheIndex::eHash;
+	if( 0 == strcasecmp( opts.mIndexType, "dict" ) ) algo = SP_DictCache::eFIFO;
+
+	SP_CacheEx cacheEx( algo, opts.mMaxCount,
+			opts.mShardCount > 0 ? opts.mShardCount : 16, maxBytes, slabs, policy );
+	cacheEx.setMaxItemSize( opts.mMaxItemSize );
+
+	SP_CacheQueueStat queueStat;
+	cacheEx.setQueueStat( &queueStat );
 
-	if( 0 == strcasecmp( serverType, "hahs" ) ) {
-		SP_Server server( "", port, new SP_CacheProtoHandlerFactory( &cacheEx ) );
+	if( opts.mHotKeys > 0 ) cacheEx.setHotKeys( new SP_CacheHotKeys( opts.mHotKeys ) );
 
-		server.setTimeout( 60 );
+	// warm up before the server starts, with all the cpus
+	if( '\0' != opts.mSnapshotPath[0] ) {
+		sSnapshot = new SP_CacheSnapshot( &cacheEx, opts.mSnapshotPath );
+		cacheEx.setSnapshot( sSnapshot );
+
+		if( 0 != sSnapshot->load( getCpuCount() ) ) {
+			sp_syslog( LOG_NOTICE, "No snapshot loaded from %s", opts.mSnapshotPath );
+		}
+
+		if( 0 != sSnapshot->start( opts.mSnapshotInterval ) ) {
+			sp_syslog( LOG_WARNING, "Cannot start the snapshot thread" );
+		}
+
+#ifndef WIN32
+		signal( SIGUSR1, onSnapshotSignal );
+#endif
+	}
+
+#ifndef WIN32
+	// after the snapshot, a replica gets it by the full sync
+	if( opts.mReplPort > 0 ) {
+		size_t backlog = (size_t)( opts.mReplBacklog > 0 ? opts.mReplBacklog : 16 ) * 1024 * 1024;
+
+		SP_CacheReplLog * replLog = new SP_CacheReplLog( backlog );
+		cacheEx.setReplLog( replLog );
+
+		SP_CacheReplPrimary * primary = new SP_CacheReplPrimary( &cacheEx, replLog );
+		if( 0 != primary->start( "", opts.mReplPort ) ) {
+			printf( "Cannot listen on replication port %d\n", opts.mReplPort );
+			exit( 0 );
+		}
+	}
+
+	if( '\0' != opts.mReplicaOf[0] ) {
+		char * pos = strrchr( opts.mReplicaOf, ':' );
+		if( NULL == pos || atoi( pos + 1 ) <= 0 ) {
+			printf( "Invalid -R %s, host:port is expected\n", opts.mReplicaOf );
+			exit( 0 );
+		}
+		*pos = '\0';
+
+		SP_CacheReplica * replica = new SP_CacheReplica( &cacheEx, opts.mReplicaOf, atoi( pos + 1 ) );
+		cacheEx.setReplica( replica );
+
+		if( 0 != replica->start() ) {
+			sp_syslog( LOG_WARNING, "Cannot start the replica thread" );
+		}
+	}
+#else
+	if( opts.mReplPort > 0 || '\0' != opts.mReplicaOf[0] ) {
+		printf( "Replication is not supported on this platform\n" );
+	}
+#endif
+
+	if( opts.mCrawlItems > 0 && 0 != cacheEx.startCrawler( opts.mCrawlItems, opts.mCrawlInterval ) ) {
+		sp_syslog( LOG_WARNING, "Cannot start the expiry crawler" );
+	}
+
+#ifndef WIN32
+	// beside the tcp server, on the same cache
+	if( opts.mUdpPort > 0 ) {
+		SP_CacheUdpServer * udpServer = new SP_CacheUdpServer( &cacheEx, "", opts.mUdpPort );
+		udpServer->setMaxThreads( getCpuCount() );
+
+		if( 0 != udpServer->start() ) {
+			printf( "Cannot listen on udp port %d\n", opts.mUdpPort );
+			exit( 0 );
+		}
+	}
+#else
+	if( opts.mUdpPort > 0 ) printf( "Udp is not supported on this platform\n" );
+#endif
+
+	int maxThreads = opts.mMaxThreads > 0 ? opts.mMaxThreads : 1;
+	int queueSize = opts.mQueueSize > 0 ? opts.mQueueSize : 100;
+
+	// admission control, the measured wait refuses new sessions before
+	// -q refuses requests of the sessions already served, -q stays the
+	// hard cap. The workers and the queue of spserver cannot be resized
+	if( opts.mAdmission ) {
+		queueStat.setTargetWait( opts.mTargetWait > 0 ? opts.mTargetWait : 2000 );
+	}
+
+	if( 0 == strcasecmp( opts.mServerType, "proxy" ) ) {
+#ifndef WIN32
+		SP_CacheProxyPool pool;
+		if( '\0' == opts.mUpstreams[0] || 0 != pool.addBackends( opts.mUpstreams ) ) {
+			printf( "Invalid -u %s, host:port,host:port is expected\n", opts.mUpstreams );
+			exit( 0 );
+		}
+
+		// a worker waits for the backends, so there are more of them
+		if( opts.mMaxThreads <= 0 ) maxThreads = getCpuCount() * 4;
+
+		SP_Server server( "", opts.mPort, new SP_CacheProxyHandlerFactory(
+				&pool, &queueStat, opts.mMaxItemSize ) );
+
+		server.setTimeout( opts.mTimeout );
 		server.setMaxThreads( maxThreads );
-		server.setReqQueueSize( 100, "SERVER_ERROR Server is busy now\r\n" );
+		server.setReqQueueSize( queueSize, "SERVER_ERROR Server is busy now\r\n" );
+		if( opts.mMaxConnections > 0 ) server.setMaxConnections( opts.mMaxConnections );
+
+		server.runForever();
+#else
+		printf( "Server type proxy is not supported on this platform\n" );
+#endif
+	} else if( 0 == strcasecmp( opts.mServerType, "mr" ) ) {
+#ifndef WIN32
+		SP_CacheMRServer server( "", opts.mPort, new SP_CacheProtoHandlerFactory( &cacheEx ) );
+
+		server.setTimeout( opts.mTimeout );
+		server.setMaxThreads( opts.mMaxThreads );
+		server.setMaxConnections( opts.mMaxConnections, "SERVER_ERROR Server is busy now\r\n" );
+		server.setBacklog( opts.mBacklog );
+
+		server.runForever();
+#else
+		printf( "Server type mr is not supported on this platform\n" );
+#endif
+	} else if( 0 == strcasecmp( opts.mServerType, "hahs" ) ) {
+		SP_Server server( "", opts.mPort, new SP_CacheProtoHandlerFactory( &cacheEx ) );
+
+		server.setTimeout( opts.mTimeout );
+		server.setMaxThreads( maxThreads );
+		server.setReqQueueSize( queueSize, "SERVER_ERROR Server is busy now\r\n" );
+		if( opts.mMaxConnections > 0 ) server.setMaxConnections( opts.mMaxConnections );
 
 		server.runForever();
 	} else {
-		SP_LFServer server( "", port, new SP_CacheProtoHandlerFactory( &cacheEx ) );
+		SP_LFServer server( "", opts.mPort, new SP_CacheProtoHandlerFactory( &cacheEx ) );
 
-		server.setTimeout( 60 );
+		server.setTimeout( opts.mTimeout );
 		server.setMaxThreads( maxThreads );
-		server.setReqQueueSize( 100, "SERVER_ERROR Server is busy now\r\n" );
+		server.setReqQueueSize( queueSize, "SERVER_ERROR Server is busy now\r\n" );
+		if( opts.mMaxConnections > 0 ) server.setMaxConnections( opts.mMaxConnections );
 
 		server.runForever();
 	}
@@ -91,4 +502,3 @@ int main( int argc, char * argv[] )
 
 	return 0;
 }
-
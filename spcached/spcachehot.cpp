@@ -0,0 +1,432 @@
+/*
+ * Copyright 2008 Stephen Liu
+ * For license terms, see the file COPYING along with this library.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "spserver/spporting.hpp"
+#include "spserver/spbuffer.hpp"
+#include "spserver/sputils.hpp"
+
+#include "spcachehot.hpp"
+#include "spcachemsg.hpp"
+#include "spcacheatomic.hpp"
+
+struct tagSP_CacheHotSlot {
+	// 0 means empty, written under mMutex, read without it
+	volatile uint64_t mHash;
+	volatile int mVersion;
+	volatile int mCount;
+
+	char mKey[ 256 ];
+};
+
+typedef struct tagSP_CacheHotCopy {
+	uint64_t mHash;
+	int mSlot, mVersion;
+	SP_CacheItem * mItem;
+} SP_CacheHotCopy_t;
+
+struct tagSP_CacheHotThread {
+	SP_CacheHotKeys * mOwner;
+
+	SP_CacheHotCopy_t mCopies[ SP_CacheHotKeys::eThreadCopies ];
+	int mVictim;
+
+	unsigned int mGets;
+
+	// only written by the thread, read by stat
+	size_t mHits, mCopyCount;
+
+	SP_CacheHotThread_t * mPrev, * mNext;
+};
+
+static int sp_hot_cmpslot( const void * a, const void * b )
+{
+	return ( (const SP_CacheHotSlot_t*)b )->mCount - ( (const SP_CacheHotSlot_t*)a )->mCount;
+}
+
+static void sp_hot_clear( SP_CacheHotCopy_t * copy )
+{
+	if( NULL != copy->mItem ) copy->mItem->release();
+	memset( copy, 0, sizeof( SP_CacheHotCopy_t ) );
+}
+
+SP_CacheHotKeys :: SP_CacheHotKeys( int topK )
+{
+	sp_thread_mutex_init( &mMutex, NULL );
+
+#ifdef WIN32
+	// no destructor, the table of a finished thread is freed with this object
+	mTlsKey = TlsAlloc();
+#else
+	pthread_key_create( &mTlsKey, freeThread );
+#endif
+
+	memset( (void*)mSketch, 0, sizeof( mSketch ) );
+	mSamples = 0;
+
+	mSlotCount = topK > 0 ? topK : 16;
+	mSlots = (SP_CacheHotSlot_t*)calloc( mSlotCount, sizeof( SP_CacheHotSlot_t ) );
+	memset( (void*)mFilter, 0, sizeof( mFilter ) );
+
+	mFlushTime = 0;
+
+	mThreads = NULL;
+	mExitedHits = mExitedCopies = 0;
+
+	mInvalidations = 0;
+}
+
+SP_CacheHotKeys :: ~SP_CacheHotKeys()
+{
+	for( ; NULL != mThreads; ) {
+		SP_CacheHotThread_t * thread = mThreads;
+		mThreads = thread->mNext;
+
+		for( int i = 0; i < eThreadCopies; i++ ) sp_hot_clear( &( thread->mCopies[i] ) );
+		free( thread );
+	}
+
+#ifdef WIN32
+	TlsFree( mTlsKey );
+#else
+	pthread_key_delete( mTlsKey );
+#endif
+
+	free( mSlots );
+
+	sp_thread_mutex_destroy( &mMutex );
+}
+
+int SP_CacheHotKeys :: getFilter( uint64_t hash )
+{
+	// the high bits, the low ones pick the shard
+	return (int)( ( hash >> 32 ) % eFilterSize );
+}
+
+SP_CacheHotThread_t * SP_CacheHotKeys :: getThread()
+{
+#ifdef WIN32
+	SP_CacheHotThread_t * thread = (SP_CacheHotThread_t*)TlsGetValue( mTlsKey );
+#else
+	SP_CacheHotThread_t * thread = (SP_CacheHotThread_t*)pthread_getspecific( mTlsKey );
+#endif
+
+	if( NULL == thread ) {
+		thread = (SP_CacheHotThread_t*)calloc( 1, sizeof( SP_CacheHotThread_t ) );
+		thread->mOwner = this;
+
+		sp_thread_mutex_lock( &mMutex );
+		thread->mNext = mThreads;
+		if( NULL != mThreads ) mThreads->mPrev = thread;
+		mThreads = thread;
+		sp_thread_mutex_unlock( &mMutex );
+
+#ifdef WIN32
+		TlsSetValue( mTlsKey, thread );
+#else
+		pthread_setspecific( mTlsKey, thread );
+#endif
+	}
+
+	return thread;
+}
+
+void SP_CacheHotKeys :: freeThread( void * arg )
+{
+	SP_CacheHotThread_t * thread = (SP_CacheHotThread_t*)arg;
+	SP_CacheHotKeys * owner = thread->mOwner;
+
+	sp_thread_mutex_lock( &owner->mMutex );
+	if( NULL != thread->mPrev ) thread->mPrev->mNext = thread->mNext;
+	if( NULL != thread->mNext ) thread->mNext->mPrev = thread->mPrev;
+	if( owner->mThreads == thread ) owner->mThreads = thread->mNext;
+
+	// the counters of the stats never go back when a worker exits
+	owner->mExitedHits += thread->mHits;
+	owner->mExitedCopies += thread->mCopyCount;
+	sp_thread_mutex_unlock( &owner->mMutex );
+
+	for( int i = 0; i < eThreadCopies; i++ ) sp_hot_clear( &( thread->mCopies[i] ) );
+	free( thread );
+}
+
+SP_CacheItem * SP_CacheHotKeys :: lookup( const char * key, uint64_t hash, uint64_t * ticket )
+{
+	*ticket = 0;
+
+	SP_CacheHotThread_t * thread = getThread();
+
+	if( 0 == ( ++thread->mGets % eSampleRate ) ) sample( key, hash );
+
+	time_t now = 0;
+
+	// a delayed flush_all takes the lock only when it is due
+	if( mFlushTime > 0 ) {
+		now = time( NULL );
+
+		if( mFlushTime <= now ) {
+			sp_thread_mutex_lock( &mMutex );
+			if( mFlushTime > 0 && mFlushTime <= now ) {
+				mFlushTime = 0;
+				bumpAll();
+			}
+			sp_thread_mutex_unlock( &mMutex );
+		}
+	}
+
+	for( int i = 0; i < eThreadCopies; i++ ) {
+		SP_CacheHotCopy_t * copy = &( thread->mCopies[i] );
+		if( NULL == copy->mItem || hash != copy->mHash || 0 != strcmp( key, copy->mItem->getKey() ) ) {
+			continue;
+		}
+
+		SP_CacheHotSlot_t * slot = &( mSlots[ copy->mSlot ] );
+
+		int isValid = ( copy->mVersion == sp_atomic_add( &( slot->mVersion ), 0 ) );
+
+		if( isValid && copy->mItem->getExpTime() > 0 ) {
+			if( 0 == now ) now = time( NULL );
+			isValid = copy->mItem->getExpTime() > now;
+		}
+
+		if( isValid ) {
+			thread->mHits++;
+			copy->mItem->addRef();
+			return copy->mItem;
+		}
+
+		sp_hot_clear( copy );
+		break;
+	}
+
+	if( 0 == mFilter[ getFilter( hash ) ] ) return NULL;
+
+	// the version is read before the item, a change after it is seen by keep
+	for( int i = 0; i < mSlotCount; i++ ) {
+		SP_CacheHotSlot_t * slot = &( mSlots[i] );
+		if( hash != slot->mHash || slot->mCount < eMinCount ) continue;
+
+		int version = sp_atomic_add( &( slot->mVersion ), 0 );
+		if( hash == slot->mHash ) *ticket = ( ( (uint64_t)( i + 1 ) ) << 32 ) | (uint32_t)version;
+		break;
+	}
+
+	return NULL;
+}
+
+void SP_CacheHotKeys :: keep( const SP_CacheItem * item, uint64_t ticket )
+{
+	int index = (int)( ticket >> 32 ) - 1;
+	int version = (int)(uint32_t)ticket;
+
+	if( index < 0 || index >= mSlotCount || item->getDataBytes() > eMaxCopyBytes ) return;
+
+	SP_CacheHotSlot_t * slot = &( mSlots[ index ] );
+	if( version != sp_atomic_add( &( slot->mVersion ), 0 ) ) return;
+
+	SP_CacheHotThread_t * thread = getThread();
+
+	// a key asked several times in one get is copied once
+	for( int i = 0; i < eThreadCopies; i++ ) {
+		SP_CacheHotCopy_t * copy = &( thread->mCopies[i] );
+		if( NULL != copy->mItem && index == copy->mSlot && version == copy->mVersion ) return;
+	}
+
+	// the reference of the caller keeps the item from being changed in place
+	SP_CacheItem * copy = SP_CacheItem::newInstance( NULL, item->getKey(), item->getDataBytes() );
+	copy->copyDataBlock( item, item->getDataBytes() );
+	copy->setClientFlags( item->getClientFlags() );
+	copy->setCasUnique( item->getCasUnique() );
+	copy->setExpTime( item->getExpTime() );
+
+	SP_CacheHotCopy_t * target = NULL;
+	for( int i = 0; i < eThreadCopies && NULL == target; i++ ) {
+		if( NULL == thread->mCopies[i].mItem || index == thread->mCopies[i].mSlot ) {
+			target = &( thread->mCopies[i] );
+		}
+	}
+
+	if( NULL == target ) {
+		target = &( thread->mCopies[ thread->mVictim ] );
+		thread->mVictim = ( thread->mVictim + 1 ) % eThreadCopies;
+	}
+
+	sp_hot_clear( target );
+
+	target->mHash = item->getHash();
+	target->mSlot = index;
+	target->mVersion = version;
+	target->mItem = copy;
+
+	thread->mCopyCount++;
+}
+
+void SP_CacheHotKeys :: invalidate( uint64_t hash )
+{
+	// a slot counts in the filter before a ticket can be taken for its hash,
+	// and the ticket is taken before the item is read under the shard lock
+	if( 0 == mFilter[ getFilter( hash ) ] ) return;
+
+	for( int i = 0; i < mSlotCount; i++ ) {
+		if( hash == mSlots[i].mHash ) {
+			sp_atomic_inc( &( mSlots[i].mVersion ) );
+			sp_atomic_inc( &mInvalidations );
+		}
+	}
+}
+
+void SP_CacheHotKeys :: invalidateAll( time_t flushTime )
+{
+	sp_thread_mutex_lock( &mMutex );
+
+	if( flushTime <= 0 || flushTime <= time( NULL ) ) {
+		bumpAll();
+	} else {
+		mFlushTime = flushTime;
+	}
+
+	sp_thread_mutex_unlock( &mMutex );
+}
+
+void SP_CacheHotKeys :: bumpAll()
+{
+	for( int i = 0; i < mSlotCount; i++ ) sp_atomic_inc( &( mSlots[i].mVersion ) );
+
+	sp_atomic_inc( &mInvalidations );
+}
+
+void SP_CacheHotKeys :: sample( const char * key, uint64_t hash )
+{
+	int estimate = 0;
+
+	for( int i = 0; i < eSketchRows; i++ ) {
+		int count = sp_atomic_inc( &( mSketch[i][ ( hash >> ( i * 16 ) ) % eSketchWidth ] ) );
+		if( 0 == i || count < estimate ) estimate = count;
+	}
+
+	if( 0 == sp_atomic_inc( &mSamples ) % eWindow ) decay();
+
+	if( estimate < eMinCount ) return;
+
+	// already tracked, the count is only reported
+	for( int i = 0; i < mSlotCount && mFilter[ getFilter( hash ) ] > 0; i++ ) {
+		if( hash == mSlots[i].mHash ) {
+			mSlots[i].mCount = estimate;
+			return;
+		}
+	}
+
+	sp_thread_mutex_lock( &mMutex );
+
+	// space-saving, the new key takes the place of the coldest one
+	int victim = 0, isTracked = 0;
+	for( int i = 0; i < mSlotCount && ! isTracked; i++ ) {
+		if( hash == mSlots[i].mHash ) isTracked = 1;
+		if( mSlots[i].mCount < mSlots[ victim ].mCount ) victim = i;
+	}
+
+	SP_CacheHotSlot_t * slot = &( mSlots[ victim ] );
+
+	if( ! isTracked && estimate > slot->mCount ) {
+		uint64_t oldHash = slot->mHash;
+
+		// the copies of the old key are dropped before the hash changes, and
+		// the tickets taken for it meanwhile by the second move
+		sp_atomic_inc( &( slot->mVersion ) );
+		sp_atomic_inc( &( mFilter[ getFilter( hash ) ] ) );
+
+		slot->mCount = 0;
+		slot->mHash = hash;
+		sp_strlcpy( slot->mKey, key, sizeof( slot->mKey ) );
+		sp_atomic_inc( &( slot->mVersion ) );
+		slot->mCount = estimate;
+
+		if( 0 != oldHash ) sp_atomic_dec( &( mFilter[ getFilter( oldHash ) ] ) );
+	}
+
+	sp_thread_mutex_unlock( &mMutex );
+}
+
+void SP_CacheHotKeys :: decay()
+{
+	sp_thread_mutex_lock( &mMutex );
+
+	// a lost increment of another thread does not matter to an estimate
+	for( int i = 0; i < eSketchRows; i++ ) {
+		for( int j = 0; j < eSketchWidth; j++ ) mSketch[i][j] = mSketch[i][j] / 2;
+	}
+
+	for( int i = 0; i < mSlotCount; i++ ) mSlots[i].mCount = mSlots[i].mCount / 2;
+
+	sp_thread_mutex_unlock( &mMutex );
+}
+
+size_t SP_CacheHotKeys :: getHits()
+{
+	sp_thread_mutex_lock( &mMutex );
+
+	size_t hits = mExitedHits;
+	for( SP_CacheHotThread_t * thread = mThreads; NULL != thread; thread = thread->mNext ) {
+		hits += thread->mHits;
+	}
+	sp_thread_mutex_unlock( &mMutex );
+
+	return hits;
+}
+
+void SP_CacheHotKeys :: stat( SP_Buffer * buffer )
+{
+	char temp[ 512 ] = { 0 };
+
+	int threads = 0;
+
+	SP_CacheHotSlot_t * slots = (SP_CacheHotSlot_t*)malloc( sizeof( SP_CacheHotSlot_t ) * mSlotCount );
+
+	sp_thread_mutex_lock( &mMutex );
+
+	size_t hits = mExitedHits, copies = mExitedCopies;
+
+	for( SP_CacheHotThread_t * thread = mThreads; NULL != thread; thread = thread->mNext ) {
+		hits += thread->mHits;
+		copies += thread->mCopyCount;
+		threads++;
+	}
+
+	memcpy( slots, (void*)mSlots, sizeof( SP_CacheHotSlot_t ) * mSlotCount );
+
+	sp_thread_mutex_unlock( &mMutex );
+
+	qsort( slots, mSlotCount, sizeof( SP_CacheHotSlot_t ), sp_hot_cmpslot );
+
+	snprintf( temp, sizeof( temp ), "STAT hot_hits %lu\r\n", (unsigned long)hits );
+	buffer->append( temp );
+
+	snprintf( temp, sizeof( temp ), "STAT hot_copies %lu\r\n", (unsigned long)copies );
+	buffer->append( temp );
+
+	snprintf( temp, sizeof( temp ), "STAT hot_invalidations %lu\r\n", (unsigned long)mInvalidations );
+	buffer->append( temp );
+
+	snprintf( temp, sizeof( temp ), "STAT hot_threads %d\r\n", threads );
+	buffer->append( temp );
+
+	// the counts are of the sampled gets, scaled back to all the gets
+	for( int i = 0, rank = 0; i < mSlotCount; i++ ) {
+		if( 0 == slots[i].mHash || slots[i].mCount <= 0 ) continue;
+
+		snprintf( temp, sizeof( temp ), "STAT hot_key_%d %s %d%s\r\n", rank++,
+				slots[i].mKey, slots[i].mCount * eSampleRate,
+				slots[i].mCount >= eMinCount ? " copied" : "" );
+		buffer->append( temp );
+	}
+
+	buffer->append( "END\r\n" );
+
+	free( slots );
+}
+
@@ -0,0 +1,113 @@
+/*
+ * Copyright 2008 Stephen Liu
+ * For license terms, see the file COPYING along with this library.
+ */
+
+#ifndef __spcachehot_hpp__
+#define __spcachehot_hpp__
+
+#include <time.h>
+#include <stdint.h>
+
+#include "spserver/spthread.hpp"
+
+#ifndef WIN32
+#include <pthread.h>
+#endif
+
+class SP_Buffer;
+class SP_CacheItem;
+
+typedef struct tagSP_CacheHotSlot SP_CacheHotSlot_t;
+typedef struct tagSP_CacheHotThread SP_CacheHotThread_t;
+
+// the hot keys of the get stream and the copies of their items.
+// A sample of the gets goes to a count-min sketch, the keys over the
+// smallest count of the top-K table take its place (space-saving).
+// Every thread serving gets keeps its own copies of the hot items, so
+// a hot get touches neither the shard lock nor the shared item.
+// A copy is valid while the version of its slot is unchanged, any
+// change of the key or a flush_all moves the version.
+class SP_CacheHotKeys {
+public:
+	// topK : count of the hot keys tracked
+	SP_CacheHotKeys( int topK );
+	~SP_CacheHotKeys();
+
+	// the copy of the thread with a reference added, NULL if none.
+	// ticket : out, not 0 if the key is hot, the item found for it is
+	// then passed to keep, together with the ticket
+	SP_CacheItem * lookup( const char * key, uint64_t hash, uint64_t * ticket );
+
+	// make a copy of item for the thread, if the ticket is still valid
+	void keep( const SP_CacheItem * item, uint64_t ticket );
+
+	// called by SP_CacheEx under the lock of the shard after the key is changed
+	void invalidate( uint64_t hash );
+
+	// flushTime : 0 means now
+	void invalidateAll( time_t flushTime );
+
+	// the gets served by the copies
+	size_t getHits();
+
+	// "stats hotkeys"
+	void stat( SP_Buffer * buffer );
+
+	// copies of a thread, the largest value copied
+	enum { eThreadCopies = 16, eMaxCopyBytes = 64 * 1024 };
+
+private:
+	enum { eSketchRows = 4, eSketchWidth = 1024 };
+
+	// one get of eSampleRate is counted, the counts are halved every eWindow samples
+	enum { eSampleRate = 8, eWindow = 16384 };
+
+	// samples in a window before a key is served by copies
+	enum { eMinCount = 16 };
+
+	// buckets of the filter of the tracked hashes
+	enum { eFilterSize = 4096 };
+
+	SP_CacheHotThread_t * getThread();
+
+	// the bucket of hash in mFilter
+	static int getFilter( uint64_t hash );
+	static void freeThread( void * arg );
+
+	void sample( const char * key, uint64_t hash );
+	void decay();
+	void bumpAll();
+
+	sp_thread_mutex_t mMutex;
+
+#ifdef WIN32
+	DWORD mTlsKey;
+#else
+	pthread_key_t mTlsKey;
+#endif
+
+	volatile int mSketch[ eSketchRows ][ eSketchWidth ];
+	volatile int mSamples;
+
+	SP_CacheHotSlot_t * mSlots;
+	int mSlotCount;
+
+	// the count of the slots in every bucket, a change of a key which
+	// is not hot finds 0 and skips the slots
+	volatile int mFilter[ eFilterSize ];
+
+	// a delayed flush_all moves the versions when it is due
+	volatile time_t mFlushTime;
+
+	// the thread tables, for stat and cleanup
+	SP_CacheHotThread_t * mThreads;
+
+	// the counts of the finished threads, under mMutex
+	size_t mExitedHits, mExitedCopies;
+
+	volatile size_t mInvalidations;
+};
+
+#endif
+
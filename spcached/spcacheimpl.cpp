@@ -5,9 +5,12 @@
 
 #include <string.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <limits.h>
 #include <errno.h>
 #include <sys/types.h>
 #include <assert.h>
+#include <ctype.h>
 
 #include "spserver/spbuffer.hpp"
 #include "spserver/sputils.hpp"
@@ -16,10 +19,19 @@
 #include "spcacheimpl.hpp"
 
 #include "spcachemsg.hpp"
-
+#include "spcacheslab.hpp"
+#include "spcacheindex.hpp"
+#include "spcacheatomic.hpp"
+#include "spcachequeue.hpp"
+#include "spcachesnap.hpp"
+#include "spcacherepl.hpp"
+#include "spcachehot.hpp"
+
+// one chunk of the data block, a chunked data block goes out as one iovec per chunk
 class SP_CacheItemMsgBlock : public SP_MsgBlock {
 public:
-	SP_CacheItemMsgBlock( SP_CacheItem * item );
+	// take over one reference of item
+	SP_CacheItemMsgBlock( SP_CacheItem * item, int chunk = 0 );
 	virtual ~SP_CacheItemMsgBlock();
 
 	virtual const void * getData() const;
@@ -27,11 +39,13 @@ public:
 
 private:
 	SP_CacheItem * mItem;
+	int mChunk;
 };
 
-SP_CacheItemMsgBlock :: SP_CacheItemMsgBlock( SP_CacheItem * item )
+SP_CacheItemMsgBlock :: SP_CacheItemMsgBlock( SP_CacheItem * item, int chunk )
 {
 	mItem = item;
+	mChunk = chunk;
 }
 
 SP_CacheItemMsgBlock :: ~SP_CacheItemMsgBlock()
@@ -41,111 +55,746 @@ SP_CacheItemMsgBlock :: ~SP_CacheItemMsgBlock()
 
 const void * SP_CacheItemMsgBlock :: getData() const
 {
-	return mItem->getDataBlock();
+	size_t bytes = 0;
+	return mItem->getChunk( mChunk, &bytes );
 }
 
 size_t SP_CacheItemMsgBlock :: getSize() const
 {
-	return mItem->getDataBytes();
+	size_t bytes = 0;
+	mItem->getChunk( mChunk, &bytes );
+	return bytes;
+}
+
+// "VALUE <key> <flags> <bytes> [<cas>]\r\n" of one item, rendered when the
+// reply is built, the value itself goes out with SP_CacheItemMsgBlock
+class SP_CacheHeaderMsgBlock : public SP_MsgBlock {
+public:
+	SP_CacheHeaderMsgBlock( const SP_CacheItem * item, int withCas );
+	virtual ~SP_CacheHeaderMsgBlock();
+
+	virtual const void * getData() const;
+	virtual size_t getSize() const;
+
+private:
+	char mHeader[ 320 ];
+	int mSize;
+};
+
+// write the decimal digits of value at pos, return the end of them
+static char * sp_header_num( char * pos, uint64_t value )
+{
+	char digits[ 20 ];
+	int count = 0;
+
+	do {
+		digits[ count++ ] = '0' + (char)( value % 10 );
+		value /= 10;
+	} while( value > 0 );
+
+	for( ; count > 0; ) *pos++ = digits[ --count ];
+
+	return pos;
+}
+
+SP_CacheHeaderMsgBlock :: SP_CacheHeaderMsgBlock( const SP_CacheItem * item, int withCas )
+{
+	// one per key of a get, snprintf was the most of its cost
+	char * pos = mHeader;
+
+	memcpy( pos, "VALUE ", 6 );
+	pos += 6;
+
+	// the decoders refuse keys over 250 bytes, the numbers are at most
+	// 20 digits, the clamp only guards the block
+	size_t keyLen = strlen( item->getKey() );
+	if( keyLen > sizeof( mHeader ) - 64 ) keyLen = sizeof( mHeader ) - 64;
+
+	memcpy( pos, item->getKey(), keyLen );
+	pos += keyLen;
+
+	*pos++ = ' ';
+	pos = sp_header_num( pos, item->getClientFlags() );
+
+	*pos++ = ' ';
+	pos = sp_header_num( pos, (unsigned int)item->getValueBytes() );
+
+	if( withCas ) {
+		*pos++ = ' ';
+		pos = sp_header_num( pos, item->getCasUnique() );
+	}
+
+	*pos++ = '\r';
+	*pos++ = '\n';
+
+	mSize = pos - mHeader;
+}
+
+SP_CacheHeaderMsgBlock :: ~SP_CacheHeaderMsgBlock()
+{
+}
+
+const void * SP_CacheHeaderMsgBlock :: getData() const
+{
+	return mHeader;
+}
+
+size_t SP_CacheHeaderMsgBlock :: getSize() const
+{
+	return mSize;
 }
 
 //---------------------------------------------------------
 
-SP_CacheItemHandler :: SP_CacheItemHandler()
+static void sp_sleep_usec( int usec )
+{
+#ifdef WIN32
+	Sleep( usec > 1000 ? usec / 1000 : 1 );
+#else
+	usleep( usec );
+#endif
+}
+
+//---------------------------------------------------------
+
+static const char * sPolicyNames[] = { "fifo", "lru", "slru", "clock", NULL };
+
+int SP_CacheShard :: getPolicy( const char * name )
+{
+	for( int i = 0; NULL != sPolicyNames[i]; i++ ) {
+		if( 0 == strcasecmp( name, sPolicyNames[i] ) ) return i;
+	}
+
+	return -1;
+}
+
+const char * SP_CacheShard :: getPolicyName( int policy )
+{
+	if( policy < eFIFO || policy > eClock ) return "unknown";
+
+	return sPolicyNames[ policy ];
+}
+
+SP_CacheShard :: SP_CacheShard( int algo, int maxItems, size_t maxBytes, int policy )
+{
+	mMaxItems = maxItems > 0 ? maxItems : 0;
+	mMaxBytes = maxBytes;
+
+	mPolicy = policy;
+
+	mPutSeq = mFlushSeq = 0;
+	mFlushTime = 0;
+
+	mIndex = SP_CacheIndex::newInstance( algo );
+
+	mCurrItems = 0;
+	mBytes = 0;
+	memset( mSegments, 0, sizeof( mSegments ) );
+	memset( mCrawlPos, 0, sizeof( mCrawlPos ) );
+
+	mTotalItems = mCmdGet = mCmdSet = mGetHits = mEvictions = 0;
+	mProtectedHits = mPromotions = mDemotions = 0;
+	mReclaimed = mExpiredUnfetched = mCrawlChecked = 0;
+
+	mHotKeys = NULL;
+
+	mReplLog = NULL;
+	mReplHead = mReplTail = NULL;
+
+	sp_rwlock_init( &mLock );
+}
+
+SP_CacheShard :: ~SP_CacheShard()
+{
+	for( int i = 0; i < eSegmentCount; i++ ) {
+		for( ; NULL != mSegments[i].mHead; ) {
+			SP_CacheItem * item = mSegments[i].mHead;
+			mIndex->remove( item->getKey(), item->getHash() );
+			unlink( item );
+			item->release();
+		}
+	}
+
+	delete mIndex;
+
+	sp_rwlock_destroy( &mLock );
+}
+
+void SP_CacheShard :: lock()
+{
+	sp_rwlock_wrlock( &mLock );
+}
+
+void SP_CacheShard :: readLock()
+{
+	if( mIndex->isConcurrentFind() ) {
+		sp_rwlock_rdlock( &mLock );
+	} else {
+		sp_rwlock_wrlock( &mLock );
+	}
+}
+
+void SP_CacheShard :: addReplRecord( SP_CacheReplRecord_t * record )
+{
+	if( NULL != mReplTail ) {
+		mReplTail->mNext = record;
+	} else {
+		mReplHead = record;
+	}
+	mReplTail = record;
+}
+
+void SP_CacheShard :: unlock()
+{
+	// only a writer adds records, a reader sees none
+	SP_CacheReplRecord_t * record = mReplHead;
+	if( NULL != record ) mReplHead = mReplTail = NULL;
+
+	sp_rwlock_unlock( &mLock );
+
+	// the values are copied into the log without blocking the shard
+	for( ; NULL != record; ) {
+		SP_CacheReplRecord_t * next = record->mNext;
+		mReplLog->put( record );
+		record = next;
+	}
+}
+
+int SP_CacheShard :: isExpired( const SP_CacheItem * item, time_t now )
+{
+	if( mFlushTime > 0 && mFlushTime <= now ) {
+		mFlushSeq = mPutSeq;
+		mFlushTime = 0;
+	}
+
+	return isStale( item, now );
+}
+
+int SP_CacheShard :: isStale( const SP_CacheItem * item, time_t now ) const
+{
+	if( item->mPutSeq <= mFlushSeq ) return 1;
+
+	// a due delayed flush covers everything put so far
+	if( mFlushTime > 0 && mFlushTime <= now ) return 1;
+
+	return item->getExpTime() > 0 && item->getExpTime() <= now;
+}
+
+void SP_CacheShard :: flush( time_t flushTime )
+{
+	if( flushTime <= 0 || flushTime <= time( NULL ) ) {
+		mFlushSeq = mPutSeq;
+		mFlushTime = 0;
+	} else {
+		mFlushTime = flushTime;
+	}
+}
+
+void SP_CacheShard :: link( SP_CacheItem * item, int segment )
+{
+	Segment_t * seg = &( mSegments[ segment ] );
+
+	item->mSegment = segment;
+	item->mPrev = seg->mTail;
+	item->mNext = NULL;
+
+	if( NULL != seg->mTail ) {
+		seg->mTail->mNext = item;
+	} else {
+		seg->mHead = item;
+	}
+	seg->mTail = item;
+
+	size_t size = item->getMemSize();
+
+	seg->mCount++;
+	seg->mBytes += size;
+
+	mCurrItems++;
+	mBytes += size;
+}
+
+void SP_CacheShard :: unlink( SP_CacheItem * item )
+{
+	Segment_t * seg = &( mSegments[ (int)item->mSegment ] );
+
+	if( NULL == item->mPrev && seg->mHead != item ) return;
+
+	if( mCrawlPos[ (int)item->mSegment ] == item ) {
+		mCrawlPos[ (int)item->mSegment ] = item->mNext;
+	}
+
+	if( NULL != item->mPrev ) {
+		item->mPrev->mNext = item->mNext;
+	} else {
+		seg->mHead = item->mNext;
+	}
+
+	if( NULL != item->mNext ) {
+		item->mNext->mPrev = item->mPrev;
+	} else {
+		seg->mTail = item->mPrev;
+	}
+
+	item->mPrev = item->mNext = NULL;
+
+	size_t size = item->getMemSize();
+
+	seg->mCount--;
+	seg->mBytes -= size;
+
+	mCurrItems--;
+	mBytes -= size;
+}
+
+SP_CacheItem * SP_CacheShard :: find( const char * key, uint64_t hash )
+{
+	SP_CacheItem * item = mIndex->find( key, hash );
+
+	if( NULL != item && isExpired( item, time( NULL ) ) ) {
+		reclaim( item );
+		item = NULL;
+	}
+
+	return item;
+}
+
+SP_CacheItem * SP_CacheShard :: lookup( const char * key, uint64_t hash )
+{
+	SP_CacheItem * item = mIndex->find( key, hash );
+
+	if( NULL != item && isStale( item, time( NULL ) ) ) item = NULL;
+
+	return item;
+}
+
+void SP_CacheShard :: reclaim( SP_CacheItem * item )
+{
+	mReclaimed++;
+	if( ! item->mFetched ) mExpiredUnfetched++;
+
+	mIndex->remove( item->getKey(), item->getHash() );
+	unlink( item );
+	item->release();
+}
+
+int SP_CacheShard :: crawl( int maxItems )
+{
+	int checked = 0, reclaimed = 0;
+
+	time_t now = time( NULL );
+
+	for( int i = 0; i < eSegmentCount && checked < maxItems; i++ ) {
+		// the last pass of this segment is done, start a new one
+		if( NULL == mCrawlPos[i] ) mCrawlPos[i] = mSegments[i].mHead;
+
+		for( ; NULL != mCrawlPos[i] && checked < maxItems; checked++ ) {
+			SP_CacheItem * item = mCrawlPos[i];
+			mCrawlPos[i] = item->mNext;
+
+			if( isExpired( item, now ) ) {
+				reclaim( item );
+				reclaimed++;
+			}
+		}
+	}
+
+	mCrawlChecked += checked;
+
+	return reclaimed;
+}
+
+int SP_CacheShard :: hit( SP_CacheItem * item )
+{
+	// several readers may be here under the shared lock, so the counters
+	// are atomic. mFetched and mActive are not: the readers only store 1,
+	// racing stores write the same byte and none is lost. They are cleared
+	// and read by the eviction under the exclusive lock, which the rwlock
+	// orders after the readers. The test before the store keeps a hot item
+	// from dirtying its cache line on every hit. mSegment and mAccessTime
+	// are only read here, they change under the exclusive lock
+	sp_atomic_inc( &mGetHits );
+	if( ! item->mFetched ) item->mFetched = 1;
+
+	if( eLRU == mPolicy ) {
+		return time( NULL ) - item->mAccessTime >= eBumpInterval;
+	} else if( eSLRU == mPolicy || eClock == mPolicy ) {
+		// only mark it, the list is rearranged when evicting
+		if( eProtected == item->mSegment ) sp_atomic_inc( &mProtectedHits );
+		if( ! item->mActive ) item->mActive = 1;
+	}
+
+	return 0;
+}
+
+void SP_CacheShard :: bump( SP_CacheItem * item )
+{
+	time_t now = time( NULL );
+
+	if( eLRU != mPolicy || now - item->mAccessTime < eBumpInterval ) return;
+
+	// it may be replaced or removed after the shared lock was released
+	if( item != mIndex->find( item->getKey(), item->getHash() ) ) return;
+
+	item->mAccessTime = now;
+	unlink( item );
+	link( item, eProbation );
+	mPromotions++;
+}
+
+int SP_CacheShard :: isProtectedFull() const
 {
+	const Segment_t * seg = &( mSegments[ eProtected ] );
+
+	// protected keeps at most 80% of the shard
+	if( mMaxBytes > 0 ) return seg->mBytes * 5 > mBytes * 4;
+
+	return seg->mCount * 5 > mCurrItems * 4;
+}
+
+SP_CacheItem * SP_CacheShard :: getVictim( const SP_CacheItem * keep )
+{
+	Segment_t * probation = &( mSegments[ eProbation ] );
+	Segment_t * protect = &( mSegments[ eProtected ] );
+
+	for( ; ; ) {
+		if( eSLRU == mPolicy ) {
+			for( ; NULL != protect->mHead && isProtectedFull(); ) {
+				SP_CacheItem * item = protect->mHead;
+				unlink( item );
+
+				if( item->mActive ) {
+					item->mActive = 0;
+					link( item, eProtected );
+				} else {
+					link( item, eProbation );
+					mDemotions++;
+				}
+			}
+		}
+
+		SP_CacheItem * item = probation->mHead;
+
+		if( NULL == item || item == keep ) {
+			if( NULL != item && probation->mHead != probation->mTail ) {
+				unlink( item );
+				link( item, eProbation );
+				continue;
+			}
+
+			// keep may be in protected too, a resize of a promoted item
+			SP_CacheItem * victim = protect->mHead;
+			if( victim == keep ) victim = victim->mNext;
+
+			return victim;
+		}
+
+		if( ( eSLRU == mPolicy || eClock == mPolicy ) && item->mActive ) {
+			item->mActive = 0;
+			unlink( item );
+			link( item, eSLRU == mPolicy ? eProtected : eProbation );
+			mPromotions++;
+			continue;
+		}
+
+		return item;
+	}
+}
+
+void SP_CacheShard :: put( SP_CacheItem * item, time_t expTime )
+{
+	time_t now = time( NULL );
+
+	// a delayed flush is due, apply it before the new item comes in
+	if( mFlushTime > 0 && mFlushTime <= now ) {
+		mFlushSeq = mPutSeq;
+		mFlushTime = 0;
+	}
+
+	item->setExpTime( expTime );
+	item->mPutSeq = ++mPutSeq;
+
+	SP_CacheItem * replaced = mIndex->insert( item );
+	if( NULL != replaced ) {
+		unlink( replaced );
+		replaced->release();
+	}
+
+	item->mActive = 0;
+	item->mAccessTime = now;
+	link( item, eProbation );
+
+	evict( item );
 }
 
-SP_CacheItemHandler :: ~SP_CacheItemHandler()
+void SP_CacheShard :: resize( SP_CacheItem * item, size_t oldSize )
 {
+	Segment_t * seg = &( mSegments[ (int)item->mSegment ] );
+
+	size_t size = item->getMemSize();
+
+	seg->mBytes = seg->mBytes - oldSize + size;
+	mBytes = mBytes - oldSize + size;
+
+	evict( item );
 }
 
-int SP_CacheItemHandler :: compare( const void * item1, const void * item2 )
+void SP_CacheShard :: evict( SP_CacheItem * keep )
 {
-	SP_CacheItem * i1 = (SP_CacheItem*)item1, * i2 = (SP_CacheItem*)item2;
+	for( ; ; ) {
+		if( ( mMaxBytes <= 0 || mBytes <= mMaxBytes )
+				&& ( mMaxItems <= 0 || mCurrItems <= mMaxItems ) ) break;
 
-	return strcmp( i1->getKey(), i2->getKey() );
+		SP_CacheItem * victim = getVictim( keep );
+		if( NULL == victim ) break;
+
+		mIndex->remove( victim->getKey(), victim->getHash() );
+		unlink( victim );
+		if( NULL != mHotKeys ) mHotKeys->invalidate( victim->getHash() );
+		victim->release();
+
+		mEvictions++;
+	}
 }
 
-void SP_CacheItemHandler :: destroy( void * item )
+SP_CacheItem * SP_CacheShard :: remove( const char * key, uint64_t hash )
 {
-	SP_CacheItem * toDelete = (SP_CacheItem*)item;
-	toDelete->release();
+	SP_CacheItem * item = mIndex->remove( key, hash );
+
+	if( NULL != item ) {
+		unlink( item );
+
+		if( isExpired( item, time( NULL ) ) ) {
+			mReclaimed++;
+			if( ! item->mFetched ) mExpiredUnfetched++;
+
+			item->release();
+			item = NULL;
+		}
+	}
+
+	return item;
 }
 
-void SP_CacheItemHandler :: onHit( const void * item, void * resultHolder )
+SP_CacheItem ** SP_CacheShard :: pin( int * count )
 {
-	if( NULL != resultHolder ) {
-		Holder_t * holder = (Holder_t*)resultHolder;
+	int capacity = 0;
+	for( int i = 0; i < eSegmentCount; i++ ) capacity += mSegments[i].mCount;
+
+	SP_CacheItem ** items = (SP_CacheItem**)malloc( sizeof( SP_CacheItem * ) * ( capacity + 1 ) );
+	*count = 0;
 
-		if( 0 == holder->mType ) {
-			SP_MsgBlockList * blockList = (SP_MsgBlockList*)holder->mPtr;
+	time_t now = time( NULL );
 
-			SP_CacheItem * it = (SP_CacheItem*)item;
-			it->addRef();
-			blockList->append( new SP_CacheItemMsgBlock( it ) );
-		} else if( 1 == holder->mType ) {
-			SP_CacheItem * it = (SP_CacheItem*)item;
-			it->addRef();
-			holder->mPtr = it;
+	// a reference keeps the value as it is now, in-place updates copy instead
+	for( int i = 0; i < eSegmentCount; i++ ) {
+		for( SP_CacheItem * item = mSegments[i].mHead;
+				NULL != item && *count < capacity; item = item->mNext ) {
+			if( isStale( item, now ) ) continue;
+
+			item->addRef();
+			items[ ( *count )++ ] = item;
 		}
 	}
+
+	return items;
 }
 
 //---------------------------------------------------------
 
-SP_CacheEx :: SP_CacheEx( int algo, int maxItems )
+SP_CacheEx :: SP_CacheEx( int algo, int maxItems, int shardCount, size_t maxBytes,
+		SP_CacheSlabs * slabs, int policy )
 {
-	mCache = SP_DictCache::newInstance( algo, maxItems,
-			new SP_CacheItemHandler(), 0 );
+	mSlabs = slabs;
+	mQueueStat = NULL;
+	mSnapshot = NULL;
+	mReplLog = NULL;
+	mReplica = NULL;
+	mHotKeys = NULL;
+	mPolicy = policy;
+
+	mShardCount = shardCount > 0 ? shardCount : 1;
+	mMaxBytes = maxBytes;
+
+	int maxShardItems = ( maxItems + mShardCount - 1 ) / mShardCount;
+	size_t maxShardBytes = ( maxBytes + mShardCount - 1 ) / mShardCount;
+
+	mShards = (SP_CacheShard**)malloc( sizeof( void * ) * mShardCount );
+	for( int i = 0; i < mShardCount; i++ ) {
+		mShards[i] = new SP_CacheShard( algo, maxShardItems, maxShardBytes, policy );
+	}
 
 	time( &mStartTime );
-	mTotalItems = mCmdGet = mCmdSet = 0;
+	mCmdFlush = 0;
+
+	mMaxItemSize = 1024 * 1024;
 
-	sp_thread_mutex_init( &mMutex, NULL );
+	mCrawlerState = -1;
+	mCrawlItems = mCrawlInterval = 0;
 }
 
 SP_CacheEx :: ~SP_CacheEx()
 {
-	delete mCache;
+	if( 1 == mCrawlerState ) {
+		mCrawlerState = 0;
+		for( ; -1 != mCrawlerState; ) sp_sleep_usec( mCrawlInterval );
+	}
+
+	for( int i = 0; i < mShardCount; i++ ) delete mShards[i];
+	free( mShards );
 
-	sp_thread_mutex_destroy( &mMutex );
+	if( NULL != mSlabs ) delete mSlabs;
+}
+
+SP_CacheSlabs * SP_CacheEx :: getSlabs() const
+{
+	return mSlabs;
+}
+
+void SP_CacheEx :: setMaxItemSize( size_t maxItemSize )
+{
+	mMaxItemSize = maxItemSize;
+}
+
+size_t SP_CacheEx :: getMaxItemSize() const
+{
+	return mMaxItemSize;
+}
+
+void SP_CacheEx :: setQueueStat( SP_CacheQueueStat * queueStat )
+{
+	mQueueStat = queueStat;
+}
+
+SP_CacheQueueStat * SP_CacheEx :: getQueueStat() const
+{
+	return mQueueStat;
+}
+
+void SP_CacheEx :: setSnapshot( SP_CacheSnapshot * snapshot )
+{
+	mSnapshot = snapshot;
+}
+
+void SP_CacheEx :: setReplLog( SP_CacheReplLog * replLog )
+{
+	mReplLog = replLog;
+
+	for( int i = 0; i < mShardCount; i++ ) mShards[i]->mReplLog = replLog;
+}
+
+void SP_CacheEx :: setReplica( SP_CacheReplica * replica )
+{
+	mReplica = replica;
+}
+
+void SP_CacheEx :: setHotKeys( SP_CacheHotKeys * hotKeys )
+{
+	mHotKeys = hotKeys;
+
+	for( int i = 0; i < mShardCount; i++ ) mShards[i]->mHotKeys = hotKeys;
+}
+
+void SP_CacheEx :: onStore( SP_CacheItem * item )
+{
+	if( NULL != mReplLog ) getShard( item->getHash() )->addReplRecord( mReplLog->takeSet( item ) );
+	if( NULL != mHotKeys ) mHotKeys->invalidate( item->getHash() );
+}
+
+void SP_CacheEx :: onErase( const char * key, uint64_t hash )
+{
+	if( NULL != mReplLog ) getShard( hash )->addReplRecord( mReplLog->takeDelete( key ) );
+	if( NULL != mHotKeys ) mHotKeys->invalidate( hash );
+}
+
+int SP_CacheEx :: startCrawler( int itemsPerSlice, int sliceInterval )
+{
+	if( -1 != mCrawlerState || itemsPerSlice <= 0 ) return -1;
+
+	mCrawlItems = itemsPerSlice;
+	mCrawlInterval = sliceInterval > 0 ? sliceInterval : 1;
+	mCrawlerState = 1;
+
+	sp_thread_attr_t attr;
+	sp_thread_attr_init( &attr );
+	sp_thread_attr_setdetachstate( &attr, SP_THREAD_CREATE_DETACHED );
+
+	sp_thread_t thread;
+	int ret = sp_thread_create( &thread, &attr, crawlerThread, this );
+	sp_thread_attr_destroy( &attr );
+
+	if( 0 != ret ) mCrawlerState = -1;
+
+	return 0 == ret ? 0 : -1;
+}
+
+sp_thread_result_t SP_THREAD_CALL SP_CacheEx :: crawlerThread( void * arg )
+{
+	SP_CacheEx * cacheEx = (SP_CacheEx*)arg;
+
+	for( ; 1 == cacheEx->mCrawlerState; ) {
+		for( int i = 0; i < cacheEx->mShardCount && 1 == cacheEx->mCrawlerState; i++ ) {
+			SP_CacheShard * shard = cacheEx->mShards[i];
+
+			// a short slice, so the shard is never held for long
+			shard->lock();
+			shard->crawl( cacheEx->mCrawlItems );
+			shard->unlock();
+
+			sp_sleep_usec( cacheEx->mCrawlInterval );
+		}
+	}
+
+	cacheEx->mCrawlerState = -1;
+
+	return 0;
+}
+
+SP_CacheShard * SP_CacheEx :: getShard( uint64_t hash ) const
+{
+	if( 1 == mShardCount ) return mShards[0];
+
+	// the low bits are left to the index
+	return mShards[ ( hash >> 32 ) % mShardCount ];
 }
 
 int SP_CacheEx :: add( SP_CacheItem * item, time_t expTime )
 {
 	int ret = -1;
 
-	sp_thread_mutex_lock( &mMutex );
+	SP_CacheShard * shard = getShard( item->getHash() );
 
-	if( 0 == mCache->get( item, NULL ) ) {
+	shard->lock();
+
+	if( NULL == shard->find( item->getKey(), item->getHash() ) ) {
 		ret = 0;
-		mCache->put( item, expTime );
-		mTotalItems++;
+		shard->put( item, expTime );
+		shard->mTotalItems++;
+
+		onStore( item );
 	}
 
-	sp_thread_mutex_unlock( &mMutex );
+	shard->unlock();
 
 	return ret;
 }
 
 int SP_CacheEx :: set( SP_CacheItem * item, time_t expTime )
 {
-	SP_CacheItemHandler::Holder_t holder;
-	memset( &holder, 0, sizeof( holder ) );
-	holder.mType = 1;
+	SP_CacheShard * shard = getShard( item->getHash() );
 
-	sp_thread_mutex_lock( &mMutex );
+	shard->lock();
 
-	if( mCache->get( item, &holder ) ) {
-		SP_CacheItem * old = (SP_CacheItem*)holder.mPtr;
-		item->setCasUnique( old->getCasUnique() + 1 );
-	}
+	SP_CacheItem * old = shard->find( item->getKey(), item->getHash() );
+	if( NULL != old ) item->setCasUnique( old->getCasUnique() + 1 );
+
+	shard->put( item, expTime );
+	shard->mTotalItems++;
+	shard->mCmdSet++;
 
-	mCache->put( item, expTime );
-	mTotalItems++;
-	mCmdSet++;
+	onStore( item );
 
-	sp_thread_mutex_unlock( &mMutex );
+	shard->unlock();
 
 	return 0;
 }
@@ -154,23 +803,23 @@ int SP_CacheEx :: replace( SP_CacheItem * item, time_t expTime )
 {
 	int ret = -1;
 
-	SP_CacheItemHandler::Holder_t holder;
-	memset( &holder, 0, sizeof( holder ) );
-	holder.mType = 1;
+	SP_CacheShard * shard = getShard( item->getHash() );
 
-	sp_thread_mutex_lock( &mMutex );
+	shard->lock();
 
-	if( mCache->get( item, &holder ) ) {
+	SP_CacheItem * old = shard->find( item->getKey(), item->getHash() );
+	if( NULL != old ) {
 		ret= 0;
 
-		SP_CacheItem * old = (SP_CacheItem*)holder.mPtr;
 		item->setCasUnique( old->getCasUnique() + 1 );
 
-		mCache->put( item, expTime );
-		mTotalItems++;
+		shard->put( item, expTime );
+		shard->mTotalItems++;
+
+		onStore( item );
 	}
 
-	sp_thread_mutex_unlock( &mMutex );
+	shard->unlock();
 
 	return ret;
 }
@@ -179,28 +828,23 @@ int SP_CacheEx :: cas( SP_CacheItem * item, time_t expTime )
 {
 	int ret = -1;
 
-	SP_CacheItemHandler::Holder_t holder;
-	memset( &holder, 0, sizeof( holder ) );
-	holder.mType = 1;
-
-	sp_thread_mutex_lock( &mMutex );
+	SP_CacheShard * shard = getShard( item->getHash() );
 
-	if( mCache->get( item, &holder ) ) {
-		if( NULL != holder.mPtr ) {
-			SP_CacheItem * old = (SP_CacheItem*)holder.mPtr;
+	shard->lock();
 
-			if( ( old->getCasUnique() + 1 ) == item->getCasUnique() ) {
-				old->release();
+	SP_CacheItem * old = shard->find( item->getKey(), item->getHash() );
+	if( NULL != old ) {
+		if( ( old->getCasUnique() + 1 ) == item->getCasUnique() ) {
+			ret = 0;
+			shard->put( item, expTime );
 
-				ret = 0;
-				mCache->put( item, expTime );
-			} else {
-				ret = 1;
-			}
+			onStore( item );
+		} else {
+			ret = 1;
 		}
 	}
 
-	sp_thread_mutex_unlock( &mMutex );
+	shard->unlock();
 
 	return ret;
 }
@@ -209,53 +853,82 @@ int SP_CacheEx :: catbuf( SP_CacheItem * item, time_t expTime, int isAppend )
 {
 	int ret = -1;
 
-	sp_thread_mutex_lock( &mMutex );
+	SP_CacheShard * shard = getShard( item->getHash() );
+
+	shard->lock();
 
-	time_t oldTime = 0;
-	SP_CacheItem * oldItem = (SP_CacheItem*)mCache->remove( item, &oldTime );
+	SP_CacheItem * oldItem = shard->find( item->getKey(), item->getHash() );
+
+	// the value cannot grow over the limit of a set, it is left as it is
+	if( NULL != oldItem && mMaxItemSize > 0
+			&& oldItem->getValueBytes() + item->getValueBytes() > mMaxItemSize ) {
+		oldItem = NULL;
+	}
 
 	if( NULL != oldItem ) {
 		ret = 0;
 
-		SP_CacheItem * newItem = new SP_CacheItem();
+		size_t oldLen = oldItem->getValueBytes(), len = item->getValueBytes();
+		size_t totalBytes = oldLen + len + 2;
 
-		const char * oldPos = strchr( (char*)oldItem->getDataBlock(), '\n' );
-		const char * pos = strchr( (char*)item->getDataBlock(), '\n' );
-
-		assert( NULL != oldPos && NULL != pos );
+		// nobody is sending it and the spare capacity is enough, grow it in place,
+		// a chunked one can always be appended by adding chunks
+		int inPlace = 0;
+		if( 1 == oldItem->getRefCount() ) {
+			if( isAppend ) {
+				inPlace = oldItem->isChunked() || totalBytes <= oldItem->getBlockCapacity();
+			} else {
+				inPlace = ! oldItem->isChunked() && ! item->isChunked()
+						&& totalBytes <= oldItem->getBlockCapacity();
+			}
+		}
 
-		int oldLen = oldItem->getDataBytes() - ( oldPos + 1 - (char*)oldItem->getDataBlock() ) - 2;
-		int len = item->getDataBytes() - ( pos + 1 - (char*)item->getDataBlock() ) - 2;
+		if( inPlace ) {
+			size_t oldSize = oldItem->getMemSize();
 
-		int totalBytes = oldLen + len;
+			if( isAppend ) {
+				oldItem->truncateDataBlock( oldLen );
+				oldItem->copyDataBlock( item, len );
+				oldItem->appendDataBlock( "\r\n", 2 );
+			} else {
+				oldItem->prependDataBlock( item->getDataBlock(), len );
+			}
 
-		char flags[ 16 ] = { 0 };
-		sp_strtok( (char*)item->getDataBlock(), 2, flags, sizeof( flags ) );
+			oldItem->setCasUnique( oldItem->getCasUnique() + 1 );
 
-		char buffer[ 512] = { 0 };
-		int buflen = snprintf( buffer, sizeof( buffer ), "VALUE %s %s %d %llu\r\n",
-				item->getKey(), flags, totalBytes, oldItem->getCasUnique() + 1 );
-		newItem->appendDataBlock( buffer, buflen, totalBytes + buflen + 2 );
+			if( oldItem->getMemSize() != oldSize ) shard->resize( oldItem, oldSize );
 
-		if( isAppend ) {
-			newItem->appendDataBlock( oldPos + 1, oldLen );
-			newItem->appendDataBlock( pos + 1, len );
+			onStore( oldItem );
 		} else {
-			newItem->appendDataBlock( pos + 1, len );
-			newItem->appendDataBlock( oldPos + 1, oldLen );
-		}
+			// leave half as much spare capacity for the next ones,
+			// so a value built by appends is copied O(log n) times
+			SP_CacheItem * newItem = SP_CacheItem::newInstance( mSlabs,
+					item->getKey(), totalBytes + totalBytes / 2 );
+
+			if( isAppend ) {
+				newItem->copyDataBlock( oldItem, oldLen );
+				newItem->copyDataBlock( item, len );
+			} else {
+				newItem->copyDataBlock( item, len );
+				newItem->copyDataBlock( oldItem, oldLen );
+			}
 
-		newItem->appendDataBlock( "\r\n", 2 );
-		newItem->setCasUnique( oldItem->getCasUnique() + 1 );
-		newItem->setKey( item->getKey() );
+			newItem->appendDataBlock( "\r\n", 2 );
 
-		mCache->put( newItem, expTime );
+			// append and prepend keep the flags of the existing item
+			newItem->setClientFlags( oldItem->getClientFlags() );
+			newItem->setCasUnique( oldItem->getCasUnique() + 1 );
 
-		delete oldItem;
-		delete item;
+			// the old one is released by put, maybe someone is still reading it
+			shard->put( newItem, oldItem->getExpTime() );
+
+			onStore( newItem );
+		}
+
+		item->release();
 	}
 
-	sp_thread_mutex_unlock( &mMutex );
+	shard->unlock();
 
 	return ret;
 }
@@ -270,43 +943,91 @@ int SP_CacheEx :: prepend( SP_CacheItem * item, time_t expTime )
 	return catbuf( item,expTime, 0 );
 }
 
-int SP_CacheEx :: erase( const SP_CacheItem * key )
+int SP_CacheEx :: erase( const char * key )
 {
 	int ret = -1;
 
-	sp_thread_mutex_lock( &mMutex );
+	uint64_t hash = SP_CacheItem::hashKey( key );
+
+	SP_CacheShard * shard = getShard( hash );
+
+	shard->lock();
+
+	SP_CacheItem * item = shard->remove( key, hash );
+	if( NULL != item ) {
+		ret = 0;
+		item->release();
 
-	if( mCache->erase( key ) ) ret = 0;
+		onErase( key, hash );
+	}
 
-	sp_thread_mutex_unlock( &mMutex );
+	shard->unlock();
 
 	return ret;
 }
 
 int SP_CacheEx :: flushAll( time_t expTime )
 {
+	for( int i = 0; i < mShardCount; i++ ) {
+		SP_CacheShard * shard = mShards[i];
+
+		shard->lock();
+		shard->flush( expTime );
+		shard->unlock();
+	}
+
+	sp_atomic_inc( &mCmdFlush );
+
+	if( NULL != mReplLog ) mReplLog->logFlush( expTime );
+	if( NULL != mHotKeys ) mHotKeys->invalidateAll( expTime );
+
 	return 0;
 }
 
-int SP_CacheEx :: calc( const SP_CacheItem * key, int delta, int isIncr, int * newValue )
+// the value must be all digits and fit in 64 bits, return 0 if OK
+static int sp_strtou64( const char * str, size_t len, uint64_t * value )
+{
+	*value = 0;
+
+	if( len <= 0 ) return -1;
+
+	for( size_t i = 0; i < len; i++ ) {
+		if( ! isdigit( (unsigned char)str[i] ) ) return -1;
+
+		uint64_t next = *value * 10 + ( str[i] - '0' );
+		if( *value > 1844674407370955161ULL || next < *value * 10 ) return -1;
+
+		*value = next;
+	}
+
+	return 0;
+}
+
+int SP_CacheEx :: calc( const char * key, uint64_t delta, int isIncr, uint64_t * newValue )
 {
 	int ret = -1;
 
-	sp_thread_mutex_lock( &mMutex );
+	uint64_t hash = SP_CacheItem::hashKey( key );
+
+	SP_CacheShard * shard = getShard( hash );
 
-	time_t expTime = 0;
-	SP_CacheItem * oldItem = (SP_CacheItem*)mCache->remove( key, &expTime );
+	shard->lock();
+
+	SP_CacheItem * oldItem = shard->find( key, hash );
 	if( NULL != oldItem ) {
-		char * realBlock = strchr( (char*)oldItem->getDataBlock(), '\n' );
+		uint64_t value = 0;
 
-		int value = strtol( realBlock ? realBlock + 1 : "", NULL, 10 );
+		// 2^64 has 20 digits, a longer value is never a number
+		char digits[ 24 ] = { 0 };
+		size_t bytes = oldItem->getValueBytes() <= 20 ? oldItem->getValueBytes() : 0;
+		oldItem->readDataBlock( 0, digits, bytes );
 
-		if( ERANGE == errno ) {
+		if( 0 != sp_strtou64( digits, bytes, &value ) ) {
 			ret = -2;
-			mCache->put( oldItem, expTime );
 		} else {
 			ret = 0;
 
+			// same as memcached, incr wraps around at 2^64, decr stops at 0
 			if( isIncr ) {
 				value += delta;
 			} else {
@@ -314,70 +1035,271 @@ int SP_CacheEx :: calc( const SP_CacheItem * key, int delta, int isIncr, int * n
 			}
 			* newValue = value;
 
-			char strKey[ 256 ] = { 0 };
-			int flags = 0;
-
-			sscanf( (char*)oldItem->getDataBlock(), "%*s %250s %u", strKey, &flags );
-
 			char num[ 32 ] = { 0 };
-			snprintf( num, sizeof( num ), "%u", value );
+			int len = snprintf( num, sizeof( num ), "%llu\r\n", (unsigned long long)value );
 
-			char buffer[ 512 ] = { 0 };
-			snprintf( buffer, sizeof( buffer ), "VALUE %s %d %u %llu\r\n%s\r\n",
-					strKey, flags, strlen( num ), oldItem->getCasUnique() + 1, num );
+			if( 1 == oldItem->getRefCount() && (size_t)len <= oldItem->getBlockCapacity() ) {
+				// nobody is sending it and the digits fit, update it in place
+				oldItem->setDataBlock( num, len );
+				oldItem->setCasUnique( oldItem->getCasUnique() + 1 );
 
-			SP_CacheItem * newItem = new SP_CacheItem( strKey );
-			newItem->setDataBlock( buffer, strlen( buffer ) );
-			newItem->setCasUnique( oldItem->getCasUnique() + 1 );
+				onStore( oldItem );
+			} else {
+				SP_CacheItem * newItem = SP_CacheItem::newInstance( mSlabs, key, len );
+				newItem->appendDataBlock( num, len );
+				newItem->setClientFlags( oldItem->getClientFlags() );
+				newItem->setCasUnique( oldItem->getCasUnique() + 1 );
 
-			mCache->put( newItem, expTime );
+				// the old one is released by put, maybe someone is still reading it
+				shard->put( newItem, oldItem->getExpTime() );
 
-			// maybe someone is reading it, so don't delete it, just release it!
-			oldItem->release();
+				onStore( newItem );
+			}
 		}
 	}
 
-	sp_thread_mutex_unlock( &mMutex );
+	shard->unlock();
 
 	return ret;
 }
 
-int SP_CacheEx :: incr( const SP_CacheItem * key, int delta, int * newValue )
+int SP_CacheEx :: incr( const char * key, uint64_t delta, uint64_t * newValue )
 {
 	return calc( key, delta, 1, newValue );
 }
 
-int SP_CacheEx :: decr( const SP_CacheItem * key, int delta, int * newValue )
+int SP_CacheEx :: decr( const char * key, uint64_t delta, uint64_t * newValue )
 {
 	return calc( key, delta, 0, newValue );
 }
 
-void SP_CacheEx :: get( SP_ArrayList * keyList, SP_MsgBlockList * blockList )
+void SP_CacheEx :: get( SP_ArrayList * keyList, SP_MsgBlockList * blockList, int withCas )
 {
-	sp_thread_mutex_lock( &mMutex );
+	int count = keyList->getCount();
 
-	SP_CacheItemHandler::Holder_t holder;
-	memset( &holder, 0, sizeof( holder ) );
-	holder.mPtr = blockList;
+	if( count > 0 ) {
+		// a usual get fits in the stack, no malloc for it
+		int stackInts[ eStackInts ];
+		uint64_t stackHashes[ eStackKeys ], stackTickets[ eStackKeys ];
+		SP_CacheItem * stackFound[ eStackKeys ];
 
-	for( int i = 0; i < keyList->getCount(); i++ ) {
-		SP_CacheItem keyItem( (char*)keyList->getItem( i ) );
-		mCache->get( &keyItem, &holder );
-	}
-	mCmdGet++;
+		int onStack = ( count <= eStackKeys && count + mShardCount <= eStackInts );
+
+		// chain the keys by shard, so every shard is locked only once
+		int * next = onStack ? stackInts : (int*)malloc( sizeof( int ) * ( count + mShardCount ) );
+		int * head = next + count;
 
-	sp_thread_mutex_unlock( &mMutex );
+		uint64_t * hashes = onStack ? stackHashes : (uint64_t*)malloc( sizeof( uint64_t ) * count );
+		SP_CacheItem ** found = onStack ? stackFound : (SP_CacheItem**)malloc( sizeof( void * ) * count );
+
+		uint64_t * tickets = NULL;
+		if( NULL != mHotKeys ) {
+			tickets = onStack ? stackTickets : (uint64_t*)malloc( sizeof( uint64_t ) * count );
+			memset( tickets, 0, sizeof( uint64_t ) * count );
+		}
+
+		memset( found, 0, sizeof( void * ) * count );
+
+		for( int i = 0; i < mShardCount; i++ ) head[i] = -1;
+
+		for( int i = count - 1; i >= 0; i-- ) {
+			if( NULL == keyList->getItem( i ) ) continue;
+
+			hashes[i] = SP_CacheItem::hashKey( (char*)keyList->getItem( i ) );
+
+			// a hot key served by the copy of this thread never goes to its shard
+			if( NULL != mHotKeys ) {
+				found[i] = mHotKeys->lookup( (char*)keyList->getItem( i ), hashes[i], &( tickets[i] ) );
+				if( NULL != found[i] ) continue;
+			}
+
+			int index = 0;
+			if( mShardCount > 1 ) index = ( hashes[i] >> 32 ) % mShardCount;
+
+			next[i] = head[ index ];
+			head[ index ] = i;
+		}
+
+		for( int i = 0; i < mShardCount; i++ ) {
+			if( head[i] < 0 ) continue;
+
+			SP_CacheShard * shard = mShards[i];
+
+			// the gets of a shard don't block each other
+			int bumps = 0;
+
+			shard->readLock();
+
+			for( int j = head[i]; j >= 0; j = next[j] ) {
+				SP_CacheItem * item = shard->lookup( (char*)keyList->getItem( j ), hashes[j] );
+				if( NULL != item ) {
+					item->addRef();
+					found[j] = item;
+					bumps += shard->hit( item );
+				}
+				sp_atomic_inc( &( shard->mCmdGet ) );
+			}
+
+			shard->unlock();
+
+			if( bumps > 0 ) {
+				shard->lock();
+				for( int j = head[i]; j >= 0; j = next[j] ) {
+					if( NULL != found[j] ) shard->bump( found[j] );
+				}
+				shard->unlock();
+			}
+		}
+
+		// keep the reply in the same order as the request
+		for( int i = 0; i < count; i++ ) {
+			if( NULL != found[i] ) {
+				if( NULL != tickets && 0 != tickets[i] ) mHotKeys->keep( found[i], tickets[i] );
+
+				blockList->append( new SP_CacheHeaderMsgBlock( found[i], withCas ) );
+
+				for( int j = 0; j < found[i]->getChunkCount(); j++ ) {
+					if( j > 0 ) found[i]->addRef();
+					blockList->append( new SP_CacheItemMsgBlock( found[i], j ) );
+				}
+			}
+			if( NULL == keyList->getItem( i ) ) {
+				blockList->append( new SP_SimpleMsgBlock( (void*)"END\r\n", 5, 0 ) );
+			}
+		}
+
+		if( ! onStack ) {
+			if( NULL != tickets ) free( tickets );
+			free( found );
+			free( hashes );
+			free( next );
+		}
+	}
 
 	blockList->append( new SP_SimpleMsgBlock( (void*)"END\r\n", 5, 0 ) );
 }
 
-void SP_CacheEx :: stat( SP_Buffer * buffer )
+SP_CacheItem * SP_CacheEx :: getItem( const char * key )
 {
-	sp_thread_mutex_lock( &mMutex );
+	uint64_t hash = SP_CacheItem::hashKey( key );
+
+	uint64_t ticket = 0;
+
+	if( NULL != mHotKeys ) {
+		SP_CacheItem * copy = mHotKeys->lookup( key, hash, &ticket );
+		if( NULL != copy ) return copy;
+	}
+
+	SP_CacheShard * shard = getShard( hash );
+
+	int bump = 0;
+
+	shard->readLock();
+
+	SP_CacheItem * item = shard->lookup( key, hash );
+	if( NULL != item ) {
+		item->addRef();
+		bump = shard->hit( item );
+	}
+	sp_atomic_inc( &( shard->mCmdGet ) );
+
+	shard->unlock();
+
+	if( bump ) {
+		shard->lock();
+		shard->bump( item );
+		shard->unlock();
+	}
+
+	if( NULL != item && 0 != ticket ) mHotKeys->keep( item, ticket );
+
+	return item;
+}
+
+void SP_CacheEx :: restore( SP_CacheItem * item, time_t expTime )
+{
+	SP_CacheShard * shard = getShard( item->getHash() );
+
+	shard->lock();
+
+	shard->put( item, expTime );
+
+	onStore( item );
+
+	shard->unlock();
+}
+
+SP_CacheItem ** SP_CacheEx :: pinItems( int index, int * count )
+{
+	SP_CacheShard * shard = mShards[ index ];
+
+	shard->readLock();
+	SP_CacheItem ** items = shard->pin( count );
+	shard->unlock();
+
+	return items;
+}
+
+int SP_CacheEx :: getShardCount() const
+{
+	return mShardCount;
+}
+
+int SP_CacheEx :: stat( SP_Buffer * buffer, const char * type )
+{
+	if( NULL != type ) {
+		if( 0 == strcasecmp( type, "slabs" ) && NULL != mSlabs ) {
+			mSlabs->stat( buffer );
+			return 0;
+		}
+
+		if( 0 == strcasecmp( type, "hotkeys" ) && NULL != mHotKeys ) {
+			mHotKeys->stat( buffer );
+			return 0;
+		}
+
+		return -1;
+	}
 
 	char temp[ 512 ] = { 0 };
 
-	SP_DictCacheStatistics * stat = mCache->getStatistics();
+	size_t currItems = 0, totalItems = 0, cmdGet = 0, cmdSet = 0, hits = 0;
+	size_t bytes = 0, evictions = 0;
+	size_t protectedItems = 0, protectedHits = 0, promotions = 0, demotions = 0;
+	size_t reclaimed = 0, expiredUnfetched = 0, crawlChecked = 0;
+
+	for( int i = 0; i < mShardCount; i++ ) {
+		SP_CacheShard * shard = mShards[i];
+
+		shard->lock();
+
+		currItems += shard->mCurrItems;
+		bytes += shard->mBytes;
+		evictions += shard->mEvictions;
+		hits += shard->mGetHits;
+
+		protectedItems += shard->mSegments[ SP_CacheShard::eProtected ].mCount;
+		protectedHits += shard->mProtectedHits;
+		promotions += shard->mPromotions;
+		demotions += shard->mDemotions;
+
+		reclaimed += shard->mReclaimed;
+		expiredUnfetched += shard->mExpiredUnfetched;
+		crawlChecked += shard->mCrawlChecked;
+
+		totalItems += shard->mTotalItems;
+		cmdGet += shard->mCmdGet;
+		cmdSet += shard->mCmdSet;
+
+		shard->unlock();
+	}
+
+	// the hot gets served by the copies never reach a shard
+	if( NULL != mHotKeys ) {
+		size_t hotHits = mHotKeys->getHits();
+		cmdGet += hotHits;
+		hits += hotHits;
+	}
 
 	snprintf( temp, sizeof( temp ), "STAT pid %u\r\n", getpid() );
 	buffer->append( temp );
@@ -401,29 +1323,79 @@ void SP_CacheEx :: stat( SP_Buffer * buffer )
 	buffer->append( temp );
 #endif
 
-	snprintf( temp, sizeof( temp ), "STAT curr_items %d\r\n", stat->getSize() );
+	snprintf( temp, sizeof( temp ), "STAT curr_items %lu\r\n", (unsigned long)currItems );
 	buffer->append( temp );
 
-	snprintf( temp, sizeof( temp ), "STAT total_items %d\r\n", mTotalItems );
+	snprintf( temp, sizeof( temp ), "STAT total_items %lu\r\n", (unsigned long)totalItems );
 	buffer->append( temp );
 
-	snprintf( temp, sizeof( temp ), "STAT cmd_get %d\r\n", mCmdGet );
+	snprintf( temp, sizeof( temp ), "STAT cmd_get %lu\r\n", (unsigned long)cmdGet );
 	buffer->append( temp );
 
-	snprintf( temp, sizeof( temp ), "STAT cmd_set %d\r\n", mCmdSet );
+	snprintf( temp, sizeof( temp ), "STAT cmd_set %lu\r\n", (unsigned long)cmdSet );
 	buffer->append( temp );
 
-	snprintf( temp, sizeof( temp ), "STAT get_hits %d\r\n", stat->getHits() );
+	snprintf( temp, sizeof( temp ), "STAT cmd_flush %d\r\n", mCmdFlush );
 	buffer->append( temp );
 
-	snprintf( temp, sizeof( temp ), "STAT get_misses %d\r\n",
-			stat->getAccesses() - stat->getHits() );
+	snprintf( temp, sizeof( temp ), "STAT get_hits %lu\r\n", (unsigned long)hits );
 	buffer->append( temp );
 
-	buffer->append( "END\r\n" );
+	snprintf( temp, sizeof( temp ), "STAT get_misses %lu\r\n", (unsigned long)( cmdGet - hits ) );
+	buffer->append( temp );
 
-	delete stat;
+	snprintf( temp, sizeof( temp ), "STAT evictions %lu\r\n", (unsigned long)evictions );
+	buffer->append( temp );
 
-	sp_thread_mutex_unlock( &mMutex );
-}
+	snprintf( temp, sizeof( temp ), "STAT reclaimed %lu\r\n", (unsigned long)reclaimed );
+	buffer->append( temp );
 
+	snprintf( temp, sizeof( temp ), "STAT expired_unfetched %lu\r\n", (unsigned long)expiredUnfetched );
+	buffer->append( temp );
+
+	snprintf( temp, sizeof( temp ), "STAT crawler_items_checked %lu\r\n", (unsigned long)crawlChecked );
+	buffer->append( temp );
+
+	snprintf( temp, sizeof( temp ), "STAT bytes %lu\r\n", (unsigned long)bytes );
+	buffer->append( temp );
+
+	snprintf( temp, sizeof( temp ), "STAT limit_maxbytes %lu\r\n", (unsigned long)mMaxBytes );
+	buffer->append( temp );
+
+	snprintf( temp, sizeof( temp ), "STAT item_size_max %lu\r\n", (unsigned long)mMaxItemSize );
+	buffer->append( temp );
+
+	snprintf( temp, sizeof( temp ), "STAT eviction_policy %s\r\n",
+			SP_CacheShard::getPolicyName( mPolicy ) );
+	buffer->append( temp );
+
+	snprintf( temp, sizeof( temp ), "STAT hit_ratio %.4f\r\n",
+			cmdGet > 0 ? (double)hits / cmdGet : 0.0 );
+	buffer->append( temp );
+
+	snprintf( temp, sizeof( temp ), "STAT policy_promotions %lu\r\n", (unsigned long)promotions );
+	buffer->append( temp );
+
+	if( SP_CacheShard::eSLRU == mPolicy ) {
+		snprintf( temp, sizeof( temp ), "STAT policy_demotions %lu\r\n", (unsigned long)demotions );
+		buffer->append( temp );
+
+		snprintf( temp, sizeof( temp ), "STAT slru_protected_items %lu\r\n", (unsigned long)protectedItems );
+		buffer->append( temp );
+
+		snprintf( temp, sizeof( temp ), "STAT slru_protected_hits %lu\r\n", (unsigned long)protectedHits );
+		buffer->append( temp );
+	}
+
+	snprintf( temp, sizeof( temp ), "STAT shards %d\r\n", mShardCount );
+	buffer->append( temp );
+
+	if( NULL != mQueueStat ) mQueueStat->stat( buffer );
+	if( NULL != mSnapshot ) mSnapshot->stat( buffer );
+	if( NULL != mReplLog ) mReplLog->stat( buffer );
+	if( NULL != mReplica ) mReplica->stat( buffer );
+
+	buffer->append( "END\r\n" );
+
+	return 0;
+}
@@ -7,34 +7,170 @@
 #define __spcacheimpl_hpp__
 
 #include <time.h>
+#include <stdint.h>
 
-#include "spdict/spdictcache.hpp"
 #include "spserver/spthread.hpp"
 
+#include "spcachelock.hpp"
+
 class SP_ArrayList;
 class SP_MsgBlockList;
 class SP_Buffer;
 class SP_CacheItem;
+class SP_CacheShard;
+class SP_CacheSlabs;
+class SP_CacheQueueStat;
+class SP_CacheSnapshot;
+class SP_CacheReplLog;
+class SP_CacheReplica;
+class SP_CacheHotKeys;
+class SP_CacheIndex;
+
+struct tagSP_CacheReplRecord;
 
-class SP_CacheItemHandler : public SP_DictCacheHandler {
+class SP_CacheShard {
 public:
-	SP_CacheItemHandler();
-	virtual ~SP_CacheItemHandler();
+	// eviction policies
+	// eFIFO : evict in insertion order
+	// eLRU : a hit moves the item to the tail, at most once per eBumpInterval
+	// eSLRU : new items go to probation, a hit only marks the item, it is
+	//   promoted to protected when it reaches the probation head
+	// eClock : a marked item at the head gets a second chance
+	enum { eFIFO, eLRU, eSLRU, eClock };
 
-	virtual int compare( const void * item1, const void * item2 );
-	virtual void destroy( void * item );
-	virtual void onHit( const void * item, void * resultHolder );
+	enum { eBumpInterval = 1 };
 
-public:
-	typedef struct tagHolder {
-		int mType;
-		void * mPtr;
-	} Holder_t;
+	// return -1 if name is unknown
+	static int getPolicy( const char * name );
+	static const char * getPolicyName( int policy );
+
+	// algo : see SP_CacheIndex::newInstance
+	// maxItems/maxBytes : 0 means no limit
+	SP_CacheShard( int algo, int maxItems, size_t maxBytes, int policy = eFIFO );
+	~SP_CacheShard();
+
+	// exclusive, for everything changing the shard
+	void lock();
+
+	// shared, only for lookup and hit, it is exclusive
+	// if the index cannot find in several threads at once
+	void readLock();
+
+	// the records of the replication log taken under lock are put after it
+	void unlock();
+
+	// return NULL if not found or expired, no reference is added
+	SP_CacheItem * find( const char * key, uint64_t hash );
+
+	// same as find, but an expired item is left for the writers,
+	// so it is safe under readLock
+	SP_CacheItem * lookup( const char * key, uint64_t hash );
+
+	// account a get hit on item, safe under readLock.
+	// return 1 if the item is due to move in the eviction order, see bump
+	int hit( SP_CacheItem * item );
+
+	// move a hit item in the eviction order, under lock
+	void bump( SP_CacheItem * item );
+
+	// the shard takes over the reference of item, the replaced item is released,
+	// then evict until under the limits
+	void put( SP_CacheItem * item, time_t expTime );
+
+	// item in the cache changed its memory size, account it again
+	// and evict until under the limits
+	void resize( SP_CacheItem * item, size_t oldSize );
+
+	// take the item out of the cache, the caller owns the returned reference,
+	// return NULL if not found or expired
+	SP_CacheItem * remove( const char * key, uint64_t hash );
+
+	// the live items in the eviction order, oldest first, each with a
+	// reference added, under readLock. The caller releases them and frees the array
+	SP_CacheItem ** pin( int * count );
+
+	// invalidate all the items stored before flushTime, 0 means now.
+	// Nothing is freed here, flushed items are dropped when they are met
+	void flush( time_t flushTime );
+
+	// check at most maxItems items for expiry, going on from the last call,
+	// return the count of reclaimed items
+	int crawl( int maxItems );
+
+private:
+	friend class SP_CacheEx;
+
+	enum { eProbation, eProtected, eSegmentCount };
+
+	typedef struct tagSegment {
+		// oldest item at head
+		SP_CacheItem * mHead, * mTail;
+		int mCount;
+		size_t mBytes;
+	} Segment_t;
+
+	// expired or flushed
+	int isExpired( const SP_CacheItem * item, time_t now );
+
+	// same as isExpired, but a due delayed flush is not applied
+	int isStale( const SP_CacheItem * item, time_t now ) const;
+
+	void link( SP_CacheItem * item, int segment );
+	void unlink( SP_CacheItem * item );
+
+	// under lock, it is put into mReplLog by unlock
+	void addReplRecord( struct tagSP_CacheReplRecord * record );
+
+	// drop an expired item from the index and the list
+	void reclaim( SP_CacheItem * item );
+
+	// evict until under the limits, never keep
+	void evict( SP_CacheItem * keep );
+
+	// return NULL if nothing can be evicted except keep
+	SP_CacheItem * getVictim( const SP_CacheItem * keep );
+	int isProtectedFull() const;
+
+	SP_CacheIndex * mIndex;
+
+	int mPolicy;
+
+	// every put gets the next sequence, items not above mFlushSeq are flushed
+	uint64_t mPutSeq, mFlushSeq;
+	// pending delayed flush, 0 means none
+	time_t mFlushTime;
+
+	int mMaxItems, mCurrItems;
+	size_t mMaxBytes, mBytes;
+
+	// eProbation is the only segment except for eSLRU
+	Segment_t mSegments[ eSegmentCount ];
+
+	// next item to check of every segment, unlink keeps it valid
+	SP_CacheItem * mCrawlPos[ eSegmentCount ];
+
+	size_t mTotalItems, mCmdGet, mCmdSet, mGetHits, mEvictions;
+	size_t mProtectedHits, mPromotions, mDemotions;
+	size_t mReclaimed, mExpiredUnfetched, mCrawlChecked;
+
+	// told about the evictions, set by SP_CacheEx
+	SP_CacheHotKeys * mHotKeys;
+
+	// the records of the changes under lock, in the order they were taken
+	SP_CacheReplLog * mReplLog;
+	struct tagSP_CacheReplRecord * mReplHead, * mReplTail;
+
+	sp_rwlock_t mLock;
 };
 
 class SP_CacheEx {
 public:
-	SP_CacheEx( int algo, int maxItems );
+	// algo : SP_CacheIndex::eHash or a SP_DictCache algorithm
+	// maxItems/maxBytes : 0 means no limit
+	// slabs : allocator for items, can be NULL, owned by SP_CacheEx
+	// policy : see SP_CacheShard
+	SP_CacheEx( int algo, int maxItems, int shardCount = 1, size_t maxBytes = 0,
+			SP_CacheSlabs * slabs = NULL, int policy = SP_CacheShard::eFIFO );
 	~SP_CacheEx();
 
 	// 0 : STORED, -1 : NOT_STORED
@@ -49,40 +185,109 @@ public:
 	// 0 : STORED, -1 : NOT_FOUND, 1 : EXISTS
 	int cas( SP_CacheItem * item, time_t expTime );
 
-	// 0 : STORED, -1 : NOT_SOTRED
+	// 0 : STORED, -1 : NOT_SOTRED, also if the value would be over getMaxItemSize
 	int append( SP_CacheItem * item, time_t expTime );
 
-	// 0 : STORED, -1 : NOT_SOTRED
+	// 0 : STORED, -1 : NOT_SOTRED, also if the value would be over getMaxItemSize
 	int prepend( SP_CacheItem * item, time_t expTime );
 
 	// 0 : DELETED, -1 : NOT_FOUND
-	int erase( const SP_CacheItem * key );
+	int erase( const char * key );
 
+	// expTime : 0 means now, otherwise the items are flushed at expTime
 	int flushAll( time_t expTime );
 
+	// 64-bit unsigned counters, incr wraps around, decr stops at 0.
 	// 0 : OK, -1 : NOT_FOUND, -2 : item is non-numeric value
-	int incr( const SP_CacheItem * key, int delta, int * newValue );
+	int incr( const char * key, uint64_t delta, uint64_t * newValue );
 
 	// 0 : OK, -1 : NOT_FOUND, -2 : item is non-numeric value
-	int decr( const SP_CacheItem * key, int delta, int * newValue );
+	int decr( const char * key, uint64_t delta, uint64_t * newValue );
+
+	// keyList can hold the keys of several gets, a NULL item ends every get
+	// but the last one, each get gets its own END.
+	// withCas : reply the "VALUE" lines of gets
+	void get( SP_ArrayList * keyList, SP_MsgBlockList * blockList, int withCas = 0 );
+
+	// return the item with a reference added, NULL if not found
+	SP_CacheItem * getItem( const char * key );
+
+	// store item as it is, the cas is kept, for snapshots and replicas
+	void restore( SP_CacheItem * item, time_t expTime );
+
+	// the live items of shard index, see SP_CacheShard::pin
+	SP_CacheItem ** pinItems( int index, int * count );
+	int getShardCount() const;
 
-	void get( SP_ArrayList * keyList, SP_MsgBlockList * blockList );
+	// type : NULL for general stats, "slabs", "hotkeys"
+	// 0 : OK, -1 : unknown type
+	int stat( SP_Buffer * buffer, const char * type = NULL );
 
-	void stat( SP_Buffer * buffer );
+	SP_CacheSlabs * getSlabs() const;
+
+	// the largest value accepted by set and the like, and the largest one
+	// append and prepend can make, default is 1m, 0 means no limit
+	void setMaxItemSize( size_t maxItemSize );
+	size_t getMaxItemSize() const;
+
+	// reported by stat, not owned
+	void setQueueStat( SP_CacheQueueStat * queueStat );
+	SP_CacheQueueStat * getQueueStat() const;
+
+	// reported by stat, not owned
+	void setSnapshot( SP_CacheSnapshot * snapshot );
+
+	// every mutation is written to replLog, not owned
+	void setReplLog( SP_CacheReplLog * replLog );
+
+	// reported by stat, not owned
+	void setReplica( SP_CacheReplica * replica );
+
+	// serve the hot keys of get from copies, not owned
+	void setHotKeys( SP_CacheHotKeys * hotKeys );
+
+	// start the expiry crawler thread, every slice locks one shard,
+	// checks at most itemsPerSlice items, then sleeps sliceInterval usec
+	// 0 : OK, -1 : fail
+	int startCrawler( int itemsPerSlice, int sliceInterval );
 
 private:
 
+	// the most keys of a get served without malloc
+	enum { eStackKeys = 64, eStackInts = 256 };
+
+	static sp_thread_result_t SP_THREAD_CALL crawlerThread( void * arg );
+
+	SP_CacheShard * getShard( uint64_t hash ) const;
+
 	// 0 : OK, -1 : NOT_FOUND, -2 : item is non-numeric value
-	int calc( const SP_CacheItem * key, int delta, int isIncr, int * newValue );
+	int calc( const char * key, uint64_t delta, int isIncr, uint64_t * newValue );
 
 	int catbuf( SP_CacheItem * key, time_t expTime, int isAppend );
 
-	SP_DictCache * mCache;
+	// item is stored or the key is erased, under the lock of the shard
+	void onStore( SP_CacheItem * item );
+	void onErase( const char * key, uint64_t hash );
+
+	int mShardCount;
+	SP_CacheShard ** mShards;
+
+	size_t mMaxBytes, mMaxItemSize;
+	int mPolicy;
+
+	SP_CacheSlabs * mSlabs;
+	SP_CacheQueueStat * mQueueStat;
+	SP_CacheSnapshot * mSnapshot;
+	SP_CacheReplLog * mReplLog;
+	SP_CacheReplica * mReplica;
+	SP_CacheHotKeys * mHotKeys;
 
 	time_t mStartTime;
-	size_t mTotalItems, mCmdGet, mCmdSet;
+	volatile int mCmdFlush;
 
-	sp_thread_mutex_t mMutex;
+	// 1 : running, 0 : asked to stop, -1 : stopped
+	volatile int mCrawlerState;
+	int mCrawlItems, mCrawlInterval;
 };
 
 #endif
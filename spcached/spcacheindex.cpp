@@ -0,0 +1,282 @@
+/*
+ * Copyright 2008 Stephen Liu
+ * For license terms, see the file COPYING along with this library.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+
+#include "spcacheindex.hpp"
+#include "spcachemsg.hpp"
+
+SP_CacheIndex * SP_CacheIndex :: newInstance( int algo )
+{
+	if( eHash == algo ) return new SP_CacheHashIndex();
+
+	return new SP_CacheDictIndex( algo );
+}
+
+SP_CacheIndex :: ~SP_CacheIndex()
+{
+}
+
+//---------------------------------------------------------
+
+// marks a removed slot of the old table, keeps the probe chains unbroken
+static char sTombstone;
+#define SP_CACHE_TOMBSTONE ((SP_CacheItem*)&sTombstone)
+
+SP_CacheHashIndex :: SP_CacheHashIndex( int initSize )
+{
+	int size = 16;
+	for( ; size < initSize; ) size = size << 1;
+
+	mTable = (Slot_t*)calloc( size, sizeof( Slot_t ) );
+	mMask = size - 1;
+	mCount = 0;
+
+	mOldTable = NULL;
+	mOldMask = mOldCount = mMigrated = 0;
+}
+
+SP_CacheHashIndex :: ~SP_CacheHashIndex()
+{
+	free( mTable );
+	if( NULL != mOldTable ) free( mOldTable );
+}
+
+int SP_CacheHashIndex :: lookup( Slot_t * table, int mask, const char * key, uint64_t hash )
+{
+	for( int i = (int)( hash & mask ); NULL != table[i].mItem; i = ( i + 1 ) & mask ) {
+		if( table[i].mHash == hash && SP_CACHE_TOMBSTONE != table[i].mItem
+				&& 0 == strcmp( table[i].mItem->getKey(), key ) ) {
+			return i;
+		}
+	}
+
+	return -1;
+}
+
+void SP_CacheHashIndex :: put( Slot_t * table, int mask, uint64_t hash, SP_CacheItem * item )
+{
+	int i = (int)( hash & mask );
+	for( ; NULL != table[i].mItem; ) i = ( i + 1 ) & mask;
+
+	table[i].mHash = hash;
+	table[i].mItem = item;
+}
+
+void SP_CacheHashIndex :: grow()
+{
+	// the previous resize must be done before the next one
+	if( NULL != mOldTable ) migrate( mOldMask + 1 );
+
+	mOldTable = mTable;
+	mOldMask = mMask;
+	mOldCount = mCount;
+	mMigrated = 0;
+
+	mMask = ( mMask << 1 ) | 1;
+	mTable = (Slot_t*)calloc( mMask + 1, sizeof( Slot_t ) );
+	mCount = 0;
+}
+
+void SP_CacheHashIndex :: migrate( int slots )
+{
+	if( NULL == mOldTable ) return;
+
+	for( ; slots > 0 && mMigrated <= mOldMask; slots--, mMigrated++ ) {
+		Slot_t * slot = &( mOldTable[ mMigrated ] );
+
+		if( NULL != slot->mItem && SP_CACHE_TOMBSTONE != slot->mItem ) {
+			put( mTable, mMask, slot->mHash, slot->mItem );
+			mCount++;
+			mOldCount--;
+
+			slot->mItem = SP_CACHE_TOMBSTONE;
+		}
+	}
+
+	if( mMigrated > mOldMask ) {
+		free( mOldTable );
+		mOldTable = NULL;
+		mOldMask = mOldCount = mMigrated = 0;
+	}
+}
+
+SP_CacheItem * SP_CacheHashIndex :: find( const char * key, uint64_t hash )
+{
+	int i = lookup( mTable, mMask, key, hash );
+	if( i >= 0 ) return mTable[i].mItem;
+
+	if( NULL != mOldTable ) {
+		i = lookup( mOldTable, mOldMask, key, hash );
+		if( i >= 0 ) return mOldTable[i].mItem;
+	}
+
+	return NULL;
+}
+
+SP_CacheItem * SP_CacheHashIndex :: insert( SP_CacheItem * item )
+{
+	SP_CacheItem * replaced = NULL;
+
+	migrate( eMigrateSlots );
+
+	const char * key = item->getKey();
+	uint64_t hash = item->getHash();
+
+	if( NULL != mOldTable ) {
+		int i = lookup( mOldTable, mOldMask, key, hash );
+		if( i >= 0 ) {
+			replaced = mOldTable[i].mItem;
+			mOldTable[i].mItem = SP_CACHE_TOMBSTONE;
+			mOldCount--;
+		}
+	}
+
+	int i = lookup( mTable, mMask, key, hash );
+	if( i >= 0 ) {
+		replaced = mTable[i].mItem;
+		mTable[i].mItem = item;
+	} else {
+		// keep the load factor under 1/2
+		if( ( mCount + mOldCount + 1 ) * 2 > mMask + 1 ) grow();
+
+		put( mTable, mMask, hash, item );
+		mCount++;
+	}
+
+	return replaced;
+}
+
+SP_CacheItem * SP_CacheHashIndex :: remove( const char * key, uint64_t hash )
+{
+	SP_CacheItem * item = NULL;
+
+	migrate( eMigrateSlots );
+
+	int i = lookup( mTable, mMask, key, hash );
+
+	if( i >= 0 ) {
+		item = mTable[i].mItem;
+
+		// shift the following slots back, so no tombstone is needed
+		for( int j = ( i + 1 ) & mMask; NULL != mTable[j].mItem; j = ( j + 1 ) & mMask ) {
+			int home = (int)( mTable[j].mHash & mMask );
+			if( ( ( j - home ) & mMask ) >= ( ( j - i ) & mMask ) ) {
+				mTable[i] = mTable[j];
+				i = j;
+			}
+		}
+
+		mTable[i].mItem = NULL;
+		mCount--;
+	} else if( NULL != mOldTable ) {
+		i = lookup( mOldTable, mOldMask, key, hash );
+		if( i >= 0 ) {
+			item = mOldTable[i].mItem;
+			mOldTable[i].mItem = SP_CACHE_TOMBSTONE;
+			mOldCount--;
+		}
+	}
+
+	return item;
+}
+
+int SP_CacheHashIndex :: getCount() const
+{
+	return mCount + mOldCount;
+}
+
+int SP_CacheHashIndex :: isConcurrentFind() const
+{
+	// the migration is done by insert and remove only
+	return 1;
+}
+
+//---------------------------------------------------------
+
+SP_CacheDictIndex :: SP_CacheDictIndex( int algo )
+{
+	// the shard evicts by itself, so the dictionary never reach its limit
+	mCache = SP_DictCache::newInstance( algo, INT_MAX, new SP_CacheItemHandler(), 0 );
+	mCount = 0;
+}
+
+SP_CacheDictIndex :: ~SP_CacheDictIndex()
+{
+	delete mCache;
+}
+
+SP_CacheItem * SP_CacheDictIndex :: find( const char * key, uint64_t hash )
+{
+	SP_CacheItem keyItem( key );
+
+	SP_CacheItem * item = NULL;
+	mCache->get( &keyItem, &item );
+
+	return item;
+}
+
+SP_CacheItem * SP_CacheDictIndex :: insert( SP_CacheItem * item )
+{
+	SP_CacheItem * replaced = (SP_CacheItem*)mCache->remove( item, NULL );
+
+	mCache->put( item, 0 );
+
+	if( NULL == replaced ) mCount++;
+
+	return replaced;
+}
+
+SP_CacheItem * SP_CacheDictIndex :: remove( const char * key, uint64_t hash )
+{
+	SP_CacheItem keyItem( key );
+
+	SP_CacheItem * item = (SP_CacheItem*)mCache->remove( &keyItem, NULL );
+
+	if( NULL != item ) mCount--;
+
+	return item;
+}
+
+int SP_CacheDictIndex :: getCount() const
+{
+	return mCount;
+}
+
+int SP_CacheDictIndex :: isConcurrentFind() const
+{
+	// a get of SP_DictCache moves the item in its lists and counts the
+	// hits in its statistics, so the readers take the exclusive lock
+	return 0;
+}
+
+//---------------------------------------------------------
+
+SP_CacheItemHandler :: SP_CacheItemHandler()
+{
+}
+
+SP_CacheItemHandler :: ~SP_CacheItemHandler()
+{
+}
+
+int SP_CacheItemHandler :: compare( const void * item1, const void * item2 )
+{
+	SP_CacheItem * i1 = (SP_CacheItem*)item1, * i2 = (SP_CacheItem*)item2;
+
+	return strcmp( i1->getKey(), i2->getKey() );
+}
+
+void SP_CacheItemHandler :: destroy( void * item )
+{
+}
+
+void SP_CacheItemHandler :: onHit( const void * item, void * resultHolder )
+{
+	if( NULL != resultHolder ) *(SP_CacheItem**)resultHolder = (SP_CacheItem*)item;
+}
+
@@ -0,0 +1,110 @@
+/*
+ * Copyright 2008 Stephen Liu
+ * For license terms, see the file COPYING along with this library.
+ */
+
+#ifndef __spcacheindex_hpp__
+#define __spcacheindex_hpp__
+
+#include <stdint.h>
+
+#include "spdict/spdictcache.hpp"
+
+class SP_CacheItem;
+
+// key -> item lookup of one shard, not thread safe
+// the index never adds or releases references of the items
+class SP_CacheIndex {
+public:
+	// eHash : SP_CacheHashIndex, other values are SP_DictCache algorithms
+	enum { eHash = 0x100 };
+
+	static SP_CacheIndex * newInstance( int algo );
+
+	virtual ~SP_CacheIndex();
+
+	// return NULL if not found
+	virtual SP_CacheItem * find( const char * key, uint64_t hash ) = 0;
+
+	// return the replaced item with the same key, NULL if none
+	virtual SP_CacheItem * insert( SP_CacheItem * item ) = 0;
+
+	// return the removed item, NULL if not found
+	virtual SP_CacheItem * remove( const char * key, uint64_t hash ) = 0;
+
+	virtual int getCount() const = 0;
+
+	// 1 : find changes nothing, so it can run in several threads at once
+	virtual int isConcurrentFind() const = 0;
+};
+
+// open addressing with linear probing, the slots keep the key hash,
+// so a mismatch never touches the item.
+// The table grows incrementally, every call moves a few slots
+// from the old table, so a resize never stalls the caller.
+class SP_CacheHashIndex : public SP_CacheIndex {
+public:
+	SP_CacheHashIndex( int initSize = 1024 );
+	virtual ~SP_CacheHashIndex();
+
+	virtual SP_CacheItem * find( const char * key, uint64_t hash );
+	virtual SP_CacheItem * insert( SP_CacheItem * item );
+	virtual SP_CacheItem * remove( const char * key, uint64_t hash );
+	virtual int getCount() const;
+	virtual int isConcurrentFind() const;
+
+private:
+	typedef struct tagSlot {
+		uint64_t mHash;
+		SP_CacheItem * mItem;
+	} Slot_t;
+
+	enum { eMigrateSlots = 16 };
+
+	static int lookup( Slot_t * table, int mask, const char * key, uint64_t hash );
+	static void put( Slot_t * table, int mask, uint64_t hash, SP_CacheItem * item );
+
+	void grow();
+	void migrate( int slots );
+
+	Slot_t * mTable;
+	int mMask, mCount;
+
+	// the old table during resize, removed slots become tombstones
+	Slot_t * mOldTable;
+	int mOldMask, mOldCount, mMigrated;
+};
+
+// the existing SP_DictCache algorithms behind SP_CacheIndex
+class SP_CacheDictIndex : public SP_CacheIndex {
+public:
+	SP_CacheDictIndex( int algo );
+	virtual ~SP_CacheDictIndex();
+
+	virtual SP_CacheItem * find( const char * key, uint64_t hash );
+	virtual SP_CacheItem * insert( SP_CacheItem * item );
+	virtual SP_CacheItem * remove( const char * key, uint64_t hash );
+	virtual int getCount() const;
+	virtual int isConcurrentFind() const;
+
+private:
+	SP_DictCache * mCache;
+	int mCount;
+};
+
+class SP_CacheItemHandler : public SP_DictCacheHandler {
+public:
+	SP_CacheItemHandler();
+	virtual ~SP_CacheItemHandler();
+
+	virtual int compare( const void * item1, const void * item2 );
+
+	// items are owned by the shard, nothing to do
+	virtual void destroy( void * item );
+
+	// resultHolder is a SP_CacheItem **
+	virtual void onHit( const void * item, void * resultHolder );
+};
+
+#endif
+
@@ -0,0 +1,94 @@
+/*
+ * Copyright 2008 Stephen Liu
+ * For license terms, see the file COPYING along with this library.
+ */
+
+#ifndef __spcachelock_hpp__
+#define __spcachelock_hpp__
+
+// reader/writer lock, several readers or one writer
+
+#ifdef WIN32
+
+#include <windows.h>
+
+// SRW locks need Vista, so a critical section serves both modes
+typedef CRITICAL_SECTION sp_rwlock_t;
+
+inline int sp_rwlock_init( sp_rwlock_t * lock )
+{
+	InitializeCriticalSection( lock );
+	return 0;
+}
+
+inline int sp_rwlock_destroy( sp_rwlock_t * lock )
+{
+	DeleteCriticalSection( lock );
+	return 0;
+}
+
+inline int sp_rwlock_rdlock( sp_rwlock_t * lock )
+{
+	EnterCriticalSection( lock );
+	return 0;
+}
+
+inline int sp_rwlock_wrlock( sp_rwlock_t * lock )
+{
+	EnterCriticalSection( lock );
+	return 0;
+}
+
+inline int sp_rwlock_unlock( sp_rwlock_t * lock )
+{
+	LeaveCriticalSection( lock );
+	return 0;
+}
+
+#else
+
+#include <pthread.h>
+
+typedef pthread_rwlock_t sp_rwlock_t;
+
+inline int sp_rwlock_init( sp_rwlock_t * lock )
+{
+	pthread_rwlockattr_t attr;
+	pthread_rwlockattr_init( &attr );
+
+#ifdef __GLIBC__
+	// the readers come 20 times as often, don't let them starve the writers
+	pthread_rwlockattr_setkind_np( &attr, PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP );
+#endif
+
+	int ret = pthread_rwlock_init( lock, &attr );
+
+	pthread_rwlockattr_destroy( &attr );
+
+	return ret;
+}
+
+inline int sp_rwlock_destroy( sp_rwlock_t * lock )
+{
+	return pthread_rwlock_destroy( lock );
+}
+
+inline int sp_rwlock_rdlock( sp_rwlock_t * lock )
+{
+	return pthread_rwlock_rdlock( lock );
+}
+
+inline int sp_rwlock_wrlock( sp_rwlock_t * lock )
+{
+	return pthread_rwlock_wrlock( lock );
+}
+
+inline int sp_rwlock_unlock( sp_rwlock_t * lock )
+{
+	return pthread_rwlock_unlock( lock );
+}
+
+#endif
+
+#endif
+
@@ -0,0 +1,728 @@
+/*
+ * Copyright 2008 Stephen Liu
+ * For license terms, see the file COPYING along with this library.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#ifdef __linux__
+#include <sched.h>
+#endif
+
+#include <event.h>
+
+#include "spserver/spporting.hpp"
+#include "spserver/spthread.hpp"
+#include "spserver/spioutils.hpp"
+#include "spserver/spbuffer.hpp"
+#include "spserver/sputils.hpp"
+#include "spserver/sprequest.hpp"
+#include "spserver/spresponse.hpp"
+#include "spserver/spmsgblock.hpp"
+#include "spserver/spmsgdecoder.hpp"
+#include "spserver/sphandler.hpp"
+
+#include "spcachemr.hpp"
+#include "spcacheatomic.hpp"
+
+typedef struct tagSP_CacheSession {
+	int mFd;
+	SP_Sid_t mSid;
+
+	// only one of them is pending, no read while replies are waiting
+	struct event mReadEvent;
+	struct event mWriteEvent;
+
+	SP_CacheReactor * mReactor;
+	SP_Request * mRequest;
+	SP_Handler * mHandler;
+	SP_Buffer * mInBuffer;
+
+	// messages waiting for the socket, the head one is written from mOutOffset
+	SP_ArrayList * mOutList;
+	size_t mOutOffset;
+
+	int mToClose;
+
+	struct tagSP_CacheSession * mPrev, * mNext;
+} SP_CacheSession_t;
+
+class SP_CacheReactor {
+public:
+	SP_CacheReactor( SP_CacheMRServer * server, int index );
+	~SP_CacheReactor();
+
+	// 0 : OK, -1 : cannot create the event base
+	int init();
+
+	// owner : the listener is closed with the reactor
+	void setListenFd( int fd, int owner );
+	int getListenFd() const;
+
+	// 0 : OK, -1 : cannot create the thread
+	int start();
+
+	// the loop exits after the current round
+	void stop();
+
+private:
+	enum { eReadSize = 16 * 1024, eMaxReads = 16, eMaxAccepts = 64, eMaxIov = 64 };
+
+	static sp_thread_result_t SP_THREAD_CALL loopThread( void * arg );
+
+	static void onAccept( int fd, short events, void * arg );
+	static void onRead( int fd, short events, void * arg );
+	static void onWrite( int fd, short events, void * arg );
+	static void onWakeup( int fd, short events, void * arg );
+
+	void addSession( int fd );
+	void closeSession( SP_CacheSession_t * session );
+
+	// decode and handle the complete requests in the input buffer
+	// isFilled : a value was read into its item by SP_CacheValueReader
+	void process( SP_CacheSession_t * session, int isFilled );
+
+	// move the messages of the response to the out list of the session
+	void takeReplies( SP_CacheSession_t * session, SP_Response * response );
+
+	// 0 : all written, 1 : socket is full, -1 : error
+	int flush( SP_CacheSession_t * session );
+
+	// write what is pending, then wait for the socket or the next request
+	void update( SP_CacheSession_t * session );
+
+	SP_CacheMRServer * mServer;
+	int mIndex;
+
+	struct event_base * mBase;
+
+	int mListenFd;
+	int mOwnListenFd;
+	struct event mAcceptEvent;
+
+	// stop() writes to mWakeupFds[1], so the loop breaks on its own thread
+	int mWakeupFds[ 2 ];
+	struct event mWakeupEvent;
+
+	SP_CacheSession_t * mSessions;
+};
+
+//---------------------------------------------------------------------------
+
+// skip the bytes already written, empty pieces are not added
+static void sp_mr_addiov( struct iovec * iov, int * count, size_t * skip,
+		const void * data, size_t size )
+{
+	if( *skip >= size ) {
+		*skip -= size;
+		return;
+	}
+
+	iov[ *count ].iov_base = (char*)data + *skip;
+	iov[ *count ].iov_len = size - *skip;
+	( *count )++;
+
+	*skip = 0;
+}
+
+static size_t sp_mr_msgsize( SP_Message * msg )
+{
+	size_t size = msg->getMsg()->getSize();
+
+	SP_MsgBlockList * blockList = msg->getFollowBlockList();
+	for( int i = 0; i < blockList->getCount(); i++ ) {
+		size += blockList->getItem( i )->getSize();
+	}
+
+	return size;
+}
+
+// reusePort : in, try SO_REUSEPORT; out, 0 if the kernel refused it
+static int sp_mr_listen( const char * ip, int port, int backlog, int * reusePort, int * fd )
+{
+	int listenFd = socket( AF_INET, SOCK_STREAM, 0 );
+	if( listenFd < 0 ) {
+		sp_syslog( LOG_WARNING, "socket failed, errno %d, %s", errno, strerror( errno ) );
+		return -1;
+	}
+
+	int flags = 1;
+	setsockopt( listenFd, SOL_SOCKET, SO_REUSEADDR, (char*)&flags, sizeof( flags ) );
+
+#ifdef SO_REUSEPORT
+	if( *reusePort && 0 != setsockopt( listenFd, SOL_SOCKET, SO_REUSEPORT,
+			(char*)&flags, sizeof( flags ) ) ) {
+		sp_syslog( LOG_NOTICE, "SO_REUSEPORT is not supported, the listener is shared" );
+		*reusePort = 0;
+	}
+#else
+	*reusePort = 0;
+#endif
+
+	struct sockaddr_in addr;
+	memset( &addr, 0, sizeof( addr ) );
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons( port );
+	addr.sin_addr.s_addr = INADDR_ANY;
+	if( '\0' != *ip ) addr.sin_addr.s_addr = inet_addr( ip );
+
+	if( 0 != bind( listenFd, (struct sockaddr*)&addr, sizeof( addr ) )
+			|| 0 != listen( listenFd, backlog ) ) {
+		sp_syslog( LOG_WARNING, "listen on %s:%d failed, errno %d, %s",
+				ip, port, errno, strerror( errno ) );
+		sp_close( listenFd );
+		return -1;
+	}
+
+	SP_IOUtils::setNonblock( listenFd );
+
+	*fd = listenFd;
+
+	return 0;
+}
+
+//---------------------------------------------------------------------------
+
+SP_CacheReactor :: SP_CacheReactor( SP_CacheMRServer * server, int index )
+{
+	mServer = server;
+	mIndex = index;
+
+	mBase = NULL;
+
+	mListenFd = -1;
+	mOwnListenFd = 0;
+
+	mWakeupFds[0] = mWakeupFds[1] = -1;
+
+	// event_del is safe on the events which are never added
+	memset( &mAcceptEvent, 0, sizeof( mAcceptEvent ) );
+	memset( &mWakeupEvent, 0, sizeof( mWakeupEvent ) );
+
+	mSessions = NULL;
+}
+
+SP_CacheReactor :: ~SP_CacheReactor()
+{
+	for( ; NULL != mSessions; ) closeSession( mSessions );
+
+	if( NULL != mBase ) {
+		event_del( &mAcceptEvent );
+		event_del( &mWakeupEvent );
+		event_base_free( mBase );
+	}
+
+	if( mOwnListenFd && mListenFd >= 0 ) sp_close( mListenFd );
+
+	if( mWakeupFds[0] >= 0 ) sp_close( mWakeupFds[0] );
+	if( mWakeupFds[1] >= 0 ) sp_close( mWakeupFds[1] );
+}
+
+int SP_CacheReactor :: init()
+{
+	if( 0 != sp_socketpair( AF_UNIX, SOCK_STREAM, 0, mWakeupFds ) ) {
+		sp_syslog( LOG_WARNING, "socketpair failed, errno %d, %s", errno, strerror( errno ) );
+		return -1;
+	}
+
+	mBase = (struct event_base*)event_base_new();
+	if( NULL == mBase ) return -1;
+
+	event_set( &mWakeupEvent, mWakeupFds[0], EV_READ | EV_PERSIST, onWakeup, this );
+	event_base_set( mBase, &mWakeupEvent );
+	event_add( &mWakeupEvent, NULL );
+
+	return 0;
+}
+
+void SP_CacheReactor :: setListenFd( int fd, int owner )
+{
+	mListenFd = fd;
+	mOwnListenFd = owner;
+}
+
+int SP_CacheReactor :: getListenFd() const
+{
+	return mListenFd;
+}
+
+int SP_CacheReactor :: start()
+{
+	event_set( &mAcceptEvent, mListenFd, EV_READ | EV_PERSIST, onAccept, this );
+	event_base_set( mBase, &mAcceptEvent );
+	event_add( &mAcceptEvent, NULL );
+
+	sp_thread_attr_t attr;
+	sp_thread_attr_init( &attr );
+	sp_thread_attr_setdetachstate( &attr, SP_THREAD_CREATE_DETACHED );
+
+	sp_thread_t thread;
+	int ret = sp_thread_create( &thread, &attr, loopThread, this );
+	sp_thread_attr_destroy( &attr );
+
+	return 0 == ret ? 0 : -1;
+}
+
+void SP_CacheReactor :: stop()
+{
+	char ch = 0;
+	if( write( mWakeupFds[1], &ch, 1 ) < 0 ) {
+		sp_syslog( LOG_WARNING, "cannot wake up reactor #%d", mIndex );
+	}
+}
+
+sp_thread_result_t SP_THREAD_CALL SP_CacheReactor :: loopThread( void * arg )
+{
+	SP_CacheReactor * reactor = (SP_CacheReactor*)arg;
+	SP_CacheMRServer * server = reactor->mServer;
+
+#ifdef __linux__
+	if( server->mCpuAffinity ) {
+		int cpus = (int)sysconf( _SC_NPROCESSORS_ONLN );
+
+		cpu_set_t cpuSet;
+		CPU_ZERO( &cpuSet );
+		CPU_SET( reactor->mIndex % ( cpus > 0 ? cpus : 1 ), &cpuSet );
+
+		if( 0 != pthread_setaffinity_np( pthread_self(), sizeof( cpuSet ), &cpuSet ) ) {
+			sp_syslog( LOG_NOTICE, "cannot pin reactor #%d to a cpu", reactor->mIndex );
+		}
+	}
+#endif
+
+	event_base_dispatch( reactor->mBase );
+
+	// the sessions belong to this thread, close them here
+	for( ; NULL != reactor->mSessions; ) reactor->closeSession( reactor->mSessions );
+
+	sp_atomic_dec( &server->mRunning );
+
+	return 0;
+}
+
+void SP_CacheReactor :: onWakeup( int fd, short events, void * arg )
+{
+	SP_CacheReactor * reactor = (SP_CacheReactor*)arg;
+
+	char ch = 0;
+	if( read( fd, &ch, 1 ) >= 0 ) event_base_loopbreak( reactor->mBase );
+}
+
+void SP_CacheReactor :: onAccept( int fd, short events, void * arg )
+{
+	SP_CacheReactor * reactor = (SP_CacheReactor*)arg;
+
+	// without SO_REUSEPORT the other reactors race for the same listener
+	for( int i = 0; i < eMaxAccepts; i++ ) {
+		struct sockaddr_in addr;
+		socklen_t addrLen = sizeof( addr );
+
+		int clientFd = accept( fd, (struct sockaddr*)&addr, &addrLen );
+		if( clientFd < 0 ) {
+			if( EAGAIN != errno && EWOULDBLOCK != errno && EINTR != errno ) {
+				sp_syslog( LOG_WARNING, "accept failed, errno %d, %s", errno, strerror( errno ) );
+			}
+			break;
+		}
+
+		SP_CacheMRServer * server = reactor->mServer;
+
+		if( server->mMaxConnections > 0
+				&& sp_atomic_inc( &server->mConnections ) > server->mMaxConnections ) {
+			sp_atomic_dec( &server->mConnections );
+
+			// best effort, the socket buffer is empty
+			if( send( clientFd, server->mRefusedMsg, strlen( server->mRefusedMsg ), 0 ) < 0 ) {
+				sp_syslog( LOG_NOTICE, "cannot refuse a session, errno %d", errno );
+			}
+			sp_close( clientFd );
+			continue;
+		}
+
+		reactor->addSession( clientFd );
+	}
+}
+
+void SP_CacheReactor :: addSession( int fd )
+{
+	SP_IOUtils::setNonblock( fd );
+
+	int flags = 1;
+	setsockopt( fd, IPPROTO_TCP, TCP_NODELAY, (char*)&flags, sizeof( flags ) );
+
+	SP_CacheSession_t * session = (SP_CacheSession_t*)calloc( 1, sizeof( SP_CacheSession_t ) );
+
+	session->mFd = fd;
+	session->mSid.mKey = mIndex;
+	session->mSid.mSeq = fd;
+	session->mReactor = this;
+	session->mRequest = new SP_Request();
+	session->mHandler = mServer->mHandlerFactory->create();
+	session->mInBuffer = new SP_Buffer();
+	session->mOutList = new SP_ArrayList();
+
+	event_set( &session->mReadEvent, fd, EV_READ, onRead, session );
+	event_base_set( mBase, &session->mReadEvent );
+	event_set( &session->mWriteEvent, fd, EV_WRITE, onWrite, session );
+	event_base_set( mBase, &session->mWriteEvent );
+
+	session->mNext = mSessions;
+	if( NULL != mSessions ) mSessions->mPrev = session;
+	mSessions = session;
+
+	SP_Response response( session->mSid );
+	if( 0 != session->mHandler->start( session->mRequest, &response ) ) session->mToClose = 1;
+	takeReplies( session, &response );
+
+	update( session );
+}
+
+void SP_CacheReactor :: closeSession( SP_CacheSession_t * session )
+{
+	event_del( &session->mReadEvent );
+	event_del( &session->mWriteEvent );
+
+	session->mHandler->close();
+	delete session->mHandler;
+	delete session->mRequest;
+	delete session->mInBuffer;
+
+	for( ; session->mOutList->getCount() > 0; ) {
+		delete (SP_Message*)session->mOutList->takeItem( SP_ArrayList::LAST_INDEX );
+	}
+	delete session->mOutList;
+
+	sp_close( session->mFd );
+
+	if( mServer->mMaxConnections > 0 ) sp_atomic_dec( &mServer->mConnections );
+
+	if( NULL != session->mPrev ) session->mPrev->mNext = session->mNext;
+	if( NULL != session->mNext ) session->mNext->mPrev = session->mPrev;
+	if( mSessions == session ) mSessions = session->mNext;
+
+	free( session );
+}
+
+void SP_CacheReactor :: onRead( int fd, short events, void * arg )
+{
+	SP_CacheSession_t * session = (SP_CacheSession_t*)arg;
+	SP_CacheReactor * reactor = session->mReactor;
+
+	if( events & EV_TIMEOUT ) {
+		SP_Response response( session->mSid );
+		session->mHandler->timeout( &response );
+		reactor->takeReplies( session, &response );
+
+		// best effort, the session is closed anyway
+		reactor->flush( session );
+		reactor->closeSession( session );
+		return;
+	}
+
+	int isEof = 0, isFilled = 0;
+
+	for( int i = 0; i < eMaxReads; i++ ) {
+		// a large value in progress is read into its item, not copied through
+		// the input buffer, only when nothing is waiting in the buffer before it
+		SP_CacheValueReader * reader = NULL;
+		if( session->mInBuffer->getSize() <= 0 ) {
+			reader = dynamic_cast<SP_CacheValueReader*>( session->mRequest->getMsgDecoder() );
+		}
+
+		size_t bytes = 0;
+		void * space = NULL == reader ? NULL : reader->getValueSpace( &bytes );
+
+		if( NULL != space && bytes >= eReadSize ) {
+			int len = recv( fd, space, bytes, 0 );
+			if( len > 0 ) {
+				reader->fillValue( len );
+				isFilled = 1;
+				if( len < (int)bytes ) break;
+				continue;
+			}
+			if( 0 == len || ( EAGAIN != errno && EWOULDBLOCK != errno && EINTR != errno ) ) {
+				isEof = 1;
+			}
+			break;
+		}
+
+		char buffer[ eReadSize ];
+
+		int len = recv( fd, buffer, sizeof( buffer ), 0 );
+		if( len > 0 ) {
+			session->mInBuffer->append( buffer, len );
+			if( len < (int)sizeof( buffer ) ) break;
+		} else {
+			if( 0 == len || ( EAGAIN != errno && EWOULDBLOCK != errno && EINTR != errno ) ) {
+				isEof = 1;
+			}
+			break;
+		}
+	}
+
+	// the requests before the eof are still served
+	reactor->process( session, isFilled );
+
+	if( isEof ) {
+		SP_Response response( session->mSid );
+		session->mHandler->error( &response );
+
+		reactor->flush( session );
+		reactor->closeSession( session );
+	} else {
+		reactor->update( session );
+	}
+}
+
+void SP_CacheReactor :: onWrite( int fd, short events, void * arg )
+{
+	SP_CacheSession_t * session = (SP_CacheSession_t*)arg;
+	SP_CacheReactor * reactor = session->mReactor;
+
+	if( events & EV_TIMEOUT ) {
+		reactor->closeSession( session );
+	} else {
+		reactor->update( session );
+	}
+}
+
+void SP_CacheReactor :: process( SP_CacheSession_t * session, int isFilled )
+{
+	// a value read into its item is decoded even without any input
+	for( int i = 0; 0 == session->mToClose
+			&& ( session->mInBuffer->getSize() > 0 || ( 0 == i && isFilled ) ); i++ ) {
+		// the handler may replace the decoder
+		SP_MsgDecoder * decoder = session->mRequest->getMsgDecoder();
+		if( SP_MsgDecoder::eOK != decoder->decode( session->mInBuffer ) ) break;
+
+		SP_Response response( session->mSid );
+		if( 0 != session->mHandler->handle( session->mRequest, &response ) ) {
+			session->mToClose = 1;
+		}
+		takeReplies( session, &response );
+	}
+}
+
+void SP_CacheReactor :: takeReplies( SP_CacheSession_t * session, SP_Response * response )
+{
+	for( SP_Message * msg = response->takeMessage(); NULL != msg;
+			msg = response->takeMessage() ) {
+		if( sp_mr_msgsize( msg ) > 0 ) {
+			session->mOutList->append( msg );
+		} else {
+			delete msg;
+		}
+	}
+}
+
+int SP_CacheReactor :: flush( SP_CacheSession_t * session )
+{
+	SP_ArrayList * outList = session->mOutList;
+
+	for( ; outList->getCount() > 0; ) {
+		struct iovec iov[ eMaxIov ];
+		int count = 0;
+		size_t skip = session->mOutOffset, total = 0;
+
+		for( int i = 0; i < outList->getCount() && count < eMaxIov; i++ ) {
+			SP_Message * msg = (SP_Message*)outList->getItem( i );
+
+			SP_Buffer * buffer = msg->getMsg();
+			sp_mr_addiov( iov, &count, &skip, buffer->getBuffer(), buffer->getSize() );
+
+			SP_MsgBlockList * blockList = msg->getFollowBlockList();
+			for( int j = 0; j < blockList->getCount() && count < eMaxIov; j++ ) {
+				const SP_MsgBlock * block = blockList->getItem( j );
+				sp_mr_addiov( iov, &count, &skip, block->getData(), block->getSize() );
+			}
+		}
+
+		for( int i = 0; i < count; i++ ) total += iov[i].iov_len;
+
+		int len = sp_writev( session->mFd, iov, count );
+		if( len < 0 ) {
+			if( EINTR == errno ) continue;
+			return ( EAGAIN == errno || EWOULDBLOCK == errno ) ? 1 : -1;
+		}
+
+		// drop the messages which are written out
+		session->mOutOffset += len;
+		for( ; outList->getCount() > 0; ) {
+			SP_Message * msg = (SP_Message*)outList->getItem( 0 );
+			size_t size = sp_mr_msgsize( msg );
+			if( session->mOutOffset < size ) break;
+
+			session->mOutOffset -= size;
+			delete (SP_Message*)outList->takeItem( 0 );
+		}
+
+		if( (size_t)len < total ) return 1;
+	}
+
+	return 0;
+}
+
+void SP_CacheReactor :: update( SP_CacheSession_t * session )
+{
+	int ret = flush( session );
+
+	if( ret < 0 || ( 0 == ret && session->mToClose ) ) {
+		closeSession( session );
+		return;
+	}
+
+	struct timeval timeout;
+	timeout.tv_sec = mServer->mTimeout;
+	timeout.tv_usec = 0;
+
+	struct timeval * tv = mServer->mTimeout > 0 ? &timeout : NULL;
+
+	if( ret > 0 ) {
+		event_add( &session->mWriteEvent, tv );
+	} else {
+		event_add( &session->mReadEvent, tv );
+	}
+}
+
+//---------------------------------------------------------------------------
+
+SP_CacheMRServer :: SP_CacheMRServer( const char * bindIP, int port,
+		SP_HandlerFactory * handlerFactory )
+{
+	sp_strlcpy( mBindIP, bindIP, sizeof( mBindIP ) );
+	mPort = port;
+	mHandlerFactory = handlerFactory;
+
+	mTimeout = 0;
+	mMaxThreads = 0;
+	mCpuAffinity = 1;
+	mBacklog = 1024;
+
+	mMaxConnections = 0;
+	mRefusedMsg = strdup( "SERVER_ERROR Too many connections\r\n" );
+	mConnections = 0;
+
+	mReactors = NULL;
+	mReactorCount = 0;
+
+	mRunning = 0;
+}
+
+SP_CacheMRServer :: ~SP_CacheMRServer()
+{
+	shutdown();
+
+	for( ; isRunning(); ) sp_sleep( 1 );
+
+	for( int i = 0; i < mReactorCount; i++ ) delete mReactors[i];
+	free( mReactors );
+	free( mRefusedMsg );
+
+	delete mHandlerFactory;
+}
+
+void SP_CacheMRServer :: setTimeout( int timeout )
+{
+	mTimeout = timeout > 0 ? timeout : 0;
+}
+
+void SP_CacheMRServer :: setMaxThreads( int maxThreads )
+{
+	mMaxThreads = maxThreads > 0 ? maxThreads : 0;
+}
+
+void SP_CacheMRServer :: setCpuAffinity( int cpuAffinity )
+{
+	mCpuAffinity = cpuAffinity;
+}
+
+void SP_CacheMRServer :: setMaxConnections( int maxConnections, const char * refusedMsg )
+{
+	mMaxConnections = maxConnections > 0 ? maxConnections : 0;
+
+	if( NULL != refusedMsg ) {
+		free( mRefusedMsg );
+		mRefusedMsg = strdup( refusedMsg );
+	}
+}
+
+void SP_CacheMRServer :: setBacklog( int backlog )
+{
+	mBacklog = backlog > 0 ? backlog : 1024;
+}
+
+void SP_CacheMRServer :: shutdown()
+{
+	for( int i = 0; i < mReactorCount; i++ ) mReactors[i]->stop();
+}
+
+int SP_CacheMRServer :: isRunning()
+{
+	return mRunning > 0;
+}
+
+int SP_CacheMRServer :: run()
+{
+	if( NULL != mReactors ) return -1;
+
+	int count = mMaxThreads;
+	if( count <= 0 ) count = (int)sysconf( _SC_NPROCESSORS_ONLN );
+	if( count <= 0 ) count = 1;
+
+	mReactors = (SP_CacheReactor**)calloc( count, sizeof( SP_CacheReactor * ) );
+
+	signal( SIGPIPE, SIG_IGN );
+
+	int reusePort = 1;
+
+	for( int i = 0; i < count; i++ ) {
+		SP_CacheReactor * reactor = new SP_CacheReactor( this, i );
+		mReactors[ mReactorCount++ ] = reactor;
+
+		if( 0 != reactor->init() ) return -1;
+
+		// one listener for every reactor, or all of them share the first one
+		if( 0 == i || reusePort ) {
+			int fd = -1;
+			if( 0 != sp_mr_listen( mBindIP, mPort, mBacklog, &reusePort, &fd ) ) return -1;
+			reactor->setListenFd( fd, 1 );
+		} else {
+			reactor->setListenFd( mReactors[0]->getListenFd(), 0 );
+		}
+	}
+
+	for( int i = 0; i < mReactorCount; i++ ) {
+		sp_atomic_inc( &mRunning );
+
+		if( 0 != mReactors[i]->start() ) {
+			sp_atomic_dec( &mRunning );
+			sp_syslog( LOG_WARNING, "cannot start reactor #%d", i );
+			shutdown();
+			return -1;
+		}
+	}
+
+	sp_syslog( LOG_NOTICE, "Listen on port [%d], %d reactors%s", mPort, mReactorCount,
+			reusePort ? " with SO_REUSEPORT" : "" );
+
+	return 0;
+}
+
+void SP_CacheMRServer :: runForever()
+{
+	if( 0 != run() ) return;
+
+	for( ; isRunning(); ) sp_sleep( 1 );
+}
+
@@ -0,0 +1,81 @@
+/*
+ * Copyright 2008 Stephen Liu
+ * For license terms, see the file COPYING along with this library.
+ */
+
+#ifndef __spcachemr_hpp__
+#define __spcachemr_hpp__
+
+#include <sys/types.h>
+
+class SP_HandlerFactory;
+class SP_CacheReactor;
+
+// a decoder which lets the reactor read a large value in progress from
+// the socket straight into its item, the other input goes to the buffer
+class SP_CacheValueReader {
+public:
+	virtual ~SP_CacheValueReader() {}
+
+	// room for the next bytes of the value in progress, at most the bytes
+	// left of the value. Return NULL if no value is in progress
+	virtual void * getValueSpace( size_t * bytes ) = 0;
+
+	// bytes were read into the value space, the next decode completes
+	// the request if the value is done
+	virtual void fillValue( size_t bytes ) = 0;
+};
+
+// multi-reactor server, every thread runs its own event loop and listener,
+// the requests are handled inline on the thread which reads them
+class SP_CacheMRServer {
+public:
+	SP_CacheMRServer( const char * bindIP, int port, SP_HandlerFactory * handlerFactory );
+	~SP_CacheMRServer();
+
+	// seconds a session may be idle, 0 means no timeout
+	void setTimeout( int timeout );
+
+	// count of the event loops, 0 means one for every online cpu
+	void setMaxThreads( int maxThreads );
+
+	// pin the event loops to the cpus, default is on
+	void setCpuAffinity( int cpuAffinity );
+
+	// the sessions over it are refused with refusedMsg, 0 means no limit
+	void setMaxConnections( int maxConnections, const char * refusedMsg = NULL );
+
+	// backlog of every listener, default is 1024
+	void setBacklog( int backlog );
+
+	void shutdown();
+	int isRunning();
+
+	// 0 : OK, -1 : cannot listen or start the loops
+	int run();
+	void runForever();
+
+private:
+	friend class SP_CacheReactor;
+
+	char mBindIP[ 64 ];
+	int mPort;
+	SP_HandlerFactory * mHandlerFactory;
+
+	int mTimeout;
+	int mMaxThreads;
+	int mCpuAffinity;
+	int mBacklog;
+
+	int mMaxConnections;
+	char * mRefusedMsg;
+	volatile int mConnections;
+
+	SP_CacheReactor ** mReactors;
+	int mReactorCount;
+
+	volatile int mRunning;
+};
+
+#endif
+
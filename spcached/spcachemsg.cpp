@@ -6,15 +6,83 @@
 #include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
+#include <ctype.h>
+#include <assert.h>
+#include <new>
 
 #include "spcachemsg.hpp"
+#include "spcacheslab.hpp"
+#include "spcacheatomic.hpp"
 #include "spserver/spbuffer.hpp"
 #include "spserver/sputils.hpp"
 
+SP_CacheItem * SP_CacheItem :: newInstance( SP_CacheSlabs * slabs,
+		const char * key, size_t blockCapacity )
+{
+	size_t keyBytes = strlen( key ) + 1;
+
+	int chunked = ( blockCapacity > eChunkSize );
+
+	size_t totalBytes = sizeof( SP_CacheItem ) + keyBytes + ( chunked ? 0 : blockCapacity + 1 );
+
+	int slabClass = -1;
+	void * chunk = NULL;
+
+	if( NULL != slabs ) {
+		slabClass = slabs->getClass( totalBytes );
+		if( slabClass >= 0 ) chunk = slabs->alloc( slabClass );
+	}
+
+	if( NULL == chunk ) {
+		slabClass = -1;
+		chunk = malloc( totalBytes );
+	}
+
+	SP_CacheItem * item = new( chunk ) SP_CacheItem();
+
+	item->mSlabs = slabs;
+	item->mSlabClass = slabClass;
+	item->mFlags = eChunk | eInlineKey | ( chunked ? eChunkedData : eInlineData );
+
+	item->mKey = (char*)( item + 1 );
+	memcpy( item->mKey, key, keyBytes );
+	item->mHash = hashKey( key );
+
+	if( chunked ) {
+		item->reserveChunks( blockCapacity );
+	} else {
+		item->mDataBlock = item->mKey + keyBytes;
+		item->mBlockCapacity = blockCapacity;
+		((char*)item->mDataBlock)[ 0 ] = '\0';
+	}
+
+	return item;
+}
+
+uint64_t SP_CacheItem :: hashKey( const char * key )
+{
+	// FNV-1a, then the murmur3 finalizer to mix the high bits
+	uint64_t hash = 14695981039346656037ULL;
+
+	for( ; '\0' != *key; key++ ) {
+		hash ^= (unsigned char)*key;
+		hash *= 1099511628211ULL;
+	}
+
+	hash ^= hash >> 33;
+	hash *= 0xff51afd7ed558ccdULL;
+	hash ^= hash >> 33;
+	hash *= 0xc4ceb9fe1a85ec53ULL;
+	hash ^= hash >> 33;
+
+	return hash;
+}
+
 SP_CacheItem :: SP_CacheItem( const char * key )
 {
 	init();
 	mKey = strdup( key );
+	mHash = hashKey( key );
 }
 
 SP_CacheItem :: SP_CacheItem()
@@ -24,54 +92,94 @@ SP_CacheItem :: SP_CacheItem()
 
 void SP_CacheItem :: init()
 {
+	mSlabs = NULL;
+	mSlabClass = -1;
+	mFlags = 0;
+
 	mKey = NULL;
+	mHash = 0;
+
+	mExpTime = 0;
 
 	mDataBlock = NULL;
 	mDataBytes = mBlockCapacity = 0;
 
+	mChunks = NULL;
+	mChunkCount = 0;
+
 	mRefCount = 1;
 
 	mCasUnique = 0;
+	mClientFlags = 0;
 
-	sp_thread_mutex_init( &mMutex, NULL );
+	mPrev = mNext = NULL;
+	mSegment = mActive = mFetched = 0;
+	mAccessTime = 0;
+	mPutSeq = 0;
 }
 
 SP_CacheItem :: ~SP_CacheItem()
 {
-	if( NULL != mKey ) free( mKey );
+	if( NULL != mKey && 0 == ( mFlags & eInlineKey ) ) free( mKey );
 	mKey = NULL;
 
-	if( NULL != mDataBlock ) free( mDataBlock );
+	if( NULL != mDataBlock && 0 == ( mFlags & eInlineData ) ) free( mDataBlock );
 	mDataBlock = NULL;
 
-	sp_thread_mutex_destroy( &mMutex );
+	for( int i = 0; i < mChunkCount; i++ ) {
+		if( mChunks[i].mSlabClass >= 0 ) {
+			mSlabs->dealloc( mChunks[i].mSlabClass, mChunks[i].mData );
+		} else {
+			free( mChunks[i].mData );
+		}
+	}
+
+	if( NULL != mChunks ) free( mChunks );
+	mChunks = NULL;
+	mChunkCount = 0;
 }
 
 void SP_CacheItem :: addRef()
 {
-	sp_thread_mutex_lock( &mMutex );
-	mRefCount++;
-	sp_thread_mutex_unlock( &mMutex );
+	sp_atomic_inc( &mRefCount );
 }
 
 void SP_CacheItem :: release()
 {
-	int refCount = 1;
+	int refCount = sp_atomic_dec( &mRefCount );
 
-	sp_thread_mutex_lock( &mMutex );
-	mRefCount--;
-	refCount = mRefCount;
-	sp_thread_mutex_unlock( &mMutex );
+	if( refCount <= 0 ) {
+		if( 0 == ( mFlags & eChunk ) ) {
+			delete this;
+		} else {
+			SP_CacheSlabs * slabs = mSlabs;
+			int slabClass = mSlabClass;
+
+			this->~SP_CacheItem();
 
-	if( refCount <= 0 ) delete this;
+			if( slabClass >= 0 ) {
+				slabs->dealloc( slabClass, this );
+			} else {
+				free( this );
+			}
+		}
+	}
+}
+
+int SP_CacheItem :: getRefCount() const
+{
+	// a full barrier, the releases of the other threads are seen
+	return sp_atomic_add( (volatile int *)&mRefCount, 0 );
 }
 
 void SP_CacheItem :: setKey( const char * key )
 {
 	char * temp = mKey;
 	mKey = strdup( key );
+	mHash = hashKey( key );
 
-	if( NULL != temp ) free( temp );
+	if( NULL != temp && 0 == ( mFlags & eInlineKey ) ) free( temp );
+	mFlags &= ~eInlineKey;
 }
 
 const char * SP_CacheItem :: getKey() const
@@ -79,6 +187,21 @@ const char * SP_CacheItem :: getKey() const
 	return mKey;
 }
 
+uint64_t SP_CacheItem :: getHash() const
+{
+	return mHash;
+}
+
+void SP_CacheItem :: setExpTime( time_t expTime )
+{
+	mExpTime = expTime;
+}
+
+time_t SP_CacheItem :: getExpTime() const
+{
+	return mExpTime;
+}
+
 void SP_CacheItem :: setCasUnique( uint64_t casUnique )
 {
 	mCasUnique = casUnique;
@@ -89,15 +212,88 @@ uint64_t SP_CacheItem :: getCasUnique() const
 	return mCasUnique;
 }
 
+void SP_CacheItem :: setClientFlags( uint32_t clientFlags )
+{
+	mClientFlags = clientFlags;
+}
+
+uint32_t SP_CacheItem :: getClientFlags() const
+{
+	return mClientFlags;
+}
+
+size_t SP_CacheItem :: getValueBytes() const
+{
+	return mDataBytes > 2 ? mDataBytes - 2 : 0;
+}
+
+void SP_CacheItem :: reserveChunks( size_t bytes )
+{
+	int count = ( bytes + eChunkSize - 1 ) / eChunkSize;
+
+	if( count > mChunkCount ) {
+		mChunks = (Chunk_t*)realloc( mChunks, sizeof( Chunk_t ) * count );
+
+		for( ; mChunkCount < count; mChunkCount++ ) {
+			Chunk_t * chunk = &( mChunks[ mChunkCount ] );
+
+			chunk->mData = NULL;
+			chunk->mSlabClass = -1;
+
+			if( NULL != mSlabs ) {
+				chunk->mSlabClass = mSlabs->getClass( eChunkSize );
+				if( chunk->mSlabClass >= 0 ) chunk->mData = (char*)mSlabs->alloc( chunk->mSlabClass );
+			}
+
+			if( NULL == chunk->mData ) {
+				chunk->mSlabClass = -1;
+				chunk->mData = (char*)malloc( eChunkSize );
+			}
+		}
+	}
+
+	if( bytes > mBlockCapacity ) mBlockCapacity = bytes;
+}
+
+void SP_CacheItem :: writeChunks( size_t offset, const void * data, size_t bytes )
+{
+	const char * pos = (const char*)data;
+
+	for( ; bytes > 0; ) {
+		size_t from = offset % eChunkSize, count = eChunkSize - from;
+		if( count > bytes ) count = bytes;
+
+		memcpy( mChunks[ offset / eChunkSize ].mData + from, pos, count );
+
+		pos += count;
+		offset += count;
+		bytes -= count;
+	}
+}
+
 void SP_CacheItem :: appendDataBlock( const void * dataBlock, size_t dataBytes,
 	size_t blockCapacity )
 {
 	size_t realBytes = mDataBytes + dataBytes;
 	realBytes = realBytes > blockCapacity ? realBytes : blockCapacity;
 
+	if( mFlags & eChunkedData ) {
+		// the chunks already there never move
+		reserveChunks( realBytes );
+		writeChunks( mDataBytes, dataBlock, dataBytes );
+		mDataBytes += dataBytes;
+		return;
+	}
+
 	if( realBytes > mBlockCapacity ) {
 		if( NULL == mDataBlock ) {
 			mDataBlock = malloc( realBytes + 1 );
+		} else if( mFlags & eInlineData ) {
+			// outgrow the chunk, move the data block to the heap
+			void * temp = malloc( realBytes + 1 );
+			memcpy( temp, mDataBlock, mDataBytes );
+			mDataBlock = temp;
+			mFlags &= ~eInlineData;
 		} else {
 			mDataBlock = realloc( mDataBlock, realBytes + 1 );
 		}
@@ -116,6 +312,104 @@ void SP_CacheItem :: setDataBlock( const void * dataBlock, size_t dataBytes )
 	appendDataBlock( dataBlock, dataBytes );
 }
 
+void SP_CacheItem :: prependDataBlock( const void * dataBlock, size_t dataBytes )
+{
+	assert( 0 == ( mFlags & eChunkedData ) );
+
+	size_t oldBytes = mDataBytes;
+
+	// grow it first, then the old data is at the front
+	appendDataBlock( dataBlock, dataBytes );
+
+	memmove( ((char*)mDataBlock) + dataBytes, mDataBlock, oldBytes );
+	memcpy( mDataBlock, dataBlock, dataBytes );
+}
+
+void SP_CacheItem :: truncateDataBlock( size_t dataBytes )
+{
+	if( dataBytes < mDataBytes ) mDataBytes = dataBytes;
+}
+
+void SP_CacheItem :: copyDataBlock( const SP_CacheItem * other, size_t dataBytes )
+{
+	for( int i = 0; i < other->getChunkCount() && dataBytes > 0; i++ ) {
+		size_t bytes = 0;
+		const void * chunk = other->getChunk( i, &bytes );
+		if( bytes > dataBytes ) bytes = dataBytes;
+
+		appendDataBlock( chunk, bytes );
+		dataBytes -= bytes;
+	}
+}
+
+size_t SP_CacheItem :: readDataBlock( size_t offset, void * buffer, size_t dataBytes ) const
+{
+	if( offset >= mDataBytes ) return 0;
+	if( dataBytes > mDataBytes - offset ) dataBytes = mDataBytes - offset;
+
+	if( 0 == ( mFlags & eChunkedData ) ) {
+		memcpy( buffer, ((char*)mDataBlock) + offset, dataBytes );
+		return dataBytes;
+	}
+
+	char * pos = (char*)buffer;
+
+	for( size_t left = dataBytes; left > 0; ) {
+		size_t from = offset % eChunkSize, count = eChunkSize - from;
+		if( count > left ) count = left;
+
+		memcpy( pos, mChunks[ offset / eChunkSize ].mData + from, count );
+
+		pos += count;
+		offset += count;
+		left -= count;
+	}
+
+	return dataBytes;
+}
+
+size_t SP_CacheItem :: takeDataBlock( SP_Buffer * buffer, size_t dataBytes )
+{
+	size_t total = 0;
+
+	// copy and drain in one step, the buffer is not compacted per chunk
+	for( ; total < dataBytes && buffer->getSize() > 0; ) {
+		size_t bytes = 0;
+		void * space = getFreeBlock( &bytes );
+		if( NULL == space ) break;
+
+		if( bytes > dataBytes - total ) bytes = dataBytes - total;
+
+		bytes = buffer->take( (char*)space, bytes );
+		if( bytes <= 0 ) break;
+
+		fillFreeBlock( bytes );
+		total += bytes;
+	}
+
+	return total;
+}
+
+void * SP_CacheItem :: getFreeBlock( size_t * bytes )
+{
+	*bytes = mBlockCapacity - mDataBytes;
+	if( *bytes <= 0 ) return NULL;
+
+	if( mFlags & eChunkedData ) {
+		size_t from = mDataBytes % eChunkSize;
+		if( *bytes > eChunkSize - from ) *bytes = eChunkSize - from;
+
+		return mChunks[ mDataBytes / eChunkSize ].mData + from;
+	}
+
+	return ((char*)mDataBlock) + mDataBytes;
+}
+
+void SP_CacheItem :: fillFreeBlock( size_t bytes )
+{
+	mDataBytes += bytes;
+}
+
 const void * SP_CacheItem :: getDataBlock() const
 {
 	return mDataBlock;
@@ -131,34 +425,161 @@ size_t SP_CacheItem :: getBlockCapacity() const
 	return mBlockCapacity;
 }
 
+int SP_CacheItem :: isChunked() const
+{
+	return 0 != ( mFlags & eChunkedData );
+}
+
+int SP_CacheItem :: getChunkCount() const
+{
+	if( 0 == ( mFlags & eChunkedData ) ) return 1;
+
+	return ( mDataBytes + eChunkSize - 1 ) / eChunkSize;
+}
+
+const void * SP_CacheItem :: getChunk( int index, size_t * bytes ) const
+{
+	if( 0 == ( mFlags & eChunkedData ) ) {
+		*bytes = mDataBytes;
+		return mDataBlock;
+	}
+
+	size_t offset = (size_t)index * eChunkSize;
+
+	*bytes = mDataBytes - offset > eChunkSize ? eChunkSize : mDataBytes - offset;
+
+	return mChunks[ index ].mData;
+}
+
+size_t SP_CacheItem :: getMemSize() const
+{
+	size_t size = sizeof( SP_CacheItem );
+	int inSlab = 0;
+
+	if( NULL != mSlabs && mSlabClass >= 0 ) {
+		size = mSlabs->getChunkSize( mSlabClass );
+		inSlab = mFlags;
+	}
+
+	if( NULL != mKey && 0 == ( inSlab & eInlineKey ) ) size += strlen( mKey ) + 1;
+	if( NULL != mDataBlock && 0 == ( inSlab & eInlineData ) ) size += mBlockCapacity + 1;
+
+	for( int i = 0; i < mChunkCount; i++ ) {
+		size += mChunks[i].mSlabClass >= 0 ? mSlabs->getChunkSize( mChunks[i].mSlabClass ) : eChunkSize;
+	}
+
+	return size;
+}
+
 //---------------------------------------------------------
 
 SP_CacheProtoMessage :: SP_CacheProtoMessage()
 {
 	memset( mCommand, 0, sizeof( mCommand ) );
+	mCmd = eUnknown;
 	mDelta = 0;
-	mExpTime = 0;
+	mExpTime = mRawExpTime = 0;
 	mItem = NULL;
+
+	mOpcode = -1;
+	mOpaque = 0;
+	mCas = mInitial = 0;
 	memset( mError, 0, sizeof( mError ) );
+	mTooLarge = 0;
 
 	mKeyList = new SP_ArrayList();
+
+	mKeyBuffer = NULL;
+	mKeyBufferSize = mKeyBufferUsed = 0;
 }
 
 SP_CacheProtoMessage :: ~SP_CacheProtoMessage()
 {
-	if( NULL != mItem ) delete mItem;
+	if( NULL != mItem ) mItem->release();
 	mItem = NULL;
 
-	for( ; mKeyList->getCount() > 0; ) {
-		free( mKeyList->takeItem( SP_ArrayList::LAST_INDEX ) );
-	}
 	delete mKeyList;
 	mKeyList = NULL;
+
+	if( NULL != mKeyBuffer ) free( mKeyBuffer );
+}
+
+void SP_CacheProtoMessage :: reset()
+{
+	mCommand[0] = '\0';
+	mCmd = eUnknown;
+	mDelta = 0;
+	mExpTime = mRawExpTime = 0;
+
+	setItem( NULL );
+
+	mOpcode = -1;
+	mOpaque = 0;
+	mCas = mInitial = 0;
+	mError[0] = '\0';
+	mTooLarge = 0;
+
+	mKeyList->clean();
+	mKeyBufferUsed = 0;
+}
+
+static const char * sCmdNames[] = {
+	"get", "gets", "set", "add", "replace", "cas", "append", "prepend",
+	"delete", "incr", "decr", "flush_all", "stats", "version", "quit"
+};
+
+int SP_CacheProtoMessage :: getCmd( const char * command )
+{
+	int cmd = eUnknown;
+
+	// the length and the first char leave at most one candidate
+	switch( strlen( command ) ) {
+		case 3:
+			switch( tolower( command[0] ) ) {
+				case 'g': cmd = eGet; break;
+				case 's': cmd = eSet; break;
+				case 'a': cmd = eAdd; break;
+				case 'c': cmd = eCas; break;
+			}
+			break;
+		case 4:
+			switch( tolower( command[0] ) ) {
+				case 'g': cmd = eGets; break;
+				case 'i': cmd = eIncr; break;
+				case 'd': cmd = eDecr; break;
+				case 'q': cmd = eQuit; break;
+			}
+			break;
+		case 5:
+			if( 's' == tolower( command[0] ) ) cmd = eStats;
+			break;
+		case 6:
+			switch( tolower( command[0] ) ) {
+				case 'a': cmd = eAppend; break;
+				case 'd': cmd = eDelete; break;
+			}
+			break;
+		case 7:
+			switch( tolower( command[0] ) ) {
+				case 'r': cmd = eReplace; break;
+				case 'p': cmd = ePrepend; break;
+				case 'v': cmd = eVersion; break;
+			}
+			break;
+		case 9:
+			if( 'f' == tolower( command[0] ) ) cmd = eFlushAll;
+			break;
+	}
+
+	if( eUnknown != cmd && 0 != strcasecmp( command, sCmdNames[ cmd ] ) ) cmd = eUnknown;
+
+	return cmd;
 }
 
 void SP_CacheProtoMessage :: setCommand( const char * command )
 {
 	snprintf( mCommand, sizeof( mCommand ), "%s", command );
+	mCmd = getCmd( command );
 }
 
 const char * SP_CacheProtoMessage :: getCommand() const
@@ -166,13 +587,15 @@ const char * SP_CacheProtoMessage :: getCommand() const
 	return mCommand;
 }
 
-int SP_CacheProtoMessage :: isCommand( const char * command ) const
+int SP_CacheProtoMessage :: getCmd() const
 {
-	return 0 == strcmp( mCommand, command );
+	return mCmd;
 }
 
 void SP_CacheProtoMessage :: setExpTime( time_t expTime )
 {
+	mRawExpTime = expTime;
+
 	if( expTime <= 60*60*24*30 && expTime > 0 ) expTime = time( NULL ) + expTime;
 
 	mExpTime = expTime;
@@ -183,25 +606,97 @@ time_t SP_CacheProtoMessage :: getExpTime() const
 	return mExpTime;
 }
 
+time_t SP_CacheProtoMessage :: getRawExpTime() const
+{
+	return mRawExpTime;
+}
+
+void SP_CacheProtoMessage :: reserveKeys( size_t bytes )
+{
+	// the list points into the buffer, so never move it under the keys
+	assert( 0 == mKeyList->getCount() );
+
+	if( mKeyBufferUsed + bytes > mKeyBufferSize ) {
+		mKeyBufferSize = mKeyBufferUsed + bytes;
+		mKeyBuffer = (char*)realloc( mKeyBuffer, mKeyBufferSize );
+	}
+}
+
+const char * SP_CacheProtoMessage :: addKey( const char * key, size_t len )
+{
+	assert( mKeyBufferUsed + len + 1 <= mKeyBufferSize );
+
+	char * ret = mKeyBuffer + mKeyBufferUsed;
+	memcpy( ret, key, len );
+	ret[ len ] = '\0';
+
+	mKeyBufferUsed += len + 1;
+	mKeyList->append( ret );
+
+	return ret;
+}
+
 SP_ArrayList * SP_CacheProtoMessage :: getKeyList() const
 {
 	return mKeyList;
 }
 
-void SP_CacheProtoMessage :: setDelta( int delta )
+const char * SP_CacheProtoMessage :: getKey() const
+{
+	return mKeyList->getCount() > 0 ? (char*)mKeyList->getItem( 0 ) : NULL;
+}
+
+void SP_CacheProtoMessage :: setDelta( uint64_t delta )
 {
 	mDelta = delta;
 }
 
-int SP_CacheProtoMessage :: getDelta() const
+uint64_t SP_CacheProtoMessage :: getDelta() const
 {
 	return mDelta;
 }
 
-SP_CacheItem * SP_CacheProtoMessage :: getItem()
+void SP_CacheProtoMessage :: setBinary( int opcode, uint32_t opaque, uint64_t cas )
 {
-	if( NULL == mItem ) mItem = new SP_CacheItem();
+	mOpcode = opcode;
+	mOpaque = opaque;
+	mCas = cas;
+}
 
+int SP_CacheProtoMessage :: getOpcode() const
+{
+	return mOpcode;
+}
+
+uint32_t SP_CacheProtoMessage :: getOpaque() const
+{
+	return mOpaque;
+}
+
+uint64_t SP_CacheProtoMessage :: getCas() const
+{
+	return mCas;
+}
+
+void SP_CacheProtoMessage :: setInitial( uint64_t initial )
+{
+	mInitial = initial;
+}
+
+uint64_t SP_CacheProtoMessage :: getInitial() const
+{
+	return mInitial;
+}
+
+void SP_CacheProtoMessage :: setItem( SP_CacheItem * item )
+{
+	if( NULL != mItem ) mItem->release();
+
+	mItem = item;
+}
+
+SP_CacheItem * SP_CacheProtoMessage :: getItem()
+{
 	return mItem;
 }
 
@@ -224,3 +719,13 @@ const char * SP_CacheProtoMessage :: getError() const
 	return '\0' == mError[0] ? NULL : mError;
 }
 
+void SP_CacheProtoMessage :: setTooLarge()
+{
+	mTooLarge = 1;
+}
+
+int SP_CacheProtoMessage :: isTooLarge() const
+{
+	return mTooLarge;
+}
+
@@ -11,82 +11,228 @@
 #include "spdict/spdictcache.hpp"
 
 #include "spserver/spporting.hpp"
-#include "spserver/spthread.hpp"
 
 class SP_ArrayList;
+class SP_Buffer;
+class SP_CacheSlabs;
 
 class SP_CacheItem {
 public:
+	// a data block larger than eChunkSize is kept in a chain of chunks,
+	// one page of SP_CacheSlabs each, so it is never linearized
+	enum { eChunkSize = 1024 * 1024 };
+
+	// header, key and data block in one chunk from slabs,
+	// slabs can be NULL, then the chunk comes from malloc
+	static SP_CacheItem * newInstance( SP_CacheSlabs * slabs,
+			const char * key, size_t blockCapacity );
+
+	// 64-bit hash of a key, the index and the shards both use it
+	static uint64_t hashKey( const char * key );
+
 	SP_CacheItem( const char * key );
 	SP_CacheItem();
 	~SP_CacheItem();
 
 	void setKey( const char * key );
 	const char * getKey() const;
+	uint64_t getHash() const;
+
+	void setExpTime( time_t expTime );
+	time_t getExpTime() const;
 
 	void appendDataBlock( const void * dataBlock, size_t dataBytes,
 			size_t blockCapacity = 0 );
 	void setDataBlock( const void * dataBlock, size_t dataBytes );
+
+	// move the data forward and copy dataBlock in front of it,
+	// not for a chunked data block
+	void prependDataBlock( const void * dataBlock, size_t dataBytes );
+
+	// append the first dataBytes of the data block of other
+	void copyDataBlock( const SP_CacheItem * other, size_t dataBytes );
+
+	// copy at most dataBytes from offset of the data block,
+	// return the count of bytes copied
+	size_t readDataBlock( size_t offset, void * buffer, size_t dataBytes ) const;
+
+	// drop the bytes behind dataBytes, the capacity is kept
+	void truncateDataBlock( size_t dataBytes );
+
+	// move at most dataBytes from buffer straight into the free capacity,
+	// return the count of bytes moved
+	size_t takeDataBlock( SP_Buffer * buffer, size_t dataBytes );
+
+	// the free capacity behind the data up to the end of its chunk, so it
+	// can be written in place, return NULL if the capacity is full
+	void * getFreeBlock( size_t * bytes );
+
+	// bytes were written at getFreeBlock, they are data now
+	void fillFreeBlock( size_t bytes );
+
+	// NULL for a chunked data block, use getChunk then
 	const void * getDataBlock() const;
 	size_t getDataBytes() const;
 	size_t getBlockCapacity() const;
 
+	int isChunked() const;
+
+	// a data block in one piece is one chunk
+	int getChunkCount() const;
+	const void * getChunk( int index, size_t * bytes ) const;
+
 	void setCasUnique( uint64_t casUnique );
 	uint64_t getCasUnique() const;
 
+	// the flags of the client, the server never looks into them
+	void setClientFlags( uint32_t clientFlags );
+	uint32_t getClientFlags() const;
+
+	// the data block is the value and its "\r\n", so it goes out as it is
+	size_t getValueBytes() const;
+
 	void addRef();
 	void release();
 
+	// 1 : only the cache holds it, nobody is sending it
+	int getRefCount() const;
+
+	// key + data block + item overhead, used for the memory limit
+	size_t getMemSize() const;
+
 private:
+	friend class SP_CacheShard;
+
 	void init();
 
+	// make the chunks hold at least bytes
+	void reserveChunks( size_t bytes );
+	void writeChunks( size_t offset, const void * data, size_t bytes );
+
+	enum { eChunk = 1, eInlineKey = 2, eInlineData = 4, eChunkedData = 8 };
+
+	// eChunk : created by newInstance, the parts inside the chunk are flagged too
+	int mFlags;
+
+	SP_CacheSlabs * mSlabs;
+	// -1 : the chunk comes from malloc
+	int mSlabClass;
+
 	char * mKey;
+	uint64_t mHash;
+
+	time_t mExpTime;
 
 	void * mDataBlock;
 	size_t mDataBytes, mBlockCapacity;
 
+	typedef struct tagChunk {
+		char * mData;
+		// -1 : the chunk comes from malloc
+		int mSlabClass;
+	} Chunk_t;
+
+	Chunk_t * mChunks;
+	int mChunkCount;
+
 	uint64_t mCasUnique;
+	uint32_t mClientFlags;
+
+	volatile int mRefCount;
 
-	sp_thread_mutex_t mMutex;
-	int mRefCount;
+	// eviction order, maintained by the owner shard.
+	// mActive and mFetched are also set to 1 under the shared lock, see SP_CacheShard::hit
+	SP_CacheItem * mPrev, * mNext;
+	char mSegment, mActive, mFetched;
+	time_t mAccessTime;
+	uint64_t mPutSeq;
 };
 
 class SP_CacheProtoMessage {
 public:
+	// text protocol commands, eUnknown is the last one
+	enum {
+		eGet, eGets, eSet, eAdd, eReplace, eCas, eAppend, ePrepend,
+		eDelete, eIncr, eDecr, eFlushAll, eStats, eVersion, eQuit, eUnknown
+	};
+
+	// return eUnknown if command is not a known one
+	static int getCmd( const char * command );
+
 	SP_CacheProtoMessage();
 	~SP_CacheProtoMessage();
 
+	// clear for the next request, the memory is kept for reuse
+	void reset();
+
+	// the command is resolved once here
 	void setCommand( const char * command );
 	const char * getCommand() const;
 
-	int isCommand( const char * command ) const;
+	int getCmd() const;
 
+	// a relative exptime is made absolute here
 	void setExpTime( time_t expTime );
 	time_t getExpTime() const;
 
+	// the exptime as in the request, a proxy forwards it
+	time_t getRawExpTime() const;
+
+	// the keys are kept in one buffer owned by the message,
+	// reserve room for all the keys of a request before adding the first one
+	void reserveKeys( size_t bytes );
+	const char * addKey( const char * key, size_t len );
+
 	SP_ArrayList * getKeyList() const;
 
-	void setDelta( int delta );
-	int getDelta() const;
+	// return the first key, NULL if none
+	const char * getKey() const;
+
+	void setDelta( uint64_t delta );
+	uint64_t getDelta() const;
+
+	// binary protocol request header, opcode is -1 for the text protocol
+	void setBinary( int opcode, uint32_t opaque, uint64_t cas );
+	int getOpcode() const;
+	uint32_t getOpaque() const;
+	uint64_t getCas() const;
 
+	// initial value of binary incr/decr, used when the key is not found
+	void setInitial( uint64_t initial );
+	uint64_t getInitial() const;
+
+	void setItem( SP_CacheItem * item );
 	SP_CacheItem * getItem();
 	SP_CacheItem * takeItem();
 
 	void setError( const char * error );
 
+	// the value is over the item size limit, it is skipped, not stored
+	void setTooLarge();
+	int isTooLarge() const;
+
 	// return NULL : not error, NOT NULL : error message
 	const char * getError() const;
 
 private:
 	char mCommand[ 16 ];
-	time_t mExpTime;
-	int mDelta;
+	int mCmd;
+	time_t mExpTime, mRawExpTime;
+	uint64_t mDelta;
+
+	int mOpcode;
+	uint32_t mOpaque;
+	uint64_t mCas, mInitial;
 
 	SP_CacheItem * mItem;
 
 	SP_ArrayList * mKeyList;
 
+	char * mKeyBuffer;
+	size_t mKeyBufferSize, mKeyBufferUsed;
+
 	char mError[ 128 ];
+	int mTooLarge;
 };
 
 #endif
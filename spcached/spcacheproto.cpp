@@ -6,161 +6,352 @@
 #include <string.h>
 #include <stdio.h>
 #include <errno.h>
+#include <ctype.h>
 
 #include "spserver/spbuffer.hpp"
 #include "spserver/sputils.hpp"
 #include "spserver/sprequest.hpp"
 #include "spserver/spresponse.hpp"
+#include "spserver/spmsgblock.hpp"
 
 #include "spcacheproto.hpp"
 #include "spcachemsg.hpp"
 #include "spcacheimpl.hpp"
+#include "spcachebinary.hpp"
+#include "spcachequeue.hpp"
 
-static char * sp_strsep(char **s, const char *del)
+// return the next token in [pos, end), NULL if none
+static const char * sp_nexttoken( const char * pos, const char * end, int * len )
 {
-	char *d, *tok;
+	for( ; pos < end && ' ' == *pos; ) pos++;
 
-	if (!s || !*s) return NULL;
-	tok = *s;
-	d = strstr(tok, del);
+	if( pos >= end ) return NULL;
 
-	if (d) {
-		*s = d + strlen(del);
-		*d = '\0';
-	} else {
-		*s = NULL;
-	}
+	const char * token = pos;
+	for( ; pos < end && ' ' != *pos; ) pos++;
 
-	return tok;
+	*len = pos - token;
+
+	return token;
 }
 
-SP_CacheMsgDecoder :: SP_CacheMsgDecoder()
+SP_CacheMsgDecoder :: SP_CacheMsgDecoder( SP_CacheSlabs * slabs, int protocol,
+		size_t maxItemSize )
 {
-	mMessage = NULL;
+	mSlabs = slabs;
+	mMaxItemSize = maxItemSize;
+
+	memset( mMessages, 0, sizeof( mMessages ) );
+	mMessages[0] = new SP_CacheProtoMessage();
+	mCount = 0;
+
+	mHasHeader = 0;
+	mProtocol = protocol;
+	mBodyLeft = 0;
+
+	mQueueStat = NULL;
+	mQueued = 0;
+	memset( &mQueueTime, 0, sizeof( mQueueTime ) );
 }
 
 SP_CacheMsgDecoder :: ~SP_CacheMsgDecoder()
 {
-	if( NULL != mMessage ) delete mMessage;
+	if( mQueued ) mQueueStat->leave( NULL );
+
+	for( int i = 0; i <= eMaxBatch; i++ ) {
+		if( NULL != mMessages[i] ) delete mMessages[i];
+	}
 }
 
-int SP_CacheMsgDecoder :: decode( SP_Buffer * inBuffer )
+void SP_CacheMsgDecoder :: reset()
 {
-	int status = eMoreData;
+	for( int i = 0; i < mCount; i++ ) mMessages[i]->reset();
 
-	if( NULL == mMessage ) {
-		char * line = inBuffer->getLine();
-		if( NULL != line ) {
-			status = eOK;
+	// move the one in progress to the front
+	SP_CacheProtoMessage * temp = mMessages[0];
+	mMessages[0] = mMessages[ mCount ];
+	mMessages[ mCount ] = temp;
 
-			mMessage = new SP_CacheProtoMessage();
+	mCount = 0;
+}
 
-			char cmd[ 32 ] = { 0 }, key[ 256 ] = { 0 }, exptime[ 16 ] = { 0 }, bytes[ 16 ] = { 0 };
+void SP_CacheMsgDecoder :: parseLine( SP_CacheProtoMessage * message,
+		const char * line, const char * end )
+{
+	enum { eMaxTokens = 8 };
 
-			const char * next = line;
-			sp_strtok( next, 0, cmd, sizeof( cmd ), ' ', &next );
+	const char * tokens[ eMaxTokens ] = { 0 };
+	int lens[ eMaxTokens ] = { 0 }, count = 0;
 
-			mMessage->setCommand( cmd );
+	if( end > line && '\r' == *( end - 1 ) ) end--;
 
-			if( 0 == strcasecmp( cmd, "add" ) || 0 == strcasecmp( cmd, "set" )
-					|| 0 == strcasecmp( cmd, "replace" ) || 0 == strcasecmp( cmd, "cas" )
-					|| 0 == strcasecmp( cmd, "append" ) || 0 == strcasecmp( cmd, "prepend" ) ) {
-				char flags[ 16 ] = { 0 }, casunique[ 32 ] = { 0 };
+	const char * pos = line;
+	for( ; count < eMaxTokens; count++ ) {
+		tokens[ count ] = sp_nexttoken( pos, end, &( lens[ count ] ) );
+		if( NULL == tokens[ count ] ) break;
+		pos = tokens[ count ] + lens[ count ];
+	}
 
-				if( NULL != next ) sp_strtok( next, 0, key, sizeof( key ), ' ', &next );
-				if( NULL != next ) sp_strtok( next, 0, flags, sizeof( flags ), ' ', &next );
-				if( NULL != next ) sp_strtok( next, 0, exptime, sizeof( exptime ), ' ', &next );
-				if( NULL != next ) sp_strtok( next, 0, bytes, sizeof( bytes ), ' ', &next );
-				if( NULL != next ) sp_strtok( next, 0, casunique, sizeof( casunique ) );
+	char cmd[ 16 ] = { 0 };
+	if( count > 0 ) snprintf( cmd, sizeof( cmd ), "%.*s", lens[0], tokens[0] );
+
+	message->setCommand( cmd );
+
+	// the tokens are followed by a space, CR or LF, so strtoul stops in the line
+	switch( message->getCmd() ) {
+		case SP_CacheProtoMessage::eAdd:
+		case SP_CacheProtoMessage::eSet:
+		case SP_CacheProtoMessage::eReplace:
+		case SP_CacheProtoMessage::eCas:
+		case SP_CacheProtoMessage::eAppend:
+		case SP_CacheProtoMessage::ePrepend:
+		{
+			int isCas = ( SP_CacheProtoMessage::eCas == message->getCmd() );
+
+			if( count < ( isCas ? 6 : 5 ) || lens[1] > eMaxKeyLen ) {
+				message->setError( "CLIENT_ERROR bad command line format" );
+				break;
+			}
 
-				int ret = -1;
+			// bytes sizes the item, "-1" or a number over size_t would wrap it
+			char * bytesEnd = NULL;
+			errno = 0;
+			unsigned long long bytes = strtoull( tokens[4], &bytesEnd, 10 );
 
-				if( '\0' != key[0] && '\0' != bytes[0] ) {
-					ret = 0;
+			if( ! isdigit( (unsigned char)*tokens[4] ) || bytesEnd != tokens[4] + lens[4]
+					|| ERANGE == errno || bytes > (size_t)-1 - 2 ) {
+				message->setError( "CLIENT_ERROR bad command line format" );
+				break;
+			}
 
-					mMessage->setExpTime( strtoul( exptime, NULL, 10 ) );
-					mMessage->getItem()->setKey( key );
+			char key[ eMaxKeyLen + 1 ] = { 0 };
+			memcpy( key, tokens[1], lens[1] );
 
-					uint64_t casid = 0;
-					sscanf( casunique, "%llu", &casid );
-					casid += 1;
+			unsigned int flags = strtoul( tokens[2], NULL, 10 );
+			message->setExpTime( strtoul( tokens[3], NULL, 10 ) );
 
-					//strtoull( casunique, NULL, 10 ) + 1;
+			uint64_t casid = ( count > 5 ? strtoull( tokens[5], NULL, 10 ) : 0 ) + 1;
 
-					char buffer[ 512] = { 0 };
-					int len = snprintf( buffer, sizeof( buffer ), "VALUE %s %s %s %llu\r\n",
-							key, flags, bytes, casid );
-					mMessage->getItem()->appendDataBlock( buffer, len, atoi( bytes ) + len + 2 );
+			if( mMaxItemSize > 0 && bytes > mMaxItemSize ) {
+				// swallow the value, the session goes on
+				message->setTooLarge();
+				mBodyLeft = (size_t)bytes + 2;
+				break;
+			}
 
-					status = eMoreData;
+			// the reply header is rendered at send time, only the value is kept
+			message->setItem( SP_CacheItem::newInstance( mSlabs, key, (size_t)bytes + 2 ) );
+			message->getItem()->setClientFlags( flags );
+			message->getItem()->setCasUnique( casid );
 
-					if( 0 == strcasecmp( cmd, "cas" ) ) {
-						if( '\0' != casunique[0] ) {
-							mMessage->getItem()->setCasUnique( casid );
-						} else {
-							mMessage->setError( "CLIENT_ERROR bad command line format" );
-						}
-					}
-				} else {
-					mMessage->setError( "CLIENT_ERROR bad command line format" );
-				}
-			} else if( 0 == strcasecmp( cmd, "get" ) || 0 == strcasecmp( cmd, "gets" ) ) {
-				char * next = strchr( line, ' ' );
-				for( ; NULL != next && '\0' != *next; ) {
-					char * nextKey = sp_strsep( &next, " " );
-					if( NULL != nextKey && '\0' != *nextKey ) {
-						mMessage->getKeyList()->append( strdup( nextKey ) );	
-					}
+			break;
+		}
+		case SP_CacheProtoMessage::eGet:
+		case SP_CacheProtoMessage::eGets:
+		{
+			// the keys are never longer than the line
+			message->reserveKeys( end - line );
+
+			for( pos = tokens[0] + lens[0]; ; ) {
+				int len = 0;
+				const char * key = sp_nexttoken( pos, end, &len );
+				if( NULL == key ) break;
+
+				// no item has a longer key, and its VALUE line would not fit
+				if( len > eMaxKeyLen ) {
+					message->setError( "CLIENT_ERROR bad command line format" );
+					break;
 				}
 
-			} else if( 0 == strcasecmp( cmd, "delete" ) ) {
-				sscanf( line, "%*s %250s %15s", key, exptime );
-				if( '\0' != key[0] ) {
-					mMessage->setExpTime( strtoul( exptime, NULL, 10 ) );
-					mMessage->getItem()->setKey( key );
-				} else {
-					mMessage->setError( "CLIENT_ERROR bad command line format" );
-				}
-			} else if( 0 == strcasecmp( cmd, "incr" ) || 0 == strcasecmp( cmd, "decr" ) ) {
-				int ret = sscanf( line, "%*s %250s %15s\n", key, bytes );
-				if( 2 == ret && '\0' != key[0] ) {
-					mMessage->setDelta( atoi( bytes ) );
-					mMessage->getItem()->setKey( key );
-				} else {
-					mMessage->setError( "CLIENT_ERROR bad command line format" );
+				message->addKey( key, len );
+				pos = key + len;
+			}
+			break;
+		}
+		case SP_CacheProtoMessage::eDelete:
+			if( count >= 2 && lens[1] <= eMaxKeyLen ) {
+				message->reserveKeys( lens[1] + 1 );
+				message->addKey( tokens[1], lens[1] );
+				if( count > 2 ) message->setExpTime( strtoul( tokens[2], NULL, 10 ) );
+			} else {
+				message->setError( "CLIENT_ERROR bad command line format" );
+			}
+			break;
+		case SP_CacheProtoMessage::eIncr:
+		case SP_CacheProtoMessage::eDecr:
+			if( count >= 3 && lens[1] <= eMaxKeyLen ) {
+				char * pos = NULL;
+
+				errno = 0;
+				message->setDelta( strtoull( tokens[2], &pos, 10 ) );
+
+				if( ! isdigit( (unsigned char)*tokens[2] ) || pos != tokens[2] + lens[2] || ERANGE == errno ) {
+					message->setError( "CLIENT_ERROR invalid numeric delta argument" );
+					break;
 				}
-			} else if( 0 == strcasecmp( cmd, "flush_all" ) ) {
-				sp_strtok( line, 1, exptime, sizeof( exptime ) );
-				mMessage->setExpTime( strtoul( exptime, NULL, 10 ) );
+
+				message->reserveKeys( lens[1] + 1 );
+				message->addKey( tokens[1], lens[1] );
+			} else {
+				message->setError( "CLIENT_ERROR bad command line format" );
+			}
+			break;
+		case SP_CacheProtoMessage::eFlushAll:
+			if( count > 1 ) message->setExpTime( strtoul( tokens[1], NULL, 10 ) );
+			break;
+		case SP_CacheProtoMessage::eStats:
+			if( count > 1 ) {
+				message->reserveKeys( lens[1] + 1 );
+				message->addKey( tokens[1], lens[1] );
 			}
+			break;
+	}
+}
+
+int SP_CacheMsgDecoder :: decode( SP_Buffer * inBuffer )
+{
+	if( eUnknown == mProtocol ) {
+		if( inBuffer->getSize() <= 0 ) return eMoreData;
+
+		unsigned char magic = *(unsigned char*)inBuffer->getBuffer();
+		mProtocol = ( SP_CacheBinaryProto::eRequestMagic == magic ) ? eBinary : eText;
+	}
 
-			free( line );
+	for( ; mCount < eMaxBatch; ) {
+		SP_CacheProtoMessage * message = mMessages[ mCount ];
+
+		int status = eMoreData;
+		if( eBinary == mProtocol ) {
+			status = SP_CacheBinaryProto::decode( inBuffer, mSlabs, mMaxItemSize,
+					message, &mHasHeader, &mBodyLeft );
+		} else {
+			status = decodeText( inBuffer, message );
 		}
+
+		if( eOK != status ) break;
+
+		mCount++;
+		mHasHeader = 0;
+		mBodyLeft = 0;
+
+		if( NULL == mMessages[ mCount ] ) mMessages[ mCount ] = new SP_CacheProtoMessage();
+
+		// the session is closed after a bad request, don't go on
+		if( NULL != message->getError() || inBuffer->getSize() <= 0 ) break;
 	}
 
-	if( NULL != mMessage && NULL == mMessage->getError() && inBuffer->getSize() > 0 ) {
-		SP_CacheItem * item = mMessage->getItem();
-		size_t bytes = item->getBlockCapacity() - item->getDataBytes();
-		if( bytes > 0 ) {
-			bytes = bytes > inBuffer->getSize() ? inBuffer->getSize() : bytes;
-			item->appendDataBlock( inBuffer->getBuffer(), bytes );
-			inBuffer->erase( bytes );
+	if( mCount > 0 && NULL != mQueueStat && ! mQueued ) {
+		mQueued = 1;
+		mQueueStat->enter( &mQueueTime );
+	}
+
+	return mCount > 0 ? eOK : eMoreData;
+}
+
+void SP_CacheMsgDecoder :: setQueueStat( SP_CacheQueueStat * queueStat )
+{
+	mQueueStat = queueStat;
+}
+
+void SP_CacheMsgDecoder :: leaveQueue()
+{
+	if( mQueued ) {
+		mQueued = 0;
+		mQueueStat->leave( &mQueueTime );
+	}
+}
+
+int SP_CacheMsgDecoder :: decodeText( SP_Buffer * inBuffer, SP_CacheProtoMessage * message )
+{
+	int status = eMoreData;
+
+	if( ! mHasHeader ) {
+		const char * line = (char*)inBuffer->getBuffer();
+		const char * end = (char*)inBuffer->find( "\n", 1 );
+
+		if( NULL != end ) {
+			mHasHeader = 1;
+
+			// tokenize in place, everything needed is copied out before erase
+			parseLine( message, line, end );
+			inBuffer->erase( end + 1 - line );
+
+			status = ( NULL == message->getError() && ( NULL != message->getItem()
+					|| mBodyLeft > 0 ) ) ? eMoreData : eOK;
+		}
+	}
+
+	if( mHasHeader && message->isTooLarge() && mBodyLeft > 0 ) {
+		size_t bytes = mBodyLeft > inBuffer->getSize() ? inBuffer->getSize() : mBodyLeft;
+		inBuffer->erase( bytes );
+		mBodyLeft -= bytes;
+
+		if( mBodyLeft <= 0 ) status = eOK;
+	}
+
+	// the value may be filled by fillValue, so it is checked without input too
+	if( mHasHeader && NULL == message->getError() && NULL != message->getItem() ) {
+		SP_CacheItem * item = message->getItem();
+		if( inBuffer->getSize() > 0 ) {
+			item->takeDataBlock( inBuffer, item->getBlockCapacity() - item->getDataBytes() );
 		}
 
-		if( item->getBlockCapacity() <= item->getDataBytes() ) status = eOK;
+		if( item->getBlockCapacity() <= item->getDataBytes() ) {
+			status = eOK;
+
+			char tail[ 2 ] = { 0 };
+			item->readDataBlock( item->getDataBytes() - 2, tail, sizeof( tail ) );
 
-		if( eOK == status && item->getDataBytes() > 2 && 0 != strncmp(
-				((char*)item->getDataBlock()) + item->getDataBytes() - 2, "\r\n", 2 ) ) {
-			mMessage->setError( "CLIENT_ERROR bad data chunk" );
+			if( item->getDataBytes() >= 2 && 0 != strncmp( tail, "\r\n", 2 ) ) {
+				message->setError( "CLIENT_ERROR bad data chunk" );
+			}
 		}
 	}
 
 	return status;
 }
 
-SP_CacheProtoMessage * SP_CacheMsgDecoder :: getMsg()
+void * SP_CacheMsgDecoder :: getValueSpace( size_t * bytes )
+{
+	*bytes = 0;
+
+	SP_CacheProtoMessage * message = mMessages[ mCount ];
+	if( ! mHasHeader || NULL != message->getError() || NULL == message->getItem() ) return NULL;
+
+	void * space = message->getItem()->getFreeBlock( bytes );
+
+	// the item of a binary set has 2 bytes more for the "\r\n" added at the end
+	if( eBinary == mProtocol && *bytes > mBodyLeft ) *bytes = mBodyLeft;
+
+	return *bytes > 0 ? space : NULL;
+}
+
+void SP_CacheMsgDecoder :: fillValue( size_t bytes )
 {
-	return mMessage;
+	SP_CacheItem * item = mMessages[ mCount ]->getItem();
+
+	item->fillFreeBlock( bytes );
+
+	// the same as SP_CacheBinaryProto::decode at the end of the value
+	if( eBinary == mProtocol ) {
+		mBodyLeft -= bytes;
+		if( mBodyLeft <= 0 ) item->appendDataBlock( "\r\n", 2 );
+	}
+}
+
+int SP_CacheMsgDecoder :: getCount() const
+{
+	return mCount;
+}
+
+SP_CacheProtoMessage * SP_CacheMsgDecoder :: getMsg( int index )
+{
+	return mMessages[ index ];
+}
+
+int SP_CacheMsgDecoder :: getProtocol() const
+{
+	return mProtocol;
 }
 
 //---------------------------------------------------------
@@ -168,139 +359,289 @@ SP_CacheProtoMessage * SP_CacheMsgDecoder :: getMsg()
 SP_CacheProtoHandler :: SP_CacheProtoHandler( SP_CacheEx * cacheEx )
 {
 	mCacheEx = cacheEx;
+
+	mGetKeys = new SP_ArrayList();
+	mPendingGets = 0;
+	mGetCmd = SP_CacheProtoMessage::eUnknown;
+
+	mText = new SP_Buffer();
+	mTail = NULL;
 }
 
 SP_CacheProtoHandler :: ~SP_CacheProtoHandler()
 {
+	delete mGetKeys;
+	delete mText;
 }
 
 int SP_CacheProtoHandler :: start( SP_Request * request, SP_Response * response )
 {
-	request->setMsgDecoder( new SP_CacheMsgDecoder() );
+	SP_CacheQueueStat * queueStat = mCacheEx->getQueueStat();
+
+	// the workers are behind, a new session only adds to the wait
+	if( NULL != queueStat && queueStat->isOverloaded() ) {
+		queueStat->reject();
+		response->getReply()->getMsg()->append( "SERVER_ERROR Server is busy now\r\n" );
+		return -1;
+	}
+
+	SP_CacheMsgDecoder * decoder = new SP_CacheMsgDecoder( mCacheEx->getSlabs(),
+			SP_CacheMsgDecoder::eUnknown, mCacheEx->getMaxItemSize() );
+	decoder->setQueueStat( queueStat );
+
+	request->setMsgDecoder( decoder );
+
 	return 0;
 }
 
+// indexed by SP_CacheProtoMessage::getCmd(), the last one is for eUnknown
+const SP_CacheProtoHandler::Command_t SP_CacheProtoHandler::sCommands[] = {
+	&SP_CacheProtoHandler::doGet,       // eGet
+	&SP_CacheProtoHandler::doGet,       // eGets
+	&SP_CacheProtoHandler::doStore,     // eSet
+	&SP_CacheProtoHandler::doStore,     // eAdd
+	&SP_CacheProtoHandler::doStore,     // eReplace
+	&SP_CacheProtoHandler::doStore,     // eCas
+	&SP_CacheProtoHandler::doStore,     // eAppend
+	&SP_CacheProtoHandler::doStore,     // ePrepend
+	&SP_CacheProtoHandler::doDelete,    // eDelete
+	&SP_CacheProtoHandler::doCalc,      // eIncr
+	&SP_CacheProtoHandler::doCalc,      // eDecr
+	&SP_CacheProtoHandler::doFlushAll,  // eFlushAll
+	&SP_CacheProtoHandler::doStats,     // eStats
+	&SP_CacheProtoHandler::doVersion,   // eVersion
+	&SP_CacheProtoHandler::doQuit,      // eQuit
+	&SP_CacheProtoHandler::doUnknown    // eUnknown
+};
+
 int SP_CacheProtoHandler :: handle( SP_Request * request, SP_Response * response )
 {
 	int ret = 0;
 
 	SP_CacheMsgDecoder * decoder = (SP_CacheMsgDecoder*)request->getMsgDecoder();
-	SP_CacheProtoMessage * message = (SP_CacheProtoMessage*)decoder->getMsg();
-	SP_Buffer * reply = response->getReply()->getMsg();
-
-	if( NULL == message->getError() ) {
-		SP_CacheItem * item = message->takeItem();
-
-		if( NULL != item ) {
-			if( message->isCommand( "add" ) ) {
-				if( 0 == mCacheEx->add( item, message->getExpTime() ) ) {
-					reply->append( "STORED\r\n" );
-				} else {
-					reply->append( "NOT_STORED\r\n" );
-					delete item;
-				}
-			} else if( message->isCommand( "set" ) ) {
-				mCacheEx->set( item, message->getExpTime() );
-				reply->append( "STORED\r\n" );
-			} else if( message->isCommand( "replace" ) ) {
-				if( 0 == mCacheEx->replace( item, message->getExpTime() ) ) {
-					reply->append( "STORED\r\n" );
-				} else {
-					reply->append( "NOT_STORED\r\n" );
-					delete item;
-				}
-			} else if( message->isCommand( "cas" ) ) {
-				ret = mCacheEx->cas( item, message->getExpTime() );
-
-				if( 0 == ret ) {
-					reply->append( "STORED\r\n" );
-				} else {
-					reply->append( 1 == ret ? "EXISTS\r\n" : "NOT_FOUND\r\n" );
-					delete item;
-				}
+	decoder->leaveQueue();
 
-				ret = 0;
-			} else if( message->isCommand( "append" ) ) {
-				if( 0 == mCacheEx->append( item, message->getExpTime() ) ) {
-					reply->append( "STORED\r\n" );
-				} else {
-					reply->append( "NOT_STORED\r\n" );
-					delete item;
-				}
-			} else if( message->isCommand( "prepend" ) ) {
-				if( 0 == mCacheEx->prepend( item, message->getExpTime() ) ) {
-					reply->append( "STORED\r\n" );
-				} else {
-					reply->append( "NOT_STORED\r\n" );
-					delete item;
-				}
-			} else if( message->isCommand( "delete" ) ) {
-				if( 0 == mCacheEx->erase( item ) ) {
-					reply->append( "DELETED\r\n" );
-				} else {
-					reply->append( "NOT_FOUND\r\n" );
-				}
-				delete item;
-			} else if( message->isCommand( "incr" )
-					|| message->isCommand( "decr" ) ) {
+	// the protocol of a session never changes after the first request
+	if( SP_CacheMsgDecoder::eBinary == decoder->getProtocol() ) {
+		for( int i = 0; i < decoder->getCount() && 0 == ret; i++ ) {
+			ret = SP_CacheBinaryProto::handle( mCacheEx, decoder->getMsg( i ), response );
+		}
 
-				int ret = 0, newValue = 0;
+		decoder->reset();
 
-				if( message->isCommand( "incr" ) ) {
-					ret = mCacheEx->incr( item, message->getDelta(), &newValue );
-				} else {
-					ret = mCacheEx->decr( item, message->getDelta(), &newValue );
-				}
+		return ret;
+	}
 
-				if( 0 == ret ) {
-					char buffer[ 32 ] = { 0 };
-					snprintf( buffer, sizeof( buffer ), "%u\r\n", newValue );
-					reply->append( buffer );
-				} else if( -1 == ret ) {
-					reply->append( "NOT_FOUND\r\n" );
-				} else if( -2 == ret ) {
-					reply->append( "CLIENT_ERROR cannot increment or decrement non-numeric value" );
-				} else {
-					reply->append( "ERROR\r\n" );
-				}
+	// all the replies of a batch go out in one response
+	mTail = NULL;
 
-				delete item;
-			} else {
-				ret = 1;
-				reply->append( "ERROR unknown command: " );
-				reply->append( message->getCommand() );
-				reply->append( "\r\n" );
-			}
+	for( int i = 0; i < decoder->getCount() && 0 == ret; i++ ) {
+		SP_CacheProtoMessage * message = decoder->getMsg( i );
+
+		int cmd = message->getCmd();
+		if( NULL != message->getError() || ( SP_CacheProtoMessage::eGet != cmd
+				&& SP_CacheProtoMessage::eGets != cmd ) || cmd != mGetCmd ) {
+			flushGets( response );
+		}
+
+		if( message->isTooLarge() ) {
+			getReply( response )->append( "SERVER_ERROR object too large for cache\r\n" );
+		} else if( NULL == message->getError() ) {
+			ret = ( this->*sCommands[ cmd ] )( message, response );
 		} else {
-			if( message->isCommand( "get" ) || message->isCommand( "gets" ) ) {
-				mCacheEx->get( message->getKeyList(), response->getReply()->getFollowBlockList() );
-			} else if( message->isCommand( "flush_all" ) ) {
-				mCacheEx->flushAll( message->getExpTime() );
-				reply->append( "OK\r\n" );
-			} else if( message->isCommand( "stats" ) ) {
-				mCacheEx->stat( reply );
-			} else if( message->isCommand( "version" ) ) {
-				reply->append( "VERSION 1.2.5\r\n" );
-			} else if( message->isCommand( "quit" ) ) {
-				ret = 1;
-			} else {
-				ret = 1;
-				reply->append( "ERROR unknown command: " );
-				reply->append( message->getCommand() );
-				reply->append( "\r\n" );
-			}
+			SP_Buffer * reply = getReply( response );
+			reply->append( message->getError() );
+			reply->append( "\r\n" );
+			ret = 1;
 		}
-	} else {
-		reply->append( message->getError() );
-		reply->append( "\r\n" );
-		ret = 1;
+
+		putReply( response );
 	}
 
-	request->setMsgDecoder( new SP_CacheMsgDecoder() );
+	flushGets( response );
+
+	decoder->reset();
 
 	return ret;
 }
 
+SP_Buffer * SP_CacheProtoHandler :: getReply( SP_Response * response )
+{
+	if( response->getReply()->getFollowBlockList()->getCount() <= 0 ) {
+		return response->getReply()->getMsg();
+	}
+
+	return mText;
+}
+
+void SP_CacheProtoHandler :: putReply( SP_Response * response )
+{
+	if( mText->getSize() <= 0 ) return;
+
+	if( NULL == mTail ) {
+		mTail = new SP_BufferMsgBlock();
+		response->getReply()->getFollowBlockList()->append( mTail );
+	}
+
+	mTail->append( mText->getBuffer(), mText->getSize() );
+	mText->reset();
+}
+
+void SP_CacheProtoHandler :: flushGets( SP_Response * response )
+{
+	if( mPendingGets <= 0 ) return;
+
+	mCacheEx->get( mGetKeys, response->getReply()->getFollowBlockList(),
+			SP_CacheProtoMessage::eGets == mGetCmd );
+
+	mGetKeys->clean();
+	mPendingGets = 0;
+
+	// text after the values needs a new block
+	mTail = NULL;
+}
+
+int SP_CacheProtoHandler :: doGet( SP_CacheProtoMessage * message, SP_Response * response )
+{
+	// the keys stay in the message until the batch is done
+	if( mPendingGets > 0 ) mGetKeys->append( NULL );
+	mPendingGets++;
+	mGetCmd = message->getCmd();
+
+	SP_ArrayList * keyList = message->getKeyList();
+	for( int i = 0; i < keyList->getCount(); i++ ) {
+		mGetKeys->append( (void*)keyList->getItem( i ) );
+	}
+
+	return 0;
+}
+
+int SP_CacheProtoHandler :: doStore( SP_CacheProtoMessage * message, SP_Response * response )
+{
+	SP_Buffer * reply = getReply( response );
+
+	SP_CacheItem * item = message->takeItem();
+
+	int ret = -1;
+
+	switch( message->getCmd() ) {
+		case SP_CacheProtoMessage::eSet:
+			ret = mCacheEx->set( item, message->getExpTime() );
+			break;
+		case SP_CacheProtoMessage::eAdd:
+			ret = mCacheEx->add( item, message->getExpTime() );
+			break;
+		case SP_CacheProtoMessage::eReplace:
+			ret = mCacheEx->replace( item, message->getExpTime() );
+			break;
+		case SP_CacheProtoMessage::eCas:
+			ret = mCacheEx->cas( item, message->getExpTime() );
+			break;
+		case SP_CacheProtoMessage::eAppend:
+			ret = mCacheEx->append( item, message->getExpTime() );
+			break;
+		case SP_CacheProtoMessage::ePrepend:
+			ret = mCacheEx->prepend( item, message->getExpTime() );
+			break;
+	}
+
+	if( 0 == ret ) {
+		reply->append( "STORED\r\n" );
+	} else {
+		if( SP_CacheProtoMessage::eCas == message->getCmd() ) {
+			reply->append( 1 == ret ? "EXISTS\r\n" : "NOT_FOUND\r\n" );
+		} else {
+			reply->append( "NOT_STORED\r\n" );
+		}
+		item->release();
+	}
+
+	return 0;
+}
+
+int SP_CacheProtoHandler :: doDelete( SP_CacheProtoMessage * message, SP_Response * response )
+{
+	SP_Buffer * reply = getReply( response );
+
+	if( 0 == mCacheEx->erase( message->getKey() ) ) {
+		reply->append( "DELETED\r\n" );
+	} else {
+		reply->append( "NOT_FOUND\r\n" );
+	}
+
+	return 0;
+}
+
+int SP_CacheProtoHandler :: doCalc( SP_CacheProtoMessage * message, SP_Response * response )
+{
+	SP_Buffer * reply = getReply( response );
+
+	int ret = 0;
+	uint64_t newValue = 0;
+
+	if( SP_CacheProtoMessage::eIncr == message->getCmd() ) {
+		ret = mCacheEx->incr( message->getKey(), message->getDelta(), &newValue );
+	} else {
+		ret = mCacheEx->decr( message->getKey(), message->getDelta(), &newValue );
+	}
+
+	if( 0 == ret ) {
+		char buffer[ 32 ] = { 0 };
+		snprintf( buffer, sizeof( buffer ), "%llu\r\n", (unsigned long long)newValue );
+		reply->append( buffer );
+	} else if( -1 == ret ) {
+		reply->append( "NOT_FOUND\r\n" );
+	} else if( -2 == ret ) {
+		reply->append( "CLIENT_ERROR cannot increment or decrement non-numeric value\r\n" );
+	} else {
+		reply->append( "ERROR\r\n" );
+	}
+
+	return 0;
+}
+
+int SP_CacheProtoHandler :: doFlushAll( SP_CacheProtoMessage * message, SP_Response * response )
+{
+	mCacheEx->flushAll( message->getExpTime() );
+	getReply( response )->append( "OK\r\n" );
+
+	return 0;
+}
+
+int SP_CacheProtoHandler :: doStats( SP_CacheProtoMessage * message, SP_Response * response )
+{
+	SP_Buffer * reply = getReply( response );
+
+	if( 0 != mCacheEx->stat( reply, message->getKey() ) ) {
+		reply->append( "ERROR\r\n" );
+	}
+
+	return 0;
+}
+
+int SP_CacheProtoHandler :: doVersion( SP_CacheProtoMessage * message, SP_Response * response )
+{
+	getReply( response )->append( "VERSION 1.2.5\r\n" );
+
+	return 0;
+}
+
+int SP_CacheProtoHandler :: doQuit( SP_CacheProtoMessage * message, SP_Response * response )
+{
+	return 1;
+}
+
+int SP_CacheProtoHandler :: doUnknown( SP_CacheProtoMessage * message, SP_Response * response )
+{
+	SP_Buffer * reply = getReply( response );
+
+	reply->append( "ERROR unknown command: " );
+	reply->append( message->getCommand() );
+	reply->append( "\r\n" );
+
+	return 1;
+}
+
 void SP_CacheProtoHandler :: error( SP_Response * response )
 {
 }
@@ -6,22 +6,78 @@
 #ifndef __spcacheproto_hpp__
 #define __spcacheproto_hpp__
 
+#include "spserver/spporting.hpp"
 #include "spserver/spmsgdecoder.hpp"
 #include "spserver/sphandler.hpp"
 
+#include "spcachemr.hpp"
+
 class SP_CacheEx;
+class SP_ArrayList;
+class SP_Buffer;
+class SP_BufferMsgBlock;
 class SP_CacheProtoMessage;
+class SP_CacheSlabs;
+class SP_CacheQueueStat;
 
-class SP_CacheMsgDecoder : public SP_MsgDecoder {
+class SP_CacheMsgDecoder : public SP_MsgDecoder, public SP_CacheValueReader {
 public:
-	SP_CacheMsgDecoder();
+	// eUnknown : sniff the first byte, 0x80 is the binary protocol
+	enum { eUnknown, eText, eBinary };
+
+	// maxItemSize : larger values are skipped before any allocation, 0 means no limit
+	SP_CacheMsgDecoder( SP_CacheSlabs * slabs = NULL, int protocol = eUnknown,
+			size_t maxItemSize = 0 );
 	virtual ~SP_CacheMsgDecoder();
 
+	// decode all the complete requests in inBuffer, at most eMaxBatch
 	virtual int decode( SP_Buffer * inBuffer );
-	SP_CacheProtoMessage * getMsg();
+
+	// count of the complete requests
+	int getCount() const;
+	SP_CacheProtoMessage * getMsg( int index );
+
+	int getProtocol() const;
+
+	// a complete batch enters queueStat, the handler takes it out by leaveQueue
+	void setQueueStat( SP_CacheQueueStat * queueStat );
+	void leaveQueue();
+
+	// drop the complete requests, the one in progress is kept,
+	// the messages are reused
+	void reset();
+
+	// the item of a set in progress, after its command line or header,
+	// and before anything else is in the input buffer
+	virtual void * getValueSpace( size_t * bytes );
+	virtual void fillValue( size_t bytes );
 
 private:
-	SP_CacheProtoMessage * mMessage;
+	enum { eMaxKeyLen = 250, eMaxBatch = 64 };
+
+	int decodeText( SP_Buffer * inBuffer, SP_CacheProtoMessage * message );
+
+	// line is the command line in the input buffer, end points to its LF
+	void parseLine( SP_CacheProtoMessage * message, const char * line, const char * end );
+
+	SP_CacheSlabs * mSlabs;
+	size_t mMaxItemSize;
+
+	// the complete ones are [0, mCount), the one in progress is mCount
+	SP_CacheProtoMessage * mMessages[ eMaxBatch + 1 ];
+	int mCount;
+
+	// the command line or the binary header of the one in progress is decoded
+	int mHasHeader;
+
+	int mProtocol;
+
+	// value bytes of a binary request still to read
+	size_t mBodyLeft;
+
+	SP_CacheQueueStat * mQueueStat;
+	int mQueued;
+	struct timeval mQueueTime;
 };
 
 class SP_CacheProtoHandler : public SP_Handler {
@@ -41,7 +97,42 @@ public:
 	virtual void close();
 
 private:
+	typedef int ( SP_CacheProtoHandler::*Command_t )( SP_CacheProtoMessage * message,
+			SP_Response * response );
+
+	// one entry for every text command, see SP_CacheProtoMessage
+	static const Command_t sCommands[];
+
+	// return 1 : terminate session, 0 : continue
+	int doGet( SP_CacheProtoMessage * message, SP_Response * response );
+	int doStore( SP_CacheProtoMessage * message, SP_Response * response );
+	int doDelete( SP_CacheProtoMessage * message, SP_Response * response );
+	int doCalc( SP_CacheProtoMessage * message, SP_Response * response );
+	int doFlushAll( SP_CacheProtoMessage * message, SP_Response * response );
+	int doStats( SP_CacheProtoMessage * message, SP_Response * response );
+	int doVersion( SP_CacheProtoMessage * message, SP_Response * response );
+	int doQuit( SP_CacheProtoMessage * message, SP_Response * response );
+	int doUnknown( SP_CacheProtoMessage * message, SP_Response * response );
+
+	// the replies keep the order of the requests, text goes to the reply buffer
+	// before the first value block, then to buffer blocks between value blocks
+	SP_Buffer * getReply( SP_Response * response );
+	void putReply( SP_Response * response );
+
+	// serve the pending gets of a batch with one SP_CacheEx::get call
+	void flushGets( SP_Response * response );
+
 	SP_CacheEx * mCacheEx;
+
+	// keys of the pending gets, every get but the first one starts with NULL
+	SP_ArrayList * mGetKeys;
+	int mPendingGets;
+
+	// get or gets, a batch of gets never mixes them
+	int mGetCmd;
+
+	SP_Buffer * mText;
+	SP_BufferMsgBlock * mTail;
 };
 
 class SP_CacheProtoHandlerFactory : public SP_HandlerFactory {
@@ -0,0 +1,933 @@
+/*
+ * Copyright 2008 Stephen Liu
+ * For license terms, see the file COPYING along with this library.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <netdb.h>
+#include <sys/types.h>
+#include <sys/time.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#include "spserver/spporting.hpp"
+#include "spserver/spbuffer.hpp"
+#include "spserver/sputils.hpp"
+#include "spserver/sprequest.hpp"
+#include "spserver/spresponse.hpp"
+
+#include "spcacheproxy.hpp"
+#include "spcacheproto.hpp"
+#include "spcachemsg.hpp"
+#include "spcachequeue.hpp"
+
+struct tagSP_CacheProxyConn {
+	int mIndex;
+	int mFd;
+
+	// the replies read ahead, [mPos, mLen) is not taken yet
+	size_t mPos, mLen;
+	char mBuffer[ 16384 ];
+};
+
+struct tagSP_CacheProxyBackend {
+	char mHost[ 64 ];
+	int mPort;
+	struct sockaddr_in mAddr;
+
+	SP_ArrayList * mIdle;
+	time_t mDownUntil;
+
+	size_t mConnects, mErrors;
+};
+
+struct tagSP_CacheProxyPoint {
+	uint32_t mPoint;
+	int mIndex;
+};
+
+// the reply of one request, it is a line from mBackend, or the VALUE
+// blocks of the keys [mFirstKey, mFirstKey + mKeyCount) from the backends
+struct tagSP_CacheProxySlot {
+	enum { eLocal, eLine, eGet, eAll };
+
+	int mType;
+	int mBackend;
+	size_t mOffset, mBytes;
+
+	int mFirstKey, mKeyCount;
+};
+
+struct tagSP_CacheProxyKey {
+	const char * mKey;
+	int mBackend;
+
+	// the VALUE block in the replies of the backend, 0 bytes for a miss
+	size_t mOffset, mBytes;
+};
+
+// the seconds an upstream read or write may take
+enum { eUpstreamTimeout = 2 };
+
+static int sp_proxy_cmppoint( const void * a, const void * b )
+{
+	uint32_t x = ( (const SP_CacheProxyPoint_t*)a )->mPoint;
+	uint32_t y = ( (const SP_CacheProxyPoint_t*)b )->mPoint;
+
+	return x < y ? -1 : ( x > y ? 1 : 0 );
+}
+
+// MD5 of RFC 1321, the continuum and the keys are hashed the same as
+// the ketama of libmemcached, so a client of it finds the same backends
+static void sp_proxy_md5block( uint32_t state[ 4 ], const unsigned char * block )
+{
+	static const uint32_t sines[ 64 ] = {
+		0xd76aa478, 0xe8c7b756, 0x242070db, 0xc1bdceee, 0xf57c0faf, 0x4787c62a, 0xa8304613, 0xfd469501,
+		0x698098d8, 0x8b44f7af, 0xffff5bb1, 0x895cd7be, 0x6b901122, 0xfd987193, 0xa679438e, 0x49b40821,
+		0xf61e2562, 0xc040b340, 0x265e5a51, 0xe9b6c7aa, 0xd62f105d, 0x02441453, 0xd8a1e681, 0xe7d3fbc8,
+		0x21e1cde6, 0xc33707d6, 0xf4d50d87, 0x455a14ed, 0xa9e3e905, 0xfcefa3f8, 0x676f02d9, 0x8d2a4c8a,
+		0xfffa3942, 0x8771f681, 0x6d9d6122, 0xfde5380c, 0xa4beea44, 0x4bdecfa9, 0xf6bb4b60, 0xbebfbc70,
+		0x289b7ec6, 0xeaa127fa, 0xd4ef3085, 0x04881d05, 0xd9d4d039, 0xe6db99e5, 0x1fa27cf8, 0xc4ac5665,
+		0xf4292244, 0x432aff97, 0xab9423a7, 0xfc93a039, 0x655b59c3, 0x8f0ccc92, 0xffeff47d, 0x85845dd1,
+		0x6fa87e4f, 0xfe2ce6e0, 0xa3014314, 0x4e0811a1, 0xf7537e82, 0xbd3af235, 0x2ad7d2bb, 0xeb86d391
+	};
+
+	static const int shifts[ 16 ] = { 7, 12, 17, 22, 5, 9, 14, 20, 4, 11, 16, 23, 6, 10, 15, 21 };
+
+	uint32_t words[ 16 ];
+	for( int i = 0; i < 16; i++ ) {
+		words[i] = block[ i * 4 ] | ( block[ i * 4 + 1 ] << 8 )
+				| ( block[ i * 4 + 2 ] << 16 ) | ( (uint32_t)block[ i * 4 + 3 ] << 24 );
+	}
+
+	uint32_t a = state[0], b = state[1], c = state[2], d = state[3];
+
+	for( int i = 0; i < 64; i++ ) {
+		uint32_t f = 0;
+		int g = 0;
+
+		if( i < 16 ) {
+			f = ( b & c ) | ( ~b & d );
+			g = i;
+		} else if( i < 32 ) {
+			f = ( d & b ) | ( ~d & c );
+			g = ( 5 * i + 1 ) % 16;
+		} else if( i < 48 ) {
+			f = b ^ c ^ d;
+			g = ( 3 * i + 5 ) % 16;
+		} else {
+			f = c ^ ( b | ~d );
+			g = ( 7 * i ) % 16;
+		}
+
+		int shift = shifts[ ( i / 16 ) * 4 + i % 4 ];
+		uint32_t sum = a + f + sines[i] + words[g];
+
+		a = d;
+		d = c;
+		c = b;
+		b = b + ( ( sum << shift ) | ( sum >> ( 32 - shift ) ) );
+	}
+
+	state[0] += a;
+	state[1] += b;
+	state[2] += c;
+	state[3] += d;
+}
+
+static void sp_proxy_md5( const char * data, size_t len, unsigned char digest[ 16 ] )
+{
+	uint32_t state[ 4 ] = { 0x67452301, 0xefcdab89, 0x98badcfe, 0x10325476 };
+
+	size_t done = 0;
+	for( ; len - done >= 64; done += 64 ) {
+		sp_proxy_md5block( state, (const unsigned char*)data + done );
+	}
+
+	// the tail, 0x80, zeros and the bits of len, in one or two blocks
+	unsigned char tail[ 128 ];
+	memset( tail, 0, sizeof( tail ) );
+	memcpy( tail, data + done, len - done );
+	tail[ len - done ] = 0x80;
+
+	size_t tailBytes = ( len - done < 56 ) ? 64 : 128;
+	uint64_t bits = (uint64_t)len * 8;
+	for( int i = 0; i < 8; i++ ) tail[ tailBytes - 8 + i ] = (unsigned char)( bits >> ( i * 8 ) );
+
+	sp_proxy_md5block( state, tail );
+	if( 128 == tailBytes ) sp_proxy_md5block( state, tail + 64 );
+
+	for( int i = 0; i < 16; i++ ) digest[i] = (unsigned char)( state[ i / 4 ] >> ( ( i % 4 ) * 8 ) );
+}
+
+// the index-th of the 4 points in a digest
+static uint32_t sp_proxy_point( const unsigned char * digest, int index )
+{
+	const unsigned char * pos = digest + index * 4;
+
+	return ( (uint32_t)pos[3] << 24 ) | ( pos[2] << 16 ) | ( pos[1] << 8 ) | pos[0];
+}
+
+// 0 : OK, -1 : broken
+static int sp_proxy_writen( int fd, const void * data, size_t bytes )
+{
+	const char * pos = (const char*)data;
+
+	for( ; bytes > 0; ) {
+		int len = send( fd, pos, bytes, MSG_NOSIGNAL );
+		if( len < 0 && EINTR == errno ) continue;
+		if( len <= 0 ) return -1;
+
+		pos += len;
+		bytes -= len;
+	}
+
+	return 0;
+}
+
+// 0 : OK, -1 : broken
+static int sp_proxy_fill( SP_CacheProxyConn_t * conn )
+{
+	for( ; ; ) {
+		int len = recv( conn->mFd, conn->mBuffer, sizeof( conn->mBuffer ), 0 );
+		if( len < 0 && EINTR == errno ) continue;
+		if( len <= 0 ) return -1;
+
+		conn->mPos = 0;
+		conn->mLen = len;
+
+		return 0;
+	}
+}
+
+// append a line with its CRLF to buffer
+// 0 : OK, -1 : broken or too long
+static int sp_proxy_readline( SP_CacheProxyConn_t * conn, SP_Buffer * buffer, size_t * bytes )
+{
+	*bytes = 0;
+
+	for( ; *bytes < 4096; ) {
+		if( conn->mPos >= conn->mLen && 0 != sp_proxy_fill( conn ) ) return -1;
+
+		const char * begin = conn->mBuffer + conn->mPos;
+		const char * end = (const char*)memchr( begin, '\n', conn->mLen - conn->mPos );
+		size_t len = NULL != end ? end + 1 - begin : conn->mLen - conn->mPos;
+
+		buffer->append( begin, len );
+		conn->mPos += len;
+		*bytes += len;
+
+		if( NULL != end ) return 0;
+	}
+
+	return -1;
+}
+
+// 0 : OK, -1 : broken
+static int sp_proxy_readn( SP_CacheProxyConn_t * conn, SP_Buffer * buffer, size_t bytes )
+{
+	for( ; bytes > 0; ) {
+		if( conn->mPos >= conn->mLen && 0 != sp_proxy_fill( conn ) ) return -1;
+
+		size_t len = conn->mLen - conn->mPos;
+		if( len > bytes ) len = bytes;
+
+		buffer->append( conn->mBuffer + conn->mPos, len );
+		conn->mPos += len;
+		bytes -= len;
+	}
+
+	return 0;
+}
+
+//---------------------------------------------------------------------------
+
+SP_CacheProxyPool :: SP_CacheProxyPool()
+{
+	sp_thread_mutex_init( &mMutex, NULL );
+
+	mBackends = NULL;
+	mCount = 0;
+
+	mPoints = NULL;
+	mPointCount = 0;
+
+	mBatches = 0;
+}
+
+SP_CacheProxyPool :: ~SP_CacheProxyPool()
+{
+	for( int i = 0; i < mCount; i++ ) {
+		SP_CacheProxyBackend_t * backend = mBackends[i];
+
+		for( ; backend->mIdle->getCount() > 0; ) {
+			SP_CacheProxyConn_t * conn = (SP_CacheProxyConn_t*)backend->mIdle->takeItem(
+					SP_ArrayList::LAST_INDEX );
+			::close( conn->mFd );
+			free( conn );
+		}
+
+		delete backend->mIdle;
+		free( backend );
+	}
+
+	free( mBackends );
+	free( mPoints );
+
+	sp_thread_mutex_destroy( &mMutex );
+}
+
+int SP_CacheProxyPool :: addBackends( const char * backends )
+{
+	int ret = 0;
+
+	char hostPort[ 128 ] = { 0 };
+	for( int i = 0; 0 == ret
+			&& 0 == sp_strtok( backends, i, hostPort, sizeof( hostPort ), ',' ); i++ ) {
+		if( '\0' != hostPort[0] ) ret = addBackend( hostPort );
+	}
+
+	if( 0 == ret ) build();
+
+	return ret;
+}
+
+int SP_CacheProxyPool :: addBackend( const char * hostPort )
+{
+	char host[ 64 ] = { 0 };
+	const char * pos = strrchr( hostPort, ':' );
+	if( NULL == pos || atoi( pos + 1 ) <= 0 || pos - hostPort >= (int)sizeof( host ) ) {
+		sp_syslog( LOG_WARNING, "Invalid backend %s, host:port is expected", hostPort );
+		return -1;
+	}
+
+	memcpy( host, hostPort, pos - hostPort );
+
+	struct addrinfo hints, * result = NULL;
+	memset( &hints, 0, sizeof( hints ) );
+	hints.ai_family = AF_INET;
+	hints.ai_socktype = SOCK_STREAM;
+
+	if( 0 != getaddrinfo( host, pos + 1, &hints, &result ) ) {
+		sp_syslog( LOG_WARNING, "Unknown backend %s", hostPort );
+		return -1;
+	}
+
+	SP_CacheProxyBackend_t * backend = (SP_CacheProxyBackend_t*)calloc(
+			1, sizeof( SP_CacheProxyBackend_t ) );
+	sp_strlcpy( backend->mHost, host, sizeof( backend->mHost ) );
+	backend->mPort = atoi( pos + 1 );
+	memcpy( &( backend->mAddr ), result->ai_addr, sizeof( backend->mAddr ) );
+	backend->mIdle = new SP_ArrayList();
+
+	freeaddrinfo( result );
+
+	mBackends = (SP_CacheProxyBackend_t**)realloc( mBackends,
+			sizeof( SP_CacheProxyBackend_t * ) * ( mCount + 1 ) );
+	mBackends[ mCount++ ] = backend;
+
+	return 0;
+}
+
+void SP_CacheProxyPool :: build()
+{
+	free( mPoints );
+
+	mPointCount = mCount * ePointsPerBackend;
+	mPoints = (SP_CacheProxyPoint_t*)malloc( sizeof( SP_CacheProxyPoint_t ) * ( mPointCount + 1 ) );
+
+	// the points of a backend depend only on its address, so the continuum
+	// is the same on every proxy. Every digest gives ePointsPerDigest points,
+	// the name leaves out the port 11211, the same as libmemcached
+	for( int i = 0; i < mCount; i++ ) {
+		for( int j = 0; j < ePointsPerBackend / ePointsPerDigest; j++ ) {
+			char name[ 128 ] = { 0 };
+			if( 11211 == mBackends[i]->mPort ) {
+				snprintf( name, sizeof( name ), "%s-%d", mBackends[i]->mHost, j );
+			} else {
+				snprintf( name, sizeof( name ), "%s:%d-%d", mBackends[i]->mHost, mBackends[i]->mPort, j );
+			}
+
+			unsigned char digest[ 16 ];
+			sp_proxy_md5( name, strlen( name ), digest );
+
+			for( int k = 0; k < ePointsPerDigest; k++ ) {
+				SP_CacheProxyPoint_t * point = &( mPoints[ i * ePointsPerBackend + j * ePointsPerDigest + k ] );
+				point->mPoint = sp_proxy_point( digest, k );
+				point->mIndex = i;
+			}
+		}
+	}
+
+	qsort( mPoints, mPointCount, sizeof( SP_CacheProxyPoint_t ), sp_proxy_cmppoint );
+}
+
+int SP_CacheProxyPool :: getCount() const
+{
+	return mCount;
+}
+
+int SP_CacheProxyPool :: locate( const char * key ) const
+{
+	if( mPointCount <= 0 ) return -1;
+
+	unsigned char digest[ 16 ];
+	sp_proxy_md5( key, strlen( key ), digest );
+
+	uint32_t point = sp_proxy_point( digest, 0 );
+
+	// the first point at or after the key, wrap around to the first one
+	int low = 0, high = mPointCount;
+	for( ; low < high; ) {
+		int mid = low + ( high - low ) / 2;
+		if( mPoints[ mid ].mPoint < point ) {
+			low = mid + 1;
+		} else {
+			high = mid;
+		}
+	}
+
+	return mPoints[ low < mPointCount ? low : 0 ].mIndex;
+}
+
+SP_CacheProxyConn_t * SP_CacheProxyPool :: take( int index )
+{
+	SP_CacheProxyBackend_t * backend = mBackends[ index ];
+
+	SP_CacheProxyConn_t * conn = NULL;
+
+	sp_thread_mutex_lock( &mMutex );
+
+	mBatches++;
+
+	int isDown = backend->mDownUntil > time( NULL );
+	if( backend->mIdle->getCount() > 0 ) {
+		conn = (SP_CacheProxyConn_t*)backend->mIdle->takeItem( SP_ArrayList::LAST_INDEX );
+	}
+
+	sp_thread_mutex_unlock( &mMutex );
+
+	if( NULL != conn || isDown ) return conn;
+
+	int fd = socket( AF_INET, SOCK_STREAM, 0 );
+	if( fd >= 0 ) {
+		struct timeval timeout;
+		timeout.tv_sec = eUpstreamTimeout;
+		timeout.tv_usec = 0;
+
+		// SO_SNDTIMEO limits the connect too
+		setsockopt( fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof( timeout ) );
+		setsockopt( fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof( timeout ) );
+
+		int on = 1;
+		setsockopt( fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof( on ) );
+
+		if( 0 != connect( fd, (struct sockaddr*)&( backend->mAddr ), sizeof( backend->mAddr ) ) ) {
+			::close( fd );
+			fd = -1;
+		}
+	}
+
+	sp_thread_mutex_lock( &mMutex );
+
+	if( fd >= 0 ) {
+		backend->mConnects++;
+
+		conn = (SP_CacheProxyConn_t*)malloc( sizeof( SP_CacheProxyConn_t ) );
+		conn->mIndex = index;
+		conn->mFd = fd;
+		conn->mPos = conn->mLen = 0;
+	} else {
+		backend->mErrors++;
+		backend->mDownUntil = time( NULL ) + eRetryInterval;
+	}
+
+	sp_thread_mutex_unlock( &mMutex );
+
+	if( fd < 0 ) {
+		sp_syslog( LOG_WARNING, "Cannot connect to backend %s:%d", backend->mHost, backend->mPort );
+	}
+
+	return conn;
+}
+
+void SP_CacheProxyPool :: put( SP_CacheProxyConn_t * conn, int broken )
+{
+	SP_CacheProxyBackend_t * backend = mBackends[ conn->mIndex ];
+
+	// a reply left over means the stream is out of step
+	if( broken || conn->mPos < conn->mLen ) {
+		sp_thread_mutex_lock( &mMutex );
+		backend->mErrors++;
+		sp_thread_mutex_unlock( &mMutex );
+
+		::close( conn->mFd );
+		free( conn );
+		return;
+	}
+
+	sp_thread_mutex_lock( &mMutex );
+	backend->mIdle->append( conn );
+	sp_thread_mutex_unlock( &mMutex );
+}
+
+void SP_CacheProxyPool :: stat( SP_Buffer * buffer )
+{
+	char temp[ 512 ] = { 0 };
+
+	sp_thread_mutex_lock( &mMutex );
+
+	snprintf( temp, sizeof( temp ), "STAT pid %d\r\n", (int)getpid() );
+	buffer->append( temp );
+
+	snprintf( temp, sizeof( temp ), "STAT proxy_backends %d\r\n", mCount );
+	buffer->append( temp );
+
+	snprintf( temp, sizeof( temp ), "STAT proxy_batches %lu\r\n", (unsigned long)mBatches );
+	buffer->append( temp );
+
+	time_t now = time( NULL );
+
+	for( int i = 0; i < mCount; i++ ) {
+		SP_CacheProxyBackend_t * backend = mBackends[i];
+
+		snprintf( temp, sizeof( temp ), "STAT backend_%d_addr %s:%d\r\n",
+				i, backend->mHost, backend->mPort );
+		buffer->append( temp );
+
+		snprintf( temp, sizeof( temp ), "STAT backend_%d_status %s\r\n",
+				i, backend->mDownUntil > now ? "down" : "up" );
+		buffer->append( temp );
+
+		snprintf( temp, sizeof( temp ), "STAT backend_%d_idle_conns %d\r\n",
+				i, backend->mIdle->getCount() );
+		buffer->append( temp );
+
+		snprintf( temp, sizeof( temp ), "STAT backend_%d_connects %lu\r\n",
+				i, (unsigned long)backend->mConnects );
+		buffer->append( temp );
+
+		snprintf( temp, sizeof( temp ), "STAT backend_%d_errors %lu\r\n",
+				i, (unsigned long)backend->mErrors );
+		buffer->append( temp );
+	}
+
+	sp_thread_mutex_unlock( &mMutex );
+}
+
+//---------------------------------------------------------------------------
+
+SP_CacheProxyHandler :: SP_CacheProxyHandler( SP_CacheProxyPool * pool,
+		SP_CacheQueueStat * queueStat, size_t maxItemSize )
+{
+	mPool = pool;
+	mQueueStat = queueStat;
+	mMaxItemSize = maxItemSize;
+
+	int count = mPool->getCount();
+
+	mOut = (SP_Buffer**)malloc( sizeof( SP_Buffer * ) * count );
+	mIn = (SP_Buffer**)malloc( sizeof( SP_Buffer * ) * count );
+	mFailed = (int*)calloc( count, sizeof( int ) );
+
+	for( int i = 0; i < count; i++ ) {
+		mOut[i] = new SP_Buffer();
+		mIn[i] = new SP_Buffer();
+	}
+
+	mLocal = new SP_Buffer();
+
+	mSlots = NULL;
+	mSlotCapacity = 0;
+
+	mKeys = NULL;
+	mKeyCount = mKeyCapacity = 0;
+}
+
+SP_CacheProxyHandler :: ~SP_CacheProxyHandler()
+{
+	for( int i = 0; i < mPool->getCount(); i++ ) {
+		delete mOut[i];
+		delete mIn[i];
+	}
+
+	free( mOut );
+	free( mIn );
+	free( mFailed );
+
+	delete mLocal;
+
+	free( mSlots );
+	free( mKeys );
+}
+
+int SP_CacheProxyHandler :: start( SP_Request * request, SP_Response * response )
+{
+	// the backends are waiting too, a new session only adds to the wait
+	if( NULL != mQueueStat && mQueueStat->isOverloaded() ) {
+		mQueueStat->reject();
+		response->getReply()->getMsg()->append( "SERVER_ERROR Server is busy now\r\n" );
+		return -1;
+	}
+
+	// the values are forwarded as they are, no slabs
+	SP_CacheMsgDecoder * decoder = new SP_CacheMsgDecoder( NULL,
+			SP_CacheMsgDecoder::eText, mMaxItemSize );
+	decoder->setQueueStat( mQueueStat );
+
+	request->setMsgDecoder( decoder );
+
+	return 0;
+}
+
+int SP_CacheProxyHandler :: handle( SP_Request * request, SP_Response * response )
+{
+	SP_CacheMsgDecoder * decoder = (SP_CacheMsgDecoder*)request->getMsgDecoder();
+	decoder->leaveQueue();
+
+	if( decoder->getCount() > mSlotCapacity ) {
+		mSlotCapacity = decoder->getCount();
+		mSlots = (SP_CacheProxySlot_t*)realloc( mSlots, sizeof( SP_CacheProxySlot_t ) * mSlotCapacity );
+	}
+
+	for( int i = 0; i < mPool->getCount(); i++ ) {
+		mOut[i]->reset();
+		mIn[i]->reset();
+		mFailed[i] = 0;
+	}
+
+	mLocal->reset();
+	mKeyCount = 0;
+
+	int ret = 0, count = 0;
+
+	// the requests after a bad one or a quit are dropped with the session
+	for( ; count < decoder->getCount() && 0 == ret; count++ ) {
+		ret = prepare( decoder->getMsg( count ), &( mSlots[ count ] ) );
+	}
+
+	forward( count );
+
+	reply( response->getReply()->getMsg(), count );
+
+	decoder->reset();
+
+	return ret;
+}
+
+int SP_CacheProxyHandler :: prepare( SP_CacheProtoMessage * message, SP_CacheProxySlot_t * slot )
+{
+	memset( slot, 0, sizeof( SP_CacheProxySlot_t ) );
+	slot->mType = SP_CacheProxySlot_t::eLocal;
+	slot->mOffset = mLocal->getSize();
+
+	int ret = 0;
+
+	char line[ 512 ] = { 0 };
+
+	if( message->isTooLarge() ) {
+		mLocal->append( "SERVER_ERROR object too large for cache\r\n" );
+	} else if( NULL != message->getError() ) {
+		mLocal->append( message->getError() );
+		mLocal->append( "\r\n" );
+		ret = 1;
+	} else {
+		switch( message->getCmd() ) {
+			case SP_CacheProtoMessage::eGet:
+			case SP_CacheProtoMessage::eGets:
+			{
+				SP_ArrayList * keyList = message->getKeyList();
+
+				if( mKeyCount + keyList->getCount() > mKeyCapacity ) {
+					mKeyCapacity = ( mKeyCount + keyList->getCount() ) * 2;
+					mKeys = (SP_CacheProxyKey_t*)realloc( mKeys, sizeof( SP_CacheProxyKey_t ) * mKeyCapacity );
+				}
+
+				slot->mType = SP_CacheProxySlot_t::eGet;
+				slot->mFirstKey = mKeyCount;
+				slot->mKeyCount = keyList->getCount();
+
+				for( int i = 0; i < keyList->getCount(); i++ ) {
+					SP_CacheProxyKey_t * key = &( mKeys[ mKeyCount++ ] );
+					memset( key, 0, sizeof( SP_CacheProxyKey_t ) );
+
+					key->mKey = (const char*)keyList->getItem( i );
+					key->mBackend = mPool->locate( key->mKey );
+				}
+
+				// one get per backend with its keys, in the order of the request
+				for( int i = 0; i < mPool->getCount(); i++ ) {
+					int hasKeys = 0;
+
+					for( int j = slot->mFirstKey; j < mKeyCount; j++ ) {
+						if( i != mKeys[j].mBackend ) continue;
+
+						if( ! hasKeys ) mOut[i]->append( message->getCommand() );
+						mOut[i]->append( " " );
+						mOut[i]->append( mKeys[j].mKey );
+						hasKeys = 1;
+					}
+
+					if( hasKeys ) mOut[i]->append( "\r\n" );
+				}
+
+				break;
+			}
+			case SP_CacheProtoMessage::eSet:
+			case SP_CacheProtoMessage::eAdd:
+			case SP_CacheProtoMessage::eReplace:
+			case SP_CacheProtoMessage::eCas:
+			case SP_CacheProtoMessage::eAppend:
+			case SP_CacheProtoMessage::ePrepend:
+			{
+				SP_CacheItem * item = message->getItem();
+
+				slot->mType = SP_CacheProxySlot_t::eLine;
+				slot->mBackend = mPool->locate( item->getKey() );
+
+				SP_Buffer * out = mOut[ slot->mBackend ];
+
+				size_t valueBytes = item->getValueBytes();
+
+				// the decoder keeps the cas of a request plus one, see parseLine
+				if( SP_CacheProtoMessage::eCas == message->getCmd() ) {
+					snprintf( line, sizeof( line ), "%s %s %u %ld %lu %llu\r\n",
+							message->getCommand(), item->getKey(), (unsigned int)item->getClientFlags(),
+							(long)message->getRawExpTime(), (unsigned long)valueBytes,
+							(unsigned long long)( item->getCasUnique() - 1 ) );
+				} else {
+					snprintf( line, sizeof( line ), "%s %s %u %ld %lu\r\n",
+							message->getCommand(), item->getKey(), (unsigned int)item->getClientFlags(),
+							(long)message->getRawExpTime(), (unsigned long)valueBytes );
+				}
+				out->append( line );
+
+				size_t left = valueBytes;
+				for( int i = 0; left > 0 && i < item->getChunkCount(); i++ ) {
+					size_t bytes = 0;
+					const void * data = item->getChunk( i, &bytes );
+					if( bytes > left ) bytes = left;
+
+					if( bytes > 0 ) out->append( data, bytes );
+					left -= bytes;
+				}
+
+				out->append( "\r\n" );
+
+				break;
+			}
+			case SP_CacheProtoMessage::eDelete:
+				slot->mType = SP_CacheProxySlot_t::eLine;
+				slot->mBackend = mPool->locate( message->getKey() );
+
+				snprintf( line, sizeof( line ), "delete %s\r\n", message->getKey() );
+				mOut[ slot->mBackend ]->append( line );
+				break;
+			case SP_CacheProtoMessage::eIncr:
+			case SP_CacheProtoMessage::eDecr:
+				slot->mType = SP_CacheProxySlot_t::eLine;
+				slot->mBackend = mPool->locate( message->getKey() );
+
+				snprintf( line, sizeof( line ), "%s %s %llu\r\n", message->getCommand(),
+						message->getKey(), (unsigned long long)message->getDelta() );
+				mOut[ slot->mBackend ]->append( line );
+				break;
+			case SP_CacheProtoMessage::eFlushAll:
+				slot->mType = SP_CacheProxySlot_t::eAll;
+
+				snprintf( line, sizeof( line ), "flush_all %ld\r\n", (long)message->getRawExpTime() );
+				for( int i = 0; i < mPool->getCount(); i++ ) mOut[i]->append( line );
+				break;
+			case SP_CacheProtoMessage::eStats:
+				// the counters of the backends are on the backends
+				if( NULL == message->getKey() ) {
+					mPool->stat( mLocal );
+					mLocal->append( "END\r\n" );
+				} else {
+					mLocal->append( "ERROR\r\n" );
+				}
+				break;
+			case SP_CacheProtoMessage::eVersion:
+				mLocal->append( "VERSION 1.2.5\r\n" );
+				break;
+			case SP_CacheProtoMessage::eQuit:
+				ret = 1;
+				break;
+			default:
+				mLocal->append( "ERROR unknown command: " );
+				mLocal->append( message->getCommand() );
+				mLocal->append( "\r\n" );
+				ret = 1;
+				break;
+		}
+	}
+
+	if( SP_CacheProxySlot_t::eLocal == slot->mType ) {
+		slot->mBytes = mLocal->getSize() - slot->mOffset;
+	}
+
+	return ret;
+}
+
+void SP_CacheProxyHandler :: forward( int slotCount )
+{
+	int count = mPool->getCount();
+
+	SP_CacheProxyConn_t ** conns = (SP_CacheProxyConn_t**)calloc( count, sizeof( void * ) );
+
+	// every backend gets its requests before any reply is read,
+	// so the backends work on them at the same time
+	for( int i = 0; i < count; i++ ) {
+		if( mOut[i]->getSize() <= 0 ) continue;
+
+		conns[i] = mPool->take( i );
+
+		if( NULL == conns[i] || 0 != sp_proxy_writen( conns[i]->mFd,
+				mOut[i]->getBuffer(), mOut[i]->getSize() ) ) {
+			mFailed[i] = 1;
+		}
+	}
+
+	for( int i = 0; i < count; i++ ) {
+		if( NULL == conns[i] ) continue;
+
+		if( ! mFailed[i] && 0 != readReplies( i, conns[i], slotCount ) ) mFailed[i] = 1;
+
+		mPool->put( conns[i], mFailed[i] );
+	}
+
+	free( conns );
+}
+
+int SP_CacheProxyHandler :: readReplies( int index, SP_CacheProxyConn_t * conn, int slotCount )
+{
+	SP_Buffer * in = mIn[ index ];
+
+	for( int i = 0; i < slotCount; i++ ) {
+		SP_CacheProxySlot_t * slot = &( mSlots[i] );
+
+		if( SP_CacheProxySlot_t::eLine == slot->mType && index == slot->mBackend ) {
+			slot->mOffset = in->getSize();
+			if( 0 != sp_proxy_readline( conn, in, &( slot->mBytes ) ) ) return -1;
+		}
+
+		// only the result matters, it is the same on every backend
+		if( SP_CacheProxySlot_t::eAll == slot->mType ) {
+			size_t offset = in->getSize(), bytes = 0;
+			if( 0 != sp_proxy_readline( conn, in, &bytes ) ) return -1;
+			if( 0 != strncmp( (const char*)in->getBuffer() + offset, "OK\r\n", 4 ) ) return -1;
+		}
+
+		if( SP_CacheProxySlot_t::eGet != slot->mType ) continue;
+
+		SP_CacheProxyKey_t * keys = mKeys + slot->mFirstKey;
+
+		int hasKeys = 0;
+		for( int j = 0; j < slot->mKeyCount && ! hasKeys; j++ ) {
+			if( index == keys[j].mBackend ) hasKeys = 1;
+		}
+		if( ! hasKeys ) continue;
+
+		// the hits come in the order of the keys, the misses are left out
+		for( int next = 0; ; ) {
+			size_t offset = in->getSize(), bytes = 0;
+			if( 0 != sp_proxy_readline( conn, in, &bytes ) ) return -1;
+
+			const char * line = (const char*)in->getBuffer() + offset;
+			if( 5 == bytes && 0 == strncmp( line, "END\r\n", 5 ) ) break;
+
+			char key[ 256 ] = { 0 };
+			unsigned int flags = 0;
+			unsigned long valueBytes = 0;
+			if( 0 != strncmp( line, "VALUE ", 6 )
+					|| 3 != sscanf( line, "VALUE %255s %u %lu", key, &flags, &valueBytes ) ) {
+				return -1;
+			}
+
+			for( ; next < slot->mKeyCount; next++ ) {
+				if( index == keys[ next ].mBackend && 0 == strcmp( key, keys[ next ].mKey ) ) break;
+			}
+			if( next >= slot->mKeyCount ) return -1;
+
+			if( 0 != sp_proxy_readn( conn, in, valueBytes + 2 ) ) return -1;
+
+			keys[ next ].mOffset = offset;
+			keys[ next ].mBytes = bytes + valueBytes + 2;
+			next++;
+		}
+	}
+
+	return 0;
+}
+
+void SP_CacheProxyHandler :: reply( SP_Buffer * buffer, int slotCount )
+{
+	for( int i = 0; i < slotCount; i++ ) {
+		SP_CacheProxySlot_t * slot = &( mSlots[i] );
+
+		if( SP_CacheProxySlot_t::eLocal == slot->mType ) {
+			if( slot->mBytes > 0 ) {
+				buffer->append( (const char*)mLocal->getBuffer() + slot->mOffset, slot->mBytes );
+			}
+		} else if( SP_CacheProxySlot_t::eLine == slot->mType ) {
+			if( mFailed[ slot->mBackend ] ) {
+				buffer->append( "SERVER_ERROR backend unavailable\r\n" );
+			} else {
+				buffer->append( (const char*)mIn[ slot->mBackend ]->getBuffer() + slot->mOffset, slot->mBytes );
+			}
+		} else if( SP_CacheProxySlot_t::eAll == slot->mType ) {
+			int failed = 0;
+			for( int j = 0; j < mPool->getCount(); j++ ) failed |= mFailed[j];
+
+			buffer->append( failed ? "SERVER_ERROR backend unavailable\r\n" : "OK\r\n" );
+		} else {
+			// the keys of a failed backend are misses
+			for( int j = 0; j < slot->mKeyCount; j++ ) {
+				SP_CacheProxyKey_t * key = &( mKeys[ slot->mFirstKey + j ] );
+				if( key->mBytes <= 0 || mFailed[ key->mBackend ] ) continue;
+
+				buffer->append( (const char*)mIn[ key->mBackend ]->getBuffer() + key->mOffset, key->mBytes );
+			}
+
+			buffer->append( "END\r\n" );
+		}
+	}
+}
+
+void SP_CacheProxyHandler :: error( SP_Response * response )
+{
+}
+
+void SP_CacheProxyHandler :: timeout( SP_Response * response )
+{
+}
+
+void SP_CacheProxyHandler :: close()
+{
+}
+
+//---------------------------------------------------------------------------
+
+SP_CacheProxyHandlerFactory :: SP_CacheProxyHandlerFactory( SP_CacheProxyPool * pool,
+		SP_CacheQueueStat * queueStat, size_t maxItemSize )
+{
+	mPool = pool;
+	mQueueStat = queueStat;
+	mMaxItemSize = maxItemSize;
+}
+
+SP_CacheProxyHandlerFactory :: ~SP_CacheProxyHandlerFactory()
+{
+}
+
+SP_Handler * SP_CacheProxyHandlerFactory :: create() const
+{
+	return new SP_CacheProxyHandler( mPool, mQueueStat, mMaxItemSize );
+}
+
@@ -0,0 +1,142 @@
+/*
+ * Copyright 2008 Stephen Liu
+ * For license terms, see the file COPYING along with this library.
+ */
+
+#ifndef __spcacheproxy_hpp__
+#define __spcacheproxy_hpp__
+
+#include <time.h>
+#include <stdint.h>
+
+#include "spserver/spthread.hpp"
+#include "spserver/sphandler.hpp"
+
+class SP_Buffer;
+class SP_CacheQueueStat;
+class SP_CacheProtoMessage;
+
+typedef struct tagSP_CacheProxyConn SP_CacheProxyConn_t;
+typedef struct tagSP_CacheProxyBackend SP_CacheProxyBackend_t;
+typedef struct tagSP_CacheProxyPoint SP_CacheProxyPoint_t;
+typedef struct tagSP_CacheProxySlot SP_CacheProxySlot_t;
+typedef struct tagSP_CacheProxyKey SP_CacheProxyKey_t;
+
+// the backends of a proxy, the keys are spread by a ketama continuum,
+// so adding or removing a backend moves only the keys of its points.
+// The continuum is that of libmemcached with the ketama compat behavior.
+// The idle upstream connections are kept for the next requests.
+class SP_CacheProxyPool {
+public:
+	SP_CacheProxyPool();
+	~SP_CacheProxyPool();
+
+	// backends : "host:port,host:port,..."
+	// 0 : OK, -1 : bad or unknown address
+	int addBackends( const char * backends );
+
+	int getCount() const;
+
+	// index of the backend of key
+	int locate( const char * key ) const;
+
+	// an idle connection or a new one, NULL if the backend cannot be reached
+	SP_CacheProxyConn_t * take( int index );
+
+	// broken : 1 if the connection is not usable any more
+	void put( SP_CacheProxyConn_t * conn, int broken );
+
+	void stat( SP_Buffer * buffer );
+
+private:
+	// the points of every backend on the continuum, 4 from every MD5 digest
+	enum { ePointsPerBackend = 160, ePointsPerDigest = 4 };
+
+	// seconds a backend which refused a connection is not tried again
+	enum { eRetryInterval = 1 };
+
+	// 0 : OK, -1 : bad or unknown address
+	int addBackend( const char * hostPort );
+	void build();
+
+	sp_thread_mutex_t mMutex;
+
+	SP_CacheProxyBackend_t ** mBackends;
+	int mCount;
+
+	// sorted by the point
+	SP_CacheProxyPoint_t * mPoints;
+	int mPointCount;
+
+	// the batches written to the backends
+	size_t mBatches;
+};
+
+// a text protocol session of a proxy, every batch of requests is
+// split by backend, sent to all the backends at once, then the replies
+// are read back and put together in the order of the requests
+class SP_CacheProxyHandler : public SP_Handler {
+public:
+	// maxItemSize : larger values are refused without forwarding, 0 means no limit
+	SP_CacheProxyHandler( SP_CacheProxyPool * pool, SP_CacheQueueStat * queueStat,
+			size_t maxItemSize );
+	virtual ~SP_CacheProxyHandler();
+
+	virtual int start( SP_Request * request, SP_Response * response );
+
+	// return -1 : terminate session, 0 : continue
+	virtual int handle( SP_Request * request, SP_Response * response );
+
+	virtual void error( SP_Response * response );
+
+	virtual void timeout( SP_Response * response );
+
+	virtual void close();
+
+private:
+	// put the request into the buffer of its backend or reply it here
+	// return 1 : terminate session after the batch, 0 : continue
+	int prepare( SP_CacheProtoMessage * message, SP_CacheProxySlot_t * slot );
+
+	// write the requests of every backend, then read the replies
+	void forward( int slotCount );
+
+	// read the replies of the backend for the slots, 0 : OK, -1 : broken
+	int readReplies( int index, SP_CacheProxyConn_t * conn, int slotCount );
+
+	void reply( SP_Buffer * buffer, int slotCount );
+
+	SP_CacheProxyPool * mPool;
+	SP_CacheQueueStat * mQueueStat;
+	size_t mMaxItemSize;
+
+	// the requests to and the replies from every backend in a batch
+	SP_Buffer ** mOut, ** mIn;
+	int * mFailed;
+
+	// the replies made here
+	SP_Buffer * mLocal;
+
+	SP_CacheProxySlot_t * mSlots;
+	int mSlotCapacity;
+
+	SP_CacheProxyKey_t * mKeys;
+	int mKeyCount, mKeyCapacity;
+};
+
+class SP_CacheProxyHandlerFactory : public SP_HandlerFactory {
+public:
+	SP_CacheProxyHandlerFactory( SP_CacheProxyPool * pool, SP_CacheQueueStat * queueStat,
+			size_t maxItemSize );
+	virtual ~SP_CacheProxyHandlerFactory();
+
+	virtual SP_Handler * create() const;
+
+private:
+	SP_CacheProxyPool * mPool;
+	SP_CacheQueueStat * mQueueStat;
+	size_t mMaxItemSize;
+};
+
+#endif
+
@@ -0,0 +1,120 @@
+/*
+ * Copyright 2008 Stephen Liu
+ * For license terms, see the file COPYING along with this library.
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+#include "spserver/spbuffer.hpp"
+
+#include "spcachequeue.hpp"
+#include "spcacheatomic.hpp"
+
+SP_CacheQueueStat :: SP_CacheQueueStat()
+{
+	sp_thread_mutex_init( &mMutex, NULL );
+
+	mDepth = mMaxDepth = 0;
+	mTargetWait = 0;
+
+	mAvgWait8 = mMaxWait = 0;
+	mTotalWait = 0;
+
+	mBatches = mRejections = 0;
+}
+
+SP_CacheQueueStat :: ~SP_CacheQueueStat()
+{
+	sp_thread_mutex_destroy( &mMutex );
+}
+
+void SP_CacheQueueStat :: enter( struct timeval * enterTime )
+{
+	gettimeofday( enterTime, NULL );
+
+	int depth = sp_atomic_inc( &mDepth );
+
+	// a stale max is fine, it is only reported
+	if( depth > mMaxDepth ) mMaxDepth = depth;
+}
+
+void SP_CacheQueueStat :: leave( const struct timeval * enterTime )
+{
+	sp_atomic_dec( &mDepth );
+
+	if( NULL == enterTime ) return;
+
+	struct timeval now;
+	gettimeofday( &now, NULL );
+
+	double wait = ( now.tv_sec - enterTime->tv_sec ) * 1000000.0
+			+ ( now.tv_usec - enterTime->tv_usec );
+	if( wait < 0 ) wait = 0;
+	if( wait > 2000000000.0 ) wait = 2000000000.0;
+
+	sp_thread_mutex_lock( &mMutex );
+
+	mBatches++;
+	mTotalWait += wait;
+	if( (int)wait > mMaxWait ) mMaxWait = (int)wait;
+
+	// 8 times 100 seconds still fits in an int
+	int sample = wait > 100000000.0 ? 100000000 : (int)wait;
+	mAvgWait8 += sample - mAvgWait8 / 8;
+
+	sp_thread_mutex_unlock( &mMutex );
+}
+
+void SP_CacheQueueStat :: reject()
+{
+	sp_thread_mutex_lock( &mMutex );
+	mRejections++;
+	sp_thread_mutex_unlock( &mMutex );
+}
+
+void SP_CacheQueueStat :: setTargetWait( int usec )
+{
+	mTargetWait = usec > 0 ? usec : 0;
+}
+
+int SP_CacheQueueStat :: isOverloaded() const
+{
+	// an empty queue drains at once, whatever the last waits were
+	return mTargetWait > 0 && mDepth > 0 && mAvgWait8 / 8 > mTargetWait;
+}
+
+void SP_CacheQueueStat :: stat( SP_Buffer * buffer )
+{
+	char temp[ 512 ] = { 0 };
+
+	sp_thread_mutex_lock( &mMutex );
+
+	snprintf( temp, sizeof( temp ), "STAT queue_depth %d\r\n", mDepth );
+	buffer->append( temp );
+
+	snprintf( temp, sizeof( temp ), "STAT queue_depth_max %d\r\n", mMaxDepth );
+	buffer->append( temp );
+
+	snprintf( temp, sizeof( temp ), "STAT queue_batches %lu\r\n", (unsigned long)mBatches );
+	buffer->append( temp );
+
+	snprintf( temp, sizeof( temp ), "STAT queue_wait_avg_usec %d\r\n", mAvgWait8 / 8 );
+	buffer->append( temp );
+
+	snprintf( temp, sizeof( temp ), "STAT queue_wait_mean_usec %.0f\r\n",
+			mBatches > 0 ? mTotalWait / mBatches : 0.0 );
+	buffer->append( temp );
+
+	snprintf( temp, sizeof( temp ), "STAT queue_wait_max_usec %d\r\n", mMaxWait );
+	buffer->append( temp );
+
+	snprintf( temp, sizeof( temp ), "STAT queue_wait_target_usec %d\r\n", mTargetWait );
+	buffer->append( temp );
+
+	snprintf( temp, sizeof( temp ), "STAT rejected_conns %lu\r\n", (unsigned long)mRejections );
+	buffer->append( temp );
+
+	sp_thread_mutex_unlock( &mMutex );
+}
+
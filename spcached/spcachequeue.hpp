@@ -0,0 +1,57 @@
+/*
+ * Copyright 2008 Stephen Liu
+ * For license terms, see the file COPYING along with this library.
+ */
+
+#ifndef __spcachequeue_hpp__
+#define __spcachequeue_hpp__
+
+#include "spserver/spporting.hpp"
+#include "spserver/spthread.hpp"
+
+class SP_Buffer;
+
+// the wait of the complete requests between the event thread and the workers,
+// a batch enters the queue when it is decoded and leaves when it is handled
+class SP_CacheQueueStat {
+public:
+	SP_CacheQueueStat();
+	~SP_CacheQueueStat();
+
+	// enterTime : out, kept by the caller until leave
+	void enter( struct timeval * enterTime );
+
+	// enterTime : NULL if the batch is dropped with its session
+	void leave( const struct timeval * enterTime );
+
+	// a new session is refused
+	void reject();
+
+	// admission control, the average wait above which new sessions are refused,
+	// 0 means never
+	void setTargetWait( int usec );
+
+	// 1 : the requests are waiting longer than the target, 0 : OK
+	int isOverloaded() const;
+
+	void stat( SP_Buffer * buffer );
+
+private:
+	sp_thread_mutex_t mMutex;
+
+	volatile int mDepth;
+	int mMaxDepth;
+
+	int mTargetWait;
+
+	// 8 times the average wait, it moves 1/8 toward every sample, so the
+	// steps below 8 usec are not truncated away
+	volatile int mAvgWait8;
+	int mMaxWait;
+	double mTotalWait;
+
+	size_t mBatches, mRejections;
+};
+
+#endif
+
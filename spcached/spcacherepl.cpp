@@ -0,0 +1,874 @@
+/*
+ * Copyright 2008 Stephen Liu
+ * For license terms, see the file COPYING along with this library.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <netdb.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/time.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#include "spserver/spporting.hpp"
+#include "spserver/spbuffer.hpp"
+#include "spserver/sputils.hpp"
+
+#include "spcacherepl.hpp"
+#include "spcacheimpl.hpp"
+#include "spcachemsg.hpp"
+#include "spcacheatomic.hpp"
+
+// the stream
+//
+//   replica : "SPREPL01", run id and offset, both 64-bit in network order,
+//             run id 0 asks for a full sync.
+//   primary : a eFullSync record, the items as eSet records, a eSyncDone record,
+//             then the log from the offset of the eFullSync record;
+//             or a eContinue record and the log from the offset asked for.
+//
+// A record is a 24-byte header in network order, the key without '\0'
+// and the value without "\r\n":
+//
+//   op u8, key bytes u8, reserved u16, flags u32, cas u64, exptime u32, value bytes u32
+//
+// eFullSync and eContinue carry the run id in cas and the offset as an 8-byte value.
+// A ePing is sent when the log is idle, only between log records.
+
+enum {
+	eSet = 1, eDelete = 2, eFlush = 3,
+	eFullSync = 4, eContinue = 5, eSyncDone = 6, ePing = 7
+};
+
+enum { eHeaderBytes = 24, eHelloBytes = 24, eIOBytes = 64 * 1024 };
+
+static const char sHelloMagic[ 8 ] = { 'S', 'P', 'R', 'E', 'P', 'L', '0', '1' };
+
+static void sp_repl_put64( char * pos, uint64_t value )
+{
+	uint32_t high = htonl( (uint32_t)( value >> 32 ) ), low = htonl( (uint32_t)value );
+	memcpy( pos, &high, 4 );
+	memcpy( pos + 4, &low, 4 );
+}
+
+static uint64_t sp_repl_get64( const char * pos )
+{
+	uint32_t high = 0, low = 0;
+	memcpy( &high, pos, 4 );
+	memcpy( &low, pos + 4, 4 );
+
+	return ( ( (uint64_t)ntohl( high ) ) << 32 ) | ntohl( low );
+}
+
+static void sp_repl_put32( char * pos, uint32_t value )
+{
+	value = htonl( value );
+	memcpy( pos, &value, 4 );
+}
+
+static uint32_t sp_repl_get32( const char * pos )
+{
+	uint32_t value = 0;
+	memcpy( &value, pos, 4 );
+
+	return ntohl( value );
+}
+
+static void sp_repl_header( char * header, int op, size_t keyBytes, uint32_t flags,
+		uint64_t cas, uint32_t expTime, uint32_t valueBytes )
+{
+	memset( header, 0, eHeaderBytes );
+
+	header[0] = (char)op;
+	header[1] = (char)keyBytes;
+	sp_repl_put32( header + 4, flags );
+	sp_repl_put64( header + 8, cas );
+	sp_repl_put32( header + 16, expTime );
+	sp_repl_put32( header + 20, valueBytes );
+}
+
+// 0 : OK, -1 : the peer is gone or too slow
+static int sp_repl_writen( int fd, const void * data, size_t bytes )
+{
+	const char * pos = (const char*)data;
+
+	for( ; bytes > 0; ) {
+		int len = send( fd, pos, bytes, MSG_NOSIGNAL );
+		if( len < 0 && EINTR == errno ) continue;
+		if( len <= 0 ) return -1;
+
+		pos += len;
+		bytes -= len;
+	}
+
+	return 0;
+}
+
+// 0 : OK, -1 : the peer is gone or too slow
+static int sp_repl_readn( int fd, void * data, size_t bytes )
+{
+	char * pos = (char*)data;
+
+	for( ; bytes > 0; ) {
+		int len = recv( fd, pos, bytes, 0 );
+		if( len < 0 && EINTR == errno ) continue;
+		if( len <= 0 ) return -1;
+
+		pos += len;
+		bytes -= len;
+	}
+
+	return 0;
+}
+
+static void sp_repl_timeout( int fd, int sec )
+{
+	struct timeval timeout;
+	timeout.tv_sec = sec;
+	timeout.tv_usec = 0;
+
+	setsockopt( fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof( timeout ) );
+	setsockopt( fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof( timeout ) );
+}
+
+// the records of a full sync are gathered and written eIOBytes at a time
+typedef struct tagSP_CacheReplOut {
+	int mFd;
+	size_t mBytes;
+	char mBuffer[ eIOBytes ];
+} SP_CacheReplOut_t;
+
+static int sp_repl_flush( SP_CacheReplOut_t * out )
+{
+	int ret = sp_repl_writen( out->mFd, out->mBuffer, out->mBytes );
+	out->mBytes = 0;
+
+	return ret;
+}
+
+static int sp_repl_out( SP_CacheReplOut_t * out, const void * data, size_t bytes )
+{
+	if( out->mBytes + bytes > sizeof( out->mBuffer ) ) {
+		if( 0 != sp_repl_flush( out ) ) return -1;
+
+		// a large value goes as it is
+		if( bytes > sizeof( out->mBuffer ) ) return sp_repl_writen( out->mFd, data, bytes );
+	}
+
+	memcpy( out->mBuffer + out->mBytes, data, bytes );
+	out->mBytes += bytes;
+
+	return 0;
+}
+
+//---------------------------------------------------------------------------
+
+SP_CacheReplLog :: SP_CacheReplLog( size_t backlogBytes )
+{
+	sp_thread_mutex_init( &mMutex, NULL );
+	sp_thread_cond_init( &mCond, NULL );
+
+	mCapacity = backlogBytes > eIOBytes ? backlogBytes : eIOBytes;
+	mRing = (char*)malloc( mCapacity );
+
+	mStart = mEnd = 0;
+	mTakeTicket = mPutTicket = 0;
+	mRecords = 0;
+	mReplicas = 0;
+
+	// never 0, a replica sends 0 when it has nothing
+	mRunId = ( ( (uint64_t)time( NULL ) ) << 32 )
+			^ ( ( (uint64_t)getpid() ) << 16 ) ^ (uint64_t)rand() ^ 1;
+}
+
+SP_CacheReplLog :: ~SP_CacheReplLog()
+{
+	free( mRing );
+
+	sp_thread_cond_destroy( &mCond );
+	sp_thread_mutex_destroy( &mMutex );
+}
+
+void SP_CacheReplLog :: write( const void * data, size_t bytes )
+{
+	size_t pos = mEnd % mCapacity;
+	size_t first = mCapacity - pos < bytes ? mCapacity - pos : bytes;
+
+	memcpy( mRing + pos, data, first );
+	if( first < bytes ) memcpy( mRing, (const char*)data + first, bytes - first );
+
+	mEnd += bytes;
+}
+
+uint64_t SP_CacheReplLog :: takeTicket()
+{
+	sp_thread_mutex_lock( &mMutex );
+	uint64_t ticket = mTakeTicket++;
+	sp_thread_mutex_unlock( &mMutex );
+
+	return ticket;
+}
+
+void SP_CacheReplLog :: append( uint64_t ticket, const char * header, size_t headerBytes,
+		const SP_CacheItem * item, size_t valueBytes )
+{
+	size_t bytes = headerBytes + valueBytes;
+
+	sp_thread_mutex_lock( &mMutex );
+
+	// the records taken before are put by the threads which have just
+	// released their shards, none of them waits for a lock
+	for( ; ticket != mPutTicket; ) sp_thread_cond_wait( &mCond, &mMutex );
+
+	if( bytes > mCapacity ) {
+		// larger than the backlog, every replica has to do a full sync
+		mEnd += bytes;
+		mStart = mEnd;
+	} else {
+		if( mEnd + bytes - mStart > mCapacity ) mStart = mEnd + bytes - mCapacity;
+
+		write( header, headerBytes );
+
+		size_t left = valueBytes;
+		for( int i = 0; NULL != item && left > 0 && i < item->getChunkCount(); i++ ) {
+			size_t chunkBytes = 0;
+			const void * data = item->getChunk( i, &chunkBytes );
+			if( chunkBytes > left ) chunkBytes = left;
+
+			write( data, chunkBytes );
+			left -= chunkBytes;
+		}
+	}
+
+	mRecords++;
+	mPutTicket++;
+
+	// the readers and the records waiting for their turn
+	sp_thread_cond_broadcast( &mCond );
+
+	sp_thread_mutex_unlock( &mMutex );
+}
+
+SP_CacheReplRecord_t * SP_CacheReplLog :: takeSet( SP_CacheItem * item )
+{
+	SP_CacheReplRecord_t * record = (SP_CacheReplRecord_t*)malloc( sizeof( SP_CacheReplRecord_t ) );
+
+	size_t keyBytes = strlen( item->getKey() );
+	if( keyBytes > 255 ) keyBytes = 255;
+
+	// the header is of the state under the lock, the value cannot change
+	// after it, an item with another reference is never changed in place
+	record->mValueBytes = item->getValueBytes();
+
+	sp_repl_header( record->mHeader, eSet, keyBytes, item->getClientFlags(),
+			item->getCasUnique(), (uint32_t)item->getExpTime(), (uint32_t)record->mValueBytes );
+	memcpy( record->mHeader + eHeaderBytes, item->getKey(), keyBytes );
+	record->mHeaderBytes = eHeaderBytes + keyBytes;
+
+	item->addRef();
+	record->mItem = item;
+	record->mNext = NULL;
+
+	record->mTicket = takeTicket();
+
+	return record;
+}
+
+SP_CacheReplRecord_t * SP_CacheReplLog :: takeDelete( const char * key )
+{
+	SP_CacheReplRecord_t * record = (SP_CacheReplRecord_t*)malloc( sizeof( SP_CacheReplRecord_t ) );
+
+	size_t keyBytes = strlen( key );
+	if( keyBytes > 255 ) keyBytes = 255;
+
+	sp_repl_header( record->mHeader, eDelete, keyBytes, 0, 0, 0, 0 );
+	memcpy( record->mHeader + eHeaderBytes, key, keyBytes );
+	record->mHeaderBytes = eHeaderBytes + keyBytes;
+
+	record->mItem = NULL;
+	record->mValueBytes = 0;
+	record->mNext = NULL;
+
+	record->mTicket = takeTicket();
+
+	return record;
+}
+
+void SP_CacheReplLog :: put( SP_CacheReplRecord_t * record )
+{
+	append( record->mTicket, record->mHeader, record->mHeaderBytes,
+			record->mItem, record->mValueBytes );
+
+	if( NULL != record->mItem ) record->mItem->release();
+
+	free( record );
+}
+
+void SP_CacheReplLog :: logFlush( time_t expTime )
+{
+	char header[ eHeaderBytes ];
+
+	sp_repl_header( header, eFlush, 0, 0, 0, (uint32_t)expTime, 0 );
+
+	append( takeTicket(), header, eHeaderBytes, NULL, 0 );
+}
+
+int SP_CacheReplLog :: read( uint64_t offset, char * buffer, int maxBytes, int timeout )
+{
+	sp_thread_mutex_lock( &mMutex );
+
+	if( offset == mEnd && timeout > 0 ) {
+		struct timeval now;
+		gettimeofday( &now, NULL );
+
+		struct timespec until;
+		until.tv_sec = now.tv_sec + timeout / 1000;
+		until.tv_nsec = now.tv_usec * 1000 + ( timeout % 1000 ) * 1000000;
+		if( until.tv_nsec >= 1000000000 ) {
+			until.tv_sec++;
+			until.tv_nsec -= 1000000000;
+		}
+
+		for( ; offset == mEnd; ) {
+			if( ETIMEDOUT == pthread_cond_timedwait( &mCond, &mMutex, &until ) ) break;
+		}
+	}
+
+	int ret = 0;
+
+	if( offset < mStart || offset > mEnd ) {
+		ret = -1;
+	} else {
+		size_t bytes = mEnd - offset;
+		if( bytes > (size_t)maxBytes ) bytes = maxBytes;
+
+		size_t pos = offset % mCapacity;
+		size_t first = mCapacity - pos < bytes ? mCapacity - pos : bytes;
+
+		memcpy( buffer, mRing + pos, first );
+		if( first < bytes ) memcpy( buffer + first, mRing, bytes - first );
+
+		ret = (int)bytes;
+	}
+
+	sp_thread_mutex_unlock( &mMutex );
+
+	return ret;
+}
+
+uint64_t SP_CacheReplLog :: getEndOffset()
+{
+	sp_thread_mutex_lock( &mMutex );
+	uint64_t offset = mEnd;
+	sp_thread_mutex_unlock( &mMutex );
+
+	return offset;
+}
+
+uint64_t SP_CacheReplLog :: getRunId() const
+{
+	return mRunId;
+}
+
+void SP_CacheReplLog :: addReplica( int delta )
+{
+	sp_atomic_add( &mReplicas, delta );
+}
+
+void SP_CacheReplLog :: stat( SP_Buffer * buffer )
+{
+	char temp[ 512 ] = { 0 };
+
+	sp_thread_mutex_lock( &mMutex );
+
+	snprintf( temp, sizeof( temp ), "STAT repl_run_id %llu\r\n", (unsigned long long)mRunId );
+	buffer->append( temp );
+
+	snprintf( temp, sizeof( temp ), "STAT repl_log_offset %llu\r\n", (unsigned long long)mEnd );
+	buffer->append( temp );
+
+	snprintf( temp, sizeof( temp ), "STAT repl_log_records %lu\r\n", (unsigned long)mRecords );
+	buffer->append( temp );
+
+	snprintf( temp, sizeof( temp ), "STAT repl_backlog_bytes %llu\r\n",
+			(unsigned long long)( mEnd - mStart ) );
+	buffer->append( temp );
+
+	snprintf( temp, sizeof( temp ), "STAT repl_backlog_size %lu\r\n", (unsigned long)mCapacity );
+	buffer->append( temp );
+
+	snprintf( temp, sizeof( temp ), "STAT repl_replicas %d\r\n", mReplicas );
+	buffer->append( temp );
+
+	sp_thread_mutex_unlock( &mMutex );
+}
+
+//---------------------------------------------------------------------------
+
+typedef struct tagSP_CacheReplConn {
+	SP_CacheReplPrimary * mPrimary;
+	int mFd;
+} SP_CacheReplConn_t;
+
+SP_CacheReplPrimary :: SP_CacheReplPrimary( SP_CacheEx * cacheEx, SP_CacheReplLog * replLog )
+{
+	mCacheEx = cacheEx;
+	mReplLog = replLog;
+	mListenFd = -1;
+}
+
+SP_CacheReplPrimary :: ~SP_CacheReplPrimary()
+{
+	if( mListenFd >= 0 ) close( mListenFd );
+}
+
+int SP_CacheReplPrimary :: start( const char * bindIP, int port )
+{
+	mListenFd = socket( AF_INET, SOCK_STREAM, 0 );
+	if( mListenFd < 0 ) return -1;
+
+	int on = 1;
+	setsockopt( mListenFd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof( on ) );
+
+	struct sockaddr_in addr;
+	memset( &addr, 0, sizeof( addr ) );
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons( port );
+	addr.sin_addr.s_addr = INADDR_ANY;
+	if( NULL != bindIP && '\0' != *bindIP ) {
+		if( 0 == inet_aton( bindIP, &addr.sin_addr ) ) addr.sin_addr.s_addr = INADDR_ANY;
+	}
+
+	if( 0 != bind( mListenFd, (struct sockaddr*)&addr, sizeof( addr ) )
+			|| 0 != listen( mListenFd, 16 ) ) {
+		sp_syslog( LOG_WARNING, "Cannot listen on replication port %d, errno %d", port, errno );
+		close( mListenFd );
+		mListenFd = -1;
+		return -1;
+	}
+
+	sp_thread_attr_t attr;
+	sp_thread_attr_init( &attr );
+	sp_thread_attr_setdetachstate( &attr, SP_THREAD_CREATE_DETACHED );
+
+	sp_thread_t thread;
+	int ret = sp_thread_create( &thread, &attr, acceptThread, this );
+	sp_thread_attr_destroy( &attr );
+
+	return 0 == ret ? 0 : -1;
+}
+
+sp_thread_result_t SP_THREAD_CALL SP_CacheReplPrimary :: acceptThread( void * arg )
+{
+	SP_CacheReplPrimary * primary = (SP_CacheReplPrimary*)arg;
+
+	for( ; ; ) {
+		struct sockaddr_in addr;
+		socklen_t len = sizeof( addr );
+
+		int fd = accept( primary->mListenFd, (struct sockaddr*)&addr, &len );
+		if( fd < 0 ) {
+			if( EINTR == errno || EAGAIN == errno || ECONNABORTED == errno ) continue;
+
+			// out of fds and the like, try again later
+			sp_syslog( LOG_WARNING, "Cannot accept a replica, errno %d", errno );
+			sleep( 1 );
+			continue;
+		}
+
+		SP_CacheReplConn_t * conn = (SP_CacheReplConn_t*)malloc( sizeof( SP_CacheReplConn_t ) );
+		conn->mPrimary = primary;
+		conn->mFd = fd;
+
+		sp_thread_attr_t attr;
+		sp_thread_attr_init( &attr );
+		sp_thread_attr_setdetachstate( &attr, SP_THREAD_CREATE_DETACHED );
+
+		sp_thread_t thread;
+		if( 0 != sp_thread_create( &thread, &attr, sendThread, conn ) ) {
+			close( fd );
+			free( conn );
+		}
+
+		sp_thread_attr_destroy( &attr );
+	}
+
+	return 0;
+}
+
+sp_thread_result_t SP_THREAD_CALL SP_CacheReplPrimary :: sendThread( void * arg )
+{
+	SP_CacheReplConn_t * conn = (SP_CacheReplConn_t*)arg;
+	SP_CacheReplPrimary * primary = conn->mPrimary;
+	int fd = conn->mFd;
+
+	free( conn );
+
+	int on = 1;
+	setsockopt( fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof( on ) );
+	sp_repl_timeout( fd, 10 );
+
+	primary->mReplLog->addReplica( 1 );
+	primary->stream( fd );
+	primary->mReplLog->addReplica( -1 );
+
+	close( fd );
+
+	return 0;
+}
+
+int SP_CacheReplPrimary :: fullSync( int fd, uint64_t offset )
+{
+	SP_CacheReplOut_t * out = (SP_CacheReplOut_t*)malloc( sizeof( SP_CacheReplOut_t ) );
+	out->mFd = fd;
+	out->mBytes = 0;
+
+	char header[ eHeaderBytes + 8 ];
+
+	sp_repl_header( header, eFullSync, 0, 0, mReplLog->getRunId(), 0, 8 );
+	sp_repl_put64( header + eHeaderBytes, offset );
+
+	int ret = sp_repl_out( out, header, sizeof( header ) );
+
+	size_t total = 0;
+
+	// the log from offset is replayed after it, so an item changed
+	// while the shards are walked ends up right anyway
+	for( int i = 0; 0 == ret && i < mCacheEx->getShardCount(); i++ ) {
+		int count = 0;
+		SP_CacheItem ** items = mCacheEx->pinItems( i, &count );
+
+		for( int j = 0; j < count; j++ ) {
+			SP_CacheItem * item = items[j];
+
+			if( 0 == ret ) {
+				size_t keyBytes = strlen( item->getKey() );
+				size_t left = item->getValueBytes();
+
+				sp_repl_header( header, eSet, keyBytes, item->getClientFlags(),
+						item->getCasUnique(), (uint32_t)item->getExpTime(), (uint32_t)left );
+
+				ret = sp_repl_out( out, header, eHeaderBytes );
+				if( 0 == ret ) ret = sp_repl_out( out, item->getKey(), keyBytes );
+
+				for( int k = 0; 0 == ret && left > 0 && k < item->getChunkCount(); k++ ) {
+					size_t bytes = 0;
+					const void * data = item->getChunk( k, &bytes );
+					if( bytes > left ) bytes = left;
+
+					ret = sp_repl_out( out, data, bytes );
+					left -= bytes;
+				}
+
+				total++;
+			}
+
+			item->release();
+		}
+
+		free( items );
+	}
+
+	if( 0 == ret ) {
+		sp_repl_header( header, eSyncDone, 0, 0, 0, 0, 0 );
+		ret = sp_repl_out( out, header, eHeaderBytes );
+	}
+
+	if( 0 == ret ) ret = sp_repl_flush( out );
+
+	free( out );
+
+	sp_syslog( LOG_NOTICE, "Full sync of %lu items to a replica %s",
+			(unsigned long)total, 0 == ret ? "done" : "failed" );
+
+	return ret;
+}
+
+void SP_CacheReplPrimary :: stream( int fd )
+{
+	char hello[ eHelloBytes ];
+
+	if( 0 != sp_repl_readn( fd, hello, sizeof( hello ) )
+			|| 0 != memcmp( hello, sHelloMagic, sizeof( sHelloMagic ) ) ) {
+		sp_syslog( LOG_WARNING, "Not a replica, closed" );
+		return;
+	}
+
+	uint64_t runId = sp_repl_get64( hello + 8 );
+	uint64_t offset = sp_repl_get64( hello + 16 );
+
+	char * buffer = (char*)malloc( eIOBytes );
+
+	int ret = 0;
+
+	// the offset is still in the backlog, go on from it
+	if( runId == mReplLog->getRunId() && 0 == mReplLog->read( offset, buffer, 0, 0 ) ) {
+		char header[ eHeaderBytes + 8 ];
+		sp_repl_header( header, eContinue, 0, 0, runId, 0, 8 );
+		sp_repl_put64( header + eHeaderBytes, offset );
+
+		ret = sp_repl_writen( fd, header, sizeof( header ) );
+	} else {
+		offset = mReplLog->getEndOffset();
+		ret = fullSync( fd, offset );
+	}
+
+	for( ; 0 == ret; ) {
+		int bytes = mReplLog->read( offset, buffer, eIOBytes, 1000 );
+
+		if( bytes > 0 ) {
+			ret = sp_repl_writen( fd, buffer, bytes );
+			offset += bytes;
+		} else if( 0 == bytes ) {
+			// idle at a record boundary, tell the replica the link is alive
+			char header[ eHeaderBytes ];
+			sp_repl_header( header, ePing, 0, 0, 0, 0, 0 );
+			ret = sp_repl_writen( fd, header, sizeof( header ) );
+		} else {
+			// fell out of the backlog, the replica comes back for a full sync
+			sp_syslog( LOG_WARNING, "A replica is behind the backlog, closed" );
+			ret = -1;
+		}
+	}
+
+	free( buffer );
+}
+
+//---------------------------------------------------------------------------
+
+SP_CacheReplica :: SP_CacheReplica( SP_CacheEx * cacheEx, const char * host, int port )
+{
+	mCacheEx = cacheEx;
+	sp_strlcpy( mHost, host, sizeof( mHost ) );
+	mPort = port;
+
+	mThreadState = -1;
+
+	mRunId = mOffset = 0;
+	mSyncRunId = mSyncOffset = 0;
+
+	mLinkUp = 0;
+	mFullSyncs = mRecords = mConnects = 0;
+	mLastIO = 0;
+}
+
+SP_CacheReplica :: ~SP_CacheReplica()
+{
+	if( 1 == mThreadState ) {
+		mThreadState = 0;
+		for( ; -1 != mThreadState; ) sp_sleep( 1 );
+	}
+}
+
+int SP_CacheReplica :: start()
+{
+	sp_thread_attr_t attr;
+	sp_thread_attr_init( &attr );
+	sp_thread_attr_setdetachstate( &attr, SP_THREAD_CREATE_DETACHED );
+
+	mThreadState = 1;
+
+	sp_thread_t thread;
+	int ret = sp_thread_create( &thread, &attr, followThread, this );
+	sp_thread_attr_destroy( &attr );
+
+	if( 0 != ret ) mThreadState = -1;
+
+	return 0 == ret ? 0 : -1;
+}
+
+sp_thread_result_t SP_THREAD_CALL SP_CacheReplica :: followThread( void * arg )
+{
+	SP_CacheReplica * replica = (SP_CacheReplica*)arg;
+
+	for( ; 1 == replica->mThreadState; ) {
+		int fd = -1;
+
+		char port[ 16 ] = { 0 };
+		snprintf( port, sizeof( port ), "%d", replica->mPort );
+
+		struct addrinfo hints, * result = NULL;
+		memset( &hints, 0, sizeof( hints ) );
+		hints.ai_family = AF_INET;
+		hints.ai_socktype = SOCK_STREAM;
+
+		if( 0 == getaddrinfo( replica->mHost, port, &hints, &result ) ) {
+			fd = socket( AF_INET, SOCK_STREAM, 0 );
+			if( fd >= 0 && 0 != connect( fd, result->ai_addr, result->ai_addrlen ) ) {
+				close( fd );
+				fd = -1;
+			}
+			freeaddrinfo( result );
+		}
+
+		if( fd >= 0 ) {
+			replica->mConnects++;
+			replica->follow( fd );
+			replica->mLinkUp = 0;
+			close( fd );
+		}
+
+		if( 1 == replica->mThreadState ) sleep( 1 );
+	}
+
+	replica->mThreadState = -1;
+
+	return 0;
+}
+
+void SP_CacheReplica :: follow( int fd )
+{
+	// the primary pings every second, a silent one is gone
+	sp_repl_timeout( fd, 10 );
+
+	char hello[ eHelloBytes ];
+	memcpy( hello, sHelloMagic, sizeof( sHelloMagic ) );
+	sp_repl_put64( hello + 8, mRunId );
+	sp_repl_put64( hello + 16, mOffset );
+
+	if( 0 != sp_repl_writen( fd, hello, sizeof( hello ) ) ) return;
+
+	for( ; 1 == mThreadState; ) {
+		char header[ eHeaderBytes ];
+		if( 0 != sp_repl_readn( fd, header, sizeof( header ) ) ) break;
+
+		mLastIO = time( NULL );
+
+		int op = 0;
+		if( 0 != apply( fd, header, &op ) ) break;
+	}
+}
+
+int SP_CacheReplica :: apply( int fd, const char * header, int * op )
+{
+	*op = (unsigned char)header[0];
+
+	size_t keyBytes = (unsigned char)header[1];
+	uint32_t flags = sp_repl_get32( header + 4 );
+	uint64_t cas = sp_repl_get64( header + 8 );
+	time_t expTime = (time_t)sp_repl_get32( header + 16 );
+	size_t valueBytes = sp_repl_get32( header + 20 );
+
+	char key[ 256 ] = { 0 };
+	if( keyBytes > 0 && 0 != sp_repl_readn( fd, key, keyBytes ) ) return -1;
+
+	if( eFullSync == *op || eContinue == *op ) {
+		char offset[ 8 ];
+		if( 8 != valueBytes || 0 != sp_repl_readn( fd, offset, sizeof( offset ) ) ) return -1;
+
+		if( eFullSync == *op ) {
+			// a sync broken halfway must start over, so the position is
+			// forgotten until eSyncDone, a reconnect asks for another full sync
+			mSyncRunId = cas;
+			mSyncOffset = sp_repl_get64( offset );
+			mRunId = mOffset = 0;
+
+			// whatever was here belongs to another run of the primary
+			mCacheEx->flushAll( 0 );
+			mFullSyncs++;
+			mLinkUp = 0;
+		} else {
+			mRunId = cas;
+			mOffset = sp_repl_get64( offset );
+			mLinkUp = 1;
+		}
+
+		sp_syslog( LOG_NOTICE, "Replica of %s:%d, %s at %llu", mHost, mPort,
+				eFullSync == *op ? "full sync" : "continue",
+				(unsigned long long)sp_repl_get64( offset ) );
+
+		return 0;
+	}
+
+	if( eSyncDone == *op ) {
+		mRunId = mSyncRunId;
+		mOffset = mSyncOffset;
+		mLinkUp = 1;
+		return 0;
+	}
+
+	if( ePing == *op ) return 0;
+
+	if( eSet == *op ) {
+		if( keyBytes <= 0 ) return -1;
+
+		SP_CacheItem * item = SP_CacheItem::newInstance( mCacheEx->getSlabs(),
+				key, valueBytes + 2 );
+
+		char * buffer = (char*)malloc( valueBytes > eIOBytes ? eIOBytes : valueBytes + 1 );
+
+		int ret = 0;
+		for( size_t left = valueBytes; 0 == ret && left > 0; ) {
+			size_t bytes = left > eIOBytes ? eIOBytes : left;
+
+			ret = sp_repl_readn( fd, buffer, bytes );
+			if( 0 == ret ) item->appendDataBlock( buffer, bytes );
+			left -= bytes;
+		}
+
+		free( buffer );
+
+		if( 0 != ret ) {
+			item->release();
+			return -1;
+		}
+
+		item->appendDataBlock( "\r\n", 2 );
+		item->setClientFlags( flags );
+		item->setCasUnique( cas );
+
+		mCacheEx->restore( item, expTime );
+	} else if( eDelete == *op ) {
+		if( keyBytes <= 0 ) return -1;
+
+		mCacheEx->erase( key );
+	} else if( eFlush == *op ) {
+		mCacheEx->flushAll( expTime );
+	} else {
+		sp_syslog( LOG_WARNING, "Unknown record %d from %s:%d", *op, mHost, mPort );
+		return -1;
+	}
+
+	mRecords++;
+
+	// only the records of the log count, not the items of a full sync
+	if( mLinkUp ) mOffset += eHeaderBytes + keyBytes + valueBytes;
+
+	return 0;
+}
+
+void SP_CacheReplica :: stat( SP_Buffer * buffer )
+{
+	char temp[ 512 ] = { 0 };
+
+	snprintf( temp, sizeof( temp ), "STAT repl_primary %s:%d\r\n", mHost, mPort );
+	buffer->append( temp );
+
+	snprintf( temp, sizeof( temp ), "STAT repl_link %s\r\n", mLinkUp ? "up" : "down" );
+	buffer->append( temp );
+
+	snprintf( temp, sizeof( temp ), "STAT repl_offset %llu\r\n", (unsigned long long)mOffset );
+	buffer->append( temp );
+
+	snprintf( temp, sizeof( temp ), "STAT repl_applied_records %lu\r\n", (unsigned long)mRecords );
+	buffer->append( temp );
+
+	snprintf( temp, sizeof( temp ), "STAT repl_full_syncs %lu\r\n", (unsigned long)mFullSyncs );
+	buffer->append( temp );
+
+	snprintf( temp, sizeof( temp ), "STAT repl_connects %lu\r\n", (unsigned long)mConnects );
+	buffer->append( temp );
+
+	snprintf( temp, sizeof( temp ), "STAT repl_last_io %ld\r\n",
+			mLastIO > 0 ? (long)( time( NULL ) - mLastIO ) : -1L );
+	buffer->append( temp );
+}
+
@@ -0,0 +1,161 @@
+/*
+ * Copyright 2008 Stephen Liu
+ * For license terms, see the file COPYING along with this library.
+ */
+
+#ifndef __spcacherepl_hpp__
+#define __spcacherepl_hpp__
+
+#include <time.h>
+#include <stdint.h>
+
+#include "spserver/spthread.hpp"
+
+class SP_Buffer;
+class SP_CacheEx;
+class SP_CacheItem;
+
+// a record taken under the lock of its shard, so the records of a key keep
+// the order of its changes, the value is copied after the lock is released
+typedef struct tagSP_CacheReplRecord {
+	uint64_t mTicket;
+
+	// the header and the key, at most 255 bytes
+	char mHeader[ 24 + 256 ];
+	size_t mHeaderBytes;
+
+	// a set holds a reference of the item until it is put
+	SP_CacheItem * mItem;
+	size_t mValueBytes;
+
+	struct tagSP_CacheReplRecord * mNext;
+} SP_CacheReplRecord_t;
+
+// the mutations of a primary in a ring of bytes, already in the wire format.
+// Every record is the resulting state of a key, so replaying a record
+// twice does no harm, see spcacherepl.cpp for the format.
+class SP_CacheReplLog {
+public:
+	// backlogBytes : the size of the ring, a replica behind it needs a full sync
+	SP_CacheReplLog( size_t backlogBytes );
+	~SP_CacheReplLog();
+
+	// called by SP_CacheEx under the lock of the shard, nothing is copied
+	// but the header, the place of the record in the log is taken
+	SP_CacheReplRecord_t * takeSet( SP_CacheItem * item );
+	SP_CacheReplRecord_t * takeDelete( const char * key );
+
+	// called when the lock of the shard is released, wait for the records
+	// taken before, copy the value into the ring and free the record
+	void put( SP_CacheReplRecord_t * record );
+
+	void logFlush( time_t expTime );
+
+	// copy at most maxBytes from offset, waiting at most timeout msec
+	// return the bytes copied, 0 : timeout, -1 : offset is out of the ring
+	int read( uint64_t offset, char * buffer, int maxBytes, int timeout );
+
+	uint64_t getEndOffset();
+
+	// a new one for every start, a replica of another run does a full sync
+	uint64_t getRunId() const;
+
+	// the count of the replicas streaming the log
+	void addReplica( int delta );
+
+	void stat( SP_Buffer * buffer );
+
+private:
+	// the caller holds mMutex
+	void write( const void * data, size_t bytes );
+
+	uint64_t takeTicket();
+
+	// header and key first, then the value, after the record of ticket - 1
+	void append( uint64_t ticket, const char * header, size_t headerBytes,
+			const SP_CacheItem * item, size_t valueBytes );
+
+	sp_thread_mutex_t mMutex;
+	sp_thread_cond_t mCond;
+
+	char * mRing;
+	size_t mCapacity;
+
+	// offsets of the stream since start, the ring keeps [ mStart, mEnd )
+	uint64_t mStart, mEnd;
+
+	// the next ticket to take and the next to append
+	uint64_t mTakeTicket, mPutTicket;
+
+	uint64_t mRunId;
+	size_t mRecords;
+	volatile int mReplicas;
+};
+
+// serve the log of a primary, every replica gets its own thread
+class SP_CacheReplPrimary {
+public:
+	SP_CacheReplPrimary( SP_CacheEx * cacheEx, SP_CacheReplLog * replLog );
+	~SP_CacheReplPrimary();
+
+	// listen on port and start the accept thread
+	// 0 : OK, -1 : fail
+	int start( const char * bindIP, int port );
+
+private:
+	static sp_thread_result_t SP_THREAD_CALL acceptThread( void * arg );
+	static sp_thread_result_t SP_THREAD_CALL sendThread( void * arg );
+
+	// 0 : the replica is done, -1 : write error
+	int fullSync( int fd, uint64_t offset );
+	void stream( int fd );
+
+	SP_CacheEx * mCacheEx;
+	SP_CacheReplLog * mReplLog;
+
+	int mListenFd;
+};
+
+// follow a primary, apply its records to the local cache and
+// reconnect with the offset reached, so a short break resumes from it
+class SP_CacheReplica {
+public:
+	SP_CacheReplica( SP_CacheEx * cacheEx, const char * host, int port );
+	~SP_CacheReplica();
+
+	// start the thread following the primary
+	// 0 : OK, -1 : fail
+	int start();
+
+	void stat( SP_Buffer * buffer );
+
+private:
+	static sp_thread_result_t SP_THREAD_CALL followThread( void * arg );
+
+	// one connection, return when it is broken
+	void follow( int fd );
+
+	// apply one record, 0 : OK, -1 : read error or bad record
+	int apply( int fd, const char * header, int * op );
+
+	SP_CacheEx * mCacheEx;
+	char mHost[ 64 ];
+	int mPort;
+
+	// 1 : running, 0 : asked to stop, -1 : stopped
+	volatile int mThreadState;
+
+	// the primary being followed and the log offset reached
+	uint64_t mRunId, mOffset;
+
+	// run id and offset of a full sync, taken only when it is done
+	uint64_t mSyncRunId, mSyncOffset;
+
+	// 1 : streaming the log, 0 : not connected or in a full sync
+	volatile int mLinkUp;
+	size_t mFullSyncs, mRecords, mConnects;
+	time_t mLastIO;
+};
+
+#endif
+
@@ -0,0 +1,241 @@
+/*
+ * Copyright 2008 Stephen Liu
+ * For license terms, see the file COPYING along with this library.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+
+#include "spserver/spbuffer.hpp"
+
+#include "spcacheslab.hpp"
+#include "spcachemsg.hpp"
+
+SP_CacheSlabs :: SP_CacheSlabs( double factor, size_t preallocBytes )
+{
+	if( factor <= 1.0 ) factor = 1.25;
+
+	memset( mClasses, 0, sizeof( mClasses ) );
+
+	// the smallest chunk holds an item header plus a small key and value
+	size_t size = sizeof( SP_CacheItem ) + 48;
+
+	for( mClassCount = 0; mClassCount < eMaxClasses - 1; mClassCount++ ) {
+		size = ( size + 7 ) & ~7;
+		if( size > ePageSize / 2 ) break;
+
+		mClasses[ mClassCount ].mChunkSize = size;
+		mClasses[ mClassCount ].mPerPage = ePageSize / size;
+
+		size = (size_t)( size * factor );
+	}
+
+	// the last class takes one whole page
+	mClasses[ mClassCount ].mChunkSize = ePageSize;
+	mClasses[ mClassCount ].mPerPage = 1;
+	mClassCount++;
+
+	for( int i = 0; i < mClassCount; i++ ) {
+		sp_thread_mutex_init( &( mClasses[i].mMutex ), NULL );
+	}
+
+	mPrealloc = NULL;
+	mPreallocBytes = mPreallocUsed = 0;
+
+	mPageList = NULL;
+	mTotalMalloced = 0;
+
+	if( preallocBytes > 0 ) {
+		mPreallocBytes = preallocBytes - ( preallocBytes % ePageSize );
+		mPrealloc = (char*)malloc( mPreallocBytes );
+		if( NULL != mPrealloc ) {
+			// touch the memory, so that it is really there
+			memset( mPrealloc, 0, mPreallocBytes );
+			mTotalMalloced += mPreallocBytes;
+		} else {
+			mPreallocBytes = 0;
+		}
+	}
+
+	sp_thread_mutex_init( &mPageMutex, NULL );
+}
+
+SP_CacheSlabs :: ~SP_CacheSlabs()
+{
+	for( ; NULL != mPageList; ) {
+		void * next = *(void**)mPageList;
+		free( mPageList );
+		mPageList = next;
+	}
+
+	if( NULL != mPrealloc ) free( mPrealloc );
+
+	for( int i = 0; i < mClassCount; i++ ) {
+		sp_thread_mutex_destroy( &( mClasses[i].mMutex ) );
+	}
+
+	sp_thread_mutex_destroy( &mPageMutex );
+}
+
+int SP_CacheSlabs :: getClass( size_t size ) const
+{
+	if( size > mClasses[ mClassCount - 1 ].mChunkSize ) return -1;
+
+	int low = 0, high = mClassCount - 1;
+
+	for( ; low < high; ) {
+		int mid = ( low + high ) / 2;
+		if( mClasses[ mid ].mChunkSize < size ) {
+			low = mid + 1;
+		} else {
+			high = mid;
+		}
+	}
+
+	return low;
+}
+
+size_t SP_CacheSlabs :: getChunkSize( int slabClass ) const
+{
+	return mClasses[ slabClass ].mChunkSize;
+}
+
+char * SP_CacheSlabs :: newPage()
+{
+	char * page = NULL;
+
+	sp_thread_mutex_lock( &mPageMutex );
+
+	if( mPreallocUsed + ePageSize <= mPreallocBytes ) {
+		page = mPrealloc + mPreallocUsed;
+		mPreallocUsed += ePageSize;
+	} else {
+		// one extra word in front to chain the page for destruction
+		void ** block = (void**)malloc( ePageSize + sizeof( void * ) );
+		if( NULL != block ) {
+			*block = mPageList;
+			mPageList = block;
+			mTotalMalloced += ePageSize;
+
+			page = (char*)( block + 1 );
+		}
+	}
+
+	sp_thread_mutex_unlock( &mPageMutex );
+
+	return page;
+}
+
+void * SP_CacheSlabs :: alloc( int slabClass )
+{
+	void * chunk = NULL;
+
+	SlabClass_t * cls = &( mClasses[ slabClass ] );
+
+	sp_thread_mutex_lock( &( cls->mMutex ) );
+
+	if( NULL != cls->mFreeList ) {
+		chunk = cls->mFreeList;
+		cls->mFreeList = *(void**)chunk;
+	} else {
+		if( cls->mEndPageFree <= 0 ) {
+			cls->mEndPage = newPage();
+			if( NULL != cls->mEndPage ) {
+				cls->mEndPageFree = cls->mPerPage;
+				cls->mTotalPages++;
+			}
+		}
+
+		if( cls->mEndPageFree > 0 ) {
+			chunk = cls->mEndPage;
+			cls->mEndPage += cls->mChunkSize;
+			cls->mEndPageFree--;
+		}
+	}
+
+	if( NULL != chunk ) cls->mUsedChunks++;
+
+	sp_thread_mutex_unlock( &( cls->mMutex ) );
+
+	return chunk;
+}
+
+void SP_CacheSlabs :: dealloc( int slabClass, void * chunk )
+{
+	SlabClass_t * cls = &( mClasses[ slabClass ] );
+
+	sp_thread_mutex_lock( &( cls->mMutex ) );
+
+	*(void**)chunk = cls->mFreeList;
+	cls->mFreeList = chunk;
+
+	cls->mUsedChunks--;
+
+	sp_thread_mutex_unlock( &( cls->mMutex ) );
+}
+
+void SP_CacheSlabs :: stat( SP_Buffer * buffer )
+{
+	char temp[ 512 ] = { 0 };
+
+	int activeSlabs = 0;
+
+	for( int i = 0; i < mClassCount; i++ ) {
+		SlabClass_t * cls = &( mClasses[ i ] );
+
+		sp_thread_mutex_lock( &( cls->mMutex ) );
+
+		size_t totalPages = cls->mTotalPages, usedChunks = cls->mUsedChunks;
+		size_t freeChunks = totalPages * cls->mPerPage - usedChunks;
+
+		sp_thread_mutex_unlock( &( cls->mMutex ) );
+
+		if( totalPages <= 0 ) continue;
+
+		activeSlabs++;
+
+		snprintf( temp, sizeof( temp ), "STAT %d:chunk_size %lu\r\n", i + 1,
+				(unsigned long)cls->mChunkSize );
+		buffer->append( temp );
+
+		snprintf( temp, sizeof( temp ), "STAT %d:chunks_per_page %lu\r\n", i + 1,
+				(unsigned long)cls->mPerPage );
+		buffer->append( temp );
+
+		snprintf( temp, sizeof( temp ), "STAT %d:total_pages %lu\r\n", i + 1,
+				(unsigned long)totalPages );
+		buffer->append( temp );
+
+		snprintf( temp, sizeof( temp ), "STAT %d:total_chunks %lu\r\n", i + 1,
+				(unsigned long)( totalPages * cls->mPerPage ) );
+		buffer->append( temp );
+
+		snprintf( temp, sizeof( temp ), "STAT %d:used_chunks %lu\r\n", i + 1,
+				(unsigned long)usedChunks );
+		buffer->append( temp );
+
+		snprintf( temp, sizeof( temp ), "STAT %d:free_chunks %lu\r\n", i + 1,
+				(unsigned long)freeChunks );
+		buffer->append( temp );
+	}
+
+	sp_thread_mutex_lock( &mPageMutex );
+
+	snprintf( temp, sizeof( temp ), "STAT active_slabs %d\r\n", activeSlabs );
+	buffer->append( temp );
+
+	snprintf( temp, sizeof( temp ), "STAT total_malloced %lu\r\n", (unsigned long)mTotalMalloced );
+	buffer->append( temp );
+
+	snprintf( temp, sizeof( temp ), "STAT prealloc_bytes %lu\r\n", (unsigned long)mPreallocBytes );
+	buffer->append( temp );
+
+	snprintf( temp, sizeof( temp ), "STAT prealloc_used %lu\r\n", (unsigned long)mPreallocUsed );
+	buffer->append( temp );
+
+	sp_thread_mutex_unlock( &mPageMutex );
+
+	buffer->append( "END\r\n" );
+}
+
@@ -0,0 +1,68 @@
+/*
+ * Copyright 2008 Stephen Liu
+ * For license terms, see the file COPYING along with this library.
+ */
+
+#ifndef __spcacheslab_hpp__
+#define __spcacheslab_hpp__
+
+#include <sys/types.h>
+
+#include "spserver/spthread.hpp"
+
+class SP_Buffer;
+
+// size-class allocator, every chunk is cut from a page of its own class
+class SP_CacheSlabs {
+public:
+	enum { ePageSize = 1024 * 1024, eMaxClasses = 64 };
+
+	// factor : growth factor of chunk size between classes
+	// preallocBytes : memory to allocate at startup, pages are cut from it first
+	SP_CacheSlabs( double factor = 1.25, size_t preallocBytes = 0 );
+	~SP_CacheSlabs();
+
+	// return -1 if size is too large for any class
+	int getClass( size_t size ) const;
+
+	size_t getChunkSize( int slabClass ) const;
+
+	void * alloc( int slabClass );
+
+	void dealloc( int slabClass, void * chunk );
+
+	void stat( SP_Buffer * buffer );
+
+private:
+
+	typedef struct tagSlabClass {
+		size_t mChunkSize, mPerPage;
+		size_t mTotalPages, mUsedChunks;
+
+		// free chunks are chained by their first word
+		void * mFreeList;
+
+		// the unused tail of the newest page
+		char * mEndPage;
+		size_t mEndPageFree;
+
+		sp_thread_mutex_t mMutex;
+	} SlabClass_t;
+
+	char * newPage();
+
+	SlabClass_t mClasses[ eMaxClasses ];
+	int mClassCount;
+
+	char * mPrealloc;
+	size_t mPreallocBytes, mPreallocUsed;
+
+	// all pages from malloc, chained by their first word
+	void * mPageList;
+	size_t mTotalMalloced;
+
+	sp_thread_mutex_t mPageMutex;
+};
+
+#endif
+
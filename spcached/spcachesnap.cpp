@@ -0,0 +1,585 @@
+/*
+ * Copyright 2008 Stephen Liu
+ * For license terms, see the file COPYING along with this library.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#ifndef WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#endif
+
+#include "spserver/spporting.hpp"
+#include "spserver/spbuffer.hpp"
+#include "spserver/sputils.hpp"
+
+#include "spcachesnap.hpp"
+#include "spcacheimpl.hpp"
+#include "spcachemsg.hpp"
+#include "spcacheatomic.hpp"
+
+// layout of the file
+//
+//   header, section table, then the records of every section.
+//   A record is its header, the key with its '\0' and the value without
+//   "\r\n", padded to 8 bytes. The checksum of a section is FNV-1a over
+//   its 64-bit words.
+
+static const char sMagic[ 8 ] = { 'S', 'P', 'C', 'S', 'N', 'A', 'P', '\0' };
+
+enum { eSnapVersion = 1, eSnapEndian = 0x01020304 };
+
+typedef struct tagSP_CacheSnapHeader {
+	char mMagic[ 8 ];
+	uint32_t mVersion, mEndian;
+	uint32_t mSectionCount, mReserved;
+	int64_t mDumpTime;
+	uint64_t mItemCount;
+} SP_CacheSnapHeader_t;
+
+typedef struct tagSP_CacheSnapSection {
+	uint64_t mOffset, mBytes, mCount, mChecksum;
+} SP_CacheSnapSection_t;
+
+typedef struct tagSP_CacheSnapRecord {
+	uint64_t mCasUnique;
+	int64_t mExpTime;
+	uint32_t mClientFlags;
+	uint32_t mKeyBytes;
+	uint64_t mValueBytes;
+} SP_CacheSnapRecord_t;
+
+static const uint64_t sChecksumInit = 14695981039346656037ULL;
+
+static uint64_t sp_snap_checksum( uint64_t sum, const char * data, size_t bytes )
+{
+	for( size_t i = 0; i + 8 <= bytes; i += 8 ) {
+		uint64_t word = 0;
+		memcpy( &word, data + i, 8 );
+		sum = ( sum ^ word ) * 1099511628211ULL;
+	}
+
+	return sum;
+}
+
+// buffered writing of one section, the checksum follows the bytes
+typedef struct tagSP_CacheSnapWriter {
+	FILE * mFp;
+	uint64_t mChecksum, mBytes;
+	char mCarry[ 8 ];
+	size_t mCarryBytes;
+} SP_CacheSnapWriter_t;
+
+static void sp_snap_begin( SP_CacheSnapWriter_t * writer, FILE * fp )
+{
+	memset( writer, 0, sizeof( SP_CacheSnapWriter_t ) );
+	writer->mFp = fp;
+	writer->mChecksum = sChecksumInit;
+}
+
+// 0 : OK, -1 : write error
+static int sp_snap_write( SP_CacheSnapWriter_t * writer, const void * data, size_t bytes )
+{
+	if( bytes <= 0 ) return 0;
+
+	if( 1 != fwrite( data, bytes, 1, writer->mFp ) ) return -1;
+
+	writer->mBytes += bytes;
+
+	const char * pos = (const char*)data;
+
+	// fill up the word left by the last write first
+	if( writer->mCarryBytes > 0 ) {
+		size_t count = 8 - writer->mCarryBytes;
+		if( count > bytes ) count = bytes;
+
+		memcpy( writer->mCarry + writer->mCarryBytes, pos, count );
+		writer->mCarryBytes += count;
+		pos += count;
+		bytes -= count;
+
+		if( writer->mCarryBytes < 8 ) return 0;
+
+		writer->mChecksum = sp_snap_checksum( writer->mChecksum, writer->mCarry, 8 );
+		writer->mCarryBytes = 0;
+	}
+
+	size_t words = bytes - bytes % 8;
+	writer->mChecksum = sp_snap_checksum( writer->mChecksum, pos, words );
+
+	memcpy( writer->mCarry, pos + words, bytes - words );
+	writer->mCarryBytes = bytes - words;
+
+	return 0;
+}
+
+static int sp_snap_record( SP_CacheSnapWriter_t * writer, SP_CacheItem * item )
+{
+	static const char sPadding[ 8 ] = { 0 };
+
+	SP_CacheSnapRecord_t record;
+	memset( &record, 0, sizeof( record ) );
+
+	record.mCasUnique = item->getCasUnique();
+	record.mExpTime = item->getExpTime();
+	record.mClientFlags = item->getClientFlags();
+	record.mKeyBytes = strlen( item->getKey() ) + 1;
+	record.mValueBytes = item->getValueBytes();
+
+	int ret = sp_snap_write( writer, &record, sizeof( record ) );
+	if( 0 == ret ) ret = sp_snap_write( writer, item->getKey(), record.mKeyBytes );
+
+	// the "\r\n" at the end of the data block is left out
+	size_t left = record.mValueBytes;
+	for( int i = 0; 0 == ret && left > 0 && i < item->getChunkCount(); i++ ) {
+		size_t bytes = 0;
+		const void * data = item->getChunk( i, &bytes );
+		if( bytes > left ) bytes = left;
+
+		ret = sp_snap_write( writer, data, bytes );
+		left -= bytes;
+	}
+
+	size_t padding = ( record.mKeyBytes + record.mValueBytes ) % 8;
+	if( 0 == ret && padding > 0 ) ret = sp_snap_write( writer, sPadding, 8 - padding );
+
+	return ret;
+}
+
+static long sp_snap_msec( const struct timeval * begin )
+{
+	struct timeval now;
+	gettimeofday( &now, NULL );
+
+	return ( now.tv_sec - begin->tv_sec ) * 1000 + ( now.tv_usec - begin->tv_usec ) / 1000;
+}
+
+//---------------------------------------------------------------------------
+
+SP_CacheSnapshot :: SP_CacheSnapshot( SP_CacheEx * cacheEx, const char * path )
+{
+	mCacheEx = cacheEx;
+	mPath = strdup( path );
+
+	sp_thread_mutex_init( &mMutex, NULL );
+	sp_thread_cond_init( &mCond, NULL );
+
+	mData = NULL;
+	mDataBytes = 0;
+	mNextSection = 0;
+	mLoadThreads = 0;
+
+	mThreadState = -1;
+	mRequested = 0;
+	mInterval = 0;
+	mDumping = 0;
+
+	mLoadedItems = mSkippedItems = mBadSections = 0;
+	mLoadMsec = 0;
+
+	mDumps = mDumpItems = 0;
+	mDumpMsec = 0;
+	mDumpTime = 0;
+}
+
+SP_CacheSnapshot :: ~SP_CacheSnapshot()
+{
+	if( 1 == mThreadState ) {
+		mThreadState = 0;
+		for( ; -1 != mThreadState; ) sp_sleep( 1 );
+	}
+
+	sp_thread_cond_destroy( &mCond );
+	sp_thread_mutex_destroy( &mMutex );
+
+	free( mPath );
+}
+
+int SP_CacheSnapshot :: load( int threads )
+{
+	struct timeval begin;
+	gettimeofday( &begin, NULL );
+
+#ifndef WIN32
+	int fd = open( mPath, O_RDONLY );
+	if( fd < 0 ) return -1;
+
+	struct stat fileStat;
+	if( 0 == fstat( fd, &fileStat ) && fileStat.st_size > 0 ) {
+		mDataBytes = fileStat.st_size;
+		void * data = mmap( NULL, mDataBytes, PROT_READ, MAP_PRIVATE, fd, 0 );
+		if( MAP_FAILED != data ) mData = (const char*)data;
+	}
+
+	close( fd );
+#else
+	FILE * fp = fopen( mPath, "rb" );
+	if( NULL == fp ) return -1;
+
+	fseek( fp, 0, SEEK_END );
+	long fileBytes = ftell( fp );
+	fseek( fp, 0, SEEK_SET );
+
+	if( fileBytes > 0 ) {
+		mDataBytes = fileBytes;
+		char * data = (char*)malloc( mDataBytes );
+		if( 1 == fread( data, mDataBytes, 1, fp ) ) {
+			mData = data;
+		} else {
+			free( data );
+		}
+	}
+
+	fclose( fp );
+#endif
+
+	if( NULL == mData ) {
+		sp_syslog( LOG_WARNING, "Cannot read snapshot %s", mPath );
+		return -1;
+	}
+
+	const SP_CacheSnapHeader_t * header = (const SP_CacheSnapHeader_t*)mData;
+
+	int ret = -1;
+
+	if( mDataBytes < sizeof( SP_CacheSnapHeader_t )
+			|| 0 != memcmp( header->mMagic, sMagic, sizeof( sMagic ) )
+			|| eSnapVersion != header->mVersion || eSnapEndian != header->mEndian
+			|| mDataBytes < sizeof( SP_CacheSnapHeader_t )
+					+ (size_t)header->mSectionCount * sizeof( SP_CacheSnapSection_t ) ) {
+		sp_syslog( LOG_WARNING, "%s is not a snapshot of this server", mPath );
+	} else {
+		int count = header->mSectionCount;
+
+		mNextSection = 0;
+		mLoadThreads = 0;
+
+		if( threads > count ) threads = count;
+
+		for( int i = 1; i < threads; i++ ) {
+			sp_thread_attr_t attr;
+			sp_thread_attr_init( &attr );
+			sp_thread_attr_setdetachstate( &attr, SP_THREAD_CREATE_DETACHED );
+
+			sp_thread_mutex_lock( &mMutex );
+			mLoadThreads++;
+			sp_thread_mutex_unlock( &mMutex );
+
+			sp_thread_t thread;
+			if( 0 != sp_thread_create( &thread, &attr, loadThread, this ) ) {
+				sp_thread_mutex_lock( &mMutex );
+				mLoadThreads--;
+				sp_thread_mutex_unlock( &mMutex );
+			}
+
+			sp_thread_attr_destroy( &attr );
+		}
+
+		// this thread takes its share too
+		loadSections();
+
+		sp_thread_mutex_lock( &mMutex );
+		for( ; mLoadThreads > 0; ) sp_thread_cond_wait( &mCond, &mMutex );
+		sp_thread_mutex_unlock( &mMutex );
+
+		ret = 0;
+	}
+
+#ifndef WIN32
+	munmap( (void*)mData, mDataBytes );
+#else
+	free( (void*)mData );
+#endif
+
+	mData = NULL;
+	mDataBytes = 0;
+
+	if( 0 == ret ) {
+		mLoadMsec = sp_snap_msec( &begin );
+
+		sp_syslog( LOG_NOTICE, "Loaded %lu items from %s in %ld ms, %lu expired, %lu bad sections",
+				(unsigned long)mLoadedItems, mPath, mLoadMsec,
+				(unsigned long)mSkippedItems, (unsigned long)mBadSections );
+	}
+
+	return ret;
+}
+
+sp_thread_result_t SP_THREAD_CALL SP_CacheSnapshot :: loadThread( void * arg )
+{
+	SP_CacheSnapshot * snapshot = (SP_CacheSnapshot*)arg;
+
+	snapshot->loadSections();
+
+	sp_thread_mutex_lock( &snapshot->mMutex );
+	snapshot->mLoadThreads--;
+	sp_thread_cond_signal( &snapshot->mCond );
+	sp_thread_mutex_unlock( &snapshot->mMutex );
+
+	return 0;
+}
+
+void SP_CacheSnapshot :: loadSections()
+{
+	const SP_CacheSnapHeader_t * header = (const SP_CacheSnapHeader_t*)mData;
+	const SP_CacheSnapSection_t * sections = (const SP_CacheSnapSection_t*)( header + 1 );
+
+	for( ; ; ) {
+		int index = sp_atomic_inc( &mNextSection ) - 1;
+		if( index >= (int)header->mSectionCount ) break;
+
+		loadSection( &( sections[ index ] ) );
+	}
+}
+
+void SP_CacheSnapshot :: loadSection( const void * entry )
+{
+	const SP_CacheSnapSection_t * section = (const SP_CacheSnapSection_t*)entry;
+
+	size_t loaded = 0, skipped = 0;
+	int isBad = 0;
+
+	if( section->mOffset > mDataBytes || section->mBytes > mDataBytes - section->mOffset
+			|| 0 != section->mOffset % 8 || 0 != section->mBytes % 8
+			|| section->mChecksum != sp_snap_checksum( sChecksumInit,
+					mData + section->mOffset, section->mBytes ) ) {
+		isBad = 1;
+	}
+
+	const char * pos = mData + section->mOffset, * end = pos + section->mBytes;
+
+	time_t now = time( NULL );
+
+	for( ; 0 == isBad && pos < end; ) {
+		const SP_CacheSnapRecord_t * record = (const SP_CacheSnapRecord_t*)pos;
+		const char * key = pos + sizeof( SP_CacheSnapRecord_t );
+
+		size_t left = end - key;
+		if( (size_t)( end - pos ) < sizeof( SP_CacheSnapRecord_t ) || record->mKeyBytes < 2
+				|| record->mKeyBytes > left || record->mValueBytes > left - record->mKeyBytes
+				|| '\0' != key[ record->mKeyBytes - 1 ] ) {
+			isBad = 1;
+			break;
+		}
+
+		const char * value = key + record->mKeyBytes;
+
+		size_t bytes = record->mKeyBytes + record->mValueBytes;
+		pos = key + bytes + ( bytes % 8 > 0 ? 8 - bytes % 8 : 0 );
+
+		if( record->mExpTime > 0 && record->mExpTime <= now ) {
+			skipped++;
+			continue;
+		}
+
+		SP_CacheItem * item = SP_CacheItem::newInstance( mCacheEx->getSlabs(),
+				key, record->mValueBytes + 2 );
+		item->appendDataBlock( value, record->mValueBytes );
+		item->appendDataBlock( "\r\n", 2 );
+		item->setClientFlags( record->mClientFlags );
+		item->setCasUnique( record->mCasUnique );
+
+		mCacheEx->restore( item, (time_t)record->mExpTime );
+
+		loaded++;
+	}
+
+	if( isBad ) {
+		sp_syslog( LOG_WARNING, "Bad section at offset %llu of %s, the rest of it is skipped",
+				(unsigned long long)section->mOffset, mPath );
+	}
+
+	sp_thread_mutex_lock( &mMutex );
+	mLoadedItems += loaded;
+	mSkippedItems += skipped;
+	if( isBad ) mBadSections++;
+	sp_thread_mutex_unlock( &mMutex );
+}
+
+int SP_CacheSnapshot :: dump()
+{
+	if( 0 == sp_atomic_cas( &mDumping, 0, 1 ) ) return -1;
+
+	struct timeval begin;
+	gettimeofday( &begin, NULL );
+
+	char tempPath[ 1024 ] = { 0 };
+	snprintf( tempPath, sizeof( tempPath ), "%s.tmp", mPath );
+
+	FILE * fp = fopen( tempPath, "wb" );
+	if( NULL == fp ) {
+		sp_syslog( LOG_WARNING, "Cannot open %s, errno %d, %s", tempPath, errno, strerror( errno ) );
+		mDumping = 0;
+		return -1;
+	}
+
+	setvbuf( fp, NULL, _IOFBF, 1024 * 1024 );
+
+	int count = mCacheEx->getShardCount();
+
+	SP_CacheSnapHeader_t header;
+	memset( &header, 0, sizeof( header ) );
+	memcpy( header.mMagic, sMagic, sizeof( sMagic ) );
+	header.mVersion = eSnapVersion;
+	header.mEndian = eSnapEndian;
+	header.mSectionCount = count;
+	header.mDumpTime = time( NULL );
+
+	SP_CacheSnapSection_t * sections = (SP_CacheSnapSection_t*)calloc(
+			count, sizeof( SP_CacheSnapSection_t ) );
+
+	// the table is written again when the sections are done
+	int ret = 0;
+	if( 1 != fwrite( &header, sizeof( header ), 1, fp )
+			|| 1 != fwrite( sections, sizeof( SP_CacheSnapSection_t ) * count, 1, fp ) ) {
+		ret = -1;
+	}
+
+	uint64_t offset = sizeof( header ) + sizeof( SP_CacheSnapSection_t ) * count;
+
+	for( int i = 0; i < count && 0 == ret; i++ ) {
+		int itemCount = 0;
+		SP_CacheItem ** items = mCacheEx->pinItems( i, &itemCount );
+
+		SP_CacheSnapWriter_t writer;
+		sp_snap_begin( &writer, fp );
+
+		for( int j = 0; j < itemCount; j++ ) {
+			if( 0 == ret ) ret = sp_snap_record( &writer, items[j] );
+			items[j]->release();
+		}
+
+		free( items );
+
+		sections[i].mOffset = offset;
+		sections[i].mBytes = writer.mBytes;
+		sections[i].mCount = itemCount;
+		sections[i].mChecksum = writer.mChecksum;
+
+		offset += writer.mBytes;
+		header.mItemCount += itemCount;
+	}
+
+	if( 0 == ret ) {
+		if( 0 != fseek( fp, 0, SEEK_SET )
+				|| 1 != fwrite( &header, sizeof( header ), 1, fp )
+				|| 1 != fwrite( sections, sizeof( SP_CacheSnapSection_t ) * count, 1, fp )
+				|| 0 != fflush( fp ) ) {
+			ret = -1;
+		}
+	}
+
+	if( 0 != fclose( fp ) ) ret = -1;
+
+	free( sections );
+
+	if( 0 == ret && 0 != rename( tempPath, mPath ) ) ret = -1;
+
+	if( 0 == ret ) {
+		long msec = sp_snap_msec( &begin );
+
+		sp_thread_mutex_lock( &mMutex );
+		mDumps++;
+		mDumpItems = header.mItemCount;
+		mDumpMsec = msec;
+		mDumpTime = header.mDumpTime;
+		sp_thread_mutex_unlock( &mMutex );
+
+		sp_syslog( LOG_NOTICE, "Dumped %llu items to %s in %ld ms",
+				(unsigned long long)header.mItemCount, mPath, msec );
+	} else {
+		sp_syslog( LOG_WARNING, "Cannot dump to %s, errno %d, %s", mPath, errno, strerror( errno ) );
+		remove( tempPath );
+	}
+
+	mDumping = 0;
+
+	return ret;
+}
+
+int SP_CacheSnapshot :: start( int interval )
+{
+	if( -1 != mThreadState ) return -1;
+
+	mInterval = interval > 0 ? interval : 0;
+	mThreadState = 1;
+
+	sp_thread_attr_t attr;
+	sp_thread_attr_init( &attr );
+	sp_thread_attr_setdetachstate( &attr, SP_THREAD_CREATE_DETACHED );
+
+	sp_thread_t thread;
+	int ret = sp_thread_create( &thread, &attr, dumpThread, this );
+	sp_thread_attr_destroy( &attr );
+
+	if( 0 != ret ) mThreadState = -1;
+
+	return 0 == ret ? 0 : -1;
+}
+
+void SP_CacheSnapshot :: request()
+{
+	mRequested = 1;
+}
+
+sp_thread_result_t SP_THREAD_CALL SP_CacheSnapshot :: dumpThread( void * arg )
+{
+	SP_CacheSnapshot * snapshot = (SP_CacheSnapshot*)arg;
+
+	time_t last = time( NULL );
+
+	for( ; 1 == snapshot->mThreadState; ) {
+		sp_sleep( 1 );
+
+		if( snapshot->mRequested || ( snapshot->mInterval > 0
+				&& time( NULL ) - last >= snapshot->mInterval ) ) {
+			snapshot->mRequested = 0;
+			snapshot->dump();
+			last = time( NULL );
+		}
+	}
+
+	snapshot->mThreadState = -1;
+
+	return 0;
+}
+
+void SP_CacheSnapshot :: stat( SP_Buffer * buffer )
+{
+	char temp[ 512 ] = { 0 };
+
+	sp_thread_mutex_lock( &mMutex );
+
+	snprintf( temp, sizeof( temp ), "STAT snapshot_loaded_items %lu\r\n", (unsigned long)mLoadedItems );
+	buffer->append( temp );
+
+	snprintf( temp, sizeof( temp ), "STAT snapshot_expired_items %lu\r\n", (unsigned long)mSkippedItems );
+	buffer->append( temp );
+
+	snprintf( temp, sizeof( temp ), "STAT snapshot_bad_sections %lu\r\n", (unsigned long)mBadSections );
+	buffer->append( temp );
+
+	snprintf( temp, sizeof( temp ), "STAT snapshot_load_msec %ld\r\n", mLoadMsec );
+	buffer->append( temp );
+
+	snprintf( temp, sizeof( temp ), "STAT snapshot_dumps %lu\r\n", (unsigned long)mDumps );
+	buffer->append( temp );
+
+	snprintf( temp, sizeof( temp ), "STAT snapshot_dump_items %lu\r\n", (unsigned long)mDumpItems );
+	buffer->append( temp );
+
+	snprintf( temp, sizeof( temp ), "STAT snapshot_dump_msec %ld\r\n", mDumpMsec );
+	buffer->append( temp );
+
+	snprintf( temp, sizeof( temp ), "STAT snapshot_dump_time %ld\r\n", (long)mDumpTime );
+	buffer->append( temp );
+
+	sp_thread_mutex_unlock( &mMutex );
+}
+
@@ -0,0 +1,85 @@
+/*
+ * Copyright 2008 Stephen Liu
+ * For license terms, see the file COPYING along with this library.
+ */
+
+#ifndef __spcachesnap_hpp__
+#define __spcachesnap_hpp__
+
+#include <time.h>
+#include <stdint.h>
+
+#include "spserver/spthread.hpp"
+
+class SP_Buffer;
+class SP_CacheEx;
+
+// a file of the live items, so a restarted server is warm.
+// One section for every shard, each with its own checksum, so the
+// sections are loaded in parallel and a bad one costs only itself.
+// The fields are in host byte order and 8-byte aligned, so a mapped
+// file is read in place, see spcachesnap.cpp for the layout.
+class SP_CacheSnapshot {
+public:
+	SP_CacheSnapshot( SP_CacheEx * cacheEx, const char * path );
+	~SP_CacheSnapshot();
+
+	// put the items of the file into the cache with at most threads threads,
+	// the expired ones are skipped, so is a section failing its checksum.
+	// 0 : OK, -1 : no file or not a snapshot
+	int load( int threads );
+
+	// write the live items to path.tmp and rename it to path.
+	// Every shard is read under its shared lock and only long enough
+	// to pin its items, the writing is done outside of the lock.
+	// 0 : OK, -1 : fail
+	int dump();
+
+	// start a thread dumping every interval seconds, 0 means only on request
+	// 0 : OK, -1 : fail
+	int start( int interval );
+
+	// ask the thread for a dump, safe in a signal handler
+	void request();
+
+	void stat( SP_Buffer * buffer );
+
+private:
+	static sp_thread_result_t SP_THREAD_CALL dumpThread( void * arg );
+	static sp_thread_result_t SP_THREAD_CALL loadThread( void * arg );
+
+	// load the sections not taken yet by the other threads
+	void loadSections();
+	// section : the entry in the section table of the mapped file
+	void loadSection( const void * section );
+
+	SP_CacheEx * mCacheEx;
+	char * mPath;
+
+	sp_thread_mutex_t mMutex;
+	sp_thread_cond_t mCond;
+
+	// the mapped file while loading
+	const char * mData;
+	size_t mDataBytes;
+	volatile int mNextSection;
+	int mLoadThreads;
+
+	// 1 : running, 0 : asked to stop, -1 : stopped
+	volatile int mThreadState;
+	volatile int mRequested;
+	int mInterval;
+
+	// one dump at a time
+	volatile int mDumping;
+
+	size_t mLoadedItems, mSkippedItems, mBadSections;
+	long mLoadMsec;
+
+	size_t mDumps, mDumpItems;
+	long mDumpMsec;
+	time_t mDumpTime;
+};
+
+#endif
+
@@ -0,0 +1,410 @@
+/*
+ * Copyright 2008 Stephen Liu
+ * For license terms, see the file COPYING along with this library.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "spserver/spporting.hpp"
+#include "spserver/sputils.hpp"
+#include "spserver/spmsgblock.hpp"
+
+#include "spcacheudp.hpp"
+#include "spcacheimpl.hpp"
+
+#ifdef __linux__
+typedef struct mmsghdr SP_CacheUdpMsg_t;
+#else
+typedef struct {
+	struct msghdr msg_hdr;
+	unsigned int msg_len;
+} SP_CacheUdpMsg_t;
+#endif
+
+// a datagram of a reply, the header is sent before the payload
+typedef struct tagSP_CacheUdpOut {
+	int mPeer;
+	size_t mOffset, mBytes;
+	unsigned char mHeader[ 8 ];
+} SP_CacheUdpOut_t;
+
+struct tagSP_CacheUdpBatch {
+	// the replies of the datagrams read, one after another
+	char * mReply;
+	size_t mBytes, mCapacity;
+
+	SP_CacheUdpOut_t * mOut;
+	int mOutCount, mOutCapacity;
+};
+
+typedef struct tagSP_CacheUdpArg {
+	SP_CacheUdpServer * mServer;
+	int mFd;
+} SP_CacheUdpArg_t;
+
+static void sp_udp_append( SP_CacheUdpBatch_t * batch, const void * data, size_t bytes )
+{
+	if( batch->mBytes + bytes > batch->mCapacity ) {
+		batch->mCapacity = ( batch->mBytes + bytes ) * 2;
+		batch->mReply = (char*)realloc( batch->mReply, batch->mCapacity );
+	}
+
+	memcpy( batch->mReply + batch->mBytes, data, bytes );
+	batch->mBytes += bytes;
+}
+
+// return the count read, -1 if fail
+static int sp_udp_recv( int fd, SP_CacheUdpMsg_t * msgs, int count )
+{
+#ifdef __linux__
+	return recvmmsg( fd, msgs, count, MSG_WAITFORONE, NULL );
+#else
+	int len = recvmsg( fd, &( msgs[0].msg_hdr ), 0 );
+	if( len >= 0 ) msgs[0].msg_len = len;
+
+	return len >= 0 ? 1 : -1;
+#endif
+}
+
+// return the count sent, -1 if fail
+static int sp_udp_send( int fd, SP_CacheUdpMsg_t * msgs, int count )
+{
+#ifdef __linux__
+	return sendmmsg( fd, msgs, count, 0 );
+#else
+	int sent = 0;
+	for( ; sent < count && sendmsg( fd, &( msgs[ sent ].msg_hdr ), 0 ) >= 0; ) sent++;
+
+	return sent > 0 ? sent : -1;
+#endif
+}
+
+SP_CacheUdpServer :: SP_CacheUdpServer( SP_CacheEx * cacheEx, const char * bindIP, int port )
+{
+	mCacheEx = cacheEx;
+	sp_strlcpy( mBindIP, bindIP, sizeof( mBindIP ) );
+	mPort = port;
+	mMaxThreads = 1;
+
+	mFds = NULL;
+	mFdCount = 0;
+}
+
+SP_CacheUdpServer :: ~SP_CacheUdpServer()
+{
+	for( int i = 0; i < mFdCount; i++ ) close( mFds[i] );
+	free( mFds );
+}
+
+void SP_CacheUdpServer :: setMaxThreads( int maxThreads )
+{
+	mMaxThreads = maxThreads > 0 ? maxThreads : 1;
+}
+
+int SP_CacheUdpServer :: bindSocket( int reusePort )
+{
+	int fd = socket( AF_INET, SOCK_DGRAM, 0 );
+	if( fd < 0 ) return -1;
+
+	int on = 1;
+	setsockopt( fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof( on ) );
+
+#ifdef SO_REUSEPORT
+	if( reusePort && 0 != setsockopt( fd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof( on ) ) ) {
+		close( fd );
+		return -1;
+	}
+#else
+	if( reusePort ) {
+		close( fd );
+		return -1;
+	}
+#endif
+
+	// a burst of gets waits in the kernel, not on the wire
+	int bufferSize = 4 * 1024 * 1024;
+	setsockopt( fd, SOL_SOCKET, SO_RCVBUF, &bufferSize, sizeof( bufferSize ) );
+	setsockopt( fd, SOL_SOCKET, SO_SNDBUF, &bufferSize, sizeof( bufferSize ) );
+
+	struct sockaddr_in addr;
+	memset( &addr, 0, sizeof( addr ) );
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons( mPort );
+	addr.sin_addr.s_addr = INADDR_ANY;
+	if( '\0' != mBindIP[0] && 0 == inet_aton( mBindIP, &addr.sin_addr ) ) {
+		addr.sin_addr.s_addr = INADDR_ANY;
+	}
+
+	if( 0 != bind( fd, (struct sockaddr*)&addr, sizeof( addr ) ) ) {
+		close( fd );
+		return -1;
+	}
+
+	return fd;
+}
+
+int SP_CacheUdpServer :: start()
+{
+	mFds = (int*)malloc( sizeof( int ) * mMaxThreads );
+
+	// one socket for every thread, the kernel spreads the datagrams
+	for( int i = 0; i < mMaxThreads; i++ ) {
+		int fd = bindSocket( mMaxThreads > 1 );
+		if( fd < 0 ) break;
+		mFds[ mFdCount++ ] = fd;
+	}
+
+	// SO_REUSEPORT is refused, the threads share one socket
+	if( mFdCount <= 0 ) {
+		int fd = bindSocket( 0 );
+		if( fd < 0 ) {
+			sp_syslog( LOG_WARNING, "Cannot bind udp port %d, errno %d", mPort, errno );
+			return -1;
+		}
+		mFds[ mFdCount++ ] = fd;
+	}
+
+	int ret = 0;
+
+	for( int i = 0; i < mMaxThreads && 0 == ret; i++ ) {
+		SP_CacheUdpArg_t * arg = (SP_CacheUdpArg_t*)malloc( sizeof( SP_CacheUdpArg_t ) );
+		arg->mServer = this;
+		arg->mFd = mFds[ i % mFdCount ];
+
+		sp_thread_attr_t attr;
+		sp_thread_attr_init( &attr );
+		sp_thread_attr_setdetachstate( &attr, SP_THREAD_CREATE_DETACHED );
+
+		sp_thread_t thread;
+		if( 0 != sp_thread_create( &thread, &attr, serveThread, arg ) ) {
+			free( arg );
+			ret = -1;
+		}
+
+		sp_thread_attr_destroy( &attr );
+	}
+
+	sp_syslog( LOG_NOTICE, "Listen on udp port [%d], %d threads, %d sockets",
+			mPort, mMaxThreads, mFdCount );
+
+	return ret;
+}
+
+sp_thread_result_t SP_THREAD_CALL SP_CacheUdpServer :: serveThread( void * arg )
+{
+	SP_CacheUdpArg_t * udpArg = (SP_CacheUdpArg_t*)arg;
+
+	SP_CacheUdpServer * server = udpArg->mServer;
+	int fd = udpArg->mFd;
+
+	free( udpArg );
+
+	server->serve( fd );
+
+	return 0;
+}
+
+void SP_CacheUdpServer :: serve( int fd )
+{
+	// one more byte for the '\0' after a request
+	char * requests = (char*)malloc( eBatchSize * ( eMaxRequest + 1 ) );
+
+	struct sockaddr_in peers[ eBatchSize ];
+	struct iovec inVecs[ eBatchSize ];
+	SP_CacheUdpMsg_t inMsgs[ eBatchSize ];
+
+	SP_CacheUdpBatch_t batch;
+	memset( &batch, 0, sizeof( batch ) );
+
+	struct iovec * outVecs = NULL;
+	SP_CacheUdpMsg_t * outMsgs = NULL;
+	int outCapacity = 0;
+
+	SP_ArrayList keyList;
+	SP_MsgBlockList blockList;
+
+	for( ; ; ) {
+		memset( inMsgs, 0, sizeof( inMsgs ) );
+
+		for( int i = 0; i < eBatchSize; i++ ) {
+			inVecs[i].iov_base = requests + i * ( eMaxRequest + 1 );
+			inVecs[i].iov_len = eMaxRequest;
+
+			inMsgs[i].msg_hdr.msg_name = &( peers[i] );
+			inMsgs[i].msg_hdr.msg_namelen = sizeof( peers[i] );
+			inMsgs[i].msg_hdr.msg_iov = &( inVecs[i] );
+			inMsgs[i].msg_hdr.msg_iovlen = 1;
+		}
+
+		int count = sp_udp_recv( fd, inMsgs, eBatchSize );
+		if( count <= 0 ) {
+			if( EINTR != errno ) sp_syslog( LOG_WARNING, "udp recv fail, errno %d", errno );
+			continue;
+		}
+
+		batch.mBytes = 0;
+		batch.mOutCount = 0;
+
+		for( int i = 0; i < count; i++ ) {
+			int outCount = batch.mOutCount;
+
+			if( inMsgs[i].msg_hdr.msg_flags & MSG_TRUNC ) continue;
+
+			handle( &batch, (char*)inVecs[i].iov_base, inMsgs[i].msg_len, &keyList, &blockList );
+
+			for( int j = outCount; j < batch.mOutCount; j++ ) batch.mOut[j].mPeer = i;
+		}
+
+		if( batch.mOutCount > outCapacity ) {
+			outCapacity = batch.mOutCount;
+			outVecs = (struct iovec*)realloc( outVecs, sizeof( struct iovec ) * 2 * outCapacity );
+			outMsgs = (SP_CacheUdpMsg_t*)realloc( outMsgs, sizeof( SP_CacheUdpMsg_t ) * outCapacity );
+		}
+
+		// the reply buffer is not moved any more, point into it now
+		for( int i = 0; i < batch.mOutCount; i++ ) {
+			SP_CacheUdpOut_t * out = &( batch.mOut[i] );
+
+			outVecs[ 2 * i ].iov_base = out->mHeader;
+			outVecs[ 2 * i ].iov_len = eHeaderBytes;
+			outVecs[ 2 * i + 1 ].iov_base = batch.mReply + out->mOffset;
+			outVecs[ 2 * i + 1 ].iov_len = out->mBytes;
+
+			memset( &( outMsgs[i] ), 0, sizeof( SP_CacheUdpMsg_t ) );
+			outMsgs[i].msg_hdr.msg_name = &( peers[ out->mPeer ] );
+			outMsgs[i].msg_hdr.msg_namelen = inMsgs[ out->mPeer ].msg_hdr.msg_namelen;
+			outMsgs[i].msg_hdr.msg_iov = &( outVecs[ 2 * i ] );
+			outMsgs[i].msg_hdr.msg_iovlen = 2;
+		}
+
+		for( int sent = 0; sent < batch.mOutCount; ) {
+			int ret = sp_udp_send( fd, outMsgs + sent, batch.mOutCount - sent );
+			if( ret < 0 && EINTR == errno ) continue;
+
+			// the client asks again, like for a datagram lost on the way
+			if( ret <= 0 ) break;
+
+			sent += ret;
+		}
+	}
+
+	free( outMsgs );
+	free( outVecs );
+	free( batch.mOut );
+	free( batch.mReply );
+	free( requests );
+}
+
+void SP_CacheUdpServer :: handle( SP_CacheUdpBatch_t * batch, const char * request, int len,
+		SP_ArrayList * keyList, SP_MsgBlockList * blockList )
+{
+	// a request of several datagrams is not supported, drop it like memcached
+	if( len <= eHeaderBytes ) return;
+
+	const unsigned char * header = (const unsigned char*)request;
+	int total = ( header[4] << 8 ) | header[5];
+	if( total > 1 ) return;
+
+	char * line = (char*)request + eHeaderBytes;
+	char * end = (char*)request + len;
+	*end = '\0';
+
+	size_t begin = batch->mBytes;
+
+	// every line of the datagram is a command
+	for( char * next = NULL; line < end; line = next ) {
+		next = strchr( line, '\n' );
+		if( NULL == next ) next = end;
+		*next++ = '\0';
+
+		keyList->clean();
+
+		char * command = NULL, * pos = line;
+		int isBad = 0;
+
+		for( ; ; ) {
+			for( ; ' ' == *pos || '\r' == *pos; ) *pos++ = '\0';
+			if( '\0' == *pos ) break;
+
+			char * token = pos;
+			for( ; '\0' != *pos && ' ' != *pos && '\r' != *pos; ) pos++;
+
+			if( NULL == command ) {
+				command = token;
+			} else {
+				if( pos - token > 250 ) isBad = 1;
+				keyList->append( token );
+			}
+		}
+
+		if( NULL == command ) continue;
+
+		int isGets = ( 0 == strcmp( command, "gets" ) );
+
+		if( ! isGets && 0 != strcmp( command, "get" ) ) {
+			const char * error = "SERVER_ERROR only get and gets over udp\r\n";
+			sp_udp_append( batch, error, strlen( error ) );
+		} else if( isBad || keyList->getCount() <= 0 ) {
+			const char * error = "CLIENT_ERROR bad command line format\r\n";
+			sp_udp_append( batch, error, strlen( error ) );
+		} else {
+			mCacheEx->get( keyList, blockList, isGets );
+
+			for( int i = 0; i < blockList->getCount(); i++ ) {
+				const SP_MsgBlock * block = blockList->getItem( i );
+				sp_udp_append( batch, block->getData(), block->getSize() );
+			}
+
+			// the references of the items go with the blocks
+			blockList->clean();
+		}
+	}
+
+	size_t payload = eMaxDatagram - eHeaderBytes;
+	size_t bytes = batch->mBytes - begin;
+	size_t count = ( bytes + payload - 1 ) / payload;
+
+	// the sequence number is 16 bits, a larger reply is not sent
+	if( count > 65535 ) {
+		batch->mBytes = begin;
+
+		const char * error = "SERVER_ERROR object too large for udp\r\n";
+		sp_udp_append( batch, error, strlen( error ) );
+
+		bytes = batch->mBytes - begin;
+		count = 1;
+	}
+
+	if( batch->mOutCount + (int)count > batch->mOutCapacity ) {
+		batch->mOutCapacity = ( batch->mOutCount + count ) * 2;
+		batch->mOut = (SP_CacheUdpOut_t*)realloc( batch->mOut,
+				sizeof( SP_CacheUdpOut_t ) * batch->mOutCapacity );
+	}
+
+	for( size_t i = 0; i < count; i++ ) {
+		SP_CacheUdpOut_t * out = &( batch->mOut[ batch->mOutCount++ ] );
+
+		out->mOffset = begin + i * payload;
+		out->mBytes = bytes - i * payload > payload ? payload : bytes - i * payload;
+
+		// the request id is copied as it is
+		out->mHeader[0] = header[0];
+		out->mHeader[1] = header[1];
+		out->mHeader[2] = (unsigned char)( i >> 8 );
+		out->mHeader[3] = (unsigned char)i;
+		out->mHeader[4] = (unsigned char)( count >> 8 );
+		out->mHeader[5] = (unsigned char)count;
+		out->mHeader[6] = 0;
+		out->mHeader[7] = 0;
+	}
+}
+
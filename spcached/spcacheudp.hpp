@@ -0,0 +1,57 @@
+/*
+ * Copyright 2008 Stephen Liu
+ * For license terms, see the file COPYING along with this library.
+ */
+
+#ifndef __spcacheudp_hpp__
+#define __spcacheudp_hpp__
+
+#include "spserver/spthread.hpp"
+
+class SP_CacheEx;
+class SP_ArrayList;
+class SP_MsgBlockList;
+
+typedef struct tagSP_CacheUdpBatch SP_CacheUdpBatch_t;
+
+// get and gets over UDP with the frame header of memcached:
+// request id, sequence number, count of datagrams, reserved, 16 bits each.
+// A request is one datagram, a reply is split into as many as needed.
+// The datagrams are read and written in batches, by recvmmsg/sendmmsg on linux.
+class SP_CacheUdpServer {
+public:
+	SP_CacheUdpServer( SP_CacheEx * cacheEx, const char * bindIP, int port );
+	~SP_CacheUdpServer();
+
+	// count of the threads, every one with its own socket if SO_REUSEPORT works
+	void setMaxThreads( int maxThreads );
+
+	// 0 : OK, -1 : cannot bind or start the threads
+	int start();
+
+private:
+	// datagrams read at once, the size of a reply datagram, the largest request
+	enum { eBatchSize = 32, eMaxDatagram = 1400, eHeaderBytes = 8, eMaxRequest = 8192 };
+
+	static sp_thread_result_t SP_THREAD_CALL serveThread( void * arg );
+
+	// return the socket, -1 if fail
+	int bindSocket( int reusePort );
+
+	void serve( int fd );
+
+	// append the reply of the datagram to the batch
+	void handle( SP_CacheUdpBatch_t * batch, const char * request, int len,
+			SP_ArrayList * keyList, SP_MsgBlockList * blockList );
+
+	SP_CacheEx * mCacheEx;
+	char mBindIP[ 64 ];
+	int mPort;
+	int mMaxThreads;
+
+	int * mFds;
+	int mFdCount;
+};
+
+#endif
+
@@ -86,14 +86,26 @@ LINK32=link.exe
 # PROP Default_Filter "cpp;c;cxx;rc;def;r;odl;idl;hpj;bat"
 # Begin Source File
 
+SOURCE=..\spcached\spcachebinary.cpp
+# End Source File
+# Begin Source File
+
 SOURCE=..\spcached\spcached.cpp
 # End Source File
 # Begin Source File
 
+SOURCE=..\spcached\spcachehot.cpp
+# End Source File
+# Begin Source File
+
 SOURCE=..\spcached\spcacheimpl.cpp
 # End Source File
 # Begin Source File
 
+SOURCE=..\spcached\spcacheindex.cpp
+# End Source File
+# Begin Source File
+
 SOURCE=..\spcached\spcachemsg.cpp
 # End Source File
 # Begin Source File
@@ -102,6 +114,18 @@ SOURCE=..\spcached\spcacheproto.cpp
 # End Source File
 # Begin Source File
 
+SOURCE=..\spcached\spcachequeue.cpp
+# End Source File
+# Begin Source File
+
+SOURCE=..\spcached\spcacheslab.cpp
+# End Source File
+# Begin Source File
+
+SOURCE=..\spcached\spcachesnap.cpp
+# End Source File
+# Begin Source File
+
 SOURCE=..\spcached\spgetopt.c
 # End Source File
 # End Group
@@ -110,10 +134,30 @@ SOURCE=..\spcached\spgetopt.c
 # PROP Default_Filter "h;hpp;hxx;hm;inl"
 # Begin Source File
 
+SOURCE=..\spcached\spcacheatomic.hpp
+# End Source File
+# Begin Source File
+
+SOURCE=..\spcached\spcachebinary.hpp
+# End Source File
+# Begin Source File
+
+SOURCE=..\spcached\spcachehot.hpp
+# End Source File
+# Begin Source File
+
 SOURCE=..\spcached\spcacheimpl.hpp
 # End Source File
 # Begin Source File
 
+SOURCE=..\spcached\spcacheindex.hpp
+# End Source File
+# Begin Source File
+
+SOURCE=..\spcached\spcachelock.hpp
+# End Source File
+# Begin Source File
+
 SOURCE=..\spcached\spcachemsg.hpp
 # End Source File
 # Begin Source File
@@ -122,6 +166,18 @@ SOURCE=..\spcached\spcacheproto.hpp
 # End Source File
 # Begin Source File
 
+SOURCE=..\spcached\spcachequeue.hpp
+# End Source File
+# Begin Source File
+
+SOURCE=..\spcached\spcacheslab.hpp
+# End Source File
+# Begin Source File
+
+SOURCE=..\spcached\spcachesnap.hpp
+# End Source File
+# Begin Source File
+
 SOURCE=..\spcached\spgetopt.h
 # End Source File
 # End Group